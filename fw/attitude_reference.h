@@ -86,9 +86,35 @@ class AttitudeReference {
   void ProcessMeasurement(float delta_s,
                           const Point3D& rate_B_rps,
                           const Point3D& accel_mps2) {
+    Propagate(delta_s, rate_B_rps, accel_mps2);
+    Update();
+  }
+
+  /// Integrate a single sample into the attitude estimate without
+  /// running the filter.  This is cheap enough to call at the full
+  /// IMU rate.  The accumulated rotation, along with the average
+  /// acceleration, is folded into the filter by the next call to
+  /// Update().
+  void Propagate(float delta_s,
+                 const Point3D& rate_B_rps,
+                 const Point3D& accel_mps2) {
     current_gyro_rps_ = rate_B_rps;
     current_accel_mps2_ = accel_mps2;
 
+    pending_delta_ = (pending_delta_ * Quaternion::IntegrateRotationRate(
+                          rate_B_rps + bias_rps(), delta_s)).normalized();
+    pending_s_ += delta_s;
+    pending_accel_mps2_ += accel_mps2;
+    pending_count_++;
+  }
+
+  /// Run the filter over everything passed to Propagate() since the
+  /// last update.
+  void Update() {
+    if (pending_count_ == 0) { return; }
+
+    const Point3D accel_mps2 =
+        pending_accel_mps2_ / static_cast<float>(pending_count_);
     const Point3D norm_g = accel_mps2.normalized();
 
     if (!initialized_) {
@@ -100,8 +126,9 @@ class AttitudeReference {
       ukf_.state()(3) = start.z();
     }
 
+    pending_bias_rps_ = bias_rps();
     ukf_.UpdateState(
-        delta_s,
+        pending_s_,
         [this](const auto& _1, const auto& _2) {
           return this->ProcessFunction(_1, _2);
         });
@@ -130,13 +157,18 @@ class AttitudeReference {
         [this](const auto& _1) { return this->MeasureYawRate(_1); },
         Eigen::Matrix<float, 1, 1>(0.f),
         (Eigen::Matrix<float, 1, 1>(options_.zero_yaw_noise_rps)));
+
+    pending_delta_ = Quaternion();
+    pending_s_ = 0.0f;
+    pending_accel_mps2_ = Point3D::Zero();
+    pending_count_ = 0;
   }
 
   Quaternion attitude() const {
-    return Quaternion(ukf_.state()(0),
-                      ukf_.state()(1),
-                      ukf_.state()(2),
-                      ukf_.state()(3));
+    return (Quaternion(ukf_.state()(0),
+                       ukf_.state()(1),
+                       ukf_.state()(2),
+                       ukf_.state()(3)) * pending_delta_).normalized();
   }
 
   Point3D rate_rps() const {
@@ -165,8 +197,11 @@ class AttitudeReference {
     const Quaternion this_attitude = Quaternion(
         state(0), state(1), state(2), state(3)).normalized();
 
-    Quaternion delta = Quaternion::IntegrateRotationRate(
-        current_gyro_rps_ + Point3D(state(4), state(5), state(6)),
+    // The gyro samples have already been integrated using the bias
+    // estimate from the start of the interval, so only the
+    // difference in bias needs to be applied here.
+    Quaternion delta = pending_delta_ * Quaternion::IntegrateRotationRate(
+        Point3D(state(4), state(5), state(6)) - pending_bias_rps_,
         dt_s);
 
     Quaternion next_attitude = (this_attitude * delta).normalized();
@@ -213,6 +248,13 @@ class AttitudeReference {
   bool initialized_ = false;
   Point3D current_gyro_rps_;
   Point3D current_accel_mps2_;
+
+  // State accumulated by Propagate() since the last Update().
+  Quaternion pending_delta_;
+  float pending_s_ = 0.0f;
+  Point3D pending_accel_mps2_ = Point3D::Zero();
+  int pending_count_ = 0;
+  Point3D pending_bias_rps_ = Point3D::Zero();
 };
 
 }
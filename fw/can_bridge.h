@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <atomic>
 #include <cstring>
 
@@ -23,6 +24,18 @@
 
 #pragma once
 
+/// The number of received CAN frames which can be queued awaiting the
+/// host, across both buses.
+#ifndef CAN_BRIDGE_RX_QUEUE_SIZE
+#define CAN_BRIDGE_RX_QUEUE_SIZE 32
+#endif
+
+/// The number of single frame transmit requests which can be queued
+/// awaiting space in the CAN peripherals.
+#ifndef CAN_BRIDGE_TX_QUEUE_SIZE
+#define CAN_BRIDGE_TX_QUEUE_SIZE 16
+#endif
+
 namespace fw {
 
 /// This presents the following SPI interface.
@@ -31,14 +44,14 @@ namespace fw {
 /// cannot be read or written piecemeal.
 ///
 /// 0: Protocol version
-///    byte 0: the constant value 2
+///    byte 0: the constant value 4
 /// 1: Interface type
 ///    byte 0: the constant value 1
 /// 2: Receive status
-///    byte 0-5 - Size of up to 6 received frames.  0 means no frame
-///      is available.  this size includes the header, so is the total
-///      number of bytes that must be read from register 3 to get a
-///      complete frame
+///    byte 0-5 - Size of the first 6 received frames in the queue.  0
+///      means no frame is available.  this size includes the header,
+///      so is the total number of bytes that must be read from
+///      register 3 to get a complete frame
 /// 3: Received frame: reading this register returns exactly one frame
 ///    from the received queue.
 ///   byte 0 (0x00 means no data)
@@ -70,8 +83,12 @@ namespace fw {
 ///    bit 0 error passive
 ///   byte 2 - CAN1 rx error count
 ///   byte 3 - CAN1 tx error count
-///   byte 4 - CAN1 reset count
-///   byte 5 - reserved
+///   byte 4 - CAN1 reset count, the number of bus off recoveries
+///     attempted.  While a bus remains bus off, recovery is retried
+///     with an exponential backoff, from kMinBusOffBackoffUs to
+///     kMaxBusOffBackoffUs, which resets once it has been healthy for
+///     kBusOffHealthyUs.
+///   byte 5 - CAN1 receive frames dropped because the queue was full
 ///   byte 6 - CAN2
 ///    bit 7-6 activity
 ///    bit 5-3 data last error code
@@ -81,15 +98,94 @@ namespace fw {
 ///    bit 2 bus_off
 ///    bit 1 warning status
 ///    bit 0 error passive
-///   byte 8 - CAN1 rx error count
-///   byte 9 - CAN1 tx error count
-///   byte 10 - CAN1 reset count
-///   byte 11 - reserved
+///   byte 8 - CAN2 rx error count
+///   byte 9 - CAN2 tx error count
+///   byte 10 - CAN2 reset count
+///   byte 11 - CAN2 receive frames dropped because the queue was full
+///   byte 12 - transmit requests dropped because all buffers were full
+///   byte 13 - transmit requests dropped because they were malformed
+///   byte 14-15 - reserved
+///   All counts are 8 bits and wrap around.
+/// 7: Send multiple CAN frames
+///   Zero or more frames are concatenated, up to kMaxBatchSize bytes
+///   total.  The list ends at the end of the SPI transfer.  Each
+///   frame is:
+///   byte 0
+///     bit 7 - CAN bus
+///     bit 6 - 1 if a 4 byte ID is present, 0 for a 2 byte ID
+///   byte 1 - size of payload (0-64)
+///   byte 2,3(,4,5) - CAN ID, MSB first
+///   byte 4+ (or 6+) - payload
+/// 8: Store a CAN frame template
+///   byte 0 - template slot (0-15)
+///   byte 1 - patch offset into payload
+///   byte 2 - patch size (0-32)
+///   byte 3+ - a single frame in the format of register 7
+///   If only byte 0 is written, then the slot is cleared.
+/// 9: Send CAN frame templates
+///   byte 0,1 - uint16 bitmask of slots to send (little endian)
+///   byte 2+ - for each selected slot in ascending order, patch size
+///     bytes which overwrite the payload at that slot's patch offset
+/// 10: Received frames: reading this register returns the frames at
+///   the head of the receive queue, those reported by register 2.
+///   byte 0 - the number of frames in the queue, which may be more
+///     than follow
+///   byte 1+ - the first kStatusItems frames (or fewer if fewer are
+///     queued), each in the format of register 3, concatenated one
+///     after the next
+///   Only those frames which were completely clocked out are
+///   consumed, so a host may read fewer bytes than are offered and
+///   leave the rest queued.
+/// 11: Configure acceptance filters (write only)
+///   byte 0
+///     bit 7 - CAN bus
+///     bit 1 - reject standard ID frames which match no filter
+///     bit 0 - reject extended ID frames which match no filter
+///   byte 1+ - zero or more filters, each 9 bytes, which are evaluated
+///     in order until one matches.  Each filter is:
+///     byte 0
+///       bits 1-0 - action: 1 accept, 2 reject
+///       bits 3-2 - mode: 0 range, 1 dual ID, 2 mask (ID 1 is the
+///         ID and ID 2 the mask)
+///       bit 4 - 1 if this applies to extended IDs, else standard
+///     byte 1,2,3,4 - ID 1, MSB first
+///     byte 5,6,7,8 - ID 2, MSB first
+///   This replaces all filters for that bus.  At most
+///   FDCan::kMaxStandardFilters standard and
+///   FDCan::kMaxExtendedFilters extended filters may be given.
+///   Frames which are rejected never enter the receive queue.
+/// 12: Aggregate received frames (write only)
+///   byte 0 - the number of frames to wait for (0-255)
+///   byte 1,2 - timeout in microseconds, uint16 little endian, 0 for
+///     none
+///   While waiting, the IRQ line is held low even if frames are
+///   queued.  Once that many frames have been received after this
+///   write, or the timeout has expired, it reverts to being asserted
+///   whenever any frame is queued.  Each write restarts the wait.
+/// 13: Received frames with timestamps: this consumes frames just as
+///   register 10 does.
+///   byte 0 - the number of frames in the queue
+///   byte 1,2,3,4 - the current time in microseconds, MSB first
+///   byte 5+ - each frame is in the format of register 3, except
+///     that after byte 4 it has the time in microseconds it was
+///     received, MSB first, bringing the header to 9 bytes.
 
 class CanBridge {
  public:
   static constexpr int kMaxSpiFrameSize = 70;
-  static constexpr int kBufferItems = 6;
+  static constexpr int kRxQueueSize = CAN_BRIDGE_RX_QUEUE_SIZE;
+  static constexpr int kTxQueueSize = CAN_BRIDGE_TX_QUEUE_SIZE;
+  static constexpr int kStatusItems = 6;
+  static constexpr int kMaxBatchSize = 1024;
+  static constexpr int kMaxTemplates = 16;
+  static constexpr int kMaxPatchSize = 32;
+  static constexpr int kFilterSize = 9;
+  static constexpr int kMaxFilters =
+      fw::FDCan::kMaxStandardFilters + fw::FDCan::kMaxExtendedFilters;
+
+  static constexpr uint32_t kMinBusOffBackoffUs = 10000;
+  static constexpr uint32_t kMaxBusOffBackoffUs = 1000000;
+  static constexpr uint32_t kBusOffHealthyUs = 1000000;
 
   struct Pins {
     PinName irq_name = NC;
@@ -105,7 +201,9 @@ class CanBridge {
         irq_{pins.irq_name, 0} {}
 
   void Poll() {
-    auto can_poll = [&](int bus_id, auto* can, uint8_t* reset_count) {
+    auto can_poll = [&](int bus_id, auto* can, uint8_t* reset_count,
+                        uint8_t* rx_overflow_count,
+                        BusOffRecovery* recovery) {
       const auto status = can->status();
       uint8_t* const can_status = &status_buf_[(bus_id - 1) * 6];
       can_status[0] = (
@@ -124,11 +222,29 @@ class CanBridge {
       can_status[2] = error_counters.RxErrorCnt;
       can_status[3] = error_counters.TxErrorCnt;
       can_status[4] = *reset_count;
+      can_status[5] = *rx_overflow_count;
 
+      // The bus remains bus off until the recovery sequence has
+      // completed, so a new attempt is only made once the backoff
+      // has expired.
+      const uint32_t now_us = timer_->read_us();
       if (status.BusOff) {
-        // We need to reset.
-        (*reset_count)++;
-        can->RecoverBusOff();
+        if (!recovery->active ||
+            (now_us - recovery->start_us) >= recovery->backoff_us) {
+          if (recovery->active) {
+            recovery->backoff_us =
+                std::min(2 * recovery->backoff_us, kMaxBusOffBackoffUs);
+          }
+          (*reset_count)++;
+          can->RecoverBusOff();
+          recovery->active = true;
+          recovery->start_us = now_us;
+        }
+        recovery->last_bus_off_us = now_us;
+      } else if (recovery->active &&
+                 (now_us - recovery->last_bus_off_us) >= kBusOffHealthyUs) {
+        recovery->active = false;
+        recovery->backoff_us = kMinBusOffBackoffUs;
       }
 
       const bool rx = can->Poll(&can_header_, rx_buffer_);
@@ -136,21 +252,19 @@ class CanBridge {
         return;
       }
 
-      auto* this_buf = [&]() -> CanReceiveBuf* {
-        for (auto& buf : can_buf_) {
-          if (!buf.active) { return &buf; }
-        }
-        return nullptr;
-      }();
+      const int size = ParseDlc(can_header_.DataLength);
 
-      if (this_buf == nullptr) {
-        // Record an error.
+      // The ISR only ever advances the tail, so we can determine if
+      // there is space without disabling interrupts.
+      if ((rx_head_ - rx_tail_) >= kRxQueueSize) {
+        // Our queue is full, so we have to throw this away.
+        (*rx_overflow_count)++;
         return;
       }
 
-      this_buf->active = true;
+      auto* const this_buf = &can_rx_queue_[rx_head_ % kRxQueueSize];
 
-      const int size = ParseDlc(can_header_.DataLength);
+      this_buf->timestamp_us = timer_->read_us();
 
       this_buf->data[0] = ((bus_id == 2) ? 0x80 : 0x00) | (size + 1);
       const auto id = can_header_.Identifier;
@@ -161,29 +275,39 @@ class CanBridge {
       this_buf->size = size;
       std::memcpy(&this_buf->data[5], rx_buffer_, size);
 
-      // Insert this item into the receive queue.
+      // Publish this item to the ISR.
       __disable_irq();
-      [&]() {
-        for (auto& item : can_rx_queue_) {
-          if (item == nullptr) {
-            item = this_buf;
-            return;
-          }
-        }
-        // Hmm, we couldn't.  Just throw it away.
-        this_buf->active = false;
-      }();
-      irq_.write(1);
+      rx_head_++;
+      aggregate_received_++;
+      UpdateIrq();
       __enable_irq();
     };
 
     if (can1_) {
-      can_poll(1, can1_, &can1_reset_count_);
+      can_poll(1, can1_, &can1_reset_count_, &can1_rx_overflow_count_,
+               &can1_recovery_);
     }
     if (can2_) {
-      can_poll(2, can2_, &can2_reset_count_);
+      can_poll(2, can2_, &can2_reset_count_, &can2_rx_overflow_count_,
+               &can2_recovery_);
     }
 
+    if (aggregate_active_) {
+      // The aggregation timeout may have expired.
+      __disable_irq();
+      UpdateIrq();
+      __enable_irq();
+    }
+
+    for (int cpu_bus = 0; cpu_bus < 2; cpu_bus++) {
+      if (filter_pending_[cpu_bus]) {
+        ConfigureFilters(cpu_bus);
+      }
+    }
+
+    status_buf_[12] = tx_overflow_count_;
+    status_buf_[13] = malformed_count_;
+
     // Look to see if we have anything to send.
     for (auto& spi_buf : spi_buf_) {
       if (spi_buf.ready_to_send) {
@@ -198,23 +322,52 @@ class CanBridge {
         spi_buf.active = false;
       }
     }
+
+    while (true) {
+      // Batches must go out in the order they were received.
+      BatchReceiveBuf* batch_buf = nullptr;
+      for (auto& buf : batch_buf_) {
+        if (!buf.ready_to_send) { continue; }
+        if (batch_buf == nullptr ||
+            static_cast<int32_t>(buf.sequence - batch_buf->sequence) < 0) {
+          batch_buf = &buf;
+        }
+      }
+      if (batch_buf == nullptr) { break; }
+
+      const auto send_result = (batch_buf->address == 9) ?
+          SendTemplates(batch_buf) :
+          SendBatch(batch_buf);
+      if (send_result == fw::FDCan::kNoSpace) {
+        // We'll pick up where we left off next time.
+        return;
+      }
+
+      batch_buf->ready_to_send = false;
+      batch_buf->active = false;
+    }
   }
 
   void PollMillisecond() {
   }
 
   uint8_t queue_size() const {
-    return can_rx_queue_[0] ? 1 : 0;
+    return std::min<uint32_t>(255, rx_head_ - rx_tail_);
   }
 
   static bool IsSpiAddress(uint16_t address) {
-    return address <= 6;
+    return address <= 13;
+  }
+
+  static bool IsWriteAddress(uint16_t address) {
+    return address == 4 || address == 5 || (address >= 7 && address <= 9) ||
+        address == 11 || address == 12;
   }
 
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
     if (address == 0) {
       return {
-        std::string_view("\x02", 1),
+        std::string_view("\x04", 1),
         {},
       };
     }
@@ -225,9 +378,13 @@ class CanBridge {
       };
     }
     if (address == 2) {
-      for (size_t i = 0; i < kBufferItems; i++) {
-        const auto item = can_rx_queue_[i];
-        address16_buf_[i] = (item == nullptr) ? 0 : (item->size + 5);
+      const uint32_t count = rx_head_ - rx_tail_;
+      const uint32_t reported = std::min<uint32_t>(count, kStatusItems);
+      for (int i = 0; i < kStatusItems; i++) {
+        address16_buf_[i] =
+            (static_cast<uint32_t>(i) < reported) ?
+            (can_rx_queue_[(rx_tail_ + i) % kRxQueueSize].size + 5) :
+            0;
       }
       return {
         address16_buf_,
@@ -235,23 +392,52 @@ class CanBridge {
       };
     }
     if (address == 3) {
-      if (!can_rx_queue_[0]) {
-        current_can_buf_ = nullptr;
+      if (rx_head_ == rx_tail_) {
         return { {}, {} };
       }
-      current_can_buf_ = can_rx_queue_[0];
 
-      // Shift everything over.
-      for (size_t i = 1; i < kBufferItems; i++) {
-        can_rx_queue_[i - 1] = can_rx_queue_[i];
+      // This will be removed from the queue once the transfer is
+      // complete.
+      current_can_buf_ = &can_rx_queue_[rx_tail_ % kRxQueueSize];
+
+      return {
+        std::string_view(current_can_buf_->data, current_can_buf_->size + 5),
+        {},
+      };
+    }
+    if (address == 10 || address == 13) {
+      // At most kStatusItems frames are staged, as the copy must be
+      // short, and the host reads no more in one pass than register
+      // 2 reports.  Frames are only removed from the queue in ISR_End
+      // once they have been completely clocked out.
+      const bool timestamp = (address == 13);
+      const uint32_t queued = rx_head_ - rx_tail_;
+      const uint32_t count = std::min<uint32_t>(queued, kStatusItems);
+      size_t size = 1;
+      drain_buf_[0] = static_cast<char>(std::min<uint32_t>(queued, 255));
+      if (timestamp) {
+        WriteU32(&drain_buf_[1], timer_->read_us());
+        size += 4;
       }
-      can_rx_queue_[kBufferItems - 1] = nullptr;
-      if (can_rx_queue_[0] == nullptr) {
-        irq_.write(0);
+      for (uint32_t i = 0; i < count; i++) {
+        const auto& item = can_rx_queue_[(rx_tail_ + i) % kRxQueueSize];
+
+        if (timestamp) {
+          std::memcpy(&drain_buf_[size], item.data, 5);
+          WriteU32(&drain_buf_[size + 5], item.timestamp_us);
+          std::memcpy(&drain_buf_[size + 9], &item.data[5], item.size);
+          size += item.size + 9;
+        } else {
+          std::memcpy(&drain_buf_[size], item.data, item.size + 5);
+          size += item.size + 5;
+        }
+        drain_end_[i] = size;
       }
+      drain_count_ = count;
+      drain_active_ = true;
 
       return {
-        std::string_view(current_can_buf_->data, current_can_buf_->size + 5),
+        std::string_view(drain_buf_, size),
         {},
       };
     }
@@ -264,8 +450,7 @@ class CanBridge {
           }
         }
         // All our buffers are full.  There must be something wrong on the CAN bus.
-        //
-        // TODO: Log an error.
+        tx_overflow_count_++;
         return nullptr;
       }();
 
@@ -287,21 +472,110 @@ class CanBridge {
         {},
       };
     }
+    if (address == 7 || address == 9) {
+      current_batch_buf_ = [&]() -> BatchReceiveBuf* {
+        for (auto& buf : batch_buf_) {
+          if (!buf.active) { return &buf; }
+        }
+        tx_overflow_count_++;
+        return nullptr;
+      }();
+
+      if (!current_batch_buf_) {
+        return { {}, {} };
+      }
+
+      current_batch_buf_->active = true;
+      current_batch_buf_->address = address;
+      return {
+        {},
+        mjlib::base::string_span(current_batch_buf_->data, kMaxBatchSize),
+      };
+    }
+    if (address == 8) {
+      return {
+        {},
+        mjlib::base::string_span(template_rx_buf_, sizeof(template_rx_buf_)),
+      };
+    }
+    if (address == 11) {
+      return {
+        {},
+        mjlib::base::string_span(filter_rx_buf_, sizeof(filter_rx_buf_)),
+      };
+    }
+    if (address == 12) {
+      return {
+        {},
+        mjlib::base::string_span(aggregate_rx_buf_, sizeof(aggregate_rx_buf_)),
+      };
+    }
 
     return { {}, {} };
   }
 
   void ISR_End(uint16_t address, int bytes) {
     if (current_can_buf_) {
-      current_can_buf_->active = false;
+      rx_tail_++;
+      if (rx_head_ == rx_tail_) {
+        irq_.write(0);
+      }
       current_can_buf_ = nullptr;
     }
 
+    if (drain_active_) {
+      uint32_t sent = 0;
+      while (sent < drain_count_ &&
+             drain_end_[sent] <= static_cast<size_t>(bytes)) {
+        sent++;
+      }
+      rx_tail_ += sent;
+      UpdateIrq();
+      drain_active_ = false;
+    }
+
     if (current_spi_buf_) {
       current_spi_buf_->size = bytes;
       current_spi_buf_->ready_to_send = true;
       current_spi_buf_ = nullptr;
     }
+
+    if (current_batch_buf_) {
+      current_batch_buf_->size = bytes;
+      current_batch_buf_->patch_offset = 0;
+      current_batch_buf_->offset = 0;
+      current_batch_buf_->sequence = batch_sequence_++;
+      current_batch_buf_->ready_to_send = true;
+      current_batch_buf_ = nullptr;
+    }
+
+    if (address == 8) {
+      StoreTemplate(bytes);
+    }
+
+    if (address == 11 && bytes >= 1) {
+      // Reconfiguring the peripheral takes too long for an ISR, so
+      // it is left for Poll.  Each port has its own pending copy, so
+      // that writes for both ports in quick succession are kept.
+      const int cpu_bus = (filter_rx_buf_[0] & 0x80) ? 1 : 0;
+      const int size = std::min<int>(bytes, sizeof(filter_rx_buf_));
+      std::memcpy(filter_pending_buf_[cpu_bus], filter_rx_buf_, size);
+      filter_pending_size_[cpu_bus] = size;
+      filter_pending_[cpu_bus] = true;
+    } else if (address == 11) {
+      malformed_count_++;
+    }
+
+    if (address == 12 && bytes >= 1) {
+      aggregate_count_ = u8(aggregate_rx_buf_[0]);
+      aggregate_timeout_us_ = (bytes >= 3) ?
+          (u8(aggregate_rx_buf_[1]) | (u8(aggregate_rx_buf_[2]) << 8)) :
+          0;
+      aggregate_start_us_ = timer_->read_us();
+      aggregate_received_ = 0;
+      aggregate_active_ = true;
+      UpdateIrq();
+    }
   }
 
  private:
@@ -313,17 +587,54 @@ class CanBridge {
     std::atomic<bool> ready_to_send{false};
   };
 
+  struct BatchReceiveBuf {
+    char data[kMaxBatchSize] = {};
+    int size = 0;
+    int address = 0;
+    int offset = 0;
+    int patch_offset = 0;
+    uint32_t sequence = 0;
+    std::atomic<bool> active{false};
+    std::atomic<bool> ready_to_send{false};
+  };
+
+  struct Template {
+    bool valid = false;
+    int can_bus = 0;
+    uint32_t id = 0;
+    int size = 0;
+    int patch_offset = 0;
+    int patch_size = 0;
+    char data[64] = {};
+  };
+
   struct CanReceiveBuf {
     char data[kMaxSpiFrameSize] = {};
     int size = 0;
-    std::atomic<bool> active{false};
+    uint32_t timestamp_us = 0;
   };
 
+  /// Set the IRQ line based upon the receive queue and any
+  /// aggregation in progress.  This must be called with interrupts
+  /// disabled, or from the ISR.
+  void UpdateIrq() {
+    if (aggregate_active_) {
+      const bool timed_out =
+          aggregate_timeout_us_ != 0 &&
+          (timer_->read_us() - aggregate_start_us_) >= aggregate_timeout_us_;
+      if (aggregate_received_ >= aggregate_count_ || timed_out) {
+        aggregate_active_ = false;
+      }
+    }
+
+    irq_.write((rx_head_ != rx_tail_ && !aggregate_active_) ? 1 : 0);
+  }
+
   fw::FDCan::SendResult SendCan(const SpiReceiveBuf* spi) {
     const int min_size = (spi->address == 4) ? 5 : 3;
     if (spi->size < min_size) {
       // This is not big enough for a header.
-      // TODO record an error.
+      malformed_count_++;
       return fw::FDCan::kSuccess;
     }
     const int can_bus = (spi->data[0] & 0x80) ? 1 : 0;
@@ -341,7 +652,8 @@ class CanBridge {
           (u8(spi->data[2]));
     }
     if (size + min_size > spi->size) {
-      // There is not enough data.  TODO Record an error.
+      // There is not enough data.
+      malformed_count_++;
       return fw::FDCan::kSuccess;
     }
 
@@ -356,6 +668,217 @@ class CanBridge {
     }
   }
 
+  fw::FDCan::SendResult SendBatch(BatchReceiveBuf* batch) {
+    while (batch->offset < batch->size) {
+      const char* const frame = &batch->data[batch->offset];
+      const int remaining = batch->size - batch->offset;
+      if (remaining < 2) {
+        // There is a partial header here.
+        malformed_count_++;
+        return fw::FDCan::kSuccess;
+      }
+
+      const int can_bus = (frame[0] & 0x80) ? 1 : 0;
+      const int id_size = (frame[0] & 0x40) ? 4 : 2;
+      const int size = u8(frame[1]);
+      const int header_size = 2 + id_size;
+      if (size > 64 || header_size + size > remaining) {
+        // This is malformed, so we can't find the start of the next
+        // frame either.
+        malformed_count_++;
+        return fw::FDCan::kSuccess;
+      }
+
+      const uint32_t id = (id_size == 4) ?
+          ((u8(frame[2]) << 24) |
+           (u8(frame[3]) << 16) |
+           (u8(frame[4]) << 8) |
+           (u8(frame[5]))) :
+          ((u8(frame[2]) << 8) |
+           (u8(frame[3])));
+
+      auto* const can = (can_bus == 0) ? can1_ : can2_;
+      if (can) {
+        const auto result =
+            can->Send(id, std::string_view(&frame[header_size], size));
+        if (result == fw::FDCan::kNoSpace) {
+          return result;
+        }
+      }
+
+      batch->offset += header_size + size;
+    }
+
+    return fw::FDCan::kSuccess;
+  }
+
+  void StoreTemplate(int bytes) {
+    if (bytes < 1) { return; }
+
+    const int slot = u8(template_rx_buf_[0]);
+    if (slot >= kMaxTemplates) {
+      malformed_count_++;
+      return;
+    }
+
+    auto& this_template = templates_[slot];
+    if (bytes == 1) {
+      this_template.valid = false;
+      return;
+    }
+
+    if (bytes < 5) { return; }
+
+    const char* const frame = &template_rx_buf_[3];
+    const int id_size = (frame[0] & 0x40) ? 4 : 2;
+    const int size = u8(frame[1]);
+    const int header_size = 2 + id_size;
+    const int patch_offset = u8(template_rx_buf_[1]);
+    const int patch_size = u8(template_rx_buf_[2]);
+
+    if (size > 64 ||
+        3 + header_size + size > bytes ||
+        patch_size > kMaxPatchSize ||
+        patch_offset + patch_size > size) {
+      // This is malformed.
+      malformed_count_++;
+      this_template.valid = false;
+      return;
+    }
+
+    this_template.can_bus = (frame[0] & 0x80) ? 1 : 0;
+    this_template.id = (id_size == 4) ?
+        ((u8(frame[2]) << 24) |
+         (u8(frame[3]) << 16) |
+         (u8(frame[4]) << 8) |
+         (u8(frame[5]))) :
+        ((u8(frame[2]) << 8) |
+         (u8(frame[3])));
+    this_template.size = size;
+    this_template.patch_offset = patch_offset;
+    this_template.patch_size = patch_size;
+    std::memcpy(this_template.data, &frame[header_size], size);
+    this_template.valid = true;
+  }
+
+  void ConfigureFilters(int cpu_bus) {
+    // The pending buffer can be re-written from the SPI ISR at any
+    // time, so we work from a copy.
+    __disable_irq();
+    const int size = filter_pending_size_[cpu_bus];
+    std::memcpy(filter_work_buf_, filter_pending_buf_[cpu_bus], size);
+    filter_pending_[cpu_bus] = false;
+    __enable_irq();
+
+    if (size < 1 || ((size - 1) % kFilterSize) != 0) {
+      malformed_count_++;
+      return;
+    }
+
+    auto u32 = [](const char* data) {
+      return (u8(data[0]) << 24) |
+          (u8(data[1]) << 16) |
+          (u8(data[2]) << 8) |
+          (u8(data[3]));
+    };
+
+    using FDCan = fw::FDCan;
+    const int count = (size - 1) / kFilterSize;
+    int standard_count = 0;
+    int extended_count = 0;
+    for (int i = 0; i < count; i++) {
+      const char* const data = &filter_work_buf_[1 + i * kFilterSize];
+      auto& filter = filters_[i];
+
+      const int action = u8(data[0]) & 0x03;
+      const int mode = (u8(data[0]) >> 2) & 0x03;
+      if (action == 0 || action == 3 || mode == 3) {
+        malformed_count_++;
+        return;
+      }
+      filter.action = (action == 1) ?
+          FDCan::FilterAction::kAccept : FDCan::FilterAction::kReject;
+      filter.mode = (mode == 0) ? FDCan::FilterMode::kRange :
+          (mode == 1) ? FDCan::FilterMode::kDual :
+          FDCan::FilterMode::kMask;
+      filter.type = (u8(data[0]) & 0x10) ?
+          FDCan::FilterType::kExtended : FDCan::FilterType::kStandard;
+      filter.id1 = u32(&data[1]);
+      filter.id2 = u32(&data[5]);
+
+      (filter.type == FDCan::FilterType::kExtended ?
+       extended_count : standard_count)++;
+    }
+
+    if (standard_count > FDCan::kMaxStandardFilters ||
+        extended_count > FDCan::kMaxExtendedFilters) {
+      malformed_count_++;
+      return;
+    }
+
+    auto* const can = (filter_work_buf_[0] & 0x80) ? can2_ : can1_;
+    if (!can) { return; }
+
+    auto global = [](bool reject) {
+      return reject ?
+          FDCan::FilterAction::kReject : FDCan::FilterAction::kAccept;
+    };
+    can->ConfigureFilters(&filters_[0], &filters_[count],
+                          global(filter_work_buf_[0] & 0x02),
+                          global(filter_work_buf_[0] & 0x01));
+  }
+
+  fw::FDCan::SendResult SendTemplates(BatchReceiveBuf* batch) {
+    if (batch->size < 2) {
+      malformed_count_++;
+      return fw::FDCan::kSuccess;
+    }
+
+    const uint16_t mask = u8(batch->data[0]) | (u8(batch->data[1]) << 8);
+
+    // Here, 'offset' is the next slot to send, and 'patch_offset' is
+    // where its patch data starts.
+    for (; batch->offset < kMaxTemplates; batch->offset++) {
+      if ((mask & (1 << batch->offset)) == 0) { continue; }
+
+      // The templates can be re-written from the SPI ISR at any time,
+      // so we work from a copy.
+      __disable_irq();
+      current_template_ = templates_[batch->offset];
+      __enable_irq();
+
+      const int patch_start = 2 + batch->patch_offset;
+      const int patch_size = current_template_.patch_size;
+      if (patch_start + patch_size > batch->size) {
+        // We ran out of patch data.
+        malformed_count_++;
+        return fw::FDCan::kSuccess;
+      }
+
+      if (!current_template_.valid) {
+        batch->patch_offset += patch_size;
+        continue;
+      }
+
+      std::memcpy(&current_template_.data[current_template_.patch_offset],
+                  &batch->data[patch_start], patch_size);
+
+      auto* const can = (current_template_.can_bus == 0) ? can1_ : can2_;
+      if (can) {
+        const auto result = can->Send(
+            current_template_.id,
+            std::string_view(current_template_.data, current_template_.size));
+        if (result == fw::FDCan::kNoSpace) {
+          return result;
+        }
+      }
+
+      batch->patch_offset += patch_size;
+    }
+
+    return fw::FDCan::kSuccess;
+  }
+
   static int ParseDlc(uint32_t dlc_code) {
     if (dlc_code == FDCAN_DLC_BYTES_0) { return 0; }
     if (dlc_code == FDCAN_DLC_BYTES_1) { return 1; }
@@ -382,6 +905,13 @@ class CanBridge {
     return static_cast<uint8_t>(value);
   }
 
+  static void WriteU32(char* data, uint32_t value) {
+    data[0] = (value >> 24) & 0xff;
+    data[1] = (value >> 16) & 0xff;
+    data[2] = (value >> 8) & 0xff;
+    data[3] = (value >> 0) & 0xff;
+  }
+
   fw::MillisecondTimer* const timer_;
   const Pins pins_;
 
@@ -390,12 +920,40 @@ class CanBridge {
 
   DigitalOut irq_;
 
-  SpiReceiveBuf spi_buf_[kBufferItems] = {};
+  SpiReceiveBuf spi_buf_[kTxQueueSize] = {};
   SpiReceiveBuf* current_spi_buf_ = nullptr;
 
-  CanReceiveBuf can_buf_[kBufferItems] = {};
-  CanReceiveBuf* can_rx_queue_[kBufferItems] = {};
-  CanReceiveBuf* current_can_buf_ = nullptr;
+  BatchReceiveBuf batch_buf_[2] = {};
+  BatchReceiveBuf* current_batch_buf_ = nullptr;
+  uint32_t batch_sequence_ = 0;
+
+  char template_rx_buf_[3 + 6 + 64] = {};
+  Template templates_[kMaxTemplates] = {};
+  Template current_template_;
+
+  char filter_rx_buf_[1 + kMaxFilters * kFilterSize] = {};
+  // Indexed by port, as selected by bit 7 of the first byte.
+  char filter_pending_buf_[2][sizeof(filter_rx_buf_)] = {};
+  int filter_pending_size_[2] = {};
+  std::atomic<bool> filter_pending_[2] = {};
+  char filter_work_buf_[sizeof(filter_rx_buf_)] = {};
+  fw::FDCan::Filter filters_[kMaxFilters] = {};
+
+  // These are written from the ISR, and only read from Poll with
+  // interrupts disabled.
+  char aggregate_rx_buf_[3] = {};
+  std::atomic<bool> aggregate_active_{false};
+  uint32_t aggregate_count_ = 0;
+  uint32_t aggregate_received_ = 0;
+  uint32_t aggregate_start_us_ = 0;
+  uint32_t aggregate_timeout_us_ = 0;
+
+  // This is a ring buffer.  Only Poll advances the head, and only the
+  // ISR advances the tail.
+  CanReceiveBuf can_rx_queue_[kRxQueueSize] = {};
+  std::atomic<uint32_t> rx_head_{0};
+  std::atomic<uint32_t> rx_tail_{0};
+  const CanReceiveBuf* current_can_buf_ = nullptr;
 
   FDCAN_RxHeaderTypeDef can_header_ = {};
   char rx_buffer_[64] = {};
@@ -403,8 +961,31 @@ class CanBridge {
   uint8_t can1_reset_count_ = 0;
   uint8_t can2_reset_count_ = 0;
 
-  char address16_buf_[kBufferItems] = {};
-  uint8_t status_buf_[12] = {};
+  struct BusOffRecovery {
+    // True from the first recovery attempt until the bus has been
+    // healthy for kBusOffHealthyUs.
+    bool active = false;
+    uint32_t start_us = 0;
+    uint32_t last_bus_off_us = 0;
+    uint32_t backoff_us = kMinBusOffBackoffUs;
+  };
+  BusOffRecovery can1_recovery_;
+  BusOffRecovery can2_recovery_;
+
+  uint8_t can1_rx_overflow_count_ = 0;
+  uint8_t can2_rx_overflow_count_ = 0;
+  uint8_t tx_overflow_count_ = 0;
+  uint8_t malformed_count_ = 0;
+
+  char address16_buf_[kStatusItems] = {};
+
+  // The stream most recently offered by register 10 or 13.
+  // 'drain_end_' holds the offset just past each frame within it.
+  char drain_buf_[5 + kStatusItems * (64 + 9)] = {};
+  size_t drain_end_[kStatusItems] = {};
+  uint32_t drain_count_ = 0;
+  bool drain_active_ = false;
+  uint8_t status_buf_[16] = {};
 };
 
 
@@ -14,18 +14,58 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <string_view>
 
+#include "fw/cycle_counter.h"
 #include "fw/register_spi_slave.h"
 
 namespace fw {
 
+/// Measures how often the main loop runs, and optionally how many CPU
+/// cycles each module spends in it, through the following SPI
+/// register.
+///
+/// 100: Performance
+///  bytes0-3: uint32 average main loop iterations per ms
+///  bytes4-7: uint32 minimum main loop iterations per ms
+///  byte8: the number of modules which follow
+///  byte9+: for each module, 12 bytes
+///   bytes0-3: uint32 average cycles per call
+///   bytes4-7: uint32 maximum cycles of any call since this register
+///     was last read this far
+///   bytes8-11: uint32 total cycles per ms
+///  The averages are over the most recent 20ms, and all values are
+///  little endian.  Which module is which depends upon the
+///  application.
 class CpuMeter {
  public:
+  static constexpr int kMaxModules = 8;
+
+  CpuMeter(int module_count = 0)
+      : module_count_(std::min(module_count, kMaxModules)) {
+    result_.module_count = module_count_;
+  }
+
   void Poll() {
     cycles_since_ms_++;
   }
 
+  /// Call @p function, accounting the cycles it takes against module
+  /// @p index.
+  template <typename Function>
+  void Measure(int index, Function function) {
+    const uint32_t start = cycle_counter_.read();
+    function();
+    const uint32_t cycles = cycle_counter_.read() - start;
+
+    auto& module = modules_[index];
+    module.total_cycles += cycles;
+    module.calls++;
+    module.max_cycles = std::max(module.max_cycles, cycles);
+  }
+
   void PollMillisecond() {
     ms_cycle_count_[ms_cycle_count_pos_] = cycles_since_ms_;
     cycles_since_ms_ = 0;
@@ -40,6 +80,22 @@ class CpuMeter {
       }
     }
     result_.average_cycle_per_ms = total / 20;
+
+    window_ms_++;
+    if (window_ms_ < 20) { return; }
+    window_ms_ = 0;
+
+    const bool clear_max = clear_max_.exchange(false);
+    for (int i = 0; i < module_count_; i++) {
+      auto& module = modules_[i];
+      auto& result = result_.modules[i];
+      result.average_cycles =
+          module.calls ? (module.total_cycles / module.calls) : 0;
+      result.max_cycles = clear_max ? module.max_cycles :
+          std::max(result.max_cycles, module.max_cycles);
+      result.cycles_per_ms = module.total_cycles / 20;
+      module = {};
+    }
   }
 
   static bool IsSpiAddress(uint16_t address) {
@@ -52,7 +108,7 @@ class CpuMeter {
       return {
         std::string_view(
             reinterpret_cast<const char*>(&result_),
-            sizeof(result_)),
+            kModuleOffset + module_count_ * sizeof(ModuleResult)),
         {}
       };
     }
@@ -61,6 +117,10 @@ class CpuMeter {
   }
 
   void ISR_End(uint16_t address, int bytes) {
+    if (address == 100 && bytes > kModuleOffset) {
+      // The maximums have been seen, so start accumulating new ones.
+      clear_max_.store(true);
+    }
   }
 
  private:
@@ -68,9 +128,31 @@ class CpuMeter {
   uint32_t ms_cycle_count_[20] = {};
   uint8_t ms_cycle_count_pos_ = 0;
 
+  struct Module {
+    uint32_t total_cycles = 0;
+    uint32_t calls = 0;
+    uint32_t max_cycles = 0;
+  };
+
+  const int module_count_;
+  CycleCounter cycle_counter_;
+  Module modules_[kMaxModules] = {};
+  int window_ms_ = 0;
+  std::atomic<bool> clear_max_{false};
+
+  struct ModuleResult {
+    uint32_t average_cycles = 0;
+    uint32_t max_cycles = 0;
+    uint32_t cycles_per_ms = 0;
+  } __attribute__((packed));
+
+  static constexpr int kModuleOffset = 9;
+
   struct Result {
     uint32_t average_cycle_per_ms = 0;
     uint32_t min_cycle_per_ms = 0;
+    uint8_t module_count = 0;
+    ModuleResult modules[kMaxModules] = {};
   } __attribute__((packed));
 
   Result result_;
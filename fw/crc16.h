@@ -0,0 +1,57 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace fw {
+
+/// Computes the CRC-16/CCITT-FALSE (polynomial 0x1021, initial value
+/// 0xffff, no reflection or final xor) a byte at a time from a table.
+class Crc16 {
+ public:
+  static constexpr uint16_t kInit = 0xffff;
+
+  /// Continue the CRC @p crc over @p size bytes of @p data.
+  static uint16_t Update(uint16_t crc, const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      const uint8_t byte = static_cast<uint8_t>(data[i]);
+      crc = (crc << 8) ^ kTable[((crc >> 8) ^ byte) & 0xff];
+    }
+    return crc;
+  }
+
+ private:
+  static constexpr std::array<uint16_t, 256> MakeTable() {
+    std::array<uint16_t, 256> result = {};
+    for (int i = 0; i < 256; i++) {
+      uint16_t value = i << 8;
+      for (int bit = 0; bit < 8; bit++) {
+        value = (value & 0x8000) ? ((value << 1) ^ 0x1021) : (value << 1);
+      }
+      result[i] = value;
+    }
+    return result;
+  }
+
+  static const std::array<uint16_t, 256> kTable;
+};
+
+inline constexpr std::array<uint16_t, 256> Crc16::kTable = Crc16::MakeTable();
+
+}
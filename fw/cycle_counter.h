@@ -0,0 +1,40 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+
+#include "mbed.h"
+
+namespace fw {
+
+/// Exposes the Cortex-M4 DWT cycle counter, for measuring how many
+/// CPU cycles a block of code takes.
+class CycleCounter {
+ public:
+  CycleCounter() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+
+  /// The counter wraps every 2^32 cycles, so differences should be
+  /// computed with unsigned arithmetic.
+  uint32_t read() const {
+    return DWT->CYCCNT;
+  }
+};
+
+}
@@ -14,16 +14,25 @@
 
 #pragma once
 
+#include <cstring>
+
+#include "mbed.h"
+
 #include "fw/git_info.h"
+#include "fw/register_spi_slave.h"
 
 namespace fw {
 
-/// Exposes device info through the following SPI register
+/// Exposes device info through the following SPI registers
 ///
 /// 97: Device Information
 ///  bytes0-19: git sha256 hash
 ///  byte20: dirty flag
 ///  byte21-32: serial number
+/// 99: Reset (write only)
+///  bytes0-3: the ASCII characters "RSET".  Once the transfer
+///    completes, the processor is reset, and takes on the order of
+///    100ms to respond again.  Any other value is ignored.
 class DeviceInfo {
  public:
   DeviceInfo() {
@@ -37,7 +46,11 @@ class DeviceInfo {
   }
 
   static bool IsSpiAddress(uint16_t address) {
-    return address == 97;
+    return address == 97 || address == 99;
+  }
+
+  static bool IsWriteAddress(uint16_t address) {
+    return address == 99;
   }
 
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
@@ -50,10 +63,21 @@ class DeviceInfo {
       };
     }
 
+    if (address == 99) {
+      return {
+        {},
+        mjlib::base::string_span(reset_buf_, sizeof(reset_buf_)),
+      };
+    }
+
     return {{}, {}};
   }
 
   void ISR_End(uint16_t address, int bytes) {
+    if (address == 99 && bytes == static_cast<int>(sizeof(reset_buf_)) &&
+        std::memcmp(reset_buf_, kResetMagic, sizeof(reset_buf_)) == 0) {
+      NVIC_SystemReset();
+    }
   }
 
  private:
@@ -64,6 +88,9 @@ class DeviceInfo {
   } __attribute__((packed));
 
   DeviceInfoData device_info_;
+
+  static constexpr char kResetMagic[4] = {'R', 'S', 'E', 'T'};
+  char reset_buf_[4] = {};
 };
 
 }
@@ -148,33 +148,111 @@ FDCan::FDCan(const Options& options)
   can.Init.DataTimeSeg1 = fast.time_seg1;
   can.Init.DataTimeSeg2 = fast.time_seg2;
 
-  can.Init.StdFiltersNbr =
-      std::count_if(
-          options.filter_begin, options.filter_end,
-          [](const auto& filter) {
-            return (filter.action != FilterAction::kDisable &&
-                    filter.type == FilterType::kStandard);
-          });
-  can.Init.ExtFiltersNbr =
-      std::count_if(
-          options.filter_begin, options.filter_end,
-          [](const auto& filter) {
-            return (filter.action != FilterAction::kDisable &&
-                    filter.type == FilterType::kExtended);
-          });
+  // Every filter element is reserved, so that the filters can be
+  // replaced later without re-initializing the peripheral.
+  can.Init.StdFiltersNbr = kMaxStandardFilters;
+  can.Init.ExtFiltersNbr = kMaxExtendedFilters;
   can.Init.TxFifoQueueMode = FDCAN_TX_FIFO_OPERATION;
   if (HAL_FDCAN_Init(&can) != HAL_OK) {
     mbed_die();
   }
 
+  ApplyFilters(options.filter_begin, options.filter_end,
+               options.global_std_action, options.global_ext_action);
+
+  if (HAL_FDCAN_Start(&can) != HAL_OK) {
+    mbed_die();
+  }
+
+  if (HAL_FDCAN_ActivateNotification(
+          &can, FDCAN_IT_RX_FIFO0_NEW_MESSAGE, 0) != HAL_OK) {
+    mbed_die();
+  }
+}
+
+namespace {
+bool ApplyOverride(bool value, FDCan::Override o) {
+  using OV = FDCan::Override;
+  switch (o) {
+    case OV::kDefault: return value;
+    case OV::kRequire: return true;
+    case OV::kDisable: return false;
+  }
+  mbed_die();
+}
+}
+
+FDCan::SendResult FDCan::Send(uint32_t dest_id,
+                              std::string_view data,
+                              const SendOptions& send_options) {
+
+  // Abort anything we have started that hasn't finished.
+  if (send_options.abort_existing && last_tx_request_) {
+    HAL_FDCAN_AbortTxRequest(&hfdcan1_, last_tx_request_);
+  }
+
+  FDCAN_TxHeaderTypeDef tx_header;
+  tx_header.Identifier = dest_id;
+  tx_header.IdType = ApplyOverride(
+      dest_id >= 2048, send_options.extended_id) ?
+      FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+  tx_header.TxFrameType =
+      ApplyOverride(options_.remote_frame,
+                    send_options.remote_frame) ?
+      FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
+  tx_header.DataLength = RoundUpDlc(data.size());
+  tx_header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+  tx_header.BitRateSwitch =
+      ApplyOverride(options_.bitrate_switch,
+                    send_options.bitrate_switch) ?
+      FDCAN_BRS_ON : FDCAN_BRS_OFF;
+  tx_header.FDFormat =
+      ApplyOverride(options_.fdcan_frame,
+                    send_options.fdcan_frame) ?
+      FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
+  tx_header.TxEventFifoControl = FDCAN_NO_TX_EVENTS;
+  tx_header.MessageMarker = 0;
+
+  if (HAL_FDCAN_AddMessageToTxFifoQ(
+          &hfdcan1_, &tx_header,
+          const_cast<uint8_t*>(
+              reinterpret_cast<const uint8_t*>(data.data()))) != HAL_OK) {
+    return kNoSpace;
+  }
+  last_tx_request_ = HAL_FDCAN_GetLatestTxFifoQRequestBuffer(&hfdcan1_);
+
+  return kSuccess;
+}
+
+bool FDCan::Poll(FDCAN_RxHeaderTypeDef* header,
+                 mjlib::base::string_span data) {
+  if (HAL_FDCAN_GetRxMessage(
+          &hfdcan1_, FDCAN_RX_FIFO0, header,
+          reinterpret_cast<uint8_t*>(data.data())) != HAL_OK) {
+    return false;
+  }
+
+  return true;
+}
+
+void FDCan::ApplyFilters(const Filter* begin, const Filter* end,
+                         FilterAction global_std_action,
+                         FilterAction global_ext_action) {
   int standard_index = 0;
   int extended_index = 0;
   std::for_each(
-      options.filter_begin, options.filter_end,
+      begin, end,
       [&](const auto& filter) {
         if (filter.action == FilterAction::kDisable) {
           return;
         }
+        // Anything which doesn't fit in the message RAM is ignored.
+        if ((filter.type == FilterType::kStandard &&
+             standard_index >= kMaxStandardFilters) ||
+            (filter.type == FilterType::kExtended &&
+             extended_index >= kMaxExtendedFilters)) {
+          return;
+        }
 
         FDCAN_FilterTypeDef sFilterConfig;
         sFilterConfig.IdType = [&]() {
@@ -215,13 +293,31 @@ FDCan::FDCan(const Options& options)
         sFilterConfig.FilterID1 = filter.id1;
         sFilterConfig.FilterID2 = filter.id2;
 
-        if (HAL_FDCAN_ConfigFilter(&can, &sFilterConfig) != HAL_OK)
+        if (HAL_FDCAN_ConfigFilter(&hfdcan1_, &sFilterConfig) != HAL_OK)
         {
           mbed_die();
         }
-
       });
 
+  // Any elements left over from a previous configuration are
+  // disabled.
+  auto disable = [&](uint32_t id_type, int index) {
+    FDCAN_FilterTypeDef sFilterConfig = {};
+    sFilterConfig.IdType = id_type;
+    sFilterConfig.FilterIndex = index;
+    sFilterConfig.FilterType = FDCAN_FILTER_RANGE;
+    sFilterConfig.FilterConfig = FDCAN_FILTER_DISABLE;
+    if (HAL_FDCAN_ConfigFilter(&hfdcan1_, &sFilterConfig) != HAL_OK) {
+      mbed_die();
+    }
+  };
+  for (; standard_index < kMaxStandardFilters; standard_index++) {
+    disable(FDCAN_STANDARD_ID, standard_index);
+  }
+  for (; extended_index < kMaxExtendedFilters; extended_index++) {
+    disable(FDCAN_EXTENDED_ID, extended_index);
+  }
+
   auto map_filter_action = [](auto value) {
     switch (value) {
       case FilterAction::kDisable:
@@ -252,87 +348,35 @@ FDCan::FDCan(const Options& options)
      Filter all remote frames with STD and EXT ID
      Reject non matching frames with STD ID and EXT ID */
   if (HAL_FDCAN_ConfigGlobalFilter(
-          &can,
-          map_filter_action(options.global_std_action),
-          map_filter_action(options.global_ext_action),
-          map_remote_action(options.global_remote_std_action),
-          map_remote_action(options.global_remote_ext_action)) != HAL_OK) {
-    mbed_die();
-  }
-
-  if (HAL_FDCAN_Start(&can) != HAL_OK) {
-    mbed_die();
-  }
-
-  if (HAL_FDCAN_ActivateNotification(
-          &can, FDCAN_IT_RX_FIFO0_NEW_MESSAGE, 0) != HAL_OK) {
+          &hfdcan1_,
+          map_filter_action(global_std_action),
+          map_filter_action(global_ext_action),
+          map_remote_action(options_.global_remote_std_action),
+          map_remote_action(options_.global_remote_ext_action)) != HAL_OK) {
     mbed_die();
   }
 }
 
-namespace {
-bool ApplyOverride(bool value, FDCan::Override o) {
-  using OV = FDCan::Override;
-  switch (o) {
-    case OV::kDefault: return value;
-    case OV::kRequire: return true;
-    case OV::kDisable: return false;
-  }
-  mbed_die();
-}
-}
-
-FDCan::SendResult FDCan::Send(uint32_t dest_id,
-                              std::string_view data,
-                              const SendOptions& send_options) {
-
-  // Abort anything we have started that hasn't finished.
-  if (send_options.abort_existing && last_tx_request_) {
-    HAL_FDCAN_AbortTxRequest(&hfdcan1_, last_tx_request_);
-  }
-
-  FDCAN_TxHeaderTypeDef tx_header;
-  tx_header.Identifier = dest_id;
-  tx_header.IdType = ApplyOverride(
-      dest_id >= 2048, send_options.extended_id) ?
-      FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
-  tx_header.TxFrameType =
-      ApplyOverride(options_.remote_frame,
-                    send_options.remote_frame) ?
-      FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
-  tx_header.DataLength = RoundUpDlc(data.size());
-  tx_header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
-  tx_header.BitRateSwitch =
-      ApplyOverride(options_.bitrate_switch,
-                    send_options.bitrate_switch) ?
-      FDCAN_BRS_ON : FDCAN_BRS_OFF;
-  tx_header.FDFormat =
-      ApplyOverride(options_.fdcan_frame,
-                    send_options.fdcan_frame) ?
-      FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
-  tx_header.TxEventFifoControl = FDCAN_NO_TX_EVENTS;
-  tx_header.MessageMarker = 0;
-
-  if (HAL_FDCAN_AddMessageToTxFifoQ(
-          &hfdcan1_, &tx_header,
-          const_cast<uint8_t*>(
-              reinterpret_cast<const uint8_t*>(data.data()))) != HAL_OK) {
-    return kNoSpace;
+void FDCan::ConfigureFilters(const Filter* begin, const Filter* end,
+                             FilterAction global_std_action,
+                             FilterAction global_ext_action) {
+  // The global filter can only be changed while the peripheral is
+  // stopped, and stopping it cancels any transmissions still pending.
+  // So give those a chance to go out first.
+  constexpr uint32_t kDrainTimeoutMs = 20;
+  const uint32_t start_ms = HAL_GetTick();
+  while (hfdcan1_.Instance->TXBRP != 0 &&
+         (HAL_GetTick() - start_ms) < kDrainTimeoutMs) {}
+
+  if (HAL_FDCAN_Stop(&hfdcan1_) != HAL_OK) {
+    mbed_die();
   }
-  last_tx_request_ = HAL_FDCAN_GetLatestTxFifoQRequestBuffer(&hfdcan1_);
 
-  return kSuccess;
-}
+  ApplyFilters(begin, end, global_std_action, global_ext_action);
 
-bool FDCan::Poll(FDCAN_RxHeaderTypeDef* header,
-                 mjlib::base::string_span data) {
-  if (HAL_FDCAN_GetRxMessage(
-          &hfdcan1_, FDCAN_RX_FIFO0, header,
-          reinterpret_cast<uint8_t*>(data.data())) != HAL_OK) {
-    return false;
+  if (HAL_FDCAN_Start(&hfdcan1_) != HAL_OK) {
+    mbed_die();
   }
-
-  return true;
 }
 
 void FDCan::RecoverBusOff() {
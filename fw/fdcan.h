@@ -50,6 +50,11 @@ class FDCan {
     FilterType type = FilterType::kStandard;
   };
 
+  // These are the number of filter elements available in the message
+  // RAM of each STM32G4 FDCAN instance.
+  static constexpr int kMaxStandardFilters = 28;
+  static constexpr int kMaxExtendedFilters = 8;
+
   struct Rate {
     int prescaler = -1;
     int sync_jump_width = -1;
@@ -118,6 +123,17 @@ class FDCan {
 
   void RecoverBusOff();
 
+  /// Replace all acceptance filters, and the action taken for frames
+  /// which match none of them.  Filters are evaluated in order, and
+  /// the first match determines the action.  Reception and
+  /// transmission are briefly stopped while this takes effect.  Frames
+  /// already handed to the peripheral are given up to 20ms to be
+  /// sent first, and any which remain after that, as when the bus is
+  /// off, are discarded.
+  void ConfigureFilters(const Filter* begin, const Filter* end,
+                        FilterAction global_std_action,
+                        FilterAction global_ext_action);
+
   FDCAN_ProtocolStatusTypeDef status();
   FDCAN_ErrorCountersTypeDef error_counters();
 
@@ -132,6 +148,10 @@ class FDCan {
   static int ParseDlc(uint32_t dlc_code);
 
  private:
+  void ApplyFilters(const Filter* begin, const Filter* end,
+                    FilterAction global_std_action,
+                    FilterAction global_ext_action);
+
   const Options options_;
   Config config_;
 
@@ -16,6 +16,26 @@
 
 namespace fw {
 
+void Imu::PushSample(uint32_t timestamp_us, const Bmi088::Data& data) {
+  const uint32_t head = fifo_head_.load();
+  if (head - fifo_tail_.load() >= kFifoSize) {
+    // The host isn't keeping up, so this sample is dropped.
+    fifo_overflow_count_.store(fifo_overflow_count_.load() + 1);
+    return;
+  }
+
+  auto& sample = fifo_[head % kFifoSize];
+  sample.timestamp_us = timestamp_us;
+  sample.gx_dps = data.rate_dps.x();
+  sample.gy_dps = data.rate_dps.y();
+  sample.gz_dps = data.rate_dps.z();
+  sample.ax_mps2 = data.accel_mps2.x();
+  sample.ay_mps2 = data.accel_mps2.y();
+  sample.az_mps2 = data.accel_mps2.z();
+
+  fifo_head_.store(head + 1);
+}
+
 void Imu::DoImu() {
   const auto start = timer_->read_us();
 
@@ -30,6 +50,8 @@ void Imu::DoImu() {
   data.rate_dps = mounting_.Rotate(data.rate_dps);
   data.accel_mps2 = mounting_.Rotate(data.accel_mps2);
 
+  PushSample(start, data);
+
   auto& imu_data = [&]() -> ImuData& {
     for (auto& item : imu_data_buffer_) {
       if (item.active.load() == false) {
@@ -43,12 +65,26 @@ void Imu::DoImu() {
 
   imu_data.imu = ImuRegister{data};
 
-  attitude_reference_->ProcessMeasurement(
+  // The gyro is integrated on every sample, so the reported attitude
+  // and rates stay current, while the more expensive filter update
+  // may be run less often.
+  attitude_reference_->Propagate(
       period_s_,
       (static_cast<float>(M_PI) / 180.0f) * data.rate_dps,
       data.accel_mps2);
 
+  filter_count_++;
+  if (filter_count_ >= filter_decimation_) {
+    filter_count_ = 0;
+
+    const uint32_t start_cycles = cycle_counter_.read();
+    attitude_reference_->Update();
+    const uint32_t end_cycles = cycle_counter_.read();
+    last_update_cycles_ = end_cycles - start_cycles;
+  }
+
   AttitudeRegister& my_att = imu_data.attitude;
+  my_att.update_cycles = last_update_cycles_;
   my_att.present = 1;
   const Quaternion att = attitude_reference_->attitude();
   my_att.w = att.w();
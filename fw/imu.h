@@ -14,6 +14,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <string_view>
@@ -22,6 +23,7 @@
 
 #include "fw/attitude_reference.h"
 #include "fw/bmi088.h"
+#include "fw/cycle_counter.h"
 #include "fw/millisecond_timer.h"
 #include "fw/quaternion.h"
 #include "fw/register_spi_slave.h"
@@ -31,7 +33,7 @@ namespace fw {
 /// Exposes an IMU through the following SPI registers.
 ///
 ///  32: Protocol version:
-///     byte 0: the constant value 0x20
+///     byte 0: the constant value 0x21
 ///  33: Raw IMU data
 ///     bytes: The contents of the 'ImuRegister' structure
 ///  34: Attitude data
@@ -39,7 +41,18 @@ namespace fw {
 ///  35: Read configuration
 ///     bytes: The contents of the 'Configuration' structure
 ///  36: Write configuration
-///     bytes: The contents of the 'Configuration' structure
+///     bytes: The contents of the 'Configuration' structure.  A write
+///            of only the first 16 bytes, as sent by older hosts,
+///            leaves 'filter_rate_hz' at 0.
+///  37: Sample FIFO status
+///     bytes: The contents of the 'FifoStatusRegister' structure
+///  38: Sample FIFO data
+///     bytes: Up to 'FifoStatusRegister::contiguous' consecutive
+///            'SampleRegister' structures, oldest first.  As many
+///            whole samples as are read are removed from the FIFO.
+///
+/// The IRQ line is asserted whenever a new sample is available, and
+/// cleared once it has been read.
 class Imu {
  public:
   struct ImuRegister {
@@ -63,6 +76,29 @@ class Imu {
     }
   } __attribute__((packed));
 
+  struct SampleRegister {
+    uint32_t timestamp_us = 0;
+    float gx_dps = 0;
+    float gy_dps = 0;
+    float gz_dps = 0;
+    float ax_mps2 = 0;
+    float ay_mps2 = 0;
+    float az_mps2 = 0;
+  } __attribute__((packed));
+
+  struct FifoStatusRegister {
+    // The total number of samples queued.
+    uint16_t count = 0;
+    // How many of those can be read with a single read of register
+    // 38.
+    uint16_t contiguous = 0;
+    // The number of samples which were discarded because the FIFO
+    // was full.
+    uint32_t overflow_count = 0;
+  } __attribute__((packed));
+
+  static constexpr int kFifoSize = 64;
+
   struct AttitudeRegister {
     uint8_t present = 0;
     uint8_t update_time_10us = 0;
@@ -88,13 +124,22 @@ class Imu {
     float uncertainty_bias_z_dps = 0;
     uint32_t error_count = 0;
     uint32_t last_error = 0;
+    // The number of CPU cycles taken by the most recent filter update.
+    uint32_t update_cycles = 0;
   } __attribute__((packed));
 
   struct Configuration {
     float yaw_deg = 0;
     float pitch_deg = 0;
     float roll_deg = 0;
+    // The rate at which the BMI088 is sampled.  Valid values are 100,
+    // 200, 400, 1000, and 2000.  Every sample is integrated into the
+    // attitude and placed in the FIFO.
     uint32_t rate_hz = 400;
+    // If non-zero, the attitude filter is only updated at
+    // approximately this rate, using the nearest integer divisor of
+    // 'rate_hz'.  0 updates it on every sample.
+    uint32_t filter_rate_hz = 0;
 
     Quaternion quaternion() {
       return Quaternion::FromEuler(
@@ -107,7 +152,8 @@ class Imu {
       return yaw_deg == rhs.yaw_deg &&
           pitch_deg == rhs.pitch_deg &&
           roll_deg == rhs.roll_deg &&
-          rate_hz == rhs.rate_hz;
+          rate_hz == rhs.rate_hz &&
+          filter_rate_hz == rhs.filter_rate_hz;
     }
 
     bool operator!=(const Configuration& rhs) const {
@@ -115,6 +161,8 @@ class Imu {
     }
   } __attribute__((packed));
 
+  static constexpr int kLegacyConfigurationSize = 16;
+
   Imu(mjlib::micro::Pool* pool, fw::MillisecondTimer* timer, PinName irq_name)
       : pool_(pool),
         timer_(timer),
@@ -144,13 +192,17 @@ class Imu {
   }
 
   static bool IsSpiAddress(uint16_t address) {
-    return address >= 32 && address <= 36;
+    return address >= 32 && address <= 38;
+  }
+
+  static bool IsWriteAddress(uint16_t address) {
+    return address == 36;
   }
 
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
     if (address == 32) {
       return {
-        std::string_view("\x20", 1),
+        std::string_view("\x21", 1),
         {},
       };
     }
@@ -171,21 +223,7 @@ class Imu {
       }
     }
     if (address == 34) {
-      const int bit = 2;
-      if (imu_isr_bitmask_ & bit) {
-        ISR_GetImuData();
-      }
-      imu_isr_bitmask_ |= bit;
-      if (imu_in_isr_) {
-        return {
-          std::string_view(
-              reinterpret_cast<const char*>(&imu_in_isr_->attitude),
-              sizeof(imu_in_isr_->attitude)),
-          {},
-        };
-      } else {
-        return {{}, {}};
-      }
+      return {ISR_GetAttitude(), {}};
     }
     if (address == 35) {
       return {
@@ -203,12 +241,61 @@ class Imu {
             sizeof(spi_config_shadow_)),
       };
     }
+    if (address == 37) {
+      const uint32_t count = fifo_head_.load() - fifo_tail_.load();
+      fifo_status_.count = count;
+      fifo_status_.contiguous = ISR_FifoContiguous();
+      fifo_status_.overflow_count = fifo_overflow_count_.load();
+      return {
+        std::string_view(
+            reinterpret_cast<const char*>(&fifo_status_),
+            sizeof(fifo_status_)),
+        {},
+      };
+    }
+    if (address == 38) {
+      fifo_read_count_ = ISR_FifoContiguous();
+      return {
+        std::string_view(
+            reinterpret_cast<const char*>(
+                &fifo_[fifo_tail_.load() % kFifoSize]),
+            fifo_read_count_ * sizeof(SampleRegister)),
+        {},
+      };
+    }
     return {};
   }
 
+  /// Return the latest attitude in the same manner as a read of
+  /// register 34, so that it can be combined with other data in a
+  /// single transfer.  An empty view is returned if no new sample
+  /// has been produced since the last read.
+  std::string_view ISR_GetAttitude() {
+    const int bit = 2;
+    if (imu_isr_bitmask_ & bit) {
+      ISR_GetImuData();
+    }
+    imu_isr_bitmask_ |= bit;
+    if (!imu_in_isr_) { return {}; }
+
+    return std::string_view(
+        reinterpret_cast<const char*>(&imu_in_isr_->attitude),
+        sizeof(imu_in_isr_->attitude));
+  }
+
   void ISR_End(uint16_t address, int bytes) {
+    if (address == 38) {
+      const uint32_t consumed = std::min<uint32_t>(
+          fifo_read_count_, bytes / sizeof(SampleRegister));
+      fifo_tail_.store(fifo_tail_.load() + consumed);
+      fifo_read_count_ = 0;
+    }
     if (address == 36 &&
-        bytes == sizeof(spi_config_shadow_)) {
+        (bytes == sizeof(spi_config_shadow_) ||
+         bytes == kLegacyConfigurationSize)) {
+      if (bytes == kLegacyConfigurationSize) {
+        spi_config_shadow_.filter_rate_hz = 0;
+      }
       if (spi_config_ != spi_config_shadow_) {
         spi_config_ = spi_config_shadow_;
         // This is a data race, but we're about to throw away our entire
@@ -237,8 +324,16 @@ class Imu {
 
         return options;
       }());
-    period_s_ = 1.0f / static_cast<float>(imu_->setup_data().rate_hz);
-    us_step_ = 1000000 / imu_->setup_data().rate_hz;
+    const uint32_t rate_hz = imu_->setup_data().rate_hz;
+    period_s_ = 1.0f / static_cast<float>(rate_hz);
+    us_step_ = 1000000 / rate_hz;
+
+    const uint32_t filter_rate_hz = spi_config_.filter_rate_hz;
+    filter_decimation_ =
+        (filter_rate_hz == 0) ? 1 :
+        std::max<uint32_t>(
+            1, (rate_hz + filter_rate_hz / 2) / filter_rate_hz);
+    filter_count_ = 0;
   };
 
   void ISR_GetImuData() {
@@ -254,17 +349,31 @@ class Imu {
     imu_isr_bitmask_ = 0;
   }
 
+  uint32_t ISR_FifoContiguous() const {
+    const uint32_t tail = fifo_tail_.load();
+    const uint32_t count = fifo_head_.load() - tail;
+    return std::min<uint32_t>(count, kFifoSize - (tail % kFifoSize));
+  }
+
+  void PushSample(uint32_t timestamp_us, const Bmi088::Data& data);
+
   void DoImu();
 
   mjlib::micro::Pool* const pool_;
   MillisecondTimer* const timer_;
   DigitalOut irq_;
+  CycleCounter cycle_counter_;
 
   std::optional<Bmi088> imu_;
   float period_s_ = 0.0;
   uint32_t us_step_ = 0;
   uint32_t next_imu_sample_ = 0;
 
+  // The attitude filter is updated once every this many samples.
+  uint32_t filter_decimation_ = 1;
+  uint32_t filter_count_ = 0;
+  uint32_t last_update_cycles_ = 0;
+
   Configuration spi_config_{0, 90, -90, 400};
   Configuration spi_config_shadow_;
   Quaternion mounting_ = spi_config_.quaternion();
@@ -287,6 +396,16 @@ class Imu {
   // Used to keep track of when we need to grab new data in the ISR.
   uint32_t imu_isr_bitmask_ = 3;
 
+  // A single producer (DoImu), single consumer (the SPI ISR) queue
+  // of samples.  The head is only written by the producer, and the
+  // tail only by the consumer.
+  SampleRegister fifo_[kFifoSize] = {};
+  std::atomic<uint32_t> fifo_head_{0};
+  std::atomic<uint32_t> fifo_tail_{0};
+  std::atomic<uint32_t> fifo_overflow_count_{0};
+  FifoStatusRegister fifo_status_;
+  uint32_t fifo_read_count_ = 0;
+
   Bmi088::SetupData setup_data_;
   std::optional<AttitudeReference> attitude_reference_;
 
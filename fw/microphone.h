@@ -14,17 +14,65 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string_view>
+
+#include "mbed.h"
+
+#include "fw/millisecond_timer.h"
+#include "fw/register_spi_slave.h"
+
+/// The rate at which the microphone is sampled after startup.
+#ifndef MICROPHONE_SAMPLE_RATE_HZ
+#define MICROPHONE_SAMPLE_RATE_HZ 22050
+#endif
+
 namespace fw {
 
 /// Exposes the microphone through the following SPI registers.
 ///
 /// 80: Protocol version:
-///  byte0: 0x20
+///  byte0: 0x22
 /// 81: Microphone data
-///  byte0: number of bytes of data
-///  byte1-255: Up to 254 bytes of data
+///  byte0-1: number of samples which follow, uint16 little endian
+///  byte2-3: samples lost because the ring was full, uint16 little
+///    endian, wraps around
+///  byte4+: up to as many 8 bit unsigned samples as were requested
+///    through register 84, oldest first
+///  The samples are consumed only if the read covers all of them.
+/// 82: Microphone status
+///  byte0-1: number of samples available, uint16 little endian
+///  byte2-3: current sample rate in Hz, uint16 little endian
+///  byte4-5: samples lost because the ring was full, uint16 little
+///    endian, wraps around
+/// 83: Microphone configuration (write only)
+///  byte0-1: sample rate in Hz, uint16 little endian, 0 to stop
+///    sampling.  This is limited to between kMinRateHz and kMaxRateHz.
+/// 84: Microphone read request (write only)
+///  byte0-1: number of samples the next read of 81 may return, uint16
+///    little endian.  This applies to one read only, and is limited
+///    to kMaxReadSize.
+///
+/// The number of bytes the SPI DMA reports as sent includes those
+/// still sitting in the TX FIFO, so it cannot tell how many samples
+/// the master actually saw.  Thus the master says in advance how many
+/// it wants, and a read of 81 with no request returns none.
+///
+/// The ADC free runs, triggered by TIM6, with DMA storing samples into
+/// a ring of kRingSize bytes.  Thus no CPU time is used per sample.
 class Microphone {
  public:
+  static constexpr uint32_t kRingSize = 4096;
+  static constexpr uint32_t kMaxReadSize = 1024;
+  static constexpr int kMinRateHz = 200;
+  static constexpr int kMaxRateHz = 48000;
+
+  // Samples closer than this to the DMA write position are treated as
+  // lost, so that a read never races with the DMA overwriting them.
+  static constexpr uint32_t kGuardSize = 64;
+
   Microphone(fw::MillisecondTimer* timer, PinName adc_name) {
     __HAL_RCC_GPIOB_CLK_ENABLE();
 
@@ -134,6 +182,43 @@ class Microphone {
 
     adc->SMPR1 = all_aux_cycles;
     adc->SMPR2 = all_aux_cycles;
+
+    // Each conversion is triggered by TIM6 and stored into our ring by
+    // DMA, with 8 bits of resolution so that a sample is one byte.
+    adc->CFGR =
+        ADC_RESOLUTION_8B |
+        ADC_CFGR_DMAEN |
+        ADC_CFGR_DMACFG |  // circular
+        ADC_CFGR_OVRMOD |
+        ADC_EXTERNALTRIGCONV_T6_TRGO |
+        ADC_CFGR_EXTEN_0;  // rising edge
+
+    __HAL_RCC_DMAMUX1_CLK_ENABLE();
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    dma_->CCR = 0;
+    dma_->CPAR = reinterpret_cast<uint32_t>(&adc->DR);
+    dma_->CMAR = reinterpret_cast<uint32_t>(&ring_[0]);
+    dma_->CNDTR = kRingSize;
+    dmamux_->CCR = DMA_REQUEST_ADC5 & DMAMUX_CxCR_DMAREQ_ID;
+    dma_->CCR =
+        DMA_PERIPH_TO_MEMORY |
+        DMA_PINC_DISABLE |
+        DMA_MINC_ENABLE |
+        DMA_PDATAALIGN_HALFWORD |
+        DMA_MDATAALIGN_BYTE |
+        DMA_CIRCULAR |
+        DMA_PRIORITY_LOW |
+        DMA_CCR_EN;
+
+    adc->CR |= ADC_CR_ADSTART;
+
+    __HAL_RCC_TIM6_CLK_ENABLE();
+    // The timer clock is 170MHz, which this divides to 10MHz.
+    TIM6->PSC = 16;
+    TIM6->CR2 = TIM_CR2_MMS_1;  // TRGO on update
+
+    SetRate(MICROPHONE_SAMPLE_RATE_HZ);
   }
 
   class DisableIrqs {
@@ -148,68 +233,173 @@ class Microphone {
   };
 
   void PollMillisecond() {
-    auto* adc = adc_.Instance;
-    adc->CR |= ADC_CR_ADSTART;
-    while ((adc->ISR & ADC_ISR_EOC) == 0);
-    adc->ISR |= ADC_ISR_EOC;
-    const auto adc_value = adc->DR >> 4;
-    adc->CR |= ADC_CR_ADSTP;
-    while (adc->CR & ADC_CR_ADSTP);
-
-    DisableIrqs disable_irqs;
-
-    auto* data = current_data_.load();
-
-    // Simple hack.  Just sample at 1kHz for now in this poll call.
-    // We should get the ADC to free run with DMA dumping its data
-    // somewhere so we can sample at a more reasonable 22kHz or 44kHz.
-    if (data->size >= sizeof(data->data)) {
-      // Overrun!
-      return;
+    if (rate_pending_) {
+      rate_pending_ = false;
+      SetRate(pending_rate_hz_);
     }
 
-    data->data[data->size++] = adc_value;
+    // The DMA write position must be observed at least once per trip
+    // around the ring, so that no wrap is missed.
+    DisableIrqs disable_irqs;
+    UpdateHead();
   }
 
   static bool IsSpiAddress(uint16_t address) {
-    return address >= 80 && address <= 81;
+    return address >= 80 && address <= 84;
+  }
+
+  static bool IsWriteAddress(uint16_t address) {
+    return address == 83 || address == 84;
   }
 
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
     if (address == 80) {
       return {
-        std::string_view("\x20", 1),
+        std::string_view("\x22", 1),
         {},
       };
     }
     if (address == 81) {
-      auto* to_read = current_data_.load();
-      current_data_.store(to_read == &data_[0] ? &data_[1] : &data_[0]);
-      (*current_data_).size = 0;
+      UpdateHead();
+
+      const uint32_t count = std::min(head_ - tail_, requested_count_);
+      requested_count_ = 0;
+      const uint32_t start = tail_ % kRingSize;
+      const uint32_t first = std::min(count, kRingSize - start);
+      std::memcpy(&read_buf_[4], &ring_[start], first);
+      std::memcpy(&read_buf_[4 + first], &ring_[0], count - first);
+      WriteU16(&read_buf_[0], count);
+      WriteU16(&read_buf_[2], overrun_count_);
+      staged_count_ = count;
+
+      return {
+        std::string_view(read_buf_, 4 + count),
+        {},
+      };
+    }
+    if (address == 82) {
+      UpdateHead();
+
+      WriteU16(&status_buf_[0], std::min<uint32_t>(head_ - tail_, 65535));
+      WriteU16(&status_buf_[2], rate_hz_);
+      WriteU16(&status_buf_[4], overrun_count_);
+      return {
+        std::string_view(status_buf_, sizeof(status_buf_)),
+        {},
+      };
+    }
+    if (address == 83) {
+      return {
+        {},
+        mjlib::base::string_span(config_buf_, sizeof(config_buf_)),
+      };
+    }
+    if (address == 84) {
       return {
-        std::string_view(reinterpret_cast<const char*>(to_read), to_read->size + 1),
         {},
+        mjlib::base::string_span(request_buf_, sizeof(request_buf_)),
       };
     }
     return {};
   }
 
   void ISR_End(uint16_t address, int bytes) {
+    if (address == 81) {
+      // A read which was cut short leaves everything staged for the
+      // next.
+      if (bytes >= static_cast<int>(4 + staged_count_)) {
+        tail_ += staged_count_;
+      }
+      staged_count_ = 0;
+    }
+    if (address == 84 && bytes >= 2) {
+      requested_count_ = std::min<uint32_t>(
+          kMaxReadSize, u8(request_buf_[0]) | (u8(request_buf_[1]) << 8));
+    }
+    if (address == 83 && bytes >= 2) {
+      pending_rate_hz_ = u8(config_buf_[0]) | (u8(config_buf_[1]) << 8);
+      rate_pending_ = true;
+    }
   }
 
  private:
+  void SetRate(int rate_hz) {
+    TIM6->CR1 = 0;
+    if (rate_hz <= 0) {
+      rate_hz_ = 0;
+      return;
+    }
+
+    rate_hz_ = std::max(kMinRateHz, std::min(kMaxRateHz, rate_hz));
+    TIM6->ARR = (10000000 / rate_hz_) - 1;
+    TIM6->CNT = 0;
+    TIM6->EGR = TIM_EGR_UG;
+    TIM6->CR1 = TIM_CR1_CEN;
+  }
+
+  /// Bring head_ up to date with the DMA write position, and discard
+  /// anything the DMA may have overwritten.  This must be called with
+  /// interrupts disabled, or from the ISR.
+  void UpdateHead() {
+    const uint32_t position = (kRingSize - dma_->CNDTR) % kRingSize;
+    if (position < last_position_) {
+      wrap_base_ += kRingSize;
+    }
+    last_position_ = position;
+    head_ = wrap_base_ + position;
+
+    const uint32_t available = head_ - tail_;
+    if (available > kRingSize - kGuardSize) {
+      const uint32_t lost = available - (kRingSize - kGuardSize);
+      overrun_count_ += lost;
+      tail_ += lost;
+    }
+  }
+
+  template <typename T>
+  static uint8_t u8(T value) {
+    return static_cast<uint8_t>(value);
+  }
+
+  static void WriteU16(char* data, uint32_t value) {
+    data[0] = value & 0xff;
+    data[1] = (value >> 8) & 0xff;
+  }
+
   DAC_HandleTypeDef dac_ = {};
   OPAMP_HandleTypeDef opamp_ = {};
   ADC_HandleTypeDef adc_ = {};
 
-  struct Data {
-    uint8_t size = 0;
-    uint8_t data[254] = {};
-  } __attribute__((packed)) ;
-
-  Data data_[2] = {};
-  std::atomic<Data*> current_data_{&data_[0]};
-
+  DMA_Channel_TypeDef* const dma_ = DMA2_Channel1;
+  DMAMUX_Channel_TypeDef* const dmamux_ =
+#if defined (STM32G471xx) || defined (STM32G473xx) || defined (STM32G474xx) || defined (STM32G483xx) || defined (STM32G484xx)
+      DMAMUX1_Channel8;
+#elif defined (STM32G431xx) || defined (STM32G441xx) || defined (STM32GBK1CB)
+      DMAMUX1_Channel6;
+#else
+      DMAMUX1_Channel7;
+#endif
+
+  uint8_t ring_[kRingSize] = {};
+
+  // These count samples since startup, and wrap around.  Only the ISR
+  // and PollMillisecond (with interrupts disabled) touch them.
+  uint32_t wrap_base_ = 0;
+  uint32_t last_position_ = 0;
+  uint32_t head_ = 0;
+  uint32_t tail_ = 0;
+  uint32_t staged_count_ = 0;
+  uint32_t requested_count_ = 0;
+  uint16_t overrun_count_ = 0;
+
+  int rate_hz_ = 0;
+  std::atomic<bool> rate_pending_{false};
+  int pending_rate_hz_ = 0;
+
+  char read_buf_[4 + kMaxReadSize] = {};
+  char status_buf_[6] = {};
+  char config_buf_[2] = {};
+  char request_buf_[2] = {};
 };
 
 }
@@ -52,17 +52,25 @@ CanBridge::Pins MakeCanPins() {
 
 class CanApplication {
  public:
+  // The modules whose time is measured, in the order they are
+  // reported through register 100.
+  enum Module {
+    kBridgePoll,
+    kSpiPollMillisecond,
+    kModuleCount,
+  };
+
   CanApplication(fw::MillisecondTimer* timer)
       : timer_(timer) {}
 
   void Poll() {
     cpu_meter_.Poll();
-    bridge_.Poll();
+    cpu_meter_.Measure(kBridgePoll, [&]() { bridge_.Poll(); });
   }
 
   void PollMillisecond() {
     cpu_meter_.PollMillisecond();
-    spi_.PollMillisecond();
+    cpu_meter_.Measure(kSpiPollMillisecond, [&]() { spi_.PollMillisecond(); });
   }
 
   fw::MillisecondTimer* const timer_;
@@ -92,7 +100,7 @@ class CanApplication {
     }()
   };
 
-  CpuMeter cpu_meter_;
+  CpuMeter cpu_meter_{kModuleCount};
   CanBridge bridge_{timer_, &can1_, &can2_, MakeCanPins()};
   DeviceInfo device_info_;
 
@@ -121,6 +129,10 @@ class CanApplication {
       if (DeviceInfo::IsSpiAddress(address)) {
         device_info_.ISR_End(address, bytes);
       }
+    },
+    [](uint16_t address) {
+      return CanBridge::IsWriteAddress(address) ||
+          DeviceInfo::IsWriteAddress(address);
     }
   };
 };
@@ -140,23 +152,37 @@ class CanApplication {
 /// D. A microphone.
 class AuxApplication {
  public:
+  // The modules whose time is measured, in the order they are
+  // reported through register 100.
+  enum Module {
+    kBridgePoll,
+    kImuPoll,
+    kRfPoll,
+    kSpiPollMillisecond,
+    kImuPollMillisecond,
+    kRfPollMillisecond,
+    kMicrophonePollMillisecond,
+    kModuleCount,
+  };
+
   AuxApplication(mjlib::micro::Pool* pool, fw::MillisecondTimer* timer)
       : pool_(pool), timer_(timer) {
   }
 
   void Poll() {
     cpu_meter_.Poll();
-    bridge_.Poll();
-    imu_.Poll();
-    rf_.Poll();
+    cpu_meter_.Measure(kBridgePoll, [&]() { bridge_.Poll(); });
+    cpu_meter_.Measure(kImuPoll, [&]() { imu_.Poll(); });
+    cpu_meter_.Measure(kRfPoll, [&]() { rf_.Poll(); });
   }
 
   void PollMillisecond() {
     cpu_meter_.PollMillisecond();
-    spi_.PollMillisecond();
-    imu_.PollMillisecond();
-    rf_.PollMillisecond();
-    microphone_.PollMillisecond();
+    cpu_meter_.Measure(kSpiPollMillisecond, [&]() { spi_.PollMillisecond(); });
+    cpu_meter_.Measure(kImuPollMillisecond, [&]() { imu_.PollMillisecond(); });
+    cpu_meter_.Measure(kRfPollMillisecond, [&]() { rf_.PollMillisecond(); });
+    cpu_meter_.Measure(kMicrophonePollMillisecond,
+                       [&]() { microphone_.PollMillisecond(); });
   }
 
  private:
@@ -179,12 +205,25 @@ class AuxApplication {
     if (address == 96) {
       // This is a multiplexing register which allows clients to
       // determine what is ready to read.
-      read_buf_[0] = bridge_.queue_size();
-      read_buf_[1] = imu_.data_present() ? 1 : 0;
-      const auto bitfield = rf_.bitfield();
-      std::memcpy(&read_buf_[2], &bitfield, sizeof(bitfield));
+      ISR_FillStatus(&read_buf_[0]);
       return {
-        std::string_view(&read_buf_[0], 6),
+        std::string_view(&read_buf_[0], kStatusSize),
+        {},
+      };
+    }
+    if (address == 98) {
+      // The same as 96, followed by the contents of register 34, so
+      // that attitude can be polled with a single transfer.
+      ISR_FillStatus(&attitude_buf_[0]);
+      const auto attitude = imu_.ISR_GetAttitude();
+      std::memcpy(&attitude_buf_[kStatusSize], attitude.data(),
+                  attitude.size());
+      // If no new attitude is available, the remainder will read as
+      // zero, which includes the 'present' byte.
+      std::memset(&attitude_buf_[kStatusSize + attitude.size()], 0,
+                  sizeof(Imu::AttitudeRegister) - attitude.size());
+      return {
+        std::string_view(&attitude_buf_[0], sizeof(attitude_buf_)),
         {},
       };
     }
@@ -194,6 +233,13 @@ class AuxApplication {
     return {};
   }
 
+  void ISR_FillStatus(char* buf) {
+    buf[0] = bridge_.queue_size();
+    buf[1] = imu_.data_present() ? 1 : 0;
+    const auto bitfield = rf_.bitfield();
+    std::memcpy(&buf[2], &bitfield, sizeof(bitfield));
+  }
+
   void ISR_End(uint16_t address, int bytes) {
     if (CanBridge::IsSpiAddress(address)) {
       bridge_.ISR_End(address, bytes);
@@ -231,7 +277,7 @@ class AuxApplication {
     }()
   };
 
-  CpuMeter cpu_meter_;
+  CpuMeter cpu_meter_{kModuleCount};
   CanBridge bridge_{timer_, &can1_, nullptr, MakeCanPins()};
 
   DigitalOut can_shdn_{PC_6, 0};
@@ -249,10 +295,20 @@ class AuxApplication {
     },
     [this](uint16_t address, int bytes) {
       this->ISR_End(address, bytes);
+    },
+    [](uint16_t address) {
+      return CanBridge::IsWriteAddress(address) ||
+          Imu::IsWriteAddress(address) ||
+          RfTransceiver::IsWriteAddress(address) ||
+          Microphone::IsWriteAddress(address) ||
+          DeviceInfo::IsWriteAddress(address);
     }
   };
 
-  char read_buf_[6] = {};
+  static constexpr size_t kStatusSize = 6;
+
+  char read_buf_[kStatusSize] = {};
+  char attitude_buf_[kStatusSize + sizeof(Imu::AttitudeRegister)] = {};
 };
 
 void SetupClock() {
@@ -14,6 +14,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <string_view>
 
 #include "mbed.h"
@@ -22,6 +24,7 @@
 #include "mjlib/base/inplace_function.h"
 #include "mjlib/base/string_span.h"
 
+#include "fw/crc16.h"
 #include "fw/millisecond_timer.h"
 
 namespace fw {
@@ -43,8 +46,49 @@ namespace fw {
 ///  * EndHandler - this is called when the most recent transaction is
 ///    complete.  It is passed the number of bytes which were
 ///    transferred.
+///
+/// It also provides a WriteQuery, which reports whether an address
+/// receives data, so that burst lists can be checked without invoking
+/// the StartHandler.
+///
+/// Two addresses are handled by this class itself, so that several
+/// registers may be read with a single chip select:
+///  * 126 (write) - a burst list of up to kMaxBurstEntries pairs of
+///    bytes, each an address and the number of bytes to read from it.
+///  * 127 (read) - the registers of the most recent burst list, each
+///    zero padded or truncated to its listed size, back to back.
+///
+/// For a burst read, the StartHandler is invoked for every listed
+/// address before any data is clocked out, and the EndHandler for each
+/// on completion, with the number of bytes of that register's section
+/// which were transferred.  Registers which keep state between the
+/// two, such as those which consume data, must therefore appear at
+/// most once per module in a list.  A list which names any register
+/// the WriteQuery reports as receiving data is discarded when it is
+/// stored, as the StartHandler of such a register may claim buffers or
+/// otherwise act as though a write had begun.
+///
+/// If the address has bit 7 (kCrcFlag) set, then it is followed by a
+/// 16 bit little endian length, and the data phase is that many bytes
+/// followed by the CRC-16/CCITT-FALSE of the 3 address bytes and the
+/// data.  Reads are zero padded or truncated to the length.  Writes
+/// only reach the EndHandler, and their register, if the CRC matches,
+/// and are otherwise reported as transferring nothing.  As the CRC is
+/// computed in software, the master must wait roughly 50ns per byte
+/// after the address of a read, and after the end of a write.
+///
+/// Register 101 reports how many CRC writes have been rejected.
 class RegisterSPISlave {
  public:
+  static constexpr uint16_t kCrcStatusAddress = 101;
+  static constexpr uint16_t kBurstListAddress = 126;
+  static constexpr uint16_t kBurstReadAddress = 127;
+  static constexpr int kMaxBurstEntries = 8;
+  static constexpr int kMaxBurstSize = 256;
+
+  static constexpr uint8_t kCrcFlag = 0x80;
+  static constexpr int kMaxCrcSize = 1024;
+
   struct Buffer {
     std::string_view tx;
     mjlib::base::string_span rx;
@@ -52,6 +96,7 @@ class RegisterSPISlave {
 
   using StartHandler = mjlib::base::inplace_function<Buffer (uint16_t)>;
   using EndHandler = mjlib::base::inplace_function<void (uint16_t, int)>;
+  using WriteQuery = mjlib::base::inplace_function<bool (uint16_t)>;
 
   struct Pins {
     PinName mosi = NC;
@@ -66,14 +111,16 @@ class RegisterSPISlave {
 
   RegisterSPISlave(fw::MillisecondTimer* timer,
                    const Pins& pins,
-                   StartHandler start_handler, EndHandler end_handler)
+                   StartHandler start_handler, EndHandler end_handler,
+                   WriteQuery write_query)
       : timer_{timer},
         dma_rx_{pins.rx_dma},
         dma_tx_{pins.tx_dma},
         nss_{pins.ssel},
         status_led_{pins.status_led, 1},
         start_handler_(start_handler),
-        end_handler_(end_handler) {
+        end_handler_(end_handler),
+        write_query_(write_query) {
     g_impl_ = this;
 
     __HAL_RCC_DMAMUX1_CLK_ENABLE();
@@ -205,7 +252,11 @@ class RegisterSPISlave {
 
     // Mark the transfer as completed if we actually started one.
     if (mode_ == kTransfer) {
-      end_handler_(current_address_, rx_bytes);
+      if (crc_) {
+        ISR_EndCrc(rx_bytes);
+      } else {
+        ISR_End(current_address_, rx_bytes);
+      }
     }
 
     // We need to flush out the peripheral's FIFOs and get it ready to
@@ -242,14 +293,31 @@ class RegisterSPISlave {
           break;
         }
         case kWaitingAddress: {
-          current_address_ = ReadRegister(&spi_->DR);
-          buffer_ = start_handler_(current_address_);
-          ISR_StartDMA();
-          mode_ = kTransfer;
-
-          // We won't be using the SPI interrupts going forward.
-          spi_->CR2 &= ~SPI_CR2_RXNEIE;
-
+          const uint8_t address = ReadRegister(&spi_->DR);
+          crc_ = (address & kCrcFlag) != 0;
+          current_address_ = address & ~kCrcFlag;
+          if (crc_) {
+            // Two length bytes follow, which need something to be
+            // clocked out in return.
+            crc_header_[0] = address;
+            WriteRegister(&spi_->DR, 0);
+            mode_ = kWaitingLength1;
+            break;
+          }
+          buffer_ = ISR_Start(current_address_);
+          ISR_BeginTransfer();
+          break;
+        }
+        case kWaitingLength1: {
+          crc_header_[1] = ReadRegister(&spi_->DR);
+          WriteRegister(&spi_->DR, 0);
+          mode_ = kWaitingLength2;
+          break;
+        }
+        case kWaitingLength2: {
+          crc_header_[2] = ReadRegister(&spi_->DR);
+          buffer_ = ISR_StartCrc();
+          ISR_BeginTransfer();
           break;
         }
         case kTransfer: {
@@ -259,6 +327,163 @@ class RegisterSPISlave {
     }
   }
 
+  void ISR_BeginTransfer() {
+    ISR_StartDMA();
+    mode_ = kTransfer;
+
+    // We won't be using the SPI interrupts going forward.
+    spi_->CR2 &= ~SPI_CR2_RXNEIE;
+  }
+
+  Buffer ISR_Start(uint16_t address) {
+    if (address == kCrcStatusAddress) {
+      return {
+        std::string_view(reinterpret_cast<const char*>(&crc_status_),
+                         sizeof(crc_status_)),
+        {},
+      };
+    }
+    if (address == kBurstListAddress) {
+      return {
+        {},
+        mjlib::base::string_span(burst_list_buf_, sizeof(burst_list_buf_)),
+      };
+    }
+    if (address == kBurstReadAddress) {
+      return ISR_StartBurst();
+    }
+    return start_handler_(address);
+  }
+
+  void ISR_End(uint16_t address, size_t bytes) {
+    if (address == kBurstListAddress) {
+      ISR_StoreBurstList(bytes);
+    } else if (address == kBurstReadAddress) {
+      ISR_EndBurst(bytes);
+    } else {
+      end_handler_(address, bytes);
+    }
+  }
+
+  /// Set up a transfer with a CRC, after the address and length have
+  /// been received.  Everything goes through crc_buf_, so that reads
+  /// can have the CRC appended, and writes can be checked before
+  /// their register sees them.
+  Buffer ISR_StartCrc() {
+    crc_length_ = u8(crc_header_[1]) | (u8(crc_header_[2]) << 8);
+    crc_target_ = {};
+    crc_available_ = 0;
+
+    if (crc_length_ > kMaxCrcSize) {
+      // Nothing is clocked out, so the master will see a mismatch.
+      crc_status_.rejected_count++;
+      return {};
+    }
+
+    const auto buffer = ISR_Start(current_address_);
+    if (buffer.rx.size() == 0) {
+      crc_available_ = std::min<size_t>(crc_length_, buffer.tx.size());
+      if (crc_available_) {
+        std::memcpy(crc_buf_, buffer.tx.data(), crc_available_);
+      }
+      std::memset(&crc_buf_[crc_available_], 0,
+                  crc_length_ - crc_available_);
+      const uint16_t crc = Crc16::Update(
+          Crc16::Update(Crc16::kInit, crc_header_, sizeof(crc_header_)),
+          crc_buf_, crc_length_);
+      crc_buf_[crc_length_] = crc >> 8;
+      crc_buf_[crc_length_ + 1] = crc & 0xff;
+      return { std::string_view(crc_buf_, crc_length_ + 2), {} };
+    }
+
+    crc_target_ = buffer.rx;
+    return {
+      {},
+      mjlib::base::string_span(crc_buf_, crc_length_ + 2),
+    };
+  }
+
+  void ISR_EndCrc(size_t bytes) {
+    // The register was never started, so is not ended either.
+    if (crc_length_ > kMaxCrcSize) { return; }
+
+    if (crc_target_.size() == 0) {
+      // A read, where only the data itself counts as transferred.
+      ISR_End(current_address_,
+              std::min<size_t>(crc_available_,
+                               std::min<size_t>(bytes, crc_length_)));
+      return;
+    }
+
+    const bool valid = [&]() {
+      if (bytes != static_cast<size_t>(crc_length_ + 2)) { return false; }
+      const uint16_t crc = Crc16::Update(
+          Crc16::Update(Crc16::kInit, crc_header_, sizeof(crc_header_)),
+          crc_buf_, crc_length_);
+      return u8(crc_buf_[crc_length_]) == (crc >> 8) &&
+          u8(crc_buf_[crc_length_ + 1]) == (crc & 0xff);
+    }();
+
+    if (!valid) {
+      crc_status_.rejected_count++;
+      ISR_End(current_address_, 0);
+      return;
+    }
+
+    const size_t size = std::min<size_t>(crc_length_, crc_target_.size());
+    std::memcpy(crc_target_.data(), crc_buf_, size);
+    ISR_End(current_address_, size);
+  }
+
+  /// Gather every register of the burst list into a single buffer.
+  /// The DMA controller cannot chain buffers without a gap, so they
+  /// are copied instead, which for status sized registers takes well
+  /// under the time the master waits after sending the address.
+  Buffer ISR_StartBurst() {
+    size_t offset = 0;
+    for (int i = 0; i < burst_count_; i++) {
+      auto& entry = burst_[i];
+      const auto tx = start_handler_(entry.address).tx;
+      entry.available = std::min<size_t>(entry.size, tx.size());
+      if (entry.available) {
+        std::memcpy(&burst_buf_[offset], tx.data(), entry.available);
+      }
+      std::memset(&burst_buf_[offset + entry.available], 0,
+                  entry.size - entry.available);
+      offset += entry.size;
+    }
+    return { std::string_view(burst_buf_, offset), {} };
+  }
+
+  void ISR_EndBurst(size_t bytes) {
+    size_t offset = 0;
+    for (int i = 0; i < burst_count_; i++) {
+      const auto& entry = burst_[i];
+      const size_t clocked =
+          (bytes > offset) ? std::min<size_t>(bytes - offset, entry.size) : 0;
+      end_handler_(entry.address, std::min(clocked, entry.available));
+      offset += entry.size;
+    }
+  }
+
+  void ISR_StoreBurstList(size_t bytes) {
+    const int count = std::min<int>(bytes / 2, kMaxBurstEntries);
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+      const uint16_t address = u8(burst_list_buf_[i * 2]);
+      if (address == kBurstListAddress || address == kBurstReadAddress ||
+          write_query_(address)) {
+        // A burst may neither nest nor write, so the list is discarded.
+        burst_count_ = 0;
+        return;
+      }
+      burst_[i].address = address;
+      burst_[i].size = u8(burst_list_buf_[i * 2 + 1]);
+      total += burst_[i].size;
+    }
+    burst_count_ = (total <= kMaxBurstSize) ? count : 0;
+  }
+
   void ISR_StartDMA() {
     uint32_t en = 0;
 
@@ -378,6 +603,10 @@ class RegisterSPISlave {
     return reinterpret_cast<uint32_t>(value);
   }
 
+  static uint8_t u8(char value) {
+    return static_cast<uint8_t>(value);
+  }
+
   fw::MillisecondTimer* const timer_;
   SPI_HandleTypeDef spi_handle_ = {};
   SPI_TypeDef* spi_ = nullptr;
@@ -392,10 +621,13 @@ class RegisterSPISlave {
 
   StartHandler start_handler_;
   EndHandler end_handler_;
+  WriteQuery write_query_;
 
   enum Mode {
     kInactive,
     kWaitingAddress,
+    kWaitingLength1,
+    kWaitingLength2,
     kTransfer,
   };
   Mode mode_ = kInactive;
@@ -403,6 +635,31 @@ class RegisterSPISlave {
 
   Buffer buffer_;
 
+  struct BurstEntry {
+    uint16_t address = 0;
+    uint8_t size = 0;
+
+    // The number of bytes the StartHandler provided, at most 'size'.
+    size_t available = 0;
+  };
+
+  char burst_list_buf_[kMaxBurstEntries * 2] = {};
+  BurstEntry burst_[kMaxBurstEntries] = {};
+  int burst_count_ = 0;
+  char burst_buf_[kMaxBurstSize] = {};
+
+  struct CrcStatus {
+    uint32_t rejected_count = 0;
+  } __attribute__((packed));
+
+  bool crc_ = false;
+  char crc_header_[3] = {};
+  int crc_length_ = 0;
+  size_t crc_available_ = 0;
+  mjlib::base::string_span crc_target_;
+  char crc_buf_[kMaxCrcSize + 2] = {};
+  CrcStatus crc_status_;
+
   static RegisterSPISlave* g_impl_;
 };
 
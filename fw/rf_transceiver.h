@@ -24,7 +24,7 @@ namespace fw {
 
 /// Exposes the RF transceiver through the following SPI registers.
 ///  48: Protocol version:
-///   byte0: 0x10
+///   byte0: 0x11
 ///  49: Read ID
 ///   byte0-3: ID
 ///  50: Write ID
@@ -36,6 +36,16 @@ namespace fw {
 ///  52: Read status
 ///   byte0-3: uint32 with 2 bits per field
 ///   byte4-7: uint32 ms since last lock from tx
+///   byte8-9: uint16 mask of slots with data not yet read through
+///     register 53
+///  53: Changed slot data
+///   byte0-1: uint16 mask of the slots which follow
+///   byte2+: for each slot in ascending order, 21 bytes of age (4),
+///     size (1), and data (16, zero padded).  A slot is only marked
+///     as read once all of its bytes have been clocked out.
+///  54: Write multiple slots
+///   Zero or more slots are concatenated, each as byte0 slot number,
+///   byte1-4 priority, byte5 size (0-16), byte6+ data.
 ///  64-79: Read slot data
 ///   byte0-3: uint32 age in ms (little endian)
 ///   byte4: size
@@ -43,6 +53,9 @@ namespace fw {
 class RfTransceiver {
  public:
   static inline constexpr int kTimeoutMs = 1000;
+  static inline constexpr int kNumSlots = SlotRfProtocol::kNumSlots;
+  static inline constexpr int kBatchSlotSize = 21;
+  static inline constexpr int kWriteSlotHeaderSize = 6;
 
   RfTransceiver(fw::MillisecondTimer* timer, PinName irq_name)
       : timer_(timer),
@@ -95,10 +108,14 @@ class RfTransceiver {
     return address >= 48 && address <= 79;
   }
 
+  static bool IsWriteAddress(uint16_t address) {
+    return address == 50 || address == 51 || address == 54;
+  }
+
   RegisterSPISlave::Buffer ISR_Start(uint16_t address) {
     if (address == 48) {
       return {
-        std::string_view("\x10", 1),
+        std::string_view("\x11", 1),
         {},
       };
     }
@@ -130,9 +147,42 @@ class RfTransceiver {
       const uint32_t lock_age_ms = lock_age_ms_.load();
       std::memcpy(&read_buf_[4], reinterpret_cast<const char*>(&lock_age_ms),
                   sizeof(lock_age_ms));
+      const uint16_t pending = PendingMask(result);
+      std::memcpy(&read_buf_[8], reinterpret_cast<const char*>(&pending),
+                  sizeof(pending));
+      return {
+        std::string_view(&read_buf_[0], 10),
+        {},
+      };
+    }
+    if (address == 53) {
+      batch_bitfield_ = bitfield();
+      batch_mask_ = PendingMask(batch_bitfield_);
+      std::memcpy(&batch_read_buf_[0],
+                  reinterpret_cast<const char*>(&batch_mask_),
+                  sizeof(batch_mask_));
+      size_t size = 2;
+      for (int i = 0; i < kNumSlots; i++) {
+        if ((batch_mask_ & (1 << i)) == 0) { continue; }
+        const auto& slot = rf_->remote()->rx_slot(i);
+        char* const entry = &batch_read_buf_[size];
+        std::memcpy(&entry[0], reinterpret_cast<const char*>(&slot.age), 4);
+        entry[4] = slot.size;
+        std::memcpy(&entry[5], slot.data, slot.size);
+        std::memset(&entry[5 + slot.size], 0, 16 - slot.size);
+        size += kBatchSlotSize;
+      }
+      return {
+        std::string_view(&batch_read_buf_[0], size),
+        {},
+      };
+    }
+    if (address == 54) {
       return {
-        std::string_view(&read_buf_[0], sizeof(result) + sizeof(lock_age_ms)),
         {},
+        mjlib::base::string_span(
+            reinterpret_cast<char*>(batch_write_buf_),
+            sizeof(batch_write_buf_)),
       };
     }
     if (address >= 64 && address <= 79) {
@@ -155,17 +205,29 @@ class RfTransceiver {
       reset_.store(true);
     }
     if (address == 51 && bytes > 5) {
-      const auto slot_num = std::max(0, std::min<int>(15, write_buf_[0]));
-      SlotRfProtocol::Slot slot;
-      slot.priority =
-          (write_buf_[1] << 0) |
-          (write_buf_[2] << 8) |
-          (write_buf_[3] << 16) |
-          (write_buf_[4] << 24);
-      slot.size = bytes - 5;
-      std::memcpy(slot.data, &write_buf_[5], bytes - 5);
-      rf_->remote()->tx_slot(slot_num, slot);
-      remaining_timeout_ms_.store(kTimeoutMs);
+      WriteSlot(write_buf_, &write_buf_[5], bytes - 5);
+    }
+    if (address == 53) {
+      // Mark as read every slot which was completely clocked out.
+      int remaining = std::max(0, bytes - 2) / kBatchSlotSize;
+      for (int i = 0; i < kNumSlots && remaining > 0; i++) {
+        if ((batch_mask_ & (1 << i)) == 0) { continue; }
+        const uint32_t bits = 3 << (i * 2);
+        delivered_bitfield_ =
+            (delivered_bitfield_ & ~bits) | (batch_bitfield_ & bits);
+        remaining--;
+      }
+      batch_mask_ = 0;
+    }
+    if (address == 54) {
+      int offset = 0;
+      while (offset + kWriteSlotHeaderSize <= bytes) {
+        const char* const header = &batch_write_buf_[offset];
+        const int size = std::min<int>(16, u8(header[5]));
+        if (offset + kWriteSlotHeaderSize + size > bytes) { break; }
+        WriteSlot(header, &header[kWriteSlotHeaderSize], size);
+        offset += kWriteSlotHeaderSize + size;
+      }
     }
   }
 
@@ -189,9 +251,45 @@ class RfTransceiver {
         return options;
       }());
     rf_->Start();
+    // The new receiver starts with no slots, so nothing it has can
+    // have been delivered yet.
+    delivered_bitfield_ = 0;
     __enable_irq();
   }
 
+  /// @param header the slot number then the priority, as in
+  /// register 51
+  void WriteSlot(const char* header, const char* data, int size) {
+    const auto slot_num =
+        std::max(0, std::min<int>(kNumSlots - 1, u8(header[0])));
+    SlotRfProtocol::Slot slot;
+    slot.priority =
+        (u8(header[1]) << 0) |
+        (u8(header[2]) << 8) |
+        (u8(header[3]) << 16) |
+        (u8(header[4]) << 24);
+    slot.size = std::min(size, 16);
+    std::memcpy(slot.data, data, slot.size);
+    rf_->remote()->tx_slot(slot_num, slot);
+    remaining_timeout_ms_.store(kTimeoutMs);
+  }
+
+  /// @return a mask of the slots whose counters in 'bitfield' differ
+  /// from what was last read through register 53
+  uint16_t PendingMask(uint32_t bitfield) const {
+    const uint32_t delta = bitfield ^ delivered_bitfield_;
+    uint16_t result = 0;
+    for (int i = 0; i < kNumSlots; i++) {
+      if (delta & (3 << (i * 2))) { result |= (1 << i); }
+    }
+    return result;
+  }
+
+  template <typename T>
+  static uint8_t u8(T value) {
+    return static_cast<uint8_t>(value);
+  }
+
   void Disable() {
     for (int slot_index = 0;
          slot_index < SlotRfProtocol::kNumSlots;
@@ -209,6 +307,11 @@ class RfTransceiver {
   uint32_t staged_id_ = id_.load();
   char write_buf_[64] = {};
   char read_buf_[24] = {};
+  char batch_read_buf_[2 + kNumSlots * kBatchSlotSize] = {};
+  char batch_write_buf_[kNumSlots * (kWriteSlotHeaderSize + 16)] = {};
+  uint32_t batch_bitfield_ = 0;
+  uint16_t batch_mask_ = 0;
+  uint32_t delivered_bitfield_ = 0;
   std::atomic<int32_t> remaining_timeout_ms_ = 0;
   std::atomic<bool> reset_{false};
   std::atomic<uint32_t> lock_age_ms_ = 0;
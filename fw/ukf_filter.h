@@ -26,6 +26,11 @@ namespace fw {
 
 /// An Unscented Kalman Filter, as described in "Optimal State
 /// Estimation", by Dan Simon.
+///
+/// The Cholesky factor of the covariance used to generate sigma
+/// points is maintained across measurement updates with rank one
+/// downdates, so that a full decomposition is only required once
+/// per process update.
 template <typename _Scalar, int _NumStates>
 class UkfFilter {
  public:
@@ -36,6 +41,7 @@ class UkfFilter {
     kNone = 0,
     kNanState,
     kNanMeasurement,
+    kNotPositiveDefinite,
   };
 
   UkfFilter(const State& initial_state,
@@ -51,7 +57,12 @@ class UkfFilter {
   const State& state() const { return state_; }
   State& state() { return state_; }
   const Covariance& covariance() const { return covariance_; }
-  Covariance& covariance() { return covariance_; }
+  Covariance& covariance() {
+    // The caller may change it, so our factor can no longer be
+    // trusted.
+    factor_valid_ = false;
+    return covariance_;
+  }
 
   template <typename ProcessFunction>
   void UpdateState(_Scalar dt_s, ProcessFunction process_function) {
@@ -70,12 +81,15 @@ class UkfFilter {
     State xhatminus = (1.0 / N) * ArraySum(xhat);
 
     // Equation 14.61
-
+    //
+    // The result is symmetric, so only the lower triangle is
+    // accumulated.
     Covariance Pminus = Covariance::Zero();
     for (int i = 0; i < N; i++) {
-      State c = xhat[i] - xhatminus;
-      Pminus += c * c.transpose();
+      const State c = xhat[i] - xhatminus;
+      AddLowerOuterProduct(&Pminus, c, 1);
     }
+    CopyLowerToUpper(&Pminus);
     Pminus *= (1.0 / N);
     Pminus += dt_s * process_noise_;
 
@@ -90,6 +104,7 @@ class UkfFilter {
 
     state_ = xhatminus;
     covariance_ = ConditionCovariance(Pminus);
+    factor_valid_ = false;
   }
 
   template <typename Array>
@@ -155,7 +170,34 @@ class UkfFilter {
                           Measurement::RowsAtCompileTime> KMatrix;
     KMatrix K = Pxy * Py.inverse();
     State xplus = state_ + K * (measurement - yhat);
-    Covariance Pplus = covariance_ - ((K * Py) * K.transpose());
+
+    // K * Py * K^T == U * U^T, which lets us apply the covariance
+    // change to our existing Cholesky factor as one rank one
+    // downdate per measurement dimension.
+    PyMatrix Py_factor;
+    const bool py_factored = Cholesky(Py, &Py_factor);
+    const KMatrix U = K * Py_factor;
+    Covariance Pplus = covariance_;
+    if (py_factored) {
+      for (int i = 0; i < Measurement::RowsAtCompileTime; i++) {
+        AddLowerOuterProduct(&Pplus, U.col(i), -1);
+      }
+      CopyLowerToUpper(&Pplus);
+    } else {
+      // Without a factor of Py, fall back to the full product, and
+      // refactor the covariance on the next step.
+      Pplus -= (K * Py) * K.transpose();
+      factor_valid_ = false;
+    }
+
+    if (factor_valid_) {
+      for (int i = 0; i < Measurement::RowsAtCompileTime; i++) {
+        if (!Downdate(&factor_, U.col(i))) {
+          factor_valid_ = false;
+          break;
+        }
+      }
+    }
 
     if (error_ == kNone) {
       for (size_t i = 0; i < _NumStates; i++) {
@@ -172,11 +214,15 @@ class UkfFilter {
 
   template <typename Array>
   void StoreSigmaPoints(Array& array) {
-    _Scalar n = _NumStates;
+    const _Scalar n = _NumStates;
 
     // Lower Cholesky decomposition to calculate the matrix square
-    // root.
-    Covariance delta = (n * covariance_).llt().matrixL();
+    // root.  sqrt(n) * chol(P) == chol(n * P).
+    if (!factor_valid_) {
+      factor_valid_ = Cholesky(covariance_, &factor_);
+    }
+    if (!factor_valid_) { RecoverFactor(); }
+    const Covariance delta = std::sqrt(n) * factor_;
 
     for (int i = 0; i < _NumStates; i++) {
       array[i] = state_ + delta.col(i);
@@ -184,6 +230,104 @@ class UkfFilter {
     }
   }
 
+  /// Rounding can leave the covariance slightly indefinite, in which
+  /// case the partial factor can not be used.  Add a growing diagonal
+  /// to the covariance until it can be factored.  Should that fail
+  /// too, report an error and fall back to the square root of the
+  /// diagonal, so that this update at least remains bounded.
+  void RecoverFactor() {
+    constexpr int kAttempts = 6;
+    const _Scalar scale = std::max<_Scalar>(
+        covariance_.diagonal().cwiseAbs().maxCoeff(), 1e-6f);
+    _Scalar jitter = 1e-6f * scale;
+    for (int i = 0; i < kAttempts; i++) {
+      covariance_.diagonal().array() += jitter;
+      if (Cholesky(covariance_, &factor_)) {
+        factor_valid_ = true;
+        return;
+      }
+      jitter *= 10;
+    }
+
+    if (error_ == kNone) { error_ = kNotPositiveDefinite; }
+    factor_ = covariance_.diagonal().cwiseMax(0).cwiseSqrt().asDiagonal();
+  }
+
+  /// Compute the lower triangular L such that L * L^T == P.
+  ///
+  /// @return false if P was not positive definite, in which case L
+  /// is only partially complete
+  template <typename Matrix>
+  static bool Cholesky(const Matrix& P, Matrix* L_out) {
+    constexpr int kSize = Matrix::RowsAtCompileTime;
+    Matrix& L = *L_out;
+    L.setZero();
+    for (int col = 0; col < kSize; col++) {
+      _Scalar diagonal = P(col, col);
+      for (int k = 0; k < col; k++) {
+        diagonal -= L(col, k) * L(col, k);
+      }
+      if (!(diagonal > 0)) { return false; }
+      const _Scalar l_diagonal = std::sqrt(diagonal);
+      L(col, col) = l_diagonal;
+      const _Scalar inverse = 1 / l_diagonal;
+      for (int row = col + 1; row < kSize; row++) {
+        _Scalar value = P(row, col);
+        for (int k = 0; k < col; k++) {
+          value -= L(row, k) * L(col, k);
+        }
+        L(row, col) = value * inverse;
+      }
+    }
+    return true;
+  }
+
+  /// Update the lower Cholesky factor L so that L * L^T is reduced by
+  /// v * v^T.
+  ///
+  /// @return false if the result would not be positive definite
+  template <typename Vector>
+  static bool Downdate(Covariance* L_out, const Vector& v_in) {
+    Covariance& L = *L_out;
+    State v = v_in;
+    for (int k = 0; k < _NumStates; k++) {
+      const _Scalar l_kk = L(k, k);
+      const _Scalar r2 = l_kk * l_kk - v(k) * v(k);
+      if (!(r2 > 0)) { return false; }
+      const _Scalar r = std::sqrt(r2);
+      const _Scalar inverse_l_kk = 1 / l_kk;
+      const _Scalar c = r * inverse_l_kk;
+      const _Scalar s = v(k) * inverse_l_kk;
+      const _Scalar inverse_c = 1 / c;
+      L(k, k) = r;
+      for (int i = k + 1; i < _NumStates; i++) {
+        L(i, k) = (L(i, k) - s * v(i)) * inverse_c;
+        v(i) = c * v(i) - s * L(i, k);
+      }
+    }
+    return true;
+  }
+
+  /// P += scale * v * v^T, for the lower triangle only.
+  template <typename Vector>
+  static void AddLowerOuterProduct(Covariance* P, const Vector& v,
+                                   _Scalar scale) {
+    for (int col = 0; col < _NumStates; col++) {
+      const _Scalar v_col = scale * v(col);
+      for (int row = col; row < _NumStates; row++) {
+        (*P)(row, col) += v(row) * v_col;
+      }
+    }
+  }
+
+  static void CopyLowerToUpper(Covariance* P) {
+    for (int col = 1; col < _NumStates; col++) {
+      for (int row = 0; row < col; row++) {
+        (*P)(row, col) = (*P)(col, row);
+      }
+    }
+  }
+
   Covariance ConditionCovariance(const Covariance& P) {
     Covariance result = P;
 
@@ -198,6 +342,10 @@ class UkfFilter {
   Covariance covariance_;
   Covariance process_noise_;
   Error error_ = kNone;
+
+  // The lower Cholesky factor of covariance_, if factor_valid_.
+  Covariance factor_;
+  bool factor_valid_ = false;
 };
 
 }
@@ -0,0 +1,260 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace mjbots {
+namespace moteus {
+
+/// Schedules a control loop which, once per period, starts a CAN
+/// cycle, waits for its replies, and then runs the controller.
+///
+///   WaitForCycle()    - the start of period k, start the CAN cycle
+///   WaitForReplies()  - 'phase_ns' later, collect the replies
+///   RecordRoundTrip() - report how long the CAN cycle actually took
+///   ... run the controller ...
+///
+/// The phase is moved to track the measured round trip, so that the
+/// controller runs on replies that are as fresh as possible while
+/// still leaving 'target_margin_ns' at the configured percentile.
+/// Optionally, the period is also lengthened or shortened to keep the
+/// same margin at the end of each cycle.
+///
+/// Each wakeup sleeps until shortly before its deadline and then
+/// spins, which gives much lower jitter than sleeping alone.
+class CycleScheduler {
+ public:
+  struct Options {
+    int64_t period_ns = 2000000;
+
+    // If true, the period is adjusted within [min_period_ns,
+    // max_period_ns] to keep 'target_margin_ns' at the end of each
+    // cycle.
+    bool adapt_period = false;
+    int64_t min_period_ns = 1000000;
+    int64_t max_period_ns = 10000000;
+
+    // This much slack is kept at 'percentile' of cycles.
+    int64_t target_margin_ns = 100000;
+    double percentile = 0.99;
+
+    // Adjustments are made after this many cycles.
+    int window = 200;
+
+    // Each wakeup sleeps until this long before its deadline, then
+    // spins the rest of the way.
+    int64_t spin_ns = 50000;
+
+    // The resolution of the margin histogram.
+    int64_t histogram_bucket_ns = 10000;
+  };
+
+  /// Accumulates margins, the time remaining before each deadline,
+  /// into fixed width buckets.  Nothing is allocated after
+  /// construction.
+  class Histogram {
+   public:
+    static constexpr int kBuckets = 256;
+
+    Histogram(int64_t bucket_ns) : bucket_ns_(bucket_ns) {}
+
+    void Add(int64_t margin_ns) {
+      count_++;
+      total_ns_ += margin_ns;
+      if (margin_ns < 0) {
+        negative_++;
+        return;
+      }
+      buckets_[std::min<int64_t>(margin_ns / bucket_ns_, kBuckets - 1)]++;
+    }
+
+    void Clear() {
+      std::fill(buckets_, buckets_ + kBuckets, 0);
+      negative_ = 0;
+      count_ = 0;
+      total_ns_ = 0;
+    }
+
+    uint64_t count() const { return count_; }
+
+    /// The number of deadlines which were missed.
+    uint64_t negative() const { return negative_; }
+
+    double mean_ns() const {
+      return count_ ? static_cast<double>(total_ns_) / count_ : 0.0;
+    }
+
+    /// @return the lower edge of the bucket containing the margin at
+    /// fraction @p p, or -1 if that margin was negative.
+    int64_t Percentile(double p) const {
+      const uint64_t target = static_cast<uint64_t>(p * count_);
+      uint64_t seen = negative_;
+      if (seen > target) { return -1; }
+      for (int i = 0; i < kBuckets; i++) {
+        seen += buckets_[i];
+        if (seen > target) { return i * bucket_ns_; }
+      }
+      return (kBuckets - 1) * bucket_ns_;
+    }
+
+    int64_t bucket_ns() const { return bucket_ns_; }
+    const uint64_t* buckets() const { return buckets_; }
+
+   private:
+    const int64_t bucket_ns_;
+    uint64_t buckets_[kBuckets] = {};
+    uint64_t negative_ = 0;
+    uint64_t count_ = 0;
+    int64_t total_ns_ = 0;
+  };
+
+  CycleScheduler(const Options& options)
+      : options_(options),
+        period_ns_(options.period_ns),
+        phase_ns_(options.period_ns / 2),
+        margins_(options.histogram_bucket_ns) {
+    round_trips_.reserve(options.window);
+    end_margins_.reserve(options.window);
+    scratch_.reserve(options.window);
+    next_cycle_ns_ = Now() + period_ns_;
+  }
+
+  /// Block until the start of the next cycle.
+  ///
+  /// @return the number of cycles which were skipped because the
+  /// previous one overran.
+  int WaitForCycle() {
+    const int64_t now = Now();
+    const int64_t margin = next_cycle_ns_ - now;
+    margins_.Add(margin);
+    end_margins_.push_back(margin);
+
+    int skipped = 0;
+    while (now > next_cycle_ns_) {
+      skipped++;
+      next_cycle_ns_ += period_ns_;
+    }
+
+    SleepUntil(next_cycle_ns_);
+    cycle_start_ns_ = next_cycle_ns_;
+    next_cycle_ns_ += period_ns_;
+
+    if (static_cast<int>(end_margins_.size()) >= options_.window) {
+      Adapt();
+    }
+
+    return skipped;
+  }
+
+  /// Block until the replies to the CAN cycle started after the most
+  /// recent WaitForCycle are expected.
+  void WaitForReplies() {
+    SleepUntil(cycle_start_ns_ + phase_ns_);
+  }
+
+  /// Report the time the CAN cycle took, from being started to its
+  /// replies being available.
+  void RecordRoundTrip(int64_t round_trip_ns) {
+    if (static_cast<int>(round_trips_.size()) < options_.window) {
+      round_trips_.push_back(round_trip_ns);
+    }
+  }
+
+  int64_t period_ns() const { return period_ns_; }
+  int64_t phase_ns() const { return phase_ns_; }
+
+  /// The margin remaining at the end of each cycle, accumulated
+  /// until cleared.
+  Histogram* margins() { return &margins_; }
+
+ private:
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void SleepUntil(int64_t deadline_ns) {
+    const int64_t sleep_ns = deadline_ns - options_.spin_ns;
+    if (sleep_ns > Now()) {
+      struct timespec ts = {};
+      ts.tv_sec = sleep_ns / 1000000000ll;
+      ts.tv_nsec = sleep_ns % 1000000000ll;
+      // steady_clock is CLOCK_MONOTONIC on linux.
+      while (::clock_nanosleep(
+                 CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) != 0);
+    }
+    while (Now() < deadline_ns);
+  }
+
+  /// @return the value at fraction @p p of @p values.
+  int64_t Percentile(const std::vector<int64_t>& values, double p) {
+    scratch_.assign(values.begin(), values.end());
+    const size_t index = std::min(
+        scratch_.size() - 1, static_cast<size_t>(p * scratch_.size()));
+    std::nth_element(scratch_.begin(), scratch_.begin() + index,
+                     scratch_.end());
+    return scratch_[index];
+  }
+
+  void Adapt() {
+    const int64_t target = options_.target_margin_ns;
+
+    if (!round_trips_.empty()) {
+      phase_ns_ = Percentile(round_trips_, options_.percentile) + target;
+    }
+
+    if (options_.adapt_period) {
+      const int64_t margin =
+          Percentile(end_margins_, 1.0 - options_.percentile);
+      if (margin < target) {
+        period_ns_ += target - margin;
+      } else if (margin > 2 * target) {
+        // Shrink slowly, so that a few quiet windows do not lead
+        // straight into an overrun.
+        period_ns_ -= (margin - target) / 2;
+      }
+      period_ns_ = std::max(options_.min_period_ns,
+                            std::min(options_.max_period_ns, period_ns_));
+    }
+
+    phase_ns_ = std::max<int64_t>(
+        0, std::min(period_ns_ - target, phase_ns_));
+
+    round_trips_.clear();
+    end_margins_.clear();
+  }
+
+  const Options options_;
+
+  int64_t period_ns_ = 0;
+  int64_t phase_ns_ = 0;
+  int64_t next_cycle_ns_ = 0;
+  int64_t cycle_start_ns_ = 0;
+
+  Histogram margins_;
+
+  std::vector<int64_t> round_trips_;
+  std::vector<int64_t> end_margins_;
+  std::vector<int64_t> scratch_;
+};
+
+}
+}
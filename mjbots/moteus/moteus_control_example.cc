@@ -28,7 +28,6 @@
 #include <chrono>
 #include <iomanip>
 #include <iostream>
-#include <future>
 #include <limits>
 #include <map>
 #include <sstream>
@@ -37,6 +36,7 @@
 #include <thread>
 #include <vector>
 
+#include "mjbots/moteus/cycle_scheduler.h"
 #include "mjbots/moteus/moteus_protocol.h"
 #include "mjbots/moteus/pi3hat_moteus_interface.h"
 
@@ -55,6 +55,8 @@ struct Arguments {
         main_cpu = std::stoull(args.at(++i));
       } else if (arg == "--can-cpu") {
         can_cpu = std::stoull(args.at(++i));
+      } else if (arg == "--spin-handoff") {
+        spin_handoff = true;
       } else if (arg == "--period-s") {
         period_s = std::stod(args.at(++i));
       } else if (arg == "--primary-id") {
@@ -65,6 +67,16 @@ struct Arguments {
         secondary_id = std::stoull(args.at(++i));
       } else if (arg == "--secondary-bus") {
         secondary_bus = std::stoull(args.at(++i));
+      } else if (arg == "--adapt-period") {
+        adapt_period = true;
+      } else if (arg == "--target-margin-s") {
+        target_margin_s = std::stod(args.at(++i));
+      } else if (arg == "--broker") {
+        broker = args.at(++i);
+      } else if (arg == "--fixed-format") {
+        fixed_format = true;
+      } else if (arg == "--cycle-log") {
+        cycle_log = args.at(++i);
       } else {
         throw std::runtime_error("Unknown argument: " + arg);
       }
@@ -74,11 +86,17 @@ struct Arguments {
   bool help = false;
   int main_cpu = 1;
   int can_cpu = 2;
+  bool spin_handoff = false;
   double period_s = 0.002;
+  bool adapt_period = false;
+  double target_margin_s = 0.0001;
   int primary_id = 1;
   int primary_bus = 1;
   int secondary_id = 2;
   int secondary_bus = 2;
+  bool fixed_format = false;
+  std::string cycle_log;
+  std::string broker;
 };
 
 void DisplayUsage() {
@@ -87,11 +105,17 @@ void DisplayUsage() {
   std::cout << "  -h, --help           display this usage message\n";
   std::cout << "  --main-cpu CPU       run main thread on a fixed CPU [default: 1]\n";
   std::cout << "  --can-cpu CPU        run CAN thread on a fixed CPU [default: 2]\n";
+  std::cout << "  --spin-handoff       spin rather than block when handing off to the CAN thread\n";
   std::cout << "  --period-s S         period to run control\n";
+  std::cout << "  --adapt-period       adjust the period to keep the target margin\n";
+  std::cout << "  --target-margin-s S  slack to keep before each deadline\n";
   std::cout << "  --primary-id ID      servo ID of primary, undriven servo\n";
   std::cout << "  --primary-bus BUS    bus of primary servo\n";
   std::cout << "  --secondary-id ID    servo ID of secondary, driven servo\n";
   std::cout << "  --secondary-bus BUS  bus of secondary servo\n";
+  std::cout << "  --fixed-format       encode with resolutions fixed at compile time\n";
+  std::cout << "  --cycle-log FILE     record every CAN cycle to FILE\n";
+  std::cout << "  --broker NAME        share the pi3hat with other processes\n";
 }
 
 void LockMemory() {
@@ -111,6 +135,7 @@ std::pair<double, double> MinMaxVoltage(
   double rmax = -std::numeric_limits<double>::infinity();
 
   for (const auto& i : r) {
+    if (i.id == 0) { continue; }
     if (i.result.voltage > rmax) { rmax = i.result.voltage; }
     if (i.result.voltage < rmin) { rmin = i.result.voltage; }
   }
@@ -123,6 +148,30 @@ class SampleController {
  public:
   SampleController(const Arguments& arguments) : arguments_(arguments) {}
 
+  /// The resolutions which Initialize selects, and the default query.
+  /// With --fixed-format, these are used to encode every command.
+  using FixedCommand = moteus::FixedPositionCommand<
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kIgnore,
+    moteus::Resolution::kIgnore,
+    moteus::Resolution::kIgnore>;
+
+  using FixedQuery = moteus::FixedQuery<
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kInt16,
+    moteus::Resolution::kIgnore,
+    moteus::Resolution::kIgnore,
+    moteus::Resolution::kIgnore,
+    moteus::Resolution::kInt8,
+    moteus::Resolution::kInt8,
+    moteus::Resolution::kInt8>;
+
   /// This is called before any control begins, and must return the
   /// set of servos that are used, along with which bus each is
   /// attached to.
@@ -139,29 +188,23 @@ class SampleController {
   /// initialization like setting the resolution of commands and
   /// queries.
   void Initialize(std::vector<MoteusInterface::ServoCommand>* commands) {
-    moteus::PositionResolution res;
-    res.position = moteus::Resolution::kInt16;
-    res.velocity = moteus::Resolution::kInt16;
-    res.feedforward_torque = moteus::Resolution::kInt16;
-    res.kp_scale = moteus::Resolution::kInt16;
-    res.kd_scale = moteus::Resolution::kInt16;
-    res.maximum_torque = moteus::Resolution::kIgnore;
-    res.stop_position = moteus::Resolution::kIgnore;
-    res.watchdog_timeout = moteus::Resolution::kIgnore;
+    const auto res = FixedCommand::resolution();
     for (auto& cmd : *commands) {
       cmd.resolution = res;
     }
   }
 
   moteus::QueryResult Get(const std::vector<MoteusInterface::ServoReply>& replies, int id) {
-    for (const auto& item : replies) {
-      if (item.id == id) { return item.result; }
+    if (id < 0 || id >= static_cast<int>(replies.size()) ||
+        replies[id].id != id) {
+      return {};
     }
-    return {};
+    return replies[id].result;
   }
 
   /// This is run at each control cycle.  @p status is the most recent
-  /// status of all servos (note that it is possible for a given
+  /// status of all servos, indexed by ID, where an entry with an ID
+  /// of 0 has never replied (note that it is possible for a given
   /// servo's result to be omitted on some frames).
   ///
   /// @p output should hold the desired output.  It will be
@@ -216,7 +259,14 @@ void Run(const Arguments& args, Controller* controller) {
   moteus::ConfigureRealtime(args.main_cpu);
   MoteusInterface::Options moteus_options;
   moteus_options.cpu = args.can_cpu;
+  moteus_options.spin_handoff = args.spin_handoff;
   moteus_options.servo_bus_map = controller->servo_bus_map();
+  moteus_options.cycle_log = args.cycle_log;
+  moteus_options.broker = args.broker;
+  if (args.fixed_format) {
+    moteus_options.fixed_format = MoteusInterface::MakeFixedFormat<
+      SampleController::FixedCommand, SampleController::FixedQuery>();
+  }
   MoteusInterface moteus_interface{moteus_options};
 
   std::vector<MoteusInterface::ServoCommand> commands;
@@ -225,106 +275,93 @@ void Run(const Arguments& args, Controller* controller) {
     commands.back().id = pair.first;
   }
 
-  std::vector<MoteusInterface::ServoReply> replies{commands.size()};
-  std::vector<MoteusInterface::ServoReply> saved_replies;
+  // Replies are stored directly into a table indexed by ID.  One
+  // table is filled in by the outstanding cycle while the controller
+  // reads from the other, and they are swapped after each cycle.
+  constexpr size_t kMaxId = 128;
+  std::vector<MoteusInterface::ServoReply> reply_tables[2] = {
+    std::vector<MoteusInterface::ServoReply>(kMaxId),
+    std::vector<MoteusInterface::ServoReply>(kMaxId),
+  };
+  int read_table = 0;
 
   controller->Initialize(&commands);
 
   MoteusInterface::Data moteus_data;
   moteus_data.commands = { commands.data(), commands.size() };
-  moteus_data.replies = { replies.data(), replies.size() };
-
-  std::future<MoteusInterface::Output> can_result;
+  moteus_data.replies_by_id = { reply_tables[1].data(), kMaxId };
 
-  const auto period =
-      std::chrono::microseconds(static_cast<int64_t>(args.period_s * 1e6));
-  auto next_cycle = std::chrono::steady_clock::now() + period;
+  moteus::CycleScheduler::Options scheduler_options;
+  scheduler_options.period_ns = static_cast<int64_t>(args.period_s * 1e9);
+  scheduler_options.adapt_period = args.adapt_period;
+  scheduler_options.target_margin_ns =
+      static_cast<int64_t>(args.target_margin_s * 1e9);
+  moteus::CycleScheduler scheduler{scheduler_options};
 
   const auto status_period = std::chrono::milliseconds(100);
-  auto next_status = next_cycle + status_period;
+  auto next_status = std::chrono::steady_clock::now() + status_period;
   uint64_t cycle_count = 0;
-  double total_margin = 0.0;
-  uint64_t margin_cycles = 0;
 
-  // We will run at a fixed cycle time.
+  // The first commands are sent before any replies have arrived.
+  controller->Run(reply_tables[read_table], &commands);
+
   while (true) {
     cycle_count++;
-    margin_cycles++;
+
+    const int skip_count = scheduler.WaitForCycle();
+    if (skip_count) {
+      std::cout << "\nSkipped " << skip_count << " cycles\n";
+    }
+
+    // Start the CAN cycle with the commands computed last time, then
+    // come back once its replies are expected.
+    moteus_interface.Cycle(moteus_data);
+    scheduler.WaitForReplies();
+    const auto output = moteus_interface.Wait();
+    scheduler.RecordRoundTrip(output.round_trip_ns);
+
+    // The table that was just filled in becomes the one we read
+    // from, and the other is used for the next cycle.
+    read_table = 1 - read_table;
+    moteus_data.replies_by_id = {
+      reply_tables[1 - read_table].data(), kMaxId };
+
+    controller->Run(reply_tables[read_table], &commands);
+
     {
       const auto now = std::chrono::steady_clock::now();
       if (now > next_status) {
         // NOTE: iomanip is not a recommended pattern.  We use it here
         // simply to not require any external dependencies, like 'fmt'.
+        const auto& saved_replies = reply_tables[read_table];
         const auto volts = MinMaxVoltage(saved_replies);
         const std::string modes = [&]() {
           std::ostringstream result;
           result.precision(4);
           result << std::fixed;
           for (const auto& item : saved_replies) {
+            if (item.id == 0) { continue; }
             result << item.id << "/"
                    << static_cast<int>(item.result.mode) << "/"
                    << item.result.position << " ";
           }
           return result.str();
         }();
-        std::cout << std::setprecision(6) << std::fixed
+        auto* const margins = scheduler.margins();
+        std::cout << std::setprecision(1) << std::fixed
                   << "Cycles " << cycle_count
-                  << "  margin: " << (total_margin / margin_cycles)
-                  << std::setprecision(1)
+                  << "  period/phase: " << scheduler.period_ns() * 1e-3
+                  << "/" << scheduler.phase_ns() * 1e-3 << "us"
+                  << "  margin p1/p50: " << margins->Percentile(0.01) * 1e-3
+                  << "/" << margins->Percentile(0.50) * 1e-3 << "us"
                   << "  volts: " << volts.first << "/" << volts.second
                   << "  modes: " << modes
                   << "   \r";
         std::cout.flush();
         next_status += status_period;
-        total_margin = 0;
-        margin_cycles = 0;
-      }
-
-      int skip_count = 0;
-      while (now > next_cycle) {
-        skip_count++;
-        next_cycle += period;
-      }
-      if (skip_count) {
-        std::cout << "\nSkipped " << skip_count << " cycles\n";
+        margins->Clear();
       }
     }
-    // Wait for the next control cycle to come up.
-    {
-      const auto pre_sleep = std::chrono::steady_clock::now();
-      std::this_thread::sleep_until(next_cycle);
-      const auto post_sleep = std::chrono::steady_clock::now();
-      std::chrono::duration<double> elapsed = post_sleep - pre_sleep;
-      total_margin += elapsed.count();
-    }
-    next_cycle += period;
-
-
-    controller->Run(saved_replies, &commands);
-
-
-    if (can_result.valid()) {
-      // Now we get the result of our last query and send off our new
-      // one.
-      const auto current_values = can_result.get();
-
-      // We copy out the results we just got out.
-      const auto rx_count = current_values.query_result_size;
-      saved_replies.resize(rx_count);
-      std::copy(replies.begin(), replies.begin() + rx_count,
-                saved_replies.begin());
-    }
-
-    // Then we can immediately ask them to be used again.
-    auto promise = std::make_shared<std::promise<MoteusInterface::Output>>();
-    moteus_interface.Cycle(
-        moteus_data,
-        [promise](const MoteusInterface::Output& output) {
-          // This is called from an arbitrary thread, so we just set
-          // the promise value here.
-          promise->set_value(output);
-        });
-    can_result = promise->get_future();
   }
 }
 }
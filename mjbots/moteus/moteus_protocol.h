@@ -20,6 +20,8 @@
 #include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <stdexcept>
+#include <tuple>
 
 /// @file
 ///
@@ -183,6 +185,19 @@ class WriteCanFrame {
     *size_ += sizeof(value);
   }
 
+  /// Reserve @p size bytes at the end of the frame.
+  ///
+  /// @return where those bytes should be written
+  uint8_t* Reserve(size_t size) {
+    if (size + *size_ > 64) {
+      throw std::runtime_error("overflow");
+    }
+
+    uint8_t* const result = &data_[*size_];
+    *size_ += size;
+    return result;
+  }
+
   void WriteMapped(
       double value,
       double int8_scale, double int16_scale, double int32_scale,
@@ -721,5 +736,349 @@ inline QueryResult ParseQueryResult(const uint8_t* data, size_t size) {
   return result;
 }
 
+/// The encoding of a single value whose resolution is known at
+/// compile time.  Each provides:
+///
+///  static constexpr size_t kSize - the number of bytes used
+///  static void Write(uint8_t* data, double value,
+///                    double int8_scale, double int16_scale,
+///                    double int32_scale)
+///  static double Read(const uint8_t* data,
+///                     double int8_scale, double int16_scale,
+///                     double int32_scale)
+template <Resolution R>
+struct FixedField;
+
+template <typename T>
+struct FixedIntField {
+  static constexpr size_t kSize = sizeof(T);
+
+  static void WriteScaled(uint8_t* data, double value, double scale) {
+    const T saturated = Saturate<T>(value, scale);
+    std::memcpy(data, &saturated, sizeof(saturated));
+  }
+
+  static double ReadScaled(const uint8_t* data, double scale) {
+    T value = {};
+    std::memcpy(&value, data, sizeof(value));
+    if (value == std::numeric_limits<T>::min()) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return value * scale;
+  }
+};
+
+template <>
+struct FixedField<Resolution::kInt8> : FixedIntField<int8_t> {
+  static void Write(uint8_t* data, double value, double int8_scale,
+                    double, double) {
+    WriteScaled(data, value, int8_scale);
+  }
+  static double Read(const uint8_t* data, double int8_scale, double, double) {
+    return ReadScaled(data, int8_scale);
+  }
+};
+
+template <>
+struct FixedField<Resolution::kInt16> : FixedIntField<int16_t> {
+  static void Write(uint8_t* data, double value, double,
+                    double int16_scale, double) {
+    WriteScaled(data, value, int16_scale);
+  }
+  static double Read(const uint8_t* data, double, double int16_scale, double) {
+    return ReadScaled(data, int16_scale);
+  }
+};
+
+template <>
+struct FixedField<Resolution::kInt32> : FixedIntField<int32_t> {
+  static void Write(uint8_t* data, double value, double, double,
+                    double int32_scale) {
+    WriteScaled(data, value, int32_scale);
+  }
+  static double Read(const uint8_t* data, double, double, double int32_scale) {
+    return ReadScaled(data, int32_scale);
+  }
+};
+
+template <>
+struct FixedField<Resolution::kFloat> {
+  static constexpr size_t kSize = sizeof(float);
+
+  static void Write(uint8_t* data, double value, double, double, double) {
+    const float f = static_cast<float>(value);
+    std::memcpy(data, &f, sizeof(f));
+  }
+  static double Read(const uint8_t* data, double, double, double) {
+    float f = 0.0f;
+    std::memcpy(&f, data, sizeof(f));
+    return f;
+  }
+};
+
+template <>
+struct FixedField<Resolution::kIgnore> {
+  static constexpr size_t kSize = 0;
+
+  static void Write(uint8_t*, double, double, double, double) {}
+  static double Read(const uint8_t*, double, double, double) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+};
+
+inline size_t ResolutionSize(Resolution res) {
+  switch (res) {
+    case Resolution::kInt8: return 1;
+    case Resolution::kInt16: return 2;
+    case Resolution::kInt32: return 4;
+    case Resolution::kFloat: return 4;
+    case Resolution::kIgnore: return 0;
+  }
+  return 0;
+}
+
+/// A precomputed frame, where all the framing is in place, and only
+/// the values remain to be filled in.
+template <size_t N>
+struct FixedLayout {
+  uint8_t data[64] = {};
+  uint8_t size = 0;
+
+  // Where each value is located.  This is only meaningful for values
+  // which are not ignored.
+  uint8_t offset[N] = {};
+
+  // The positions of all the framing bytes.
+  uint8_t header[64] = {};
+  uint8_t header_size = 0;
+
+  /// Append the framing for a block of consecutive registers, exactly
+  /// as WriteCombiner would emit it.  If @p values is false, only the
+  /// framing is emitted, as in a query.
+  template <size_t M>
+  void Append(int8_t base_command, uint32_t start_register,
+              std::array<Resolution, M> resolutions, size_t first_value,
+              bool values = true) {
+    WriteCanFrame frame(data, &size);
+    WriteCombiner<M> combiner(&frame, base_command, start_register,
+                              resolutions);
+    for (size_t i = 0; i < M; i++) {
+      const auto before = size;
+      if (!combiner.MaybeWrite()) { continue; }
+
+      for (auto j = before; j < size; j++) {
+        header[header_size++] = j;
+      }
+      offset[first_value + i] = size;
+      if (values) { frame.Reserve(ResolutionSize(resolutions[i])); }
+    }
+  }
+
+  /// @return true if @p frame has exactly this framing, followed by
+  /// nothing but padding.
+  bool Matches(const uint8_t* frame, size_t frame_size) const {
+    if (frame_size < size) { return false; }
+    for (size_t i = 0; i < header_size; i++) {
+      if (frame[header[i]] != data[header[i]]) { return false; }
+    }
+    for (size_t i = size; i < frame_size; i++) {
+      if (frame[i] != Multiplex::kNop) { return false; }
+    }
+    return true;
+  }
+};
+
+/// A position mode command with resolutions fixed at compile time.
+/// It produces exactly the same bytes as EmitPositionCommand, but the
+/// framing is computed only once, and each value is written with
+/// straight-line code.
+template <Resolution PositionRes,
+          Resolution VelocityRes,
+          Resolution FeedforwardTorqueRes,
+          Resolution KpScaleRes,
+          Resolution KdScaleRes,
+          Resolution MaximumTorqueRes,
+          Resolution StopPositionRes,
+          Resolution WatchdogTimeoutRes>
+class FixedPositionCommand {
+ public:
+  static PositionResolution resolution() {
+    PositionResolution result;
+    result.position = PositionRes;
+    result.velocity = VelocityRes;
+    result.feedforward_torque = FeedforwardTorqueRes;
+    result.kp_scale = KpScaleRes;
+    result.kd_scale = KdScaleRes;
+    result.maximum_torque = MaximumTorqueRes;
+    result.stop_position = StopPositionRes;
+    result.watchdog_timeout = WatchdogTimeoutRes;
+    return result;
+  }
+
+  /// The number of bytes written by Emit.
+  static size_t size() { return layout().size; }
+
+  static void Emit(WriteCanFrame* frame, const PositionCommand& command) {
+    const auto& l = layout();
+    uint8_t* const data = frame->Reserve(l.size);
+    std::memcpy(data, l.data, l.size);
+
+    FixedField<PositionRes>::Write(
+        &data[l.offset[0]], command.position, 0.01, 0.0001, 0.00001);
+    FixedField<VelocityRes>::Write(
+        &data[l.offset[1]], command.velocity, 0.1, 0.00025, 0.00001);
+    FixedField<FeedforwardTorqueRes>::Write(
+        &data[l.offset[2]], command.feedforward_torque, 0.5, 0.01, 0.001);
+    FixedField<KpScaleRes>::Write(
+        &data[l.offset[3]], command.kp_scale,
+        1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0);
+    FixedField<KdScaleRes>::Write(
+        &data[l.offset[4]], command.kd_scale,
+        1.0 / 127.0, 1.0 / 32767.0, 1.0 / 2147483647.0);
+    FixedField<MaximumTorqueRes>::Write(
+        &data[l.offset[5]], command.maximum_torque, 0.5, 0.01, 0.001);
+    FixedField<StopPositionRes>::Write(
+        &data[l.offset[6]], command.stop_position, 0.01, 0.0001, 0.00001);
+    FixedField<WatchdogTimeoutRes>::Write(
+        &data[l.offset[7]], static_cast<float>(command.watchdog_timeout),
+        0.01, 0.001, 0.000001);
+  }
+
+ private:
+  static const FixedLayout<8>& layout() {
+    static const FixedLayout<8> result = []() {
+      FixedLayout<8> l;
+      WriteCanFrame frame(l.data, &l.size);
+      frame.Write<int8_t>(Multiplex::kWriteInt8 | 0x01);
+      frame.Write<int8_t>(Register::kMode);
+      frame.Write<int8_t>(Mode::kPosition);
+
+      l.Append<8>(0x00, Register::kCommandPosition, {{
+            PositionRes, VelocityRes, FeedforwardTorqueRes,
+                KpScaleRes, KdScaleRes, MaximumTorqueRes,
+                StopPositionRes, WatchdogTimeoutRes,
+                }}, 0);
+      return l;
+    }();
+    return result;
+  }
+};
+
+/// A query with resolutions fixed at compile time.  Emit produces
+/// exactly the same bytes as EmitQueryCommand.  Parse decodes a reply
+/// with straight-line code if it has the layout that moteus uses to
+/// answer this query, and otherwise falls back to ParseQueryResult.
+template <Resolution ModeRes,
+          Resolution PositionRes,
+          Resolution VelocityRes,
+          Resolution TorqueRes,
+          Resolution QCurrentRes,
+          Resolution DCurrentRes,
+          Resolution RezeroStateRes,
+          Resolution VoltageRes,
+          Resolution TemperatureRes,
+          Resolution FaultRes>
+class FixedQuery {
+ public:
+  static QueryCommand command() {
+    QueryCommand result;
+    result.mode = ModeRes;
+    result.position = PositionRes;
+    result.velocity = VelocityRes;
+    result.torque = TorqueRes;
+    result.q_current = QCurrentRes;
+    result.d_current = DCurrentRes;
+    result.rezero_state = RezeroStateRes;
+    result.voltage = VoltageRes;
+    result.temperature = TemperatureRes;
+    result.fault = FaultRes;
+    return result;
+  }
+
+  /// The number of bytes written by Emit.
+  static size_t size() { return query_layout().size; }
+
+  static void Emit(WriteCanFrame* frame) {
+    const auto& l = query_layout();
+    std::memcpy(frame->Reserve(l.size), l.data, l.size);
+  }
+
+  static QueryResult Parse(const uint8_t* data, size_t size) {
+    const auto& l = reply_layout();
+    if (!l.Matches(data, size)) {
+      return ParseQueryResult(data, size);
+    }
+
+    QueryResult result;
+    if (ModeRes != Resolution::kIgnore) {
+      result.mode = static_cast<Mode>(static_cast<int>(
+          FixedField<ModeRes>::Read(&data[l.offset[0]], 1.0, 1.0, 1.0)));
+    }
+    if (PositionRes != Resolution::kIgnore) {
+      result.position = FixedField<PositionRes>::Read(
+          &data[l.offset[1]], 0.01, 0.0001, 0.00001);
+    }
+    if (VelocityRes != Resolution::kIgnore) {
+      result.velocity = FixedField<VelocityRes>::Read(
+          &data[l.offset[2]], 0.1, 0.00025, 0.00001);
+    }
+    if (TorqueRes != Resolution::kIgnore) {
+      result.torque = FixedField<TorqueRes>::Read(
+          &data[l.offset[3]], 0.5, 0.01, 0.001);
+    }
+    if (QCurrentRes != Resolution::kIgnore) {
+      result.q_current = FixedField<QCurrentRes>::Read(
+          &data[l.offset[4]], 1.0, 0.1, 0.001);
+    }
+    if (DCurrentRes != Resolution::kIgnore) {
+      result.d_current = FixedField<DCurrentRes>::Read(
+          &data[l.offset[5]], 1.0, 0.1, 0.001);
+    }
+    if (RezeroStateRes != Resolution::kIgnore) {
+      result.rezero_state = static_cast<int>(
+          FixedField<RezeroStateRes>::Read(
+              &data[l.offset[6]], 1.0, 1.0, 1.0)) != 0;
+    }
+    if (VoltageRes != Resolution::kIgnore) {
+      result.voltage = FixedField<VoltageRes>::Read(
+          &data[l.offset[7]], 0.5, 0.1, 0.001);
+    }
+    if (TemperatureRes != Resolution::kIgnore) {
+      result.temperature = FixedField<TemperatureRes>::Read(
+          &data[l.offset[8]], 1.0, 0.1, 0.001);
+    }
+    if (FaultRes != Resolution::kIgnore) {
+      result.fault = static_cast<int>(
+          FixedField<FaultRes>::Read(&data[l.offset[9]], 1.0, 1.0, 1.0));
+    }
+    return result;
+  }
+
+ private:
+  static FixedLayout<10> MakeLayout(int8_t base_command, bool values) {
+    FixedLayout<10> l;
+    l.Append<6>(base_command, Register::kMode, {{
+          ModeRes, PositionRes, VelocityRes, TorqueRes,
+              QCurrentRes, DCurrentRes,
+              }}, 0, values);
+    l.Append<4>(base_command, Register::kRezeroState, {{
+          RezeroStateRes, VoltageRes, TemperatureRes, FaultRes,
+              }}, 6, values);
+    return l;
+  }
+
+  static const FixedLayout<10>& query_layout() {
+    static const FixedLayout<10> result = MakeLayout(Multiplex::kReadBase, false);
+    return result;
+  }
+
+  // moteus answers each block of reads with a block of replies
+  // having the same framing.
+  static const FixedLayout<10>& reply_layout() {
+    static const FixedLayout<10> result = MakeLayout(Multiplex::kReplyBase, true);
+    return result;
+  }
+};
+
 }
 }
@@ -0,0 +1,145 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Compares the per-servo cost of the generic moteus encoders and
+/// decoders with the ones specialized at compile time.
+///
+/// NOTE: This file can be compiled manually using the following
+/// command line:
+///
+/// g++ -O2 -std=c++11 -I. mjbots/moteus/moteus_protocol_bench.cc -o moteus_protocol_bench
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "mjbots/moteus/moteus_protocol.h"
+
+using namespace mjbots;
+
+namespace {
+
+// The resolutions used by moteus_control_example.
+using FixedCommand = moteus::FixedPositionCommand<
+  moteus::Resolution::kInt16,
+  moteus::Resolution::kInt16,
+  moteus::Resolution::kInt16,
+  moteus::Resolution::kInt8,
+  moteus::Resolution::kInt8,
+  moteus::Resolution::kIgnore,
+  moteus::Resolution::kIgnore,
+  moteus::Resolution::kIgnore>;
+
+using FixedQuery = moteus::FixedQuery<
+  moteus::Resolution::kInt16,
+  moteus::Resolution::kInt16,
+  moteus::Resolution::kInt16,
+  moteus::Resolution::kInt16,
+  moteus::Resolution::kIgnore,
+  moteus::Resolution::kIgnore,
+  moteus::Resolution::kIgnore,
+  moteus::Resolution::kInt8,
+  moteus::Resolution::kInt8,
+  moteus::Resolution::kInt8>;
+
+// Results are accumulated here so that nothing can be optimized away.
+volatile double g_sink = 0.0;
+
+template <typename Function>
+double TimeNsPerIteration(int iterations, Function function) {
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    function(i);
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+      iterations;
+}
+
+moteus::PositionCommand MakeCommand(int i) {
+  moteus::PositionCommand result;
+  result.position = 0.001 * (i & 1023);
+  result.velocity = 0.5;
+  result.feedforward_torque = 0.1;
+  result.kp_scale = 0.8;
+  result.kd_scale = 0.6;
+  return result;
+}
+
+void Report(const char* name, double generic_ns, double fixed_ns) {
+  std::printf("%-8s generic %8.1f ns/servo  fixed %8.1f ns/servo  (%.2fx)\n",
+              name, generic_ns, fixed_ns, generic_ns / fixed_ns);
+}
+
+}
+
+int main(int argc, char** argv) {
+  int iterations = 1000000;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--iterations" && (i + 1) < argc) {
+      iterations = std::atoi(argv[++i]);
+    } else {
+      std::fprintf(stderr, "Usage: %s [--iterations N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (iterations <= 0) {
+    std::fprintf(stderr, "--iterations must be positive\n");
+    return 1;
+  }
+
+  const auto resolution = FixedCommand::resolution();
+  const auto query = FixedQuery::command();
+
+  const double generic_emit = TimeNsPerIteration(iterations, [&](int i) {
+      moteus::CanFrame frame;
+      moteus::WriteCanFrame write_frame(&frame);
+      moteus::EmitPositionCommand(&write_frame, MakeCommand(i), resolution);
+      moteus::EmitQueryCommand(&write_frame, query);
+      g_sink = g_sink + frame.data[i % frame.size];
+    });
+  const double fixed_emit = TimeNsPerIteration(iterations, [&](int i) {
+      moteus::CanFrame frame;
+      moteus::WriteCanFrame write_frame(&frame);
+      FixedCommand::Emit(&write_frame, MakeCommand(i));
+      FixedQuery::Emit(&write_frame);
+      g_sink = g_sink + frame.data[i % frame.size];
+    });
+
+  // This is how moteus answers the above query, padded to 20 bytes.
+  const uint8_t reply[] = {
+    0x24, 0x04, 0x00,
+    0x0a, 0x00, 0x10, 0x27, 0x00, 0x01, 0x9c, 0xff,
+    0x23, 0x0d, 0x20, 0x28, 0x00,
+    0x50, 0x50, 0x50, 0x50,
+  };
+
+  const double generic_parse = TimeNsPerIteration(iterations, [&](int) {
+      const auto result = moteus::ParseQueryResult(reply, sizeof(reply));
+      g_sink = g_sink + result.position + result.voltage;
+    });
+  const double fixed_parse = TimeNsPerIteration(iterations, [&](int) {
+      const auto result = FixedQuery::Parse(reply, sizeof(reply));
+      g_sink = g_sink + result.position + result.voltage;
+    });
+
+  Report("emit", generic_emit, fixed_emit);
+  Report("parse", generic_parse, fixed_parse);
+
+  return 0;
+}
@@ -14,8 +14,14 @@
 
 #include "moteus/tool/moteus_tool.h"
 
+#include <atomic>
+#include <deque>
+#include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include <boost/asio/executor.hpp>
 #include <boost/asio/post.hpp>
@@ -26,6 +32,7 @@
 #include "mjlib/multiplex/asio_client.h"
 
 #include "mjbots/pi3hat/pi3hat.h"
+#include "mjbots/pi3hat/pi3hat_broker.h"
 
 namespace {
 template <typename T>
@@ -56,6 +63,9 @@ class Pi3hatWrapper : public mjlib::multiplex::AsioClient {
     // from the previous cycle causing us to be one cycle behind).
     double min_wait_s = 0.00005;
 
+    // If non-empty, rather than accessing the pi3hat directly, connect
+    // to the Pi3HatBroker of the process which owns it.
+    std::string broker;
 
     template <typename Archive>
     void Serialize(Archive* a) {
@@ -63,20 +73,16 @@ class Pi3hatWrapper : public mjlib::multiplex::AsioClient {
       a->Visit(MJ_NVP(query_timeout_s));
       a->Visit(MJ_NVP(force_bus));
       a->Visit(MJ_NVP(min_wait_s));
+      a->Visit(MJ_NVP(broker));
     }
   };
 
   Pi3hatWrapper(const boost::asio::any_io_executor& executor,
                 const Options& options)
       : executor_(executor),
-        options_(options) {
-    thread_ = std::thread(std::bind(&Pi3hatWrapper::CHILD_Run, this));
-  }
+        host_(Host::Get(options)) {}
 
-  ~Pi3hatWrapper() {
-    child_context_.stop();
-    thread_.join();
-  }
+  ~Pi3hatWrapper() {}
 
   void AsyncStart(mjlib::io::ErrorCallback callback) {
     boost::asio::post(
@@ -88,10 +94,14 @@ class Pi3hatWrapper : public mjlib::multiplex::AsioClient {
   void AsyncTransmit(const AsioClient::Request* request,
                      Reply* reply,
                      mjlib::io::ErrorCallback callback) override {
+    auto* const host = host_.get();
     boost::asio::post(
-        child_context_,
-        [this, callback=std::move(callback), request, reply]() mutable {
-          this->CHILD_Transmit(request, reply, std::move(callback));
+        host->child_context_,
+        [host, executor=executor_, callback=std::move(callback),
+         request, reply]() mutable {
+          host->child_transmits_.push_back(
+              {request, reply, executor, std::move(callback)});
+          host->CHILD_SchedulePump();
         });
   }
 
@@ -117,35 +127,23 @@ class Pi3hatWrapper : public mjlib::multiplex::AsioClient {
     void async_read_some(mjlib::io::MutableBufferSequence buffers,
                          mjlib::io::ReadHandler handler) override {
       boost::asio::post(
-          parent_->child_context_,
+          parent_->host_->child_context_,
           [self=shared_from_this(), buffers,
            handler=std::move(handler)]() mutable {
-            const auto bytes_read = self->parent_->CHILD_TunnelPoll(
-                self->id_, self->channel_, buffers);
-            if (bytes_read > 0) {
-              boost::asio::post(
-                  self->parent_->executor_,
-                  [self, handler=std::move(handler), bytes_read]() mutable {
-                    handler(mjlib::base::error_code(), bytes_read);
-                  });
-            } else {
-              self->timer_.expires_from_now(self->options_.poll_rate);
-              self->timer_.async_wait(
-                  [self, handler=std::move(handler), buffers](
-                      const auto& ec) mutable {
-                    self->HandlePoll(ec, buffers, std::move(handler));
-                  });
-            }
+            auto* const host = self->parent_->host_.get();
+            host->child_polls_.push_back({self, buffers, std::move(handler)});
+            host->CHILD_SchedulePump();
           });
     }
 
     void async_write_some(mjlib::io::ConstBufferSequence buffers,
                           mjlib::io::WriteHandler handler) override {
       boost::asio::post(
-          parent_->child_context_,
+          parent_->host_->child_context_,
           [self=shared_from_this(), buffers, handler=std::move(handler)]() mutable {
-            self->parent_->CHILD_TunnelWrite(
-                self->id_, self->channel_, buffers, std::move(handler));
+            auto* const host = self->parent_->host_.get();
+            host->child_writes_.push_back({self, buffers, std::move(handler)});
+            host->CHILD_SchedulePump();
           });
     }
 
@@ -157,6 +155,30 @@ class Pi3hatWrapper : public mjlib::multiplex::AsioClient {
       timer_.cancel();
     }
 
+    uint8_t id() const { return id_; }
+    uint32_t channel() const { return channel_; }
+
+    /// Called from the child thread once a poll has completed.
+    void CHILD_FinishPoll(size_t bytes_read,
+                          mjlib::io::MutableBufferSequence buffers,
+                          mjlib::io::ReadHandler handler) {
+      auto self = shared_from_this();
+      if (bytes_read > 0) {
+        boost::asio::post(
+            parent_->executor_,
+            [self, handler=std::move(handler), bytes_read]() mutable {
+              handler(mjlib::base::error_code(), bytes_read);
+            });
+      } else {
+        timer_.expires_from_now(options_.poll_rate);
+        timer_.async_wait(
+            [self, handler=std::move(handler), buffers](
+                const auto& ec) mutable {
+              self->HandlePoll(ec, buffers, std::move(handler));
+            });
+      }
+    }
+
    private:
     void HandlePoll(const mjlib::base::error_code& ec,
                     mjlib::io::MutableBufferSequence buffers,
@@ -177,273 +199,462 @@ class Pi3hatWrapper : public mjlib::multiplex::AsioClient {
     mjlib::io::DeadlineTimer timer_{parent_->executor_};
   };
 
-  void CHILD_Run() {
-    pi3hat_.emplace([&]() {
-        mjbots::pi3hat::Pi3Hat::Configuration c;
-        c.spi_speed_hz = options_.spi_speed_hz;
-        return c;
-      }());
-
-    boost::asio::io_context::work work{child_context_};
-    child_context_.run();
-
-    // Destroy before we finish in the child thread.
-    pi3hat_.reset();
-  }
-
-  void CHILD_SetupCAN(mjbots::pi3hat::Pi3Hat::Input* input,
-                      const Request* requests) {
-    auto& d = pi3data_;
-    d.tx_can.clear();
-
-    for (const auto& request : *requests) {
-      d.tx_can.push_back({});
-      auto& dst = d.tx_can.back();
-      dst.id = request.id | (request.request.request_reply() ? 0x8000 : 0x00);
-      dst.size = request.request.buffer().size();
-      std::memcpy(&dst.data[0], request.request.buffer().data(), dst.size);
-      dst.bus = SelectBus(request.id);
-      dst.expect_reply = request.request.request_reply();
+  /// Owns the pi3hat, along with the thread which accesses it.  All
+  /// the Pi3hatWrappers in a process share one, so that operations
+  /// from every one of them are coalesced into the same cycles.
+  class Host {
+   public:
+    // A tunnel subframe carries a type, the channel, and the size
+    // before its data, each of which takes one byte here, and all of
+    // which must fit in one CAN-FD frame.
+    static constexpr uint32_t kMaxTunnelData = 61;
+
+    /// @return the Host for this process, creating it with @p options
+    /// if there is none.
+    static std::shared_ptr<Host> Get(const Options& options) {
+      static std::mutex mutex;
+      static std::weak_ptr<Host> instance;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      auto result = instance.lock();
+      if (!result) {
+        result = std::make_shared<Host>(options);
+        instance = result;
+      }
+      return result;
     }
 
-    if (d.tx_can.size()) {
-      input->tx_can = {&d.tx_can[0], d.tx_can.size()};
+    Host(const Options& options) : options_(options) {
+      thread_ = std::thread(std::bind(&Host::CHILD_Run, this));
     }
 
-    d.rx_can.resize(std::max<size_t>(d.tx_can.size() * 2, 24));
-    input->rx_can = {&d.rx_can[0], d.rx_can.size()};
-  }
-
-  void CHILD_Transmit(const Request* request,
-                      Reply* reply,
-                      mjlib::io::ErrorCallback callback) {
-    mjbots::pi3hat::Pi3Hat::Input input;
-
-    CHILD_SetupCAN(&input, request);
-
-    input.timeout_ns = options_.query_timeout_s * 1e9;
-
-    pi3data_.result = pi3hat_->Cycle(input);
-
-    // Now come back to the main thread.
-    boost::asio::post(
-        executor_,
-        [this, callback=std::move(callback), reply]() mutable {
-          this->FinishTransmit(reply, std::move(callback));
-        });
-  }
-
-  size_t CHILD_TunnelPoll(uint8_t id, uint32_t channel,
-                          mjlib::io::MutableBufferSequence buffers) {
-    mjbots::pi3hat::Pi3Hat::Input input;
-
-    if (pi3data_.rx_can.size() < 4) {
-      pi3data_.rx_can.resize(4);
+    ~Host() {
+      child_context_.stop();
+      thread_.join();
     }
 
-    for (auto& frame : pi3data_.rx_can) {
-      std::memset(&frame.data[0], 0, sizeof(frame.data));
-    }
-    input.rx_can = {&pi3data_.rx_can[0], pi3data_.rx_can.size()};
-    input.force_can_check = (1 << SelectBus(id));
-    input.timeout_ns = 0;
-    input.min_tx_wait_ns = 0;
+    void CHILD_Run() {
+      if (!options_.broker.empty()) {
+        broker_.emplace([&]() {
+            mjbots::pi3hat::Pi3HatBrokerClient::Options o;
+            o.name = options_.broker;
+            return o;
+          }());
+      } else {
+        pi3hat_.emplace([&]() {
+            mjbots::pi3hat::Pi3Hat::Configuration c;
+            c.spi_speed_hz = options_.spi_speed_hz;
+            return c;
+          }());
+      }
 
-    // Check for anything lying around first.
-    pi3data_.result = pi3hat_->Cycle(input);
+      boost::asio::io_context::work work{child_context_};
+      child_context_.run();
 
-    if (pi3data_.result.rx_can_size > 0) {
-      return CHILD_ParseTunnelPoll(id, channel, buffers);
+      // Destroy before we finish in the child thread.
+      pi3hat_.reset();
+      broker_.reset();
     }
 
-    input.timeout_ns = options_.query_timeout_s * 1e9;
-    input.min_tx_wait_ns = options_.min_wait_s * 1e9;
-
-    // Nope, so we should poll.
-    if (pi3data_.tx_can.size() < 1) {
-      pi3data_.tx_can.resize(1);
+    mjbots::pi3hat::Pi3Hat::Output CHILD_Cycle(
+        const mjbots::pi3hat::Pi3Hat::Input& input) {
+      if (broker_) { return broker_->Cycle(input); }
+      return pi3hat_->Cycle(input);
     }
 
-    auto& out_frame = pi3data_.tx_can[0];
-    mjlib::base::BufferWriteStream stream{
-      {reinterpret_cast<char*>(&out_frame.data[0]), sizeof(out_frame.data)}};
-    mjlib::multiplex::WriteStream writer{stream};
-
-    writer.WriteVaruint(
-        u32(mjlib::multiplex::Format::Subframe::kClientPollServer));
-    writer.WriteVaruint(channel);
-    writer.WriteVaruint(
-        std::min<uint32_t>(48, boost::asio::buffer_size(buffers)));
-
-    out_frame.expect_reply = true;
-    out_frame.bus = SelectBus(id);
-    out_frame.id = 0x8000 | id;
-    out_frame.size = stream.offset();
-
-    input.tx_can = {&pi3data_.tx_can[0], 1};
-
-    pi3data_.result = pi3hat_->Cycle(input);
-
-    return CHILD_ParseTunnelPoll(id, channel, buffers);
-  }
-
-  size_t CHILD_ParseTunnelPoll(uint8_t id, uint32_t channel,
-                               mjlib::io::MutableBufferSequence buffers) {
-    size_t result = 0;
+    /// Arrange for everything queued so far to be sent.  Operations are
+    /// only queued from handlers in the child context, so any which are
+    /// posted before the pump runs are sent in the same cycle.
+    void CHILD_SchedulePump() {
+      if (pump_scheduled_) { return; }
+      pump_scheduled_ = true;
+      boost::asio::post(child_context_, [this]() { this->CHILD_Pump(); });
+    }
 
-    for (size_t i = 0; i < pi3data_.result.rx_can_size; i++) {
-      const auto& src = pi3data_.rx_can[i];
-      if (((src.id >> 8) & 0xff) != id) { continue; }
+    /// Send as many queued operations as possible in one cycle.  Each
+    /// servo is sent at most one frame expecting a reply per cycle, so
+    /// that every reply can be attributed to the operation which asked
+    /// for it.  Anything which conflicts is left for the next cycle.
+    void CHILD_Pump() {
+      pump_scheduled_ = false;
+
+      auto& d = pi3data_;
+      d.tx_can.clear();
+      for (auto& owner : reply_owner_) { owner = {}; }
+
+      bool any_transmits = false;
+
+      for (auto it = child_transmits_.begin(); it != child_transmits_.end();) {
+        const bool conflict = [&]() {
+          for (const auto& request : *it->request) {
+            if (request.request.request_reply() &&
+                reply_owner_[request.id].kind != Owner::kNone) {
+              return true;
+            }
+          }
+          return false;
+        }();
+        if (conflict) {
+          ++it;
+          continue;
+        }
+
+        const int index = active_transmits_.size();
+        for (const auto& request : *it->request) {
+          CHILD_SetupCAN(request);
+          if (request.request.request_reply()) {
+            reply_owner_[request.id] = {Owner::kTransmit, index};
+          }
+        }
+        any_transmits = true;
+        active_transmits_.push_back(std::move(*it));
+        it = child_transmits_.erase(it);
+      }
 
-      mjlib::base::BufferReadStream buffer_stream{
-        {reinterpret_cast<const char*>(&src.data[0]), src.size}};
-      mjlib::multiplex::ReadStream<
-        mjlib::base::BufferReadStream> stream{buffer_stream};
+      for (auto it = child_polls_.begin(); it != child_polls_.end();) {
+        const uint8_t id = it->tunnel->id();
+        if (reply_owner_[id].kind != Owner::kNone) {
+          ++it;
+          continue;
+        }
+
+        reply_owner_[id] = {Owner::kPoll, static_cast<int>(active_polls_.size())};
+        CHILD_SetupPoll(*it);
+        active_polls_.push_back(std::move(*it));
+        it = child_polls_.erase(it);
+      }
 
-      const auto maybe_subframe = stream.ReadVaruint();
-      if (!maybe_subframe || *maybe_subframe !=
-          u32(mjlib::multiplex::Format::Subframe::kServerToClient)) {
-        continue;
+      // Writes expect no reply, and so can always be sent.
+      for (auto& write : child_writes_) {
+        CHILD_SetupWrite(&write);
+        active_writes_.push_back(std::move(write));
+      }
+      child_writes_.clear();
+
+      d.result = {};
+      if (!d.tx_can.empty()) {
+        mjbots::pi3hat::Pi3Hat::Input input;
+        input.tx_can = {&d.tx_can[0], d.tx_can.size()};
+        d.rx_can.resize(std::max<size_t>(d.tx_can.size() * 2, 24));
+        for (auto& frame : d.rx_can) {
+          std::memset(&frame.data[0], 0, sizeof(frame.data));
+        }
+        input.rx_can = {&d.rx_can[0], d.rx_can.size()};
+        input.timeout_ns = options_.query_timeout_s * 1e9;
+        input.match_reply_ids = true;
+        if (!any_transmits) {
+          input.min_tx_wait_ns = options_.min_wait_s * 1e9;
+        }
+
+        d.result = CHILD_Cycle(input);
       }
 
-      const auto maybe_channel = stream.ReadVaruint();
-      if (!maybe_channel || *maybe_channel != channel) {
-        continue;
+      for (size_t i = 0; i < d.result.rx_can_size; i++) {
+        const auto& src = d.rx_can[i];
+        const auto& owner = reply_owner_[(src.id >> 8) & 0xff];
+        if (owner.kind == Owner::kTransmit) {
+          FinishCAN(active_transmits_[owner.index].reply, src);
+        }
       }
 
-      const auto maybe_stream_size = stream.ReadVaruint();
-      if (!maybe_stream_size) {
-        continue;
+      for (auto& transmit : active_transmits_) {
+        boost::asio::post(
+            transmit.executor,
+            std::bind(std::move(transmit.callback), mjlib::base::error_code()));
       }
+      active_transmits_.clear();
 
-      const auto stream_size = *maybe_stream_size;
-      if (stream_size == 0) { continue; }
+      for (auto& poll : active_polls_) {
+        const auto bytes_read = CHILD_ParseTunnelPoll(
+            poll.tunnel->id(), poll.tunnel->channel(), poll.buffers);
+        poll.tunnel->CHILD_FinishPoll(
+            bytes_read, poll.buffers, std::move(poll.handler));
+      }
+      active_polls_.clear();
 
-      auto remaining_data = stream_size;
-      for (auto buffer : buffers) {
-        if (remaining_data == 0) { break; }
+      for (auto& write : active_writes_) {
+        boost::asio::post(
+            write.tunnel->get_executor(),
+            std::bind(std::move(write.handler),
+                      mjlib::base::error_code(), write.size));
+      }
+      active_writes_.clear();
 
-        const auto to_read = std::min<size_t>(buffer.size(), remaining_data);
-        buffer_stream.read({static_cast<char*>(buffer.data()),
-                static_cast<std::streamsize>(to_read)});
-        remaining_data -= to_read;
-        result += to_read;
+      if (!child_transmits_.empty() || !child_polls_.empty()) {
+        CHILD_SchedulePump();
       }
     }
 
-    return result;
-  }
-
-  void CHILD_TunnelWrite(uint8_t id, uint32_t channel,
-                         mjlib::io::ConstBufferSequence buffers,
-                         mjlib::io::WriteHandler callback) {
-    if (pi3data_.tx_can.size() < 1) {
-      pi3data_.tx_can.resize(1);
-    }
-    auto& dst = pi3data_.tx_can[0];
-
-    mjlib::base::BufferWriteStream stream{
-      {reinterpret_cast<char*>(&dst.data[0]), sizeof(dst.data)}};
-    mjlib::multiplex::WriteStream writer{stream};
-
-    writer.WriteVaruint(u32(mjlib::multiplex::Format::Subframe::kClientToServer));
-    writer.WriteVaruint(channel);
-
-    const auto size = std::min<size_t>(48, boost::asio::buffer_size(buffers));
-    writer.WriteVaruint(size);
-    auto remaining_size = size;
-    for (auto buffer : buffers) {
-      if (remaining_size == 0) { break; }
-      const auto to_write = std::min(remaining_size, buffer.size());
-      stream.write({static_cast<const char*>(buffer.data()), to_write});
-      remaining_size -= to_write;
+    void CHILD_SetupCAN(const AsioClient::IdRequest& request) {
+      auto& d = pi3data_;
+      d.tx_can.push_back({});
+      auto& dst = d.tx_can.back();
+      dst.id = request.id | (request.request.request_reply() ? 0x8000 : 0x00);
+      dst.size = request.request.buffer().size();
+      std::memcpy(&dst.data[0], request.request.buffer().data(), dst.size);
+      dst.bus = SelectBus(request.id);
+      dst.expect_reply = request.request.request_reply();
     }
 
-    dst.id = id;
-    dst.bus = SelectBus(id);
-    dst.size = stream.offset();
-
-    mjbots::pi3hat::Pi3Hat::Input input;
-    input.tx_can = {&pi3data_.tx_can[0], 1};
-
-    pi3hat_->Cycle(input);
-
-    boost::asio::post(
-        executor_,
-        std::bind(std::move(callback), mjlib::base::error_code(), size));
-  }
+    size_t CHILD_ParseTunnelPoll(uint8_t id, uint32_t channel,
+                                 mjlib::io::MutableBufferSequence buffers) {
+      size_t result = 0;
+
+      for (size_t i = 0; i < pi3data_.result.rx_can_size; i++) {
+        const auto& src = pi3data_.rx_can[i];
+        if (((src.id >> 8) & 0xff) != id) { continue; }
+
+        mjlib::base::BufferReadStream buffer_stream{
+          {reinterpret_cast<const char*>(&src.data[0]), src.size}};
+        mjlib::multiplex::ReadStream<
+          mjlib::base::BufferReadStream> stream{buffer_stream};
+
+        const auto maybe_subframe = stream.ReadVaruint();
+        if (!maybe_subframe || *maybe_subframe !=
+            u32(mjlib::multiplex::Format::Subframe::kServerToClient)) {
+          continue;
+        }
+
+        const auto maybe_channel = stream.ReadVaruint();
+        if (!maybe_channel || *maybe_channel != channel) {
+          continue;
+        }
+
+        const auto maybe_stream_size = stream.ReadVaruint();
+        if (!maybe_stream_size) {
+          continue;
+        }
+
+        const auto stream_size = *maybe_stream_size;
+        if (stream_size == 0) { continue; }
+
+        auto remaining_data = stream_size;
+        for (auto buffer : buffers) {
+          if (remaining_data == 0) { break; }
+
+          const auto to_read = std::min<size_t>(buffer.size(), remaining_data);
+          buffer_stream.read({static_cast<char*>(buffer.data()),
+                  static_cast<std::streamsize>(to_read)});
+          remaining_data -= to_read;
+          result += to_read;
+        }
+      }
 
-  void FinishCAN(Reply* reply) {
-    // First CAN.
-    for (size_t i = 0; i < pi3data_.result.rx_can_size; i++) {
-      const auto& src = pi3data_.rx_can[i];
+      return result;
+    }
 
+    void FinishCAN(Reply* reply, const mjbots::pi3hat::CanFrame& src) {
       if (src.id == 0x10004) {
         // This came from the power_dist board.  Ignore.
-        continue;
+        return;
       }
 
       parsed_data_.clear();
       mjlib::base::BufferReadStream payload_stream{
-        {reinterpret_cast<const char*>(&src.data[0]),
-              pi3data_.rx_can[i].size}};
+        {reinterpret_cast<const char*>(&src.data[0]), src.size}};
       mjlib::multiplex::ParseRegisterReply(payload_stream, &parsed_data_);
       for (const auto& pair : parsed_data_) {
         reply->push_back({static_cast<uint8_t>((src.id >> 8) & 0xff),
                 pair.first, pair.second});
       }
     }
-  }
 
-  void FinishTransmit(Reply* reply, mjlib::io::ErrorCallback callback) {
-    FinishCAN(reply);
+    int SelectBus(int id) const {
+      if (options_.force_bus >= 0) { return options_.force_bus; }
 
-    // Finally, post our CAN response.
-    boost::asio::post(
-        executor_,
-        std::bind(std::move(callback), mjlib::base::error_code()));
-  }
+      return (id >= 1 && id <= 3) ? 1 :
+          (id >= 4 && id <= 6) ? 2 :
+          (id >= 7 && id <= 9) ? 3 :
+          (id >= 10 && id <= 12) ? 4 :
+          1; // just send everything else out to 1 by default
+    }
 
-  int SelectBus(int id) const {
-    if (options_.force_bus >= 0) { return options_.force_bus; }
+    struct Transmit {
+      const AsioClient::Request* request = nullptr;
+      Reply* reply = nullptr;
+      boost::asio::any_io_executor executor;
+      mjlib::io::ErrorCallback callback;
+    };
+
+    struct Poll {
+      std::shared_ptr<Tunnel> tunnel;
+      mjlib::io::MutableBufferSequence buffers;
+      mjlib::io::ReadHandler handler;
+    };
+
+    struct Write {
+      std::shared_ptr<Tunnel> tunnel;
+      mjlib::io::ConstBufferSequence buffers;
+      mjlib::io::WriteHandler handler;
+      size_t size = 0;
+    };
+
+    struct Owner {
+      enum Kind {
+        kNone,
+        kTransmit,
+        kPoll,
+      };
+
+      Kind kind = kNone;
+      int index = 0;
+    };
+
+    void CHILD_SetupPoll(const Poll& poll) {
+      auto& d = pi3data_;
+      d.tx_can.push_back({});
+      auto& out_frame = d.tx_can.back();
+
+      mjlib::base::BufferWriteStream stream{
+        {reinterpret_cast<char*>(&out_frame.data[0]), sizeof(out_frame.data)}};
+      mjlib::multiplex::WriteStream writer{stream};
+
+      writer.WriteVaruint(
+          u32(mjlib::multiplex::Format::Subframe::kClientPollServer));
+      writer.WriteVaruint(poll.tunnel->channel());
+      writer.WriteVaruint(
+          std::min<uint32_t>(kMaxTunnelData,
+                             boost::asio::buffer_size(poll.buffers)));
+
+      const uint8_t id = poll.tunnel->id();
+      out_frame.expect_reply = true;
+      out_frame.bus = SelectBus(id);
+      out_frame.id = 0x8000 | id;
+      out_frame.size = stream.offset();
+    }
 
-    return (id >= 1 && id <= 3) ? 1 :
-        (id >= 4 && id <= 6) ? 2 :
-        (id >= 7 && id <= 9) ? 3 :
-        (id >= 10 && id <= 12) ? 4 :
-        1; // just send everything else out to 1 by default
-  }
+    void CHILD_SetupWrite(Write* write) {
+      auto& d = pi3data_;
+      d.tx_can.push_back({});
+      auto& dst = d.tx_can.back();
 
- private:
-  boost::asio::any_io_executor executor_;
-  const Options options_;
+      mjlib::base::BufferWriteStream stream{
+        {reinterpret_cast<char*>(&dst.data[0]), sizeof(dst.data)}};
+      mjlib::multiplex::WriteStream writer{stream};
+
+      writer.WriteVaruint(u32(mjlib::multiplex::Format::Subframe::kClientToServer));
+      writer.WriteVaruint(write->tunnel->channel());
+
+      const auto size = std::min<size_t>(
+          kMaxTunnelData, boost::asio::buffer_size(write->buffers));
+      writer.WriteVaruint(size);
+      auto remaining_size = size;
+      for (auto buffer : write->buffers) {
+        if (remaining_size == 0) { break; }
+        const auto to_write = std::min(remaining_size, buffer.size());
+        stream.write({static_cast<const char*>(buffer.data()), to_write});
+        remaining_size -= to_write;
+      }
+
+      const uint8_t id = write->tunnel->id();
+      dst.id = id;
+      dst.bus = SelectBus(id);
+      dst.size = stream.offset();
+
+      write->size = size;
+    }
+
+    const Options options_;
+
+    std::thread thread_;
 
-  std::thread thread_;
+    std::vector<mjlib::multiplex::RegisterValue> parsed_data_;
 
-  std::vector<mjlib::multiplex::RegisterValue> parsed_data_;
+    // Only accessed from the child thread.
+    std::optional<mjbots::pi3hat::Pi3Hat> pi3hat_;
+    std::optional<mjbots::pi3hat::Pi3HatBrokerClient> broker_;
 
-  // Only accessed from the thread.
-  std::optional<mjbots::pi3hat::Pi3Hat> pi3hat_;
-  boost::asio::io_context child_context_;
+    // Operations waiting for a cycle, and those in the current one.
+    // These are only accessed from the child thread.
+    std::deque<Transmit> child_transmits_;
+    std::deque<Poll> child_polls_;
+    std::deque<Write> child_writes_;
+    std::deque<Transmit> active_transmits_;
+    std::deque<Poll> active_polls_;
+    std::deque<Write> active_writes_;
+    bool pump_scheduled_ = false;
 
-  // This can be accessed in either thread, but never at the same
-  // time.  They can either be accessed inside CHILD_Register, or in
-  // the parent until the callback is invoked.
-  struct Pi3Data {
-    std::vector<mjbots::pi3hat::CanFrame> tx_can;
-    std::vector<mjbots::pi3hat::CanFrame> rx_can;
+    // Indexed by servo ID, which operation in the current cycle
+    // expects its reply.
+    Owner reply_owner_[256];
 
-    mjbots::pi3hat::Pi3Hat::Output result;
+    // Only accessed from the child thread.
+    struct Pi3Data {
+      std::vector<mjbots::pi3hat::CanFrame> tx_can;
+      std::vector<mjbots::pi3hat::CanFrame> rx_can;
+
+      mjbots::pi3hat::Pi3Hat::Output result;
+    };
+    Pi3Data pi3data_;
+
+    boost::asio::io_context child_context_;
   };
-  Pi3Data pi3data_;
+
+ private:
+  boost::asio::any_io_executor executor_;
+  std::shared_ptr<Host> host_;
 };
-}
 
-int main(int argc, char** argv) {
+int RunTool(std::vector<std::string> args) {
+  std::vector<char*> argv;
+  for (auto& arg : args) { argv.push_back(&arg[0]); }
+  argv.push_back(nullptr);
+
   boost::asio::io_context context;
   mjlib::io::Selector<mjlib::multiplex::AsioClient> client_selector{
     context.get_executor(), "client_type"};
   client_selector.Register<Pi3hatWrapper>("pi3");
   client_selector.set_default("pi3");
-  return moteus::tool::moteus_tool_main(context, argc, argv, &client_selector);
+  return moteus::tool::moteus_tool_main(
+      context, argv.size() - 1, argv.data(), &client_selector);
+}
+
+std::vector<std::string> SplitTargets(const std::string& value) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  while (start <= value.size()) {
+    const size_t end = std::min(value.find(',', start), value.size());
+    if (end > start) { result.push_back(value.substr(start, end - start)); }
+    start = end + 1;
+  }
+  return result;
+}
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> args{argv, argv + argc};
+
+  // With "--parallel-targets ID,ID,...", a separate moteus_tool
+  // session is run for each target at the same time, for instance to
+  // flash them all at once.  They share one pi3hat, so their traffic
+  // is merged into the same cycles and spread across every bus.
+  std::vector<std::string> targets;
+  for (size_t i = 1; i + 1 < args.size(); i++) {
+    if (args[i] == "--parallel-targets") {
+      targets = SplitTargets(args[i + 1]);
+      args.erase(args.begin() + i, args.begin() + i + 2);
+      break;
+    }
+  }
+
+  if (targets.empty()) { return RunTool(args); }
+
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (const auto& target : targets) {
+    threads.emplace_back([&args, &failures, target]() {
+        auto target_args = args;
+        target_args.push_back("--target");
+        target_args.push_back(target);
+        try {
+          if (RunTool(target_args) != 0) { failures++; }
+        } catch (std::exception& e) {
+          std::cerr << "target " << target << ": " << e.what() << "\n";
+          failures++;
+        }
+      });
+  }
+  for (auto& thread : threads) { thread.join(); }
+
+  return failures.load() ? 1 : 0;
 }
@@ -14,16 +14,23 @@
 
 #pragma once
 
+#include <atomic>
+#include <bitset>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "mjbots/pi3hat/cycle_log.h"
 #include "mjbots/pi3hat/pi3hat.h"
+#include "mjbots/pi3hat/pi3hat_broker.h"
 
+#include "mjbots/moteus/moteus_protocol.h"
 #include "mjbots/moteus/realtime.h"
 
 namespace mjbots {
@@ -35,11 +42,62 @@ namespace moteus {
 /// is taking place.
 class Pi3HatMoteusInterface {
  public:
+  /// Encoders for when every servo uses the same resolutions, known
+  /// at compile time.  These are faster than the general purpose
+  /// functions.  Use MakeFixedFormat to create one from a
+  /// FixedPositionCommand and a FixedQuery.
+  struct FixedFormat {
+    void (*emit_position)(WriteCanFrame*, const PositionCommand&) = nullptr;
+    void (*emit_query)(WriteCanFrame*) = nullptr;
+    QueryResult (*parse)(const uint8_t*, size_t) = nullptr;
+  };
+
+  template <typename Command, typename Query>
+  static FixedFormat MakeFixedFormat() {
+    FixedFormat result;
+    result.emit_position = &Command::Emit;
+    result.emit_query = &Query::Emit;
+    result.parse = &Query::Parse;
+    return result;
+  }
+
   struct Options {
+    // The CPU to run the background thread on, at realtime priority.
+    // If negative, its affinity and scheduling are left unchanged.
     int cpu = -1;
 
+    // Passed to the Pi3Hat.  Setting 'transport' allows this to be
+    // used with Pi3HatSimulator.
+    pi3hat::Pi3Hat::Configuration pi3hat_configuration;
+
     // If a servo is not present, it is assumed to be on bus 1.
     std::map<int, int> servo_bus_map;
+
+    // If true, then work is handed to and from the background thread
+    // by spinning on atomic counters rather than through a mutex and
+    // condition variable.  This avoids kernel wakeup latency, at the
+    // expense of the background thread consuming 100% of its CPU,
+    // and is only appropriate when it has an isolated core.
+    bool spin_handoff = false;
+
+    // If true, then each cycle ends as soon as every queried servo
+    // has replied, rather than waiting for further traffic.
+    bool match_reply_ids = false;
+
+    // If non-empty, every cycle is recorded to this file in the
+    // format described in mjbots/pi3hat/cycle_log.h.
+    std::string cycle_log;
+
+    // If non-empty, other processes may send CAN frames through this
+    // interface using a Pi3HatBrokerClient with the same name.
+    std::string broker;
+
+    // If set, then every position and zero velocity command is
+    // encoded with this, and every command carries its query, so
+    // ServoCommand::resolution and ServoCommand::query are ignored.
+    // Replies which do not have the expected layout are still
+    // decoded correctly, just more slowly.
+    FixedFormat fixed_format;
   };
 
   Pi3HatMoteusInterface(const Options& options)
@@ -48,9 +106,12 @@ class Pi3HatMoteusInterface {
   }
 
   ~Pi3HatMoteusInterface() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    done_ = true;
-    condition_.notify_one();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+      condition_.notify_one();
+    }
+    spin_done_.store(true);
     thread_.join();
   }
 
@@ -76,11 +137,27 @@ class Pi3HatMoteusInterface {
   struct Data {
     pi3hat::Span<ServoCommand> commands;
 
+    // Replies are stored here in the order they arrive.  This may be
+    // empty.
     pi3hat::Span<ServoReply> replies;
+
+    // If non-empty, each reply is also parsed directly into the entry
+    // of this table indexed by the replying servo's ID.  It should
+    // have room for the largest ID in use, up to 128 entries.
+    // Entries for servos which did not reply are left untouched.
+    pi3hat::Span<ServoReply> replies_by_id;
   };
 
   struct Output {
+    // The number of entries stored into Data::replies.
     size_t query_result_size = 0;
+
+    // The IDs which replied during this cycle.
+    std::bitset<128> updated_ids;
+
+    // The time from Cycle being called until the result was
+    // available.
+    int64_t round_trip_ns = 0;
   };
 
   using CallbackFunction = std::function<void (const Output&)>;
@@ -92,6 +169,19 @@ class Pi3HatMoteusInterface {
   /// All memory pointed to by @p data must remain valid until the
   /// callback is invoked.
   void Cycle(const Data& data, CallbackFunction callback) {
+    if (options_.spin_handoff) {
+      if (!ready()) {
+        throw std::logic_error(
+            "Cycle cannot be called until the previous has completed");
+      }
+
+      callback_ = std::move(callback);
+      data_ = data;
+      start_ns_ = Now();
+      request_count_.fetch_add(1, std::memory_order_release);
+      return;
+    }
+
     std::lock_guard<std::mutex> lock(mutex_);
     if (active_) {
       throw std::logic_error(
@@ -101,20 +191,75 @@ class Pi3HatMoteusInterface {
     callback_ = std::move(callback);
     active_ = true;
     data_ = data;
+    start_ns_ = Now();
+    request_count_.fetch_add(1, std::memory_order_release);
 
     condition_.notify_all();
   }
 
+  /// Schedule a cycle of communication with no callback.  Its
+  /// completion can be determined with 'ready' or 'Wait'.  This
+  /// performs no memory allocation.
+  void Cycle(const Data& data) {
+    Cycle(data, CallbackFunction());
+  }
+
+  /// @return true if no cycle is outstanding.
+  bool ready() const {
+    return complete_count_.load(std::memory_order_acquire) ==
+        request_count_.load(std::memory_order_relaxed);
+  }
+
+  /// Block until the most recently scheduled cycle is complete, and
+  /// return its result.  In spin_handoff mode, this spins.
+  Output Wait() {
+    if (options_.spin_handoff) {
+      while (!ready());
+      return output_;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    complete_condition_.wait(lock, [&]() { return ready(); });
+    return output_;
+  }
+
  private:
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
   void CHILD_Run() {
-    ConfigureRealtime(options_.cpu);
+    // The log's writer thread is started before we become realtime,
+    // so that it does not share our CPU.
+    if (!options_.cycle_log.empty()) {
+      pi3hat::CycleLog::Options log_options;
+      log_options.filename = options_.cycle_log;
+      cycle_log_.reset(new pi3hat::CycleLog(log_options));
+    }
+
+    if (options_.cpu >= 0) {
+      ConfigureRealtime(options_.cpu);
+    }
+
+    pi3hat_.reset(new pi3hat::Pi3Hat(options_.pi3hat_configuration));
+    if (!options_.broker.empty()) {
+      pi3hat::Pi3HatBroker::Options broker_options;
+      broker_options.name = options_.broker;
+      broker_.reset(new pi3hat::Pi3HatBroker(broker_options));
+    }
 
-    pi3hat_.reset(new pi3hat::Pi3Hat({}));
+    if (options_.spin_handoff) {
+      CHILD_RunSpin();
+      return;
+    }
 
     while (true) {
       {
         std::unique_lock<std::mutex> lock(mutex_);
         if (!active_) {
+          // The destructor may have run before we started waiting.
+          if (done_) { return; }
           condition_.wait(lock);
           if (done_) { return; }
 
@@ -127,21 +272,61 @@ class Pi3HatMoteusInterface {
       {
         std::unique_lock<std::mutex> lock(mutex_);
         active_ = false;
+        output_ = output;
+        complete_count_.store(request_count_.load(std::memory_order_relaxed),
+                              std::memory_order_release);
         std::swap(callback_copy, callback_);
       }
-      callback_copy(output);
+      complete_condition_.notify_all();
+      if (callback_copy) {
+        callback_copy(output);
+      }
+    }
+  }
+
+  void CHILD_RunSpin() {
+    uint64_t handled_count = 0;
+    while (true) {
+      uint64_t this_count = 0;
+      while (true) {
+        this_count = request_count_.load(std::memory_order_acquire);
+        if (this_count != handled_count) { break; }
+        if (spin_done_.load(std::memory_order_relaxed)) { return; }
+      }
+      handled_count = this_count;
+
+      // We must take our copy of the callback before reporting that
+      // we are done, as the parent may then immediately start the
+      // next cycle.
+      CallbackFunction callback_copy;
+      std::swap(callback_copy, callback_);
+
+      output_ = CHILD_Cycle();
+      complete_count_.store(this_count, std::memory_order_release);
+
+      if (callback_copy) {
+        callback_copy(output_);
+      }
     }
   }
 
   Output CHILD_Cycle() {
-    tx_can_.resize(data_.commands.size());
+    // These only ever grow, so in steady state they neither allocate
+    // nor re-initialize their contents.
+    const size_t tx_size = data_.commands.size();
+    const size_t rx_size = data_.commands.size() * 2;
+    if (tx_can_.size() < tx_size) { tx_can_.resize(tx_size); }
+    if (rx_can_.size() < rx_size) { rx_can_.resize(rx_size); }
+
+    const auto& fixed = options_.fixed_format;
+
     int out_idx = 0;
     for (const auto& cmd : data_.commands) {
       const auto& query = cmd.query;
 
       auto& can = tx_can_[out_idx++];
 
-      can.expect_reply = query.any_set();
+      can.expect_reply = fixed.emit_query ? true : query.any_set();
       can.id = cmd.id | (can.expect_reply ? 0x8000 : 0x0000);
       can.size = 0;
 
@@ -161,33 +346,67 @@ class Pi3HatMoteusInterface {
         }
         case Mode::kPosition:
         case Mode::kZeroVelocity: {
-          moteus::EmitPositionCommand(&write_frame, cmd.position, cmd.resolution);
+          if (fixed.emit_position) {
+            fixed.emit_position(&write_frame, cmd.position);
+          } else {
+            moteus::EmitPositionCommand(
+                &write_frame, cmd.position, cmd.resolution);
+          }
           break;
         }
         default: {
           throw std::logic_error("unsupported mode");
         }
       }
-      moteus::EmitQueryCommand(&write_frame, cmd.query);
+      if (fixed.emit_query) {
+        fixed.emit_query(&write_frame);
+      } else {
+        moteus::EmitQueryCommand(&write_frame, cmd.query);
+      }
     }
 
-    rx_can_.resize(data_.commands.size() * 2);
-
     pi3hat::Pi3Hat::Input input;
-    input.tx_can = { tx_can_.data(), tx_can_.size() };
-    input.rx_can = { rx_can_.data(), rx_can_.size() };
+    input.tx_can = { tx_can_.data(), tx_size };
+    input.rx_can = { rx_can_.data(), rx_size };
+    input.match_reply_ids = options_.match_reply_ids;
 
     Output result;
 
-    const auto output = pi3hat_->Cycle(input);
-    for (size_t i = 0; i < output.rx_can_size && i < data_.replies.size(); i++) {
+    const auto output = broker_ ?
+        broker_->Cycle(pi3hat_.get(), input) :
+        pi3hat_->Cycle(input);
+    if (cycle_log_) { cycle_log_->Record(input, output); }
+    for (size_t i = 0; i < output.rx_can_size; i++) {
       const auto& can = rx_can_[i];
+      const int id = (can.id & 0x7f00) >> 8;
+
+      // Each reply is decoded once, directly into its destination.
+      ServoReply* const reply = [&]() -> ServoReply* {
+        if (static_cast<size_t>(id) < data_.replies_by_id.size()) {
+          return &data_.replies_by_id[id];
+        }
+        if (result.query_result_size < data_.replies.size()) {
+          return &data_.replies[result.query_result_size];
+        }
+        return nullptr;
+      }();
+      if (reply == nullptr) { continue; }
+
+      reply->id = id;
+      reply->result = fixed.parse ?
+          fixed.parse(can.data, can.size) :
+          moteus::ParseQueryResult(can.data, can.size);
+      result.updated_ids.set(id);
 
-      data_.replies[i].id = (can.id & 0x7f00) >> 8;
-      data_.replies[i].result = moteus::ParseQueryResult(can.data, can.size);
-      result.query_result_size = i + 1;
+      if (result.query_result_size < data_.replies.size()) {
+        if (reply != &data_.replies[result.query_result_size]) {
+          data_.replies[result.query_result_size] = *reply;
+        }
+        result.query_result_size++;
+      }
     }
 
+    result.round_trip_ns = Now() - start_ns_;
     return result;
   }
 
@@ -199,8 +418,18 @@ class Pi3HatMoteusInterface {
   std::condition_variable condition_;
   bool active_ = false;;
   bool done_ = false;
+  std::condition_variable complete_condition_;
+
+  /// These are handed between threads using 'request_count_' and
+  /// 'complete_count_'.  In spin_handoff mode they are not protected
+  /// by the mutex at all.
   CallbackFunction callback_;
   Data data_;
+  Output output_;
+  int64_t start_ns_ = 0;
+  std::atomic<uint64_t> request_count_{0};
+  std::atomic<uint64_t> complete_count_{0};
+  std::atomic<bool> spin_done_{false};
 
   std::thread thread_;
 
@@ -208,6 +437,8 @@ class Pi3HatMoteusInterface {
   /// All further variables are only used from within the child thread.
 
   std::unique_ptr<pi3hat::Pi3Hat> pi3hat_;
+  std::unique_ptr<pi3hat::CycleLog> cycle_log_;
+  std::unique_ptr<pi3hat::Pi3HatBroker> broker_;
 
   // These are kept persistently so that no memory allocation is
   // required in steady state.
@@ -151,3 +151,167 @@ BOOST_AUTO_TEST_CASE(ParseQueryResultTest) {
     BOOST_TEST(result.temperature == 8.0);
   }
 }
+
+namespace {
+template <typename Fixed>
+void CheckFixedPositionCommand(const PositionCommand& pos) {
+  CanFrame generic;
+  WriteCanFrame generic_frame{&generic};
+  EmitPositionCommand(&generic_frame, pos, Fixed::resolution());
+
+  CanFrame fixed;
+  WriteCanFrame fixed_frame{&fixed};
+  Fixed::Emit(&fixed_frame, pos);
+
+  BOOST_TEST(fixed.size == generic.size);
+  BOOST_TEST(Fixed::size() == generic.size);
+  for (size_t i = 0; i < generic.size; i++) {
+    BOOST_TEST(fixed.data[i] == generic.data[i]);
+  }
+}
+
+template <typename Fixed>
+void CheckFixedQueryCommand() {
+  CanFrame generic;
+  WriteCanFrame generic_frame{&generic};
+  EmitQueryCommand(&generic_frame, Fixed::command());
+
+  CanFrame fixed;
+  WriteCanFrame fixed_frame{&fixed};
+  Fixed::Emit(&fixed_frame);
+
+  BOOST_TEST(fixed.size == generic.size);
+  BOOST_TEST(Fixed::size() == generic.size);
+  for (size_t i = 0; i < generic.size; i++) {
+    BOOST_TEST(fixed.data[i] == generic.data[i]);
+  }
+}
+
+void CheckSameResult(const QueryResult& a, const QueryResult& b) {
+  auto same = [](double lhs, double rhs) {
+    return (std::isnan(lhs) && std::isnan(rhs)) || lhs == rhs;
+  };
+  BOOST_TEST((a.mode == b.mode));
+  BOOST_TEST(same(a.position, b.position));
+  BOOST_TEST(same(a.velocity, b.velocity));
+  BOOST_TEST(same(a.torque, b.torque));
+  BOOST_TEST(same(a.q_current, b.q_current));
+  BOOST_TEST(same(a.d_current, b.d_current));
+  BOOST_TEST(a.rezero_state == b.rezero_state);
+  BOOST_TEST(same(a.voltage, b.voltage));
+  BOOST_TEST(same(a.temperature, b.temperature));
+  BOOST_TEST(a.fault == b.fault);
+}
+}
+
+BOOST_AUTO_TEST_CASE(FixedPositionCommandTest) {
+  using R = Resolution;
+
+  PositionCommand pos;
+  pos.position = 1.25;
+  pos.velocity = -0.5;
+  pos.feedforward_torque = 2.0;
+  pos.kp_scale = 0.75;
+  pos.kd_scale = 0.25;
+  pos.maximum_torque = 3.5;
+  pos.stop_position = std::numeric_limits<double>::quiet_NaN();
+  pos.watchdog_timeout = 0.1;
+
+  // The default resolution.
+  CheckFixedPositionCommand<
+    FixedPositionCommand<R::kFloat, R::kFloat, R::kFloat, R::kFloat,
+                         R::kFloat, R::kIgnore, R::kFloat, R::kFloat>>(pos);
+  // The one used by moteus_control_example.
+  CheckFixedPositionCommand<
+    FixedPositionCommand<R::kInt16, R::kInt16, R::kInt16, R::kInt8,
+                         R::kInt8, R::kIgnore, R::kIgnore, R::kIgnore>>(pos);
+  CheckFixedPositionCommand<
+    FixedPositionCommand<R::kInt8, R::kInt32, R::kIgnore, R::kInt16,
+                         R::kInt16, R::kInt16, R::kInt16, R::kInt32>>(pos);
+  CheckFixedPositionCommand<
+    FixedPositionCommand<R::kIgnore, R::kIgnore, R::kInt32, R::kInt32,
+                         R::kIgnore, R::kFloat, R::kInt8, R::kInt8>>(pos);
+
+  // Saturation has to match too.
+  pos.position = 1e9;
+  pos.velocity = -1e9;
+  CheckFixedPositionCommand<
+    FixedPositionCommand<R::kInt16, R::kInt8, R::kInt16, R::kInt8,
+                         R::kInt8, R::kIgnore, R::kIgnore, R::kIgnore>>(pos);
+}
+
+BOOST_AUTO_TEST_CASE(FixedQueryTest) {
+  using R = Resolution;
+
+  using DefaultQuery = FixedQuery<
+    R::kInt16, R::kInt16, R::kInt16, R::kInt16, R::kIgnore,
+    R::kIgnore, R::kIgnore, R::kInt8, R::kInt8, R::kInt8>;
+  using OtherQuery = FixedQuery<
+    R::kInt8, R::kFloat, R::kInt32, R::kIgnore, R::kInt16,
+    R::kInt16, R::kInt8, R::kIgnore, R::kInt16, R::kInt32>;
+
+  CheckFixedQueryCommand<DefaultQuery>();
+  CheckFixedQueryCommand<OtherQuery>();
+
+  {
+    // This is how moteus answers the default query, followed by
+    // padding to the next DLC size.
+    const uint8_t reply[] = {
+      0x24, 0x04, 0x00,
+      0x0a, 0x00,  // mode
+      0x10, 0x27,  // position
+      0x00, 0x80,  // velocity (NaN)
+      0x9c, 0xff,  // torque
+      0x23, 0x0d,
+      0x20,  // voltage
+      0x28,  // temperature
+      0x00,  // fault
+      0x50, 0x50, 0x50, 0x50,
+    };
+
+    const auto fixed = DefaultQuery::Parse(reply, sizeof(reply));
+    const auto generic = ParseQueryResult(reply, sizeof(reply));
+    CheckSameResult(fixed, generic);
+
+    BOOST_TEST((fixed.mode == Mode::kPosition));
+    BOOST_TEST(fixed.position == 1.0);
+    BOOST_TEST(std::isnan(fixed.velocity));
+    BOOST_TEST(fixed.torque == -1.0);
+    BOOST_TEST(fixed.voltage == 16.0);
+    BOOST_TEST(fixed.temperature == 40.0);
+    BOOST_TEST(fixed.fault == 0);
+  }
+
+  {
+    // A reply with a different framing, here only the mode and
+    // position, must still decode correctly through the fallback.
+    const uint8_t reply[] = {
+      0x22, 0x00,
+      0x0a,  // mode
+      0x64,  // position
+    };
+
+    const auto fixed = DefaultQuery::Parse(reply, sizeof(reply));
+    const auto generic = ParseQueryResult(reply, sizeof(reply));
+    CheckSameResult(fixed, generic);
+
+    BOOST_TEST((fixed.mode == Mode::kPosition));
+    BOOST_TEST(fixed.position == 1.0);
+    BOOST_TEST(std::isnan(fixed.voltage));
+  }
+
+  {
+    // Trailing data which is not padding must not be ignored.
+    const uint8_t reply[] = {
+      0x24, 0x04, 0x00,
+      0x0a, 0x00, 0x10, 0x27, 0x00, 0x00, 0x00, 0x00,
+      0x23, 0x0d, 0x20, 0x28, 0x05,
+      0x21, 0x04, 0x0a,
+    };
+
+    const auto fixed = DefaultQuery::Parse(reply, sizeof(reply));
+    const auto generic = ParseQueryResult(reply, sizeof(reply));
+    CheckSameResult(fixed, generic);
+    BOOST_TEST(fixed.q_current == 10.0);
+  }
+}
@@ -0,0 +1,412 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pi3hat.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+/// A cycle log is a binary file recording everything which went in
+/// and out of a sequence of Pi3Hat::Cycle calls.  It consists of a
+/// CycleLogHeader followed by any number of CycleLogRecords.  Every
+/// record is the same size, so the file can be mapped into memory and
+/// indexed directly.  All values are in the host's byte order.
+struct CycleLogHeader {
+  static constexpr uint32_t kVersion = 1;
+
+  char magic[8] = { 'P', 'I', '3', 'H', 'L', 'O', 'G', '\0' };
+  uint32_t version = kVersion;
+  uint32_t header_size = 64;
+  uint32_t record_size = 96;
+  uint8_t reserved[44] = {};
+};
+
+static_assert(sizeof(CycleLogHeader) == 64, "header size changed");
+
+struct CycleLogRecord {
+  enum Type : uint16_t {
+    kCycle = 1,
+    kTxCan = 2,
+    kRxCan = 3,
+    kAttitude = 4,
+  };
+
+  struct Cycle {
+    // The members of Pi3Hat::Timing, in order, except 'spi'.
+    int32_t timing_ns[13];
+    uint32_t spi_transactions[3];
+    uint32_t spi_bytes[3];
+    int32_t error;
+  };
+
+  struct Can {
+    uint32_t id;
+    uint8_t bus;
+    uint8_t size;
+    uint8_t expect_reply;
+    uint8_t reserved;
+    uint32_t timestamp_us;
+    uint8_t data[64];
+  };
+
+  struct Attitude {
+    float attitude[4];  // w, x, y, z
+    float rate_dps[3];
+    float accel_mps2[3];
+    float bias_dps[3];
+    float attitude_uncertainty[4];
+    float bias_uncertainty_dps[3];
+  };
+
+  uint16_t type = 0;
+  uint16_t reserved = 0;
+
+  // Each call to CycleLog::Record is one cycle, numbered from 0.
+  uint32_t cycle = 0;
+
+  // When the cycle was recorded, from CLOCK_MONOTONIC.
+  int64_t timestamp_ns = 0;
+
+  union {
+    Cycle cycle_data;
+    Can can;
+    Attitude attitude;
+    uint8_t raw[80];
+  };
+
+  CycleLogRecord() {
+    std::memset(raw, 0, sizeof(raw));
+  }
+};
+
+static_assert(sizeof(CycleLogRecord) == 96, "record size changed");
+
+/// Records cycles to a cycle log file.  Record is intended to be
+/// called from a realtime thread; it never blocks or allocates, and
+/// only copies into a fixed size ring buffer.  A background thread at
+/// idle priority drains that buffer to disk.  If the disk falls behind
+/// far enough for the buffer to fill, records are discarded and
+/// counted in 'dropped'.  Records which could not be written to the
+/// file, as when the disk is full, are counted in 'write_errors'.
+///
+/// Record must only ever be called from one thread at a time.
+class CycleLog {
+ public:
+  struct Options {
+    std::string filename;
+
+    // The ring buffer holds this many records.  It is rounded up to a
+    // power of 2.
+    size_t capacity = 65536;
+  };
+
+  CycleLog(const Options& options)
+      : ring_(RoundUpPowerOf2(options.capacity)),
+        mask_(ring_.size() - 1) {
+    file_ = ::fopen(options.filename.c_str(), "wb");
+    if (file_ == nullptr) {
+      throw Error("Could not open cycle log: " + options.filename);
+    }
+    const CycleLogHeader header;
+    if (::fwrite(&header, sizeof(header), 1, file_) != 1) {
+      ::fclose(file_);
+      throw Error("Could not write cycle log: " + options.filename);
+    }
+
+    writer_ = std::thread(&CycleLog::Write, this);
+  }
+
+  ~CycleLog() {
+    done_.store(true);
+    writer_.join();
+    ::fclose(file_);
+  }
+
+  // This object is non-copyable.
+  CycleLog(const CycleLog&) = delete;
+  CycleLog& operator=(const CycleLog&) = delete;
+
+  /// Record one call to Pi3Hat::Cycle, given the input it was passed
+  /// and the output it returned.
+  void Record(const Pi3Hat::Input& input, const Pi3Hat::Output& output) {
+    const int64_t now = GetNow();
+
+    {
+      CycleLogRecord* const record = Start(CycleLogRecord::kCycle, now);
+      if (record) {
+        auto& data = record->cycle_data;
+        const auto& timing = output.timing;
+        const int64_t values[] = {
+          timing.send_can_start_ns, timing.send_can_end_ns,
+          timing.send_rf_start_ns, timing.send_rf_end_ns,
+          timing.read_rf_start_ns, timing.read_rf_end_ns,
+          timing.attitude_start_ns, timing.attitude_end_ns,
+          timing.submit_end_ns, timing.first_can_reply_ns,
+          timing.last_can_reply_ns, timing.timeout_ns, timing.complete_ns,
+        };
+        for (int i = 0; i < 13; i++) {
+          data.timing_ns[i] = static_cast<int32_t>(values[i]);
+        }
+        for (int i = 0; i < 3; i++) {
+          data.spi_transactions[i] = timing.spi[i].transactions;
+          data.spi_bytes[i] = timing.spi[i].bytes;
+        }
+        data.error = output.error;
+        Finish();
+      }
+    }
+
+    for (const auto& frame : input.tx_can) {
+      RecordCan(CycleLogRecord::kTxCan, now, frame);
+    }
+    for (size_t i = 0; i < output.rx_can_size; i++) {
+      RecordCan(CycleLogRecord::kRxCan, now, input.rx_can[i]);
+    }
+
+    if (output.attitude_present && input.attitude) {
+      CycleLogRecord* const record = Start(CycleLogRecord::kAttitude, now);
+      if (record) {
+        const auto& a = *input.attitude;
+        auto& data = record->attitude;
+        const Quaternion* const quaternions[] = {
+          &a.attitude, &a.attitude_uncertainty };
+        float* const quaternion_out[] = {
+          data.attitude, data.attitude_uncertainty };
+        for (int i = 0; i < 2; i++) {
+          quaternion_out[i][0] = quaternions[i]->w;
+          quaternion_out[i][1] = quaternions[i]->x;
+          quaternion_out[i][2] = quaternions[i]->y;
+          quaternion_out[i][3] = quaternions[i]->z;
+        }
+        const Point3D* const points[] = {
+          &a.rate_dps, &a.accel_mps2, &a.bias_dps, &a.bias_uncertainty_dps };
+        float* const point_out[] = {
+          data.rate_dps, data.accel_mps2, data.bias_dps,
+          data.bias_uncertainty_dps };
+        for (int i = 0; i < 4; i++) {
+          point_out[i][0] = points[i]->x;
+          point_out[i][1] = points[i]->y;
+          point_out[i][2] = points[i]->z;
+        }
+        Finish();
+      }
+    }
+
+    cycle_++;
+  }
+
+  /// The number of records discarded because the ring buffer was full.
+  uint64_t dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  /// The number of records which failed to be written to the file.
+  uint64_t write_errors() const {
+    return write_errors_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static size_t RoundUpPowerOf2(size_t value) {
+    size_t result = 1;
+    while (result < value) { result <<= 1; }
+    return result;
+  }
+
+  static int64_t GetNow() {
+    struct timespec ts = {};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000ll +
+        static_cast<int64_t>(ts.tv_nsec);
+  }
+
+  /// @return the next free record, with its common fields filled in,
+  /// or nullptr if the ring buffer is full.
+  CycleLogRecord* Start(CycleLogRecord::Type type, int64_t now) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) >= ring_.size()) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    CycleLogRecord* const record = &ring_[head & mask_];
+    std::memset(record->raw, 0, sizeof(record->raw));
+    record->type = type;
+    record->cycle = cycle_;
+    record->timestamp_ns = now;
+    return record;
+  }
+
+  /// Publish the record returned by the most recent Start.
+  void Finish() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+  }
+
+  void RecordCan(CycleLogRecord::Type type, int64_t now,
+                 const CanFrame& frame) {
+    CycleLogRecord* const record = Start(type, now);
+    if (!record) { return; }
+    auto& can = record->can;
+    can.id = frame.id;
+    can.bus = frame.bus;
+    can.size = std::min<uint8_t>(frame.size, 64);
+    can.expect_reply = frame.expect_reply ? 1 : 0;
+    can.timestamp_us = frame.timestamp_us;
+    std::memcpy(can.data, frame.data, can.size);
+    Finish();
+  }
+
+  void Write() {
+    // We should never compete with the realtime work for CPU time.
+    struct sched_param params = {};
+    ::sched_setscheduler(0, SCHED_IDLE, &params);
+
+    while (true) {
+      // Read 'done_' first, so that once it is seen, everything
+      // recorded before it was set is drained below.
+      const bool done = done_.load();
+
+      uint64_t tail = tail_.load(std::memory_order_relaxed);
+      const uint64_t head = head_.load(std::memory_order_acquire);
+      while (tail != head) {
+        // Write as much as is contiguous in the ring at once.
+        const size_t start = tail & mask_;
+        const size_t count = std::min<uint64_t>(head - tail,
+                                                ring_.size() - start);
+        const size_t written =
+            ::fwrite(&ring_[start], sizeof(CycleLogRecord), count, file_);
+        if (written != count) {
+          write_errors_.fetch_add(count - written, std::memory_order_relaxed);
+        }
+        tail += count;
+        tail_.store(tail, std::memory_order_release);
+      }
+
+      if (done) {
+        ::fflush(file_);
+        return;
+      }
+      ::usleep(1000);
+    }
+  }
+
+  std::vector<CycleLogRecord> ring_;
+  const uint64_t mask_;
+
+  // Only Record advances the head, and only the writer the tail.
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> write_errors_{0};
+  std::atomic<bool> done_{false};
+
+  uint32_t cycle_ = 0;
+
+  FILE* file_ = nullptr;
+  std::thread writer_;
+};
+
+/// Provides random access to the records of a cycle log by mapping it
+/// into memory.
+class CycleLogReader {
+ public:
+  CycleLogReader(const std::string& filename) {
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      throw Error("Could not open cycle log: " + filename);
+    }
+
+    struct stat st = {};
+    if (::fstat(fd_, &st) < 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(CycleLogHeader)) {
+      ::close(fd_);
+      throw Error("Cycle log too short: " + filename);
+    }
+    mapped_size_ = st.st_size;
+
+    void* const data =
+        ::mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd_);
+      throw Error("Could not map cycle log: " + filename);
+    }
+    data_ = static_cast<const uint8_t*>(data);
+
+    CycleLogHeader expected;
+    header_ = reinterpret_cast<const CycleLogHeader*>(data_);
+    if (std::memcmp(header_->magic, expected.magic,
+                    sizeof(expected.magic)) != 0 ||
+        header_->version != CycleLogHeader::kVersion ||
+        header_->record_size != sizeof(CycleLogRecord)) {
+      Close();
+      throw Error("Not a supported cycle log: " + filename);
+    }
+
+    // A partially written record at the end is ignored.
+    size_ = (mapped_size_ - header_->header_size) / sizeof(CycleLogRecord);
+  }
+
+  ~CycleLogReader() {
+    Close();
+  }
+
+  // This object is non-copyable.
+  CycleLogReader(const CycleLogReader&) = delete;
+  CycleLogReader& operator=(const CycleLogReader&) = delete;
+
+  size_t size() const { return size_; }
+
+  const CycleLogRecord& operator[](size_t index) const {
+    return reinterpret_cast<const CycleLogRecord*>(
+        data_ + header_->header_size)[index];
+  }
+
+ private:
+  void Close() {
+    if (data_) {
+      ::munmap(const_cast<uint8_t*>(data_), mapped_size_);
+      data_ = nullptr;
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  int fd_ = -1;
+  size_t mapped_size_ = 0;
+  const uint8_t* data_ = nullptr;
+  const CycleLogHeader* header_ = nullptr;
+  size_t size_ = 0;
+};
+
+}
+}
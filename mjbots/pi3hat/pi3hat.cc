@@ -18,18 +18,29 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cstdlib>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <bcm_host.h>
@@ -194,6 +205,96 @@ class SystemMmap {
 };
 
 
+/// Runs a single function in a background thread each time it is
+/// requested.  Work is handed off in each direction by spinning on
+/// atomic counters, so the background thread consumes its CPU
+/// entirely.
+class SpinWorker {
+ public:
+  /// If @p cpu is non-negative, the background thread is pinned to
+  /// that CPU and run at realtime priority.
+  SpinWorker(int cpu, std::function<void ()> work)
+      : work_(work),
+        thread_(std::bind(&SpinWorker::Run, this, cpu)) {}
+
+  ~SpinWorker() {
+    done_.store(true);
+    thread_.join();
+  }
+
+  SpinWorker(const SpinWorker&) = delete;
+  SpinWorker& operator=(const SpinWorker&) = delete;
+
+  void Start() {
+    request_count_.fetch_add(1, std::memory_order_release);
+  }
+
+  void Wait() {
+    const auto request = request_count_.load(std::memory_order_relaxed);
+    while (complete_count_.load(std::memory_order_acquire) != request);
+
+    if (error_) {
+      auto error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+ private:
+  void Run(int cpu) {
+    try {
+      if (cpu >= 0) {
+        cpu_set_t cpuset = {};
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        ThrowIfErrno(::sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) < 0,
+                     "pi3hat: could not set thread affinity");
+
+        struct sched_param params = {};
+        params.sched_priority = 99;
+        ThrowIfErrno(::sched_setscheduler(0, SCHED_RR, &params) < 0,
+                     "pi3hat: could not set thread scheduler");
+      }
+    } catch (...) {
+      // This will be reported on the first Wait.
+      error_ = std::current_exception();
+    }
+
+    uint64_t handled_count = 0;
+    while (true) {
+      uint64_t this_count = 0;
+      while (true) {
+        this_count = request_count_.load(std::memory_order_acquire);
+        if (this_count != handled_count) { break; }
+        if (done_.load(std::memory_order_relaxed)) { return; }
+      }
+      handled_count = this_count;
+
+      if (!error_) {
+        try {
+          work_();
+        } catch (...) {
+          error_ = std::current_exception();
+        }
+      }
+
+      complete_count_.store(this_count, std::memory_order_release);
+    }
+  }
+
+  const std::function<void ()> work_;
+  std::atomic<uint64_t> request_count_{0};
+  std::atomic<uint64_t> complete_count_{0};
+  std::atomic<bool> done_{false};
+
+  // This is only accessed by the background thread between receiving
+  // a request and completing it, and by the foreground after the
+  // completion.
+  std::exception_ptr error_;
+
+  std::thread thread_;
+};
+
 ///////////////////////////////////////////////
 /// Drivers for the Raspberry Pi hardware
 
@@ -201,7 +302,7 @@ class Rpi3Gpio {
  public:
   static constexpr uint32_t GPIO_BASE          = 0x00200000;
 
-  // static constexpr uint32_t INPUT = 0;
+  static constexpr uint32_t INPUT = 0;
   static constexpr uint32_t OUTPUT = 1;
   static constexpr uint32_t ALT_0 = 4;
   // static constexpr uint32_t ALT_1 = 5;
@@ -231,6 +332,11 @@ class Rpi3Gpio {
     }
   }
 
+  bool GetGpioInput(uint32_t gpio) const {
+    const uint32_t reg_offset = gpio / 32 + 13;
+    return (gpio_[reg_offset] & (1 << (gpio % 32))) != 0;
+  }
+
   volatile uint32_t& operator[](int index) { return gpio_[index]; }
   const volatile uint32_t& operator[](int index) const { return gpio_[index]; }
 
@@ -255,6 +361,23 @@ class Rpi3Gpio {
 };
 
 
+/// These are the BCM GPIOs connected to the CAN IRQ line of each
+/// processor.  Each is high whenever that processor has received CAN
+/// frames queued.
+constexpr uint32_t kCan1Irq = 26;
+constexpr uint32_t kCan2Irq = 5;
+constexpr uint32_t kAuxCanIrq = 22;
+constexpr uint32_t kImuIrq = 23;
+
+/// This is toggled at the end of every cycle, for use with a scope.
+constexpr uint32_t kDebugGpio = 13;
+
+/// The number of CAN acceptance filters each bus supports.
+constexpr int kMaxStandardCanFilters = 28;
+constexpr int kMaxExtendedCanFilters = 8;
+constexpr int kMaxCanFilters =
+    kMaxStandardCanFilters + kMaxExtendedCanFilters;
+
 constexpr uint32_t kSpi0CS0 = 8;
 constexpr uint32_t kSpi0CS1 = 7;
 constexpr uint32_t kSpi0CS[] = {kSpi0CS0, kSpi0CS1};
@@ -264,23 +387,277 @@ constexpr uint32_t SPI_CS_TA = 1 << 7;
 constexpr uint32_t SPI_CS_DONE = 1 << 16;
 constexpr uint32_t SPI_CS_RXD = 1 << 17;
 constexpr uint32_t SPI_CS_TXD = 1 << 18;
+constexpr uint32_t SPI_CS_DMAEN = 1 << 8;
+constexpr uint32_t SPI_CS_ADCS = 1 << 11;
+
+/// Allocates physically contiguous, uncached memory from the
+/// VideoCore using the mailbox property interface, so that it can be
+/// used as the source or destination of DMA transfers.
+class VideoCoreMemory {
+ public:
+  VideoCoreMemory(int mem_fd, size_t size) {
+    mbox_fd_ = ::open("/dev/vcio", 0);
+    ThrowIfErrno(mbox_fd_ < 0, "pi3hat: could not open /dev/vcio");
+
+    size_ = (size + 4095) & ~static_cast<size_t>(4095);
+
+    // The BCM2835 requires the L2 coherent alias to bypass the
+    // cache, later chips use the direct alias.
+    const uint32_t flags =
+        (bcm_host_get_sdram_address() == 0x40000000) ? 0x0c : 0x04;
+    handle_ = Property(kTagAllocate, {
+        static_cast<uint32_t>(size_), 4096, flags});
+    ThrowIf(handle_ == 0, []() {
+      return "pi3hat: could not allocate DMA memory"; });
+
+    bus_address_ = Property(kTagLock, {handle_});
+    if (bus_address_ == 0) {
+      Property(kTagRelease, {handle_});
+      throw Error("pi3hat: could not lock DMA memory");
+    }
+
+    mmap_ = SystemMmap(mem_fd, size_, bus_address_ & ~0xc0000000);
+  }
+
+  ~VideoCoreMemory() {
+    mmap_ = SystemMmap();
+    Property(kTagUnlock, {handle_});
+    Property(kTagRelease, {handle_});
+  }
+
+  VideoCoreMemory(const VideoCoreMemory&) = delete;
+  VideoCoreMemory& operator=(const VideoCoreMemory&) = delete;
+
+  char* ptr() { return static_cast<char*>(mmap_.ptr()); }
+  uint32_t bus_address() const { return bus_address_; }
+
+ private:
+  static constexpr uint32_t kTagAllocate = 0x3000c;
+  static constexpr uint32_t kTagLock = 0x3000d;
+  static constexpr uint32_t kTagUnlock = 0x3000e;
+  static constexpr uint32_t kTagRelease = 0x3000f;
+
+  /// Issue a single tag property request, returning the first word
+  /// of the response, or 0 on failure.
+  uint32_t Property(uint32_t tag, std::initializer_list<uint32_t> args) {
+    uint32_t buf[16] = {};
+    size_t pos = 0;
+    buf[pos++] = 0;  // total size, filled in below
+    buf[pos++] = 0;  // process request
+    buf[pos++] = tag;
+    buf[pos++] = args.size() * 4;  // value buffer size
+    buf[pos++] = args.size() * 4;  // request size
+    for (const auto arg : args) { buf[pos++] = arg; }
+    buf[pos++] = 0;  // end tag
+    buf[0] = pos * 4;
+
+    if (::ioctl(mbox_fd_, _IOWR(100, 0, char*), buf) < 0) { return 0; }
+    return buf[5];
+  }
+
+  SystemFd mbox_fd_;
+  size_t size_ = 0;
+  uint32_t handle_ = 0;
+  uint32_t bus_address_ = 0;
+  SystemMmap mmap_;
+};
+
+constexpr uint32_t DMA_BASE = 0x007000;
+constexpr uint32_t kPeripheralBusBase = 0x7e000000;
+
+constexpr uint32_t DMA_CS_ACTIVE = 1 << 0;
+constexpr uint32_t DMA_CS_END = 1 << 1;
+constexpr uint32_t DMA_CS_WAIT_FOR_WRITES = 1 << 28;
+constexpr uint32_t DMA_CS_RESET = 1u << 31;
+
+constexpr uint32_t DMA_TI_WAIT_RESP = 1 << 3;
+constexpr uint32_t DMA_TI_DEST_INC = 1 << 4;
+constexpr uint32_t DMA_TI_DEST_DREQ = 1 << 6;
+constexpr uint32_t DMA_TI_SRC_INC = 1 << 8;
+constexpr uint32_t DMA_TI_SRC_DREQ = 1 << 10;
+constexpr uint32_t DMA_TI_PERMAP(uint32_t x) { return x << 16; }
+
+constexpr uint32_t kDreqSpiTx = 6;
+constexpr uint32_t kDreqSpiRx = 7;
+
+/// Drives full duplex transfers on the SPI0 FIFO using a pair of
+/// DMA channels, one feeding the TX FIFO and one draining the RX
+/// FIFO.
+class Spi0Dma {
+ public:
+  // The largest data phase which will be sent with DMA.
+  static constexpr size_t kMaxSize = 2048;
+
+  Spi0Dma(int mem_fd, int tx_channel, int rx_channel)
+      : memory_(mem_fd, kTxOffset + 2 * kBufferSize) {
+    ThrowIf(tx_channel < 0 || tx_channel > 10 ||
+            rx_channel < 0 || rx_channel > 10 ||
+            tx_channel == rx_channel,
+            [&]() {
+              return Format("pi3hat: invalid SPI DMA channels %d/%d",
+                            tx_channel, rx_channel);
+            });
+
+    dma_mmap_ = SystemMmap(
+        mem_fd, 4096, bcm_host_get_peripheral_address() + DMA_BASE);
+    tx_ = Channel(tx_channel);
+    rx_ = Channel(rx_channel);
+
+    for (auto* channel : {tx_, rx_}) {
+      channel->cs = DMA_CS_RESET;
+      BusyWaitUs(10);
+      channel->cs = DMA_CS_END;
+    }
+
+    const uint32_t fifo_bus = kPeripheralBusBase + SPI_BASE + 4;
+
+    auto* tx_cb = control_block(kTxCbOffset);
+    *tx_cb = {};
+    tx_cb->ti = (DMA_TI_PERMAP(kDreqSpiTx) | DMA_TI_DEST_DREQ |
+                 DMA_TI_SRC_INC | DMA_TI_WAIT_RESP);
+    tx_cb->source_ad = memory_.bus_address() + kTxOffset;
+    tx_cb->dest_ad = fifo_bus;
+
+    auto* rx_cb = control_block(kRxCbOffset);
+    *rx_cb = {};
+    rx_cb->ti = (DMA_TI_PERMAP(kDreqSpiRx) | DMA_TI_SRC_DREQ |
+                 DMA_TI_DEST_INC | DMA_TI_WAIT_RESP);
+    rx_cb->source_ad = fifo_bus;
+    rx_cb->dest_ad = memory_.bus_address() + kRxOffset;
+  }
+
+  ~Spi0Dma() {
+    for (auto* channel : {tx_, rx_}) {
+      if (channel) { channel->cs = DMA_CS_RESET; }
+    }
+  }
+
+  Spi0Dma(const Spi0Dma&) = delete;
+  Spi0Dma& operator=(const Spi0Dma&) = delete;
+
+  /// Start both channels for a data phase of 'size' bytes.  The SPI
+  /// peripheral must already have DMAEN set and TA clear.  'tx' may
+  /// be nullptr, in which case zeros are sent.
+  void Start(const char* tx, size_t size) {
+    char* const tx_buf = memory_.ptr() + kTxOffset;
+
+    // In DMA mode, the first word written to the FIFO while TA is
+    // clear is loaded into DLEN and the low byte of CS.
+    const uint32_t header = (static_cast<uint32_t>(size) << 16) | SPI_CS_TA;
+    ::memcpy(tx_buf, &header, sizeof(header));
+    if (tx) {
+      ::memcpy(tx_buf + 4, tx, size);
+    } else {
+      ::memset(tx_buf + 4, 0, size);
+    }
+
+    // The FIFO is always accessed a full word at a time.
+    const uint32_t words = (size + 3) / 4;
+    control_block(kTxCbOffset)->txfr_len = 4 + words * 4;
+    control_block(kRxCbOffset)->txfr_len = words * 4;
+
+    __sync_synchronize();
+
+    // The receive side is started first, so that it is ready before
+    // the first byte can possibly arrive.
+    rx_->conblk_ad = memory_.bus_address() + kRxCbOffset;
+    rx_->cs = DMA_CS_ACTIVE | DMA_CS_WAIT_FOR_WRITES;
+
+    tx_->conblk_ad = memory_.bus_address() + kTxCbOffset;
+    tx_->cs = DMA_CS_ACTIVE | DMA_CS_WAIT_FOR_WRITES;
+  }
+
+  /// Wait for the transfer started with Start to finish, and copy
+  /// out the received data if 'rx' is non-null.
+  void Finish(char* rx, size_t size) {
+    const auto start = GetNow();
+    while ((rx_->cs & DMA_CS_ACTIVE) || (tx_->cs & DMA_CS_ACTIVE)) {
+      if ((GetNow() - start) > kTimeoutNs) {
+        rx_->cs = DMA_CS_RESET;
+        tx_->cs = DMA_CS_RESET;
+        throw Error("pi3hat: SPI DMA transfer timed out");
+      }
+    }
+    rx_->cs = DMA_CS_END;
+    tx_->cs = DMA_CS_END;
+
+    __sync_synchronize();
+
+    if (rx) {
+      ::memcpy(rx, memory_.ptr() + kRxOffset, size);
+    }
+  }
+
+ private:
+  struct Bcm2835DmaChannel {
+    uint32_t cs;
+    uint32_t conblk_ad;
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t debug;
+  };
+
+  struct ControlBlock {
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t reserved[2];
+  };
+
+  static constexpr size_t kTxCbOffset = 0;
+  static constexpr size_t kRxCbOffset = 32;
+  static constexpr size_t kBufferSize = kMaxSize + 8;
+  static constexpr size_t kTxOffset = 64;
+  static constexpr size_t kRxOffset = kTxOffset + kBufferSize;
+  static constexpr int64_t kTimeoutNs = 10000000;
+
+  volatile Bcm2835DmaChannel* Channel(int channel) {
+    return reinterpret_cast<volatile Bcm2835DmaChannel*>(
+        static_cast<char*>(dma_mmap_.ptr()) + channel * 0x100);
+  }
+
+  ControlBlock* control_block(size_t offset) {
+    return reinterpret_cast<ControlBlock*>(memory_.ptr() + offset);
+  }
+
+  VideoCoreMemory memory_;
+  SystemMmap dma_mmap_;
+  volatile Bcm2835DmaChannel* tx_ = nullptr;
+  volatile Bcm2835DmaChannel* rx_ = nullptr;
+};
 
 
 /// This class interacts with the SPI0 device on a raspberry pi using
 /// the BCM2835/6/7's registers directly.  The kernel driver must not
 /// be active (it can be loaded, as long as you're not using it), and
 /// this must be run as root or otherwise have access to /dev/mem.
-class PrimarySpi {
+class PrimarySpi : public SpiTransport {
  public:
   struct Options {
     int speed_hz = 10000000;
     int cs_hold_us = 3;
     int address_hold_us = 3;
 
+    // If true, data phases of at least dma_min_size bytes are moved
+    // by the DMA controller rather than by pumping the FIFO.
+    bool dma = false;
+    int dma_tx_channel = 7;
+    int dma_rx_channel = 8;
+    size_t dma_min_size = 16;
+
     Options() {}
   };
 
-  PrimarySpi(const Options& options = Options()) {
+  PrimarySpi(const Options& options = Options())
+      : options_(options),
+        dma_min_size_(options.dma_min_size) {
     fd_ = ::open("/dev/mem", O_RDWR | O_SYNC);
     ThrowIfErrno(fd_ < 0, "pi3hat: could not open /dev/mem");
 
@@ -322,9 +699,18 @@ class PrimarySpi {
                 );
 
     // Configure the SPI peripheral.
-    const int clkdiv =
-        std::max(0, std::min(65535, 400000000 / options.speed_hz));
-    spi_->clk = clkdiv;
+    SpiTiming timing;
+    timing.speed_hz = options.speed_hz;
+    timing.cs_hold_us = options.cs_hold_us;
+    timing.address_hold_us = options.address_hold_us;
+    for (int cs = 0; cs < 2; cs++) { SetTiming(cs, timing); }
+    spi_->clk = clkdiv_[0];
+    current_clkdiv_ = clkdiv_[0];
+
+    if (options.dma) {
+      dma_.reset(new Spi0Dma(
+          fd_, options.dma_tx_channel, options.dma_rx_channel));
+    }
   }
 
   ~PrimarySpi() {}
@@ -336,23 +722,37 @@ class PrimarySpi {
     return gpio_.get();
   }
 
-  void Write(int cs, int address, const char* data, size_t size) {
-    BusyWaitUs(options_.cs_hold_us);
+  void SetTiming(int cs, const SpiTiming& timing) override {
+    timing_[cs] = timing;
+    clkdiv_[cs] = std::max(0, std::min(65535, 400000000 / timing.speed_hz));
+  }
+
+  void Write(int cs, int address, const char* data,
+             size_t size) override {
+    const char header = address & 0xff;
+    WriteHeader(cs, &header, 1, 0, data, size);
+  }
+
+  void WriteHeader(int cs, const char* header, size_t header_size,
+                   int hold_us, const char* data, size_t size) override {
+    const auto& timing = timing_[cs];
+    SetClock(cs);
+    BusyWaitUs(timing.cs_hold_us);
     Rpi3Gpio::ActiveLow cs_holder(gpio_.get(), kSpi0CS[cs]);
-    BusyWaitUs(options_.cs_hold_us);
+    BusyWaitUs(timing.cs_hold_us);
 
     spi_->cs = (spi_->cs | (SPI_CS_TA | (3 << 4)));  // CLEAR
 
-    spi_->fifo = address & 0xff;
-
-    // We are done when we have received one byte back.
-    while ((spi_->cs & SPI_CS_RXD) == 0);
-    (void) spi_->fifo;
+    SendHeader(header, header_size);
 
     if (size != 0) {
       // Wait our address hold time.
-      BusyWaitUs(options_.address_hold_us);
+      BusyWaitUs(timing.address_hold_us + hold_us);
+    }
 
+    if (UseDma(size)) {
+      DmaTransfer(data, nullptr, size);
+    } else if (size != 0) {
       size_t offset = 0;
       while (offset < size) {
         while ((spi_->cs & SPI_CS_TXD) == 0);
@@ -371,23 +771,31 @@ class PrimarySpi {
     spi_->cs = (spi_->cs & (~SPI_CS_TA));
   }
 
-  void Read(int cs, int address, char* data, size_t size) {
-    BusyWaitUs(options_.cs_hold_us);
+  void Read(int cs, int address, char* data, size_t size) override {
+    const char header = address & 0xff;
+    ReadHeader(cs, &header, 1, 0, data, size);
+  }
+
+  void ReadHeader(int cs, const char* header, size_t header_size,
+                  int hold_us, char* data, size_t size) override {
+    const auto& timing = timing_[cs];
+    SetClock(cs);
+    BusyWaitUs(timing.cs_hold_us);
     Rpi3Gpio::ActiveLow cs_holder(gpio_.get(), kSpi0CS[cs]);
-    BusyWaitUs(options_.cs_hold_us);
+    BusyWaitUs(timing.cs_hold_us);
 
     spi_->cs = (spi_->cs | (SPI_CS_TA | (3 << 4)));  // CLEAR
 
-    spi_->fifo = (address & 0x00ff);
-
-    // We are done when we have received one byte back.
-    while ((spi_->cs & SPI_CS_RXD) == 0);
-    (void) spi_->fifo;
+    SendHeader(header, header_size);
 
     if (size != 0) {
       // Wait our address hold time.
-      BusyWaitUs(options_.address_hold_us);
+      BusyWaitUs(timing.address_hold_us + hold_us);
+    }
 
+    if (UseDma(size)) {
+      DmaTransfer(nullptr, data, size);
+    } else if (size != 0) {
       // Now we write out dummy values, reading values in.
       std::size_t remaining_read = size;
       std::size_t remaining_write = remaining_read;
@@ -414,6 +822,43 @@ class PrimarySpi {
   }
 
  private:
+  /// The clock divider is shared by both chip selects, so it is
+  /// changed between transactions as necessary.
+  void SetClock(int cs) {
+    if (clkdiv_[cs] == current_clkdiv_) { return; }
+    spi_->clk = clkdiv_[cs];
+    current_clkdiv_ = clkdiv_[cs];
+  }
+
+  void SendHeader(const char* header, size_t header_size) {
+    for (size_t i = 0; i < header_size; i++) {
+      spi_->fifo = header[i] & 0xff;
+    }
+
+    // We are done when we have received every byte back.
+    for (size_t i = 0; i < header_size; i++) {
+      while ((spi_->cs & SPI_CS_RXD) == 0);
+      (void) spi_->fifo;
+    }
+  }
+
+  bool UseDma(size_t size) const {
+    return dma_ && size >= dma_min_size_ && size <= Spi0Dma::kMaxSize;
+  }
+
+  void DmaTransfer(const char* tx, char* rx, size_t size) {
+    // The data phase is handed to the DMA controller with TA clear,
+    // so that the first word it writes can load DLEN.  ADCS then
+    // clears TA again once DLEN bytes have been exchanged.
+    spi_->cs = ((spi_->cs & ~SPI_CS_TA) |
+                SPI_CS_DMAEN | SPI_CS_ADCS | (3 << 4));  // CLEAR
+
+    dma_->Start(tx, size);
+    dma_->Finish(rx, size);
+
+    spi_->cs = (spi_->cs & ~(SPI_CS_DMAEN | SPI_CS_ADCS));
+  }
+
   // This is the memory layout of the SPI peripheral.
   struct Bcm2835Spi {
     uint32_t cs;
@@ -430,6 +875,12 @@ class PrimarySpi {
   volatile Bcm2835Spi* spi_ = nullptr;
 
   std::unique_ptr<Rpi3Gpio> gpio_;
+  const size_t dma_min_size_;
+  std::unique_ptr<Spi0Dma> dma_;
+
+  SpiTiming timing_[2];
+  uint32_t clkdiv_[2] = {};
+  uint32_t current_clkdiv_ = 0;
 };
 
 constexpr uint32_t AUX_BASE           = 0x00215000;
@@ -451,7 +902,7 @@ constexpr int AUXSPI_STAT_BUSY = 1 << 6;
 /// using the BCM2835/6/7's registers directly.  The kernel driver
 /// must not be active, and this must be run as root or otherwise have
 /// access to /dev/mem.
-class AuxSpi {
+class AuxSpi : public SpiTransport {
  public:
   struct Options {
     int speed_hz = 10000000;
@@ -463,7 +914,7 @@ class AuxSpi {
 
   static constexpr int kPack = 3;
 
-  AuxSpi(const Options& options = Options()) {
+  AuxSpi(const Options& options = Options()) : options_(options) {
     fd_ = ::open("/dev/mem", O_RDWR | O_SYNC);
     ThrowIfErrno(fd_ < 0, "rpi3_aux_spi: could not open /dev/mem");
 
@@ -499,11 +950,15 @@ class AuxSpi {
     spi_->cntl0 = (1 << 9); // clear fifos
 
     // Configure the SPI peripheral.
-    const int clkdiv =
-        std::max(0, std::min(4095, 250000000 / 2 / options.speed_hz - 1));
-    spi_->cntl0 = (
+    SpiTiming timing;
+    timing.speed_hz = options.speed_hz;
+    timing.cs_hold_us = options.cs_hold_us;
+    timing.address_hold_us = options.address_hold_us;
+    for (int cs = 0; cs < 3; cs++) { SetTiming(cs, timing); }
+    current_clkdiv_ = clkdiv_[0];
+
+    cntl0_ = (
         0
-        | (clkdiv << 20)
         | (0 << 17) // chip select defaults
         | (0 << 16) // post-input mode
         | (0 << 15) // variable CS
@@ -517,6 +972,7 @@ class AuxSpi {
         | (1 << 6) // MSB first
         | (0 << 0) // shift length
                    );
+    spi_->cntl0 = cntl0_ | (current_clkdiv_ << 20);
 
     spi_->cntl1 = (
         0
@@ -533,17 +989,27 @@ class AuxSpi {
   AuxSpi(const AuxSpi&) = delete;
   AuxSpi& operator=(const AuxSpi&) = delete;
 
-  void Write(int cs, int address, const char* data, size_t size) {
-    BusyWaitUs(options_.cs_hold_us);
+  void SetTiming(int cs, const SpiTiming& timing) override {
+    timing_[cs] = timing;
+    clkdiv_[cs] = std::max(
+        0, std::min(4095, 250000000 / 2 / timing.speed_hz - 1));
+  }
+
+  void Write(int cs, int address, const char* data,
+             size_t size) override {
+    const char header = address & 0xff;
+    WriteHeader(cs, &header, 1, 0, data, size);
+  }
+
+  void WriteHeader(int cs, const char* header, size_t header_size,
+                   int hold_us, const char* data, size_t size) override {
+    const auto& timing = timing_[cs];
+    SetClock(cs);
+    BusyWaitUs(timing.cs_hold_us);
     Rpi3Gpio::ActiveLow cs_holder(gpio_.get(), kSpi1CS[cs]);
-    BusyWaitUs(options_.cs_hold_us);
+    BusyWaitUs(timing.cs_hold_us);
 
-    const uint32_t value =
-        0
-        | (0 << 29) // CS
-        | (8 << 24) // data width
-        | ((address & 0xff) << 16) // data
-        ;
+    const uint32_t value = HeaderValue(header, header_size);
 
     if (size != 0) {
       spi_->txhold = value;
@@ -556,7 +1022,7 @@ class AuxSpi {
     if (size == 0) { return; }
 
     // Wait our address hold time.
-    BusyWaitUs(options_.address_hold_us);
+    BusyWaitUs(timing.address_hold_us + hold_us);
 
     size_t offset = 0;
     while (offset < size) {
@@ -602,16 +1068,20 @@ class AuxSpi {
     while (spi_->stat & AUXSPI_STAT_BUSY);
   }
 
-  void Read(int cs, int address, char* data, size_t size) {
-    BusyWaitUs(options_.cs_hold_us);
+  void Read(int cs, int address, char* data, size_t size) override {
+    const char header = address & 0xff;
+    ReadHeader(cs, &header, 1, 0, data, size);
+  }
+
+  void ReadHeader(int cs, const char* header, size_t header_size,
+                  int hold_us, char* data, size_t size) override {
+    const auto& timing = timing_[cs];
+    SetClock(cs);
+    BusyWaitUs(timing.cs_hold_us);
     Rpi3Gpio::ActiveLow cs_holder(gpio_.get(), kSpi1CS[cs]);
-    BusyWaitUs(options_.cs_hold_us);
+    BusyWaitUs(timing.cs_hold_us);
 
-    const uint32_t value = 0
-                           | (0 << 29) // CS
-                           | (8 << 24) // data width
-                           | ((address & 0xff) << 16) // data
-                           ;
+    const uint32_t value = HeaderValue(header, header_size);
     if (size != 0) {
       spi_->txhold = value;
     } else {
@@ -623,7 +1093,7 @@ class AuxSpi {
     if (size == 0) { return; }
 
     // Wait our address hold time.
-    BusyWaitUs(options_.address_hold_us);
+    BusyWaitUs(timing.address_hold_us + hold_us);
 
     // Discard the rx fifo.
     while ((spi_->stat & AUXSPI_STAT_RX_EMPTY) == 0) {
@@ -677,6 +1147,29 @@ class AuxSpi {
   }
 
  private:
+  /// The clock divider is shared by all chip selects, so it is
+  /// changed between transactions as necessary.
+  void SetClock(int cs) {
+    if (clkdiv_[cs] == current_clkdiv_) { return; }
+    spi_->cntl0 = cntl0_ | (clkdiv_[cs] << 20);
+    current_clkdiv_ = clkdiv_[cs];
+  }
+
+  /// The whole header fits in a single FIFO entry.
+  static uint32_t HeaderValue(const char* header, size_t header_size) {
+    const size_t size = std::min<size_t>(header_size, kPack);
+    uint32_t data_value = 0;
+    for (size_t i = 0; i < size; i++) {
+      data_value |= static_cast<uint32_t>(header[i] & 0xff) << (16 - 8 * i);
+    }
+    return
+        0
+        | (0 << 29) // CS
+        | ((8 * size) << 24) // data width
+        | data_value // data
+        ;
+  }
+
   // This is the memory layout of the SPI peripheral.
   struct Bcm2835AuxSpi {
     uint32_t cntl0;
@@ -698,6 +1191,226 @@ class AuxSpi {
   volatile Bcm2835AuxSpi* spi_ = nullptr;
 
   std::unique_ptr<Rpi3Gpio> gpio_;
+
+  SpiTiming timing_[3];
+  uint32_t clkdiv_[3] = {};
+  uint32_t current_clkdiv_ = 0;
+
+  // The value of cntl0, less the clock divider.
+  uint32_t cntl0_ = 0;
+};
+
+/// Accesses the pi3hat through the SPI and GPIO peripherals of the
+/// Raspberry Pi.
+class RpiTransport : public Transport {
+ public:
+  RpiTransport(const Pi3Hat::Configuration& configuration)
+      : primary_spi_{[&]() {
+            PrimarySpi::Options options;
+            options.speed_hz = configuration.spi_speed_hz;
+            options.dma = configuration.spi_dma;
+            options.dma_tx_channel = configuration.spi_dma_tx_channel;
+            options.dma_rx_channel = configuration.spi_dma_rx_channel;
+            return options;
+    }()},
+        aux_spi_{[&]() {
+            AuxSpi::Options options;
+            options.speed_hz = configuration.spi_speed_hz;
+            return options;
+          }()} {
+    for (const auto gpio : { kCan1Irq, kCan2Irq, kAuxCanIrq, kImuIrq }) {
+      primary_spi_.gpio()->SetGpioMode(gpio, Rpi3Gpio::INPUT);
+    }
+    primary_spi_.gpio()->SetGpioMode(kDebugGpio, Rpi3Gpio::OUTPUT);
+  }
+
+  SpiTransport* primary_spi() override { return &primary_spi_; }
+  SpiTransport* aux_spi() override { return &aux_spi_; }
+
+  bool GetGpioInput(int gpio) override {
+    return primary_spi_.gpio()->GetGpioInput(gpio);
+  }
+
+  void SetGpioOutput(int gpio, bool value) override {
+    primary_spi_.gpio()->SetGpioOutput(gpio, value);
+  }
+
+ private:
+  PrimarySpi primary_spi_;
+  AuxSpi aux_spi_;
+};
+
+/// Counts the traffic sent to a single chip select.
+struct SpiCounters {
+  uint64_t transactions = 0;
+  uint64_t bytes = 0;
+
+  // Only used with CRCs, see CountingSpi::SetCrc.
+  uint64_t crc_retries = 0;
+  uint64_t crc_failures = 0;
+};
+
+/// CRC-16/CCITT-FALSE, as used by RegisterSPISlave, continuing from
+/// @p crc.
+uint16_t Crc16(uint16_t crc, const char* data, size_t size) {
+  static const std::vector<uint16_t> table = []() {
+    std::vector<uint16_t> result(256);
+    for (int i = 0; i < 256; i++) {
+      uint16_t value = i << 8;
+      for (int bit = 0; bit < 8; bit++) {
+        value = (value & 0x8000) ? ((value << 1) ^ 0x1021) : (value << 1);
+      }
+      result[i] = value;
+    }
+    return result;
+  }();
+
+  for (size_t i = 0; i < size; i++) {
+    crc = (crc << 8) ^ table[((crc >> 8) ^ (data[i] & 0xff)) & 0xff];
+  }
+  return crc;
+}
+
+/// The registers of RegisterSPISlave which read several other
+/// registers in a single transfer.
+constexpr int kBurstListAddress = 126;
+constexpr int kBurstReadAddress = 127;
+
+/// Forwards transactions to a SpiTransport, while counting the
+/// traffic on each chip select.
+class CountingSpi {
+ public:
+  CountingSpi(SpiTransport* spi) : spi_(spi) {}
+
+  const SpiCounters& counters(int cs) const {
+    return counters_[cs];
+  }
+
+  /// If @p retries is non-negative, every transaction from now on
+  /// uses the CRC framing of RegisterSPISlave, and reads are retried
+  /// this many times.
+  void SetCrc(int retries) {
+    crc_retries_ = retries;
+  }
+
+  /// @return the largest transfer which may be made in one go.  Only
+  /// the CRC framing has a limit.
+  size_t max_transfer_size() const {
+    return crc_retries_ < 0 ? std::numeric_limits<size_t>::max() :
+        size_t(kMaxCrcSize);
+  }
+
+  void Write(int cs, int address, const char* data, size_t size) {
+    Count(cs, size);
+    if (address == kBurstListAddress) {
+      // A burst read is only as retriable as the registers it names.
+      burst_consumes_[cs] = false;
+      for (size_t i = 0; i < size; i += 2) {
+        if (ConsumesData(data[i] & 0xff)) { burst_consumes_[cs] = true; }
+      }
+    }
+    if (crc_retries_ < 0) {
+      spi_->Write(cs, address, data, size);
+      return;
+    }
+
+    ThrowIf(size > kMaxCrcSize,
+            [&]() { return Format("SPI write of %d too large for CRC",
+                                  static_cast<int>(size)); });
+    char header[3] = {};
+    MakeHeader(address, size, header);
+    char buf[kMaxCrcSize + 2];
+    ::memcpy(buf, data, size);
+    const uint16_t crc =
+        Crc16(Crc16(kCrcInit, header, sizeof(header)), data, size);
+    buf[size] = crc >> 8;
+    buf[size + 1] = crc & 0xff;
+    spi_->WriteHeader(cs, header, sizeof(header), 0, buf, size + 2);
+
+    // The processor checks the CRC once the transfer is complete,
+    // and must be done before it can be selected again.
+    BusyWaitUs(CrcHoldUs(size));
+  }
+
+  void Read(int cs, int address, char* data, size_t size) {
+    Count(cs, size);
+    if (crc_retries_ < 0) {
+      spi_->Read(cs, address, data, size);
+      return;
+    }
+
+    ThrowIf(size > kMaxCrcSize,
+            [&]() { return Format("SPI read of %d too large for CRC",
+                                  static_cast<int>(size)); });
+    char header[3] = {};
+    MakeHeader(address, size, header);
+    const uint16_t header_crc = Crc16(kCrcInit, header, sizeof(header));
+    char buf[kMaxCrcSize + 2];
+    const bool consumes = ConsumesData(address) ||
+        (address == kBurstReadAddress && burst_consumes_[cs]);
+    const int attempts = consumes ? 1 : (1 + crc_retries_);
+    for (int i = 0; i < attempts; i++) {
+      if (i != 0) { counters_[cs].crc_retries++; }
+      spi_->ReadHeader(cs, header, sizeof(header), CrcHoldUs(size),
+                       buf, size + 2);
+      const uint16_t crc = Crc16(header_crc, buf, size);
+      if ((buf[size] & 0xff) == (crc >> 8) &&
+          (buf[size + 1] & 0xff) == (crc & 0xff)) {
+        ::memcpy(data, buf, size);
+        return;
+      }
+    }
+
+    // Whatever we received can't be trusted.
+    counters_[cs].crc_failures++;
+    ::memset(data, 0, size);
+  }
+
+  void SetTiming(int cs, const SpiTiming& timing) {
+    spi_->SetTiming(cs, timing);
+  }
+
+ private:
+  static constexpr size_t kMaxCrcSize = 1024;
+  static constexpr uint16_t kCrcInit = 0xffff;
+  static constexpr uint8_t kCrcFlag = 0x80;
+
+  /// The processor computes CRCs in software, at up to this rate.
+  static constexpr int kCrcNsPerByte = 50;
+
+  static int CrcHoldUs(size_t size) {
+    return static_cast<int>((size * kCrcNsPerByte + 999) / 1000);
+  }
+
+  static void MakeHeader(int address, size_t size, char* header) {
+    header[0] = (address & 0x7f) | kCrcFlag;
+    header[1] = size & 0xff;
+    header[2] = (size >> 8) & 0xff;
+  }
+
+  /// Reading these registers removes the data read from the
+  /// processor, or marks the IMU sample as read, so they cannot be
+  /// retried.
+  static bool ConsumesData(int address) {
+    return address == 3 || address == 10 || address == 13 ||
+        address == 33 || address == 34 || address == 38 ||
+        address == 53 || address == 81 || address == 98;
+  }
+
+  void Count(int cs, size_t size) {
+    counters_[cs].transactions++;
+    // include the address byte, and any CRC framing
+    counters_[cs].bytes += 1 + size + (crc_retries_ >= 0 ? 4 : 0);
+  }
+
+  SpiTransport* const spi_;
+  SpiCounters counters_[3];
+  int crc_retries_ = -1;
+
+  // True if the burst list last written to each chip select names a
+  // register which consumes data.  The list is assumed to be
+  // unknown, and so consuming, until it has been written.
+  bool burst_consumes_[3] = { true, true, true };
 };
 
 ///////////////////////////////////////////////
@@ -727,7 +1440,25 @@ struct DeviceAttitudeData {
   float uncertainty_bias_x_dps = 0;
   float uncertainty_bias_y_dps = 0;
   float uncertainty_bias_z_dps = 0;
-  uint8_t padding[4] = {};
+  uint32_t error_count = 0;
+  uint32_t last_error = 0;
+  uint32_t update_cycles = 0;
+} __attribute__((packed));
+
+struct DeviceImuSample {
+  uint32_t timestamp_us = 0;
+  float gx_dps = 0;
+  float gy_dps = 0;
+  float gz_dps = 0;
+  float ax_mps2 = 0;
+  float ay_mps2 = 0;
+  float az_mps2 = 0;
+} __attribute__((packed));
+
+struct DeviceImuFifoStatus {
+  uint16_t count = 0;
+  uint16_t contiguous = 0;
+  uint32_t overflow_count = 0;
 } __attribute__((packed));
 
 struct DeviceImuConfiguration {
@@ -735,12 +1466,18 @@ struct DeviceImuConfiguration {
   float pitch_deg = 0;
   float roll_deg = 0;
   uint32_t rate_hz = 0;
+  // Firmware which does not support decimating the attitude filter
+  // only accepts, and reports, the fields before this one.
+  uint32_t filter_rate_hz = 0;
+
+  static constexpr size_t kLegacySize = 16;
 
   bool operator==(const DeviceImuConfiguration& rhs) const {
     return yaw_deg == rhs.yaw_deg &&
         pitch_deg == rhs.pitch_deg &&
         roll_deg == rhs.roll_deg &&
-        rate_hz == rhs.rate_hz;
+        rate_hz == rhs.rate_hz &&
+        filter_rate_hz == rhs.filter_rate_hz;
   }
 
   bool operator!=(const DeviceImuConfiguration& rhs) const {
@@ -757,8 +1494,21 @@ struct DeviceSlotData {
 struct DeviceRfStatus {
   uint32_t bitfield = 0;
   uint32_t lock_age_ms = 0;
+  uint16_t pending_mask = 0;
 } __attribute__((packed));
 
+/// The size of the readiness information which prefixes registers
+/// 96 and 98.
+constexpr size_t kAuxStatusSize = 6;
+
+// The burst list used to read the error status (6) along with the
+// receive status (2) of a CAN processor.
+constexpr uint8_t kCanStatusBurst[] = { 2, 6, 6, 16 };
+
+/// The number of RF slots, and how each is encoded in register 53.
+constexpr int kRfSlots = 15;
+constexpr int kRfBatchSlotSize = sizeof(DeviceSlotData);
+
 struct DeviceDeviceInfo {
   uint8_t git_hash[20] = {};
   uint8_t dirty = 0;
@@ -768,6 +1518,34 @@ struct DeviceDeviceInfo {
 struct DevicePerformance {
   uint32_t cycles_per_ms = 0;
   uint32_t min_cycles_per_ms = 0;
+
+  uint8_t module_count = 0;
+  struct Module {
+    uint32_t average_cycles = 0;
+    uint32_t max_cycles = 0;
+    uint32_t cycles_per_ms = 0;
+  } __attribute__((packed));
+  Module modules[Pi3Hat::PerformanceInfo::kMaxModules];
+} __attribute__((packed));
+
+// These match the order of the Module enumerations in fw/pi3_hat.cc.
+const char* const kCanModuleNames[] = {
+  "bridge.Poll",
+  "spi.PollMillisecond",
+};
+
+const char* const kAuxModuleNames[] = {
+  "bridge.Poll",
+  "imu.Poll",
+  "rf.Poll",
+  "spi.PollMillisecond",
+  "imu.PollMillisecond",
+  "rf.PollMillisecond",
+  "microphone.PollMillisecond",
+};
+
+struct DeviceCrcStatus {
+  uint32_t rejected_count = 0;
 } __attribute__((packed));
 
 template <typename Spi>
@@ -784,76 +1562,255 @@ Pi3Hat::ProcessorInfo GetProcessorInfo(Spi* spi, int cs) {
 }
 
 template <typename Spi>
-Pi3Hat::PerformanceInfo GetPerformance(Spi* spi, int cs) {
+Pi3Hat::PerformanceInfo GetPerformance(Spi* spi, int cs, bool aux) {
+  // Older firmware, which does not measure modules, reads as zero
+  // past the first 8 bytes.
   DevicePerformance dp;
   spi->Read(cs, 100, reinterpret_cast<char*>(&dp), sizeof(dp));
 
   Pi3Hat::PerformanceInfo result;
   result.cycles_per_ms = dp.cycles_per_ms;
   result.min_cycles_per_ms = dp.min_cycles_per_ms;
+
+  const auto* const names = aux ? kAuxModuleNames : kCanModuleNames;
+  const int name_count = aux ?
+      sizeof(kAuxModuleNames) / sizeof(*kAuxModuleNames) :
+      sizeof(kCanModuleNames) / sizeof(*kCanModuleNames);
+  result.module_count = std::min<int>(
+      dp.module_count, int(Pi3Hat::PerformanceInfo::kMaxModules));
+  for (int i = 0; i < result.module_count; i++) {
+    auto& module = result.modules[i];
+    module.name = (i < name_count) ? names[i] : "unknown";
+    module.average_cycles = dp.modules[i].average_cycles;
+    module.max_cycles = dp.modules[i].max_cycles;
+    module.cycles_per_ms = dp.modules[i].cycles_per_ms;
+  }
   return result;
 }
 }
 
 
+int64_t EstimateCanFrameTimeNs(const CanRate& rate,
+                               uint32_t id, size_t size) {
+  const bool extended = id > 0x7ff;
+
+  if (!rate.fdcan_frame) {
+    // SOF through the CRC delimiter, the ACK, EOF, and interframe
+    // space.
+    const int bits = (extended ? 67 : 47) + 8 * std::min<size_t>(size, 8);
+    return static_cast<int64_t>(bits) * 1000000000ll / rate.nominal_bitrate;
+  }
+
+  const size_t data_size = RoundUpDlc(size);
+
+  // SOF through BRS, then ACK through the interframe space.
+  const int nominal_bits = (extended ? 36 : 17) + 12;
+  // ESI, DLC, data, stuff count, CRC and its delimiter.
+  const int data_bits = 1 + 4 + 8 * data_size + 4 +
+                        (data_size > 16 ? 21 : 17) + 1;
+  const int data_bitrate =
+      rate.bitrate_switch ? rate.data_bitrate : rate.nominal_bitrate;
+
+  return static_cast<int64_t>(nominal_bits) * 1000000000ll /
+      rate.nominal_bitrate +
+      static_cast<int64_t>(data_bits) * 1000000000ll / data_bitrate;
+}
+
 class Pi3Hat::Impl {
  public:
   Impl(const Configuration& configuration)
       : config_(configuration),
-        primary_spi_{[&]() {
-            PrimarySpi::Options options;
-            options.speed_hz = configuration.spi_speed_hz;
-            return options;
-    }()},
-        aux_spi_{[&]() {
-            AuxSpi::Options options;
-            options.speed_hz = configuration.spi_speed_hz;
-            return options;
-          }()} {
+        rpi_transport_(configuration.transport ? nullptr :
+                       new RpiTransport(configuration)),
+        transport_(configuration.transport ? configuration.transport :
+                   rpi_transport_.get()),
+        primary_spi_(transport_->primary_spi()),
+        aux_spi_(transport_->aux_spi()) {
+    for (int i = 0; i < 3; i++) {
+      spi_timing_[i] = config_.spi_timing[i];
+      if (spi_timing_[i].speed_hz == 0) {
+        spi_timing_[i].speed_hz = config_.spi_speed_hz;
+      }
+      SetSpiTiming(i, spi_timing_[i]);
+    }
 
-    // Verify the versions of all peripherals we will use.
-    VerifyVersions();
+    if (config_.spi_crc) {
+      primary_spi_.SetCrc(config_.spi_crc_retries);
+      aux_spi_.SetCrc(config_.spi_crc_retries);
+    }
 
-    // See if we need to update the IMU configuration.
-    DeviceImuConfiguration original_imu_configuration;
-    primary_spi_.Read(
-        0, 35,
-        reinterpret_cast<char*>(&original_imu_configuration),
-        sizeof(original_imu_configuration));
+    // The filters are kept, so that they can be restored if a
+    // processor is reset.
+    for (int bus = 1; bus <= 5; bus++) {
+      const auto& filters = configuration.can_filters[bus];
+      can_filter_storage_[bus].assign(filters.filters.begin(),
+                                      filters.filters.end());
+      can_filters_[bus] = filters;
+      can_filters_[bus].filters = {
+        can_filter_storage_[bus].data(), can_filter_storage_[bus].size() };
+    }
 
-    DeviceImuConfiguration desired_imu;
-    desired_imu.yaw_deg = configuration.mounting_deg.yaw;
-    desired_imu.pitch_deg = configuration.mounting_deg.pitch;
-    desired_imu.roll_deg = configuration.mounting_deg.roll;
+    startup_time_.transport_s = (GetNow() - start_ns_) * 1e-9;
+
+    if (config_.fast_start) {
+      // The auxiliary processor is alone on the primary SPI bus, so
+      // it can be brought up while the two CAN processors on the
+      // auxiliary SPI bus are.
+      std::exception_ptr primary_error;
+      std::thread primary_thread([&]() {
+          try {
+            StartProcessor(2);
+          } catch (...) {
+            primary_error = std::current_exception();
+          }
+        });
+      std::exception_ptr aux_error;
+      try {
+        StartProcessor(0);
+        StartProcessor(1);
+      } catch (...) {
+        aux_error = std::current_exception();
+      }
+      primary_thread.join();
+      if (aux_error) { std::rethrow_exception(aux_error); }
+      if (primary_error) { std::rethrow_exception(primary_error); }
+    } else {
+      for (int processor = 0; processor < 3; processor++) {
+        StartProcessor(processor);
+      }
+    }
+
+    if (config_.primary_spi_thread) {
+      primary_worker_.reset(
+          new SpinWorker(
+              config_.primary_spi_thread_cpu,
+              [this]() {
+                PrimaryWork(pending_input_, &pending_output_,
+                            &primary_expected_replies_);
+              }));
+    }
+
+    startup_time_.total_s = (GetNow() - start_ns_) * 1e-9;
+  }
+
+  /// Calibrate, verify, and configure @p processor during
+  /// construction.  This only touches the SPI bus of @p processor,
+  /// and state belonging to it.
+  void StartProcessor(int processor) {
+    const int64_t start = GetNow();
+
+    if (config_.calibrate_spi_timing) {
+      spi_timing_[processor] = CalibrateSpiTiming(processor);
+    }
+
+    // Verify the versions of all peripherals we will use.
+    VerifyVersions(processor);
+
+    ConfigureProcessor(processor);
+
+    startup_time_.processor_s[processor] = (GetNow() - start) * 1e-9;
+  }
+
+  /// Give a configuration change up to @p timeout_us to take effect,
+  /// as checked by @p done.  Only with Configuration::fast_start is
+  /// @p done polled, otherwise the full time is always waited.
+  template <typename Done>
+  bool WaitApplied(int timeout_us, Done done) {
+    if (!config_.fast_start) {
+      ::usleep(timeout_us);
+      return done();
+    }
+
+    constexpr int kPollUs = 100;
+    const int64_t start = GetNow();
+    while (!done()) {
+      if (GetNow() - start > timeout_us * 1000ll) { return false; }
+      ::usleep(kPollUs);
+    }
+    return true;
+  }
+
+  /// Apply everything we configure on @p processor, either at
+  /// construction or after it has been reset.
+  void ConfigureProcessor(int processor) {
+    const int bus_start = processor * 2 + 1;
+    const int bus_end = (processor == 2) ? 5 : (bus_start + 1);
+    for (int bus = bus_start; bus <= bus_end; bus++) {
+      if (can_filters_[bus].enabled) {
+        SetCanFilters(bus, can_filters_[bus]);
+      }
+      for (int slot = 0; slot < kCanTemplatesPerBus; slot++) {
+        const auto& can_template = can_templates_[bus][slot];
+        if (!can_template.valid) { continue; }
+        StoreCanTemplate(bus, slot, &can_template.frame,
+                         can_template.patch_offset, can_template.patch_size);
+      }
+    }
+
+    // The processor's burst list must be written again.
+    burst_list_size_[processor] = 0;
+
+    if (processor != 2) { return; }
+
+    // See if we need to update the IMU configuration.
+    DeviceImuConfiguration original_imu_configuration;
+    primary_spi_.Read(
+        0, 35,
+        reinterpret_cast<char*>(&original_imu_configuration),
+        sizeof(original_imu_configuration));
+
+    DeviceImuConfiguration desired_imu;
+    desired_imu.yaw_deg = config_.mounting_deg.yaw;
+    desired_imu.pitch_deg = config_.mounting_deg.pitch;
+    desired_imu.roll_deg = config_.mounting_deg.roll;
+    const uint32_t attitude_rate_hz =
+        std::min<uint32_t>(2000, config_.attitude_rate_hz);
     desired_imu.rate_hz =
-        std::min<uint32_t>(1000, configuration.attitude_rate_hz);
+        config_.imu_rate_hz == 0 ? attitude_rate_hz :
+        std::min<uint32_t>(2000, config_.imu_rate_hz);
+    desired_imu.filter_rate_hz =
+        attitude_rate_hz < desired_imu.rate_hz ? attitude_rate_hz : 0;
+
+    // Unless decimation was asked for, only the legacy fields are
+    // used, so that older firmware can still be configured.
+    const size_t imu_config_size =
+        desired_imu.filter_rate_hz != 0 ?
+        sizeof(desired_imu) : DeviceImuConfiguration::kLegacySize;
+    if (imu_config_size == DeviceImuConfiguration::kLegacySize) {
+      original_imu_configuration.filter_rate_hz = 0;
+    }
 
     if (desired_imu != original_imu_configuration) {
       primary_spi_.Write(
           0, 36,
           reinterpret_cast<const char*>(&desired_imu),
-          sizeof(desired_imu));
+          imu_config_size);
 
       // Give it some time to work.
-      ::usleep(100);
       DeviceImuConfiguration config_verify;
-      primary_spi_.Read(
-          0, 35,
-          reinterpret_cast<char*>(&config_verify),
-          sizeof(config_verify));
+      const bool applied = WaitApplied(100, [&]() {
+          primary_spi_.Read(
+              0, 35,
+              reinterpret_cast<char*>(&config_verify),
+              imu_config_size);
+          return desired_imu == config_verify;
+        });
       ThrowIf(
-          desired_imu != config_verify,
+          !applied,
           [&]() {
             return Format(
-                "IMU config not set properly (%f,%f,%f) %d != (%f,%f,%f) %d",
+                "IMU config not set properly (%f,%f,%f) %d/%d != "
+                "(%f,%f,%f) %d/%d",
                 desired_imu.yaw_deg,
                 desired_imu.pitch_deg,
                 desired_imu.roll_deg,
                 desired_imu.rate_hz,
+                desired_imu.filter_rate_hz,
                 config_verify.yaw_deg,
                 config_verify.pitch_deg,
                 config_verify.roll_deg,
-                config_verify.rate_hz);
+                config_verify.rate_hz,
+                config_verify.filter_rate_hz);
           });
     }
 
@@ -867,19 +1824,53 @@ class Pi3Hat::Impl {
           0, 50,
           reinterpret_cast<const char*>(&config_.rf_id), sizeof(uint32_t));
       // Changing the ID takes at least a few milliseconds.
-      ::usleep(10000);
       uint32_t id_verify = 0;
-      primary_spi_.Read(
-          0, 49,
-          reinterpret_cast<char*>(&id_verify), sizeof(id_verify));
+      const bool applied = WaitApplied(10000, [&]() {
+          primary_spi_.Read(
+              0, 49,
+              reinterpret_cast<char*>(&id_verify), sizeof(id_verify));
+          return config_.rf_id == id_verify;
+        });
       ThrowIf(
-          config_.rf_id != id_verify,
+          !applied,
           [&]() {
             return Format("RF Id not set properly (%08x != %08x)",
                           config_.rf_id,
                           id_verify);
           });
     }
+
+    if (config_.microphone_rate_hz >= 0) {
+      ConfigureMicrophone(config_.microphone_rate_hz);
+    }
+  }
+
+  void ResetProcessor(int processor) {
+    ThrowIf(processor < 0 || processor > 2,
+            [&]() { return Format("Invalid processor %d", processor); });
+    ThrowIf(submitted_, []() {
+        return "ResetProcessor called with a cycle outstanding";
+      });
+
+    constexpr int kCanVersion = 0x04;
+    constexpr int64_t kResetTimeoutNs = 2000000000;
+
+    CountingSpi* spi = nullptr;
+    const int cs = ProcessorSpi(processor, &spi);
+    const char magic[4] = { 'R', 'S', 'E', 'T' };
+    spi->Write(cs, 99, magic, sizeof(magic));
+
+    const int64_t start = GetNow();
+    do {
+      ::usleep(10000);
+      ThrowIf(GetNow() - start > kResetTimeoutNs, [&]() {
+          return Format("Processor %d did not respond after reset",
+                        processor);
+        });
+    } while (ReadByte(spi, cs, 0) != kCanVersion);
+
+    ConfigureProcessor(processor);
+    silent_[processor] = {};
   }
 
   template <typename Spi>
@@ -891,7 +1882,7 @@ class Pi3Hat::Impl {
 
   template <typename Spi>
   void TestCan(Spi* spi, int cs, const char* name) {
-    constexpr int kCanVersion = 0x02;
+    constexpr int kCanVersion = 0x04;
 
     const auto version = ReadByte(spi, cs, 0);
     if (version != kCanVersion) {
@@ -902,13 +1893,150 @@ class Pi3Hat::Impl {
     }
   }
 
-  void VerifyVersions() {
-    constexpr int kAttitudeVersion = 0x20;
-    constexpr int kRfVersion = 0x10;
+  /// @return the chip select of @p processor, indexed as in
+  /// Output::timing.spi, and store its bus into @p spi.
+  int ProcessorSpi(int processor, CountingSpi** spi) {
+    *spi = (processor == 2) ? &primary_spi_ : &aux_spi_;
+    return (processor == 2) ? 0 : processor;
+  }
+
+  void SetSpiTiming(int processor, const SpiTiming& timing) {
+    CountingSpi* spi = nullptr;
+    const int cs = ProcessorSpi(processor, &spi);
+    spi->SetTiming(cs, timing);
+  }
+
+  /// @return true if every one of @p count attempts to read the
+  /// version and device information of @p processor with @p timing
+  /// gives the expected result.
+  bool SpiTimingReliable(int processor, const SpiTiming& timing,
+                         const DeviceDeviceInfo& expected, int count) {
+    constexpr int kCanVersion = 0x04;
+
+    CountingSpi* spi = nullptr;
+    const int cs = ProcessorSpi(processor, &spi);
+    spi->SetTiming(cs, timing);
+
+    // With CRCs, a retry is as much a sign of trouble as a bad value.
+    const SpiCounters start = spi->counters(cs);
+    for (int i = 0; i < count; i++) {
+      if (ReadByte(spi, cs, 0) != kCanVersion) { return false; }
+      DeviceDeviceInfo di;
+      spi->Read(cs, 97, reinterpret_cast<char*>(&di), sizeof(di));
+      if (::memcmp(&di, &expected, sizeof(di)) != 0) { return false; }
+    }
+    const SpiCounters& end = spi->counters(cs);
+    return end.crc_retries == start.crc_retries &&
+        end.crc_failures == start.crc_failures;
+  }
+
+  /// The estimated time taken by a typical transaction, of an
+  /// address and 16 bytes of data.
+  static int64_t SpiTransactionNs(const SpiTiming& timing) {
+    return (2 * timing.cs_hold_us + timing.address_hold_us) * 1000ll +
+        17ll * 8 * 1000000000ll / timing.speed_hz;
+  }
+
+  /// Find the fastest timing which reads @p processor reliably,
+  /// starting from the one currently configured, and use it.
+  SpiTiming CalibrateSpiTiming(int processor) {
+    // Each candidate is tried this many times, and the final choice
+    // many more.
+    constexpr int kTrialCount = 32;
+    constexpr int kConfirmCount = 512;
+
+    const SpiTiming safe = spi_timing_[processor];
+
+    // The data phase is checked against the device information as
+    // read with the configured timing.
+    CountingSpi* spi = nullptr;
+    const int cs = ProcessorSpi(processor, &spi);
+    DeviceDeviceInfo expected;
+    spi->Read(cs, 97, reinterpret_cast<char*>(&expected), sizeof(expected));
+    if (!SpiTimingReliable(processor, safe, expected, kTrialCount)) {
+      // The version check will report this shortly.
+      SetSpiTiming(processor, safe);
+      return safe;
+    }
+
+    SpiTiming best = safe;
+    for (const double scale : { 1.0, 1.25, 1.5, 2.0, 2.5, 3.0, 4.0 }) {
+      SpiTiming candidate = safe;
+      candidate.speed_hz = static_cast<int>(safe.speed_hz * scale);
+      if (candidate.speed_hz > config_.calibrate_max_speed_hz) { break; }
+      if (!SpiTimingReliable(processor, candidate, expected, kTrialCount)) {
+        break;
+      }
+
+      // Then shorten the chip select hold for as long as it keeps
+      // working.  The address hold is left alone: registers 0 and 97
+      // are ready almost at once, while others, such as a full
+      // receive drain, a burst, or a CRC read, take far longer
+      // before their data can be clocked out.
+      while (candidate.cs_hold_us > 0) {
+        candidate.cs_hold_us--;
+        if (!SpiTimingReliable(
+                processor, candidate, expected, kTrialCount)) {
+          candidate.cs_hold_us++;
+          break;
+        }
+      }
+
+      if (SpiTransactionNs(candidate) < SpiTransactionNs(best)) {
+        best = candidate;
+      }
+    }
+
+    // Give the shortened hold a microsecond of margin, which costs
+    // little compared with what was saved.
+    best.cs_hold_us = std::min(safe.cs_hold_us, best.cs_hold_us + 1);
+
+    if (!SpiTimingReliable(processor, best, expected, kConfirmCount)) {
+      best = safe;
+    }
+    SetSpiTiming(processor, best);
+    return best;
+  }
+
+  SpiTiming spi_timing(int processor) {
+    ThrowIf(processor < 0 || processor > 2,
+            [&]() { return Format("Invalid processor %d", processor); });
+    return spi_timing_[processor];
+  }
+
+  StartupTime startup_time() const { return startup_time_; }
+
+  SpiCrcStatus spi_crc_status() {
+    SpiCrcStatus result;
+    for (int i = 0; i < 3; i++) {
+      CountingSpi* spi = nullptr;
+      const int cs = ProcessorSpi(i, &spi);
+      result.retries[i] = spi->counters(cs).crc_retries;
+      result.failures[i] = spi->counters(cs).crc_failures;
+      if (config_.spi_crc) {
+        DeviceCrcStatus status;
+        spi->Read(cs, 101, reinterpret_cast<char*>(&status), sizeof(status));
+        result.rejected_writes[i] = status.rejected_count;
+      }
+    }
+    return result;
+  }
+
+  void VerifyVersions(int processor) {
+    constexpr int kAttitudeVersion = 0x21;
+    constexpr int kRfVersion = 0x11;
+    constexpr int kMicrophoneVersion = 0x22;
+
+    if (processor == 0) {
+      TestCan(&aux_spi_, 0, "can1");
+      return;
+    }
+    if (processor == 1) {
+      TestCan(&aux_spi_, 1, "can2");
+      return;
+    }
 
     TestCan(&primary_spi_, 0, "aux");
-    TestCan(&aux_spi_, 0, "can1");
-    TestCan(&aux_spi_, 1, "can2");
 
     const auto attitude_version = ReadByte(&primary_spi_, 0, 32);
     if (attitude_version != kAttitudeVersion) {
@@ -926,6 +2054,14 @@ class Pi3Hat::Impl {
               "Incorrect RF version %d != %d",
               rf_version, kRfVersion));
     }
+
+    const auto microphone_version = ReadByte(&primary_spi_, 0, 80);
+    if (microphone_version != kMicrophoneVersion) {
+      throw std::runtime_error(
+          Format(
+              "Incorrect microphone version %d != %d",
+              microphone_version, kMicrophoneVersion));
+    }
   }
 
   DeviceInfo device_info() {
@@ -940,9 +2076,9 @@ class Pi3Hat::Impl {
   DevicePerformance device_performance() {
     DevicePerformance result;
     // Now get the device information from all three processors.
-    result.can1 = GetPerformance(&aux_spi_, 0);
-    result.can2 = GetPerformance(&aux_spi_, 1);
-    result.aux = GetPerformance(&primary_spi_, 0);
+    result.can1 = GetPerformance(&aux_spi_, 0, false);
+    result.can2 = GetPerformance(&aux_spi_, 1, false);
+    result.aux = GetPerformance(&primary_spi_, 0, true);
     return result;
   }
 
@@ -956,27 +2092,49 @@ class Pi3Hat::Impl {
     }
   }
 
-  bool GetAttitude(Attitude* output, bool wait, bool detail) {
+  /// The number of bytes of register 34 which are read.
+  static size_t AttitudeSize(bool detail) {
+    return detail ? sizeof(DeviceAttitudeData) : 42;
+  }
+
+  bool GetAttitude(Attitude* output, bool wait, bool detail, bool irq) {
     device_attitude_ = {};
 
-    // Busy loop until we get something.
-    if (wait) {
-      char buf[2] = {};
-      do {
-        primary_spi_.Read(0, 96, buf, sizeof(buf));
-        if (buf[1] == 1) { break; }
-        // If we spam the STM32 too hard, then it doesn't have any
-        // cycles left to actually work on the IMU.
-        BusyWaitUs(20);
-      } while (true);
+    if (wait && irq) {
+      // The IMU raises its IRQ line when a new sample is available,
+      // so we can wait on that without any SPI traffic at all.  Should
+      // it never be raised, the polling below takes over.
+      constexpr int64_t kIrqTimeoutPeriods = 3;
+      const uint32_t rate_hz = std::max<uint32_t>(
+          1, config_.imu_rate_hz ? config_.imu_rate_hz :
+          config_.attitude_rate_hz);
+      const int64_t timeout_ns =
+          kIrqTimeoutPeriods * 1000000000ll / rate_hz;
+      const int64_t start = GetNow();
+      while (!transport_->GetGpioInput(kImuIrq) &&
+             (GetNow() - start) < timeout_ns);
     }
 
+    // Register 98 returns the same readiness information as register
+    // 96, followed by the attitude, so that each attempt only costs a
+    // single transfer.
+    char buf[kAuxStatusSize + sizeof(device_attitude_)];
+    const size_t attitude_size = AttitudeSize(detail);
     do {
-      primary_spi_.Read(
-          0, 34,
-          reinterpret_cast<char*>(&device_attitude_),
-          detail ? sizeof(device_attitude_) : 42);
-    } while (wait && ((device_attitude_.present & 0x01) == 0));
+      if (status_burst_.attitude) {
+        // The first attempt was already made by ReadStatusBurst.
+        ::memcpy(buf, status_burst_.attitude_buf, sizeof(buf));
+        status_burst_.attitude = false;
+      } else {
+        primary_spi_.Read(0, 98, buf, kAuxStatusSize + attitude_size);
+      }
+      ::memcpy(&device_attitude_, &buf[kAuxStatusSize], attitude_size);
+      if ((device_attitude_.present & 0x01) != 0) { break; }
+
+      // If we spam the STM32 too hard, then it doesn't have any
+      // cycles left to actually work on the IMU.
+      if (wait) { BusyWaitUs(20); }
+    } while (wait);
 
     if ((device_attitude_.present & 0x01) == 0) {
       return false;
@@ -999,6 +2157,7 @@ class Pi3Hat::Impl {
       da.uncertainty_bias_y_dps,
       da.uncertainty_bias_z_dps,
     };
+    o.update_cycles = da.update_cycles;
 
     return true;
   }
@@ -1068,16 +2227,297 @@ class Pi3Hat::Impl {
     }
   }
 
+  template <typename Spi>
+  void WriteCanFilters(Spi& spi, int cs, int cpu_bus,
+                       const CanFilterConfiguration& config) {
+    using Action = CanFilter::Action;
+    using Mode = CanFilter::Mode;
+
+    constexpr size_t kFilterSize = 9;
+    char buf[1 + kMaxCanFilters * kFilterSize] = {};
+    buf[0] = (cpu_bus ? 0x80 : 0x00) |
+        ((config.standard_default == Action::kReject) ? 0x02 : 0x00) |
+        ((config.extended_default == Action::kReject) ? 0x01 : 0x00);
+
+    size_t size = 1;
+    for (const auto& filter : config.filters) {
+      char* const data = &buf[size];
+      data[0] =
+          ((filter.action == Action::kAccept) ? 0x01 : 0x02) |
+          ((filter.mode == Mode::kRange ? 0 :
+            filter.mode == Mode::kDual ? 1 : 2) << 2) |
+          (filter.extended ? 0x10 : 0x00);
+      for (int i = 0; i < 4; i++) {
+        data[1 + i] = (filter.id1 >> (24 - 8 * i)) & 0xff;
+        data[5 + i] = (filter.id2 >> (24 - 8 * i)) & 0xff;
+      }
+      size += kFilterSize;
+    }
+
+    spi.Write(cs, 11, buf, size);
+  }
+
+  void SetCanFilters(int bus, const CanFilterConfiguration& config) {
+    int standard_count = 0;
+    int extended_count = 0;
+    for (const auto& filter : config.filters) {
+      (filter.extended ? extended_count : standard_count)++;
+    }
+    ThrowIf(
+        standard_count > kMaxStandardCanFilters ||
+        extended_count > kMaxExtendedCanFilters,
+        [&]() {
+          return Format("Too many CAN filters for bus %d (%d standard, "
+                        "%d extended)", bus, standard_count, extended_count);
+        });
+
+    switch (bus) {
+      case 1: {
+        WriteCanFilters(aux_spi_, 0, 0, config);
+        break;
+      }
+      case 2: {
+        WriteCanFilters(aux_spi_, 0, 1, config);
+        break;
+      }
+      case 3: {
+        WriteCanFilters(aux_spi_, 1, 0, config);
+        break;
+      }
+      case 4: {
+        WriteCanFilters(aux_spi_, 1, 1, config);
+        break;
+      }
+      case 5: {
+        WriteCanFilters(primary_spi_, 0, 0, config);
+        break;
+      }
+    }
+  }
+
   struct ExpectedReply {
     std::array<int, 6> count = { {} };
+
+    // The source IDs which replies are expected from, using the
+    // moteus convention that the destination of a frame is in its
+    // low 7 bits.
+    std::array<std::bitset<128>, 6> ids;
+
+    void Add(const CanFrame& frame) {
+      count[frame.bus]++;
+      ids[frame.bus].set(frame.id & 0x7f);
+    }
+  };
+
+  /// Encode a single frame in the format accepted by the multiple
+  /// frame transmit register, 7.
+  ///
+  /// @return the number of bytes used
+  static size_t EncodeBatchFrame(char* buf, int cpu_bus,
+                                 const CanFrame& can_frame) {
+    const auto size = RoundUpDlc(can_frame.size);
+    const bool long_id = can_frame.id > 0xffff;
+
+    buf[0] = ((cpu_bus == 1) ? 0x80 : 0x00) | (long_id ? 0x40 : 0x00);
+    buf[1] = size;
+
+    size_t offset = 2;
+    if (long_id) {
+      buf[offset++] = (can_frame.id >> 24) & 0xff;
+      buf[offset++] = (can_frame.id >> 16) & 0xff;
+    }
+    buf[offset++] = (can_frame.id >> 8) & 0xff;
+    buf[offset++] = (can_frame.id >> 0) & 0xff;
+
+    ::memcpy(&buf[offset], can_frame.data, can_frame.size);
+    for (std::size_t i = can_frame.size; i < size; i++) {
+      buf[offset + i] = 0x50;
+    }
+    return offset + size;
+  }
+
+  /// Send all the frames destined for one processor in as few SPI
+  /// transactions as possible, alternating between its two buses.
+  template <typename Spi>
+  void SendCanBatch(Spi& spi, int cs, int bus_start, const Input& input) {
+    constexpr size_t kMaxFrameSize = 6 + 64;
+
+    const auto& first = can_packets_[bus_start];
+    const auto& second = can_packets_[bus_start + 1];
+
+    // When scheduling, the busier of the two buses gets the first
+    // frame.
+    const int first_cpu_bus =
+        (input.schedule_can &&
+         can_bus_ns_[bus_start + 1] > can_bus_ns_[bus_start]) ? 1 : 0;
+
+    size_t batch_size = 0;
+    size_t first_offset = 0;
+    size_t second_offset = 0;
+    while (first_offset < first.size() || second_offset < second.size()) {
+      for (int i = 0; i < 2; i++) {
+        const int cpu_bus = i ^ first_cpu_bus;
+        const auto& packets = (cpu_bus == 0) ? first : second;
+        auto& offset = (cpu_bus == 0) ? first_offset : second_offset;
+        if (offset >= packets.size()) { continue; }
+
+        if (batch_size + kMaxFrameSize > sizeof(can_batch_buf_)) {
+          spi.Write(cs, 7, can_batch_buf_, batch_size);
+          batch_size = 0;
+        }
+
+        batch_size += EncodeBatchFrame(
+            &can_batch_buf_[batch_size], cpu_bus,
+            input.tx_can[packets[offset]]);
+        offset++;
+      }
+    }
+
+    if (batch_size) {
+      spi.Write(cs, 7, can_batch_buf_, batch_size);
+    }
+  }
+
+  struct CanTemplate {
+    bool valid = false;
+    CanFrame frame;
+    int patch_offset = 0;
+    int patch_size = 0;
   };
 
-  ExpectedReply SendCan(const Input& input) {
+  template <typename Spi>
+  void WriteCanTemplate(Spi& spi, int cs, int cpu_bus, int slot,
+                        const CanFrame* frame,
+                        int patch_offset, int patch_size) {
+    char buf[3 + 6 + 64] = {};
+    buf[0] = cpu_bus * kCanTemplatesPerBus + slot;
+    if (frame == nullptr) {
+      spi.Write(cs, 8, buf, 1);
+      return;
+    }
+
+    buf[1] = patch_offset;
+    buf[2] = patch_size;
+    const auto size = EncodeBatchFrame(&buf[3], cpu_bus, *frame);
+    spi.Write(cs, 8, buf, 3 + size);
+  }
+
+  void StoreCanTemplate(int bus, int slot, const CanFrame* frame,
+                        int patch_offset, int patch_size) {
+    switch (bus) {
+      case 1: {
+        WriteCanTemplate(aux_spi_, 0, 0, slot, frame, patch_offset, patch_size);
+        break;
+      }
+      case 2: {
+        WriteCanTemplate(aux_spi_, 0, 1, slot, frame, patch_offset, patch_size);
+        break;
+      }
+      case 3: {
+        WriteCanTemplate(aux_spi_, 1, 0, slot, frame, patch_offset, patch_size);
+        break;
+      }
+      case 4: {
+        WriteCanTemplate(aux_spi_, 1, 1, slot, frame, patch_offset, patch_size);
+        break;
+      }
+      case 5: {
+        WriteCanTemplate(primary_spi_, 0, 0, slot, frame,
+                         patch_offset, patch_size);
+        break;
+      }
+    }
+  }
+
+  void SetCanTemplate(int slot, const CanFrame& frame,
+                      int patch_offset, int patch_size) {
+    ThrowIf(
+        frame.bus < 1 || frame.bus > 5 ||
+        slot < 0 || slot >= kCanTemplatesPerBus,
+        [&]() {
+          return Format("Invalid CAN template bus=%d slot=%d",
+                        frame.bus, slot);
+        });
+    ThrowIf(
+        patch_size < 0 || patch_offset < 0 ||
+        patch_size > static_cast<int>(sizeof(CanTemplateTrigger::patch)) ||
+        (patch_offset + patch_size) > static_cast<int>(RoundUpDlc(frame.size)),
+        [&]() {
+          return Format("Invalid CAN template patch offset=%d size=%d",
+                        patch_offset, patch_size);
+        });
+
+    StoreCanTemplate(frame.bus, slot, &frame, patch_offset, patch_size);
+
+    auto& can_template = can_templates_[frame.bus][slot];
+    can_template.valid = true;
+    can_template.frame = frame;
+    can_template.patch_offset = patch_offset;
+    can_template.patch_size = patch_size;
+  }
+
+  void ClearCanTemplate(int bus, int slot) {
+    if (bus < 1 || bus > 5 || slot < 0 || slot >= kCanTemplatesPerBus) {
+      return;
+    }
+
+    StoreCanTemplate(bus, slot, nullptr, 0, 0);
+    can_templates_[bus][slot] = {};
+  }
+
+  /// Send all the requested templates for one processor in a single
+  /// SPI transaction.
+  template <typename Spi>
+  void SendCanTemplates(Spi& spi, int cs, int bus_start, const Input& input,
+                        char* batch_buf, ExpectedReply* expected_replies) {
+    constexpr int kProcessorTemplates = 2 * kCanTemplatesPerBus;
+    const CanTemplateTrigger* triggers[kProcessorTemplates] = {};
+
+    bool any_trigger = false;
+    for (const auto& trigger : input.tx_can_template) {
+      if (trigger.bus != bus_start && trigger.bus != (bus_start + 1)) {
+        continue;
+      }
+      if (trigger.slot < 0 || trigger.slot >= kCanTemplatesPerBus) {
+        continue;
+      }
+      triggers[(trigger.bus - bus_start) * kCanTemplatesPerBus +
+               trigger.slot] = &trigger;
+      any_trigger = true;
+    }
+
+    if (!any_trigger) { return; }
+
+    uint16_t mask = 0;
+    size_t size = 2;
+    for (int i = 0; i < kProcessorTemplates; i++) {
+      if (triggers[i] == nullptr) { continue; }
+
+      const auto bus = triggers[i]->bus;
+      const auto& can_template = can_templates_[bus][i % kCanTemplatesPerBus];
+      if (!can_template.valid) { continue; }
+
+      mask |= (1 << i);
+      ::memcpy(&batch_buf[size], triggers[i]->patch,
+               can_template.patch_size);
+      size += can_template.patch_size;
+
+      if (can_template.frame.expect_reply) {
+        expected_replies->Add(can_template.frame);
+      }
+    }
+
+    if (mask == 0) { return; }
+
+    batch_buf[0] = mask & 0xff;
+    batch_buf[1] = (mask >> 8) & 0xff;
+    spi.Write(cs, 9, batch_buf, size);
+  }
+
+  /// Sort the CAN frames to be sent by bus.
+  ExpectedReply PrepareCan(const Input& input) {
     ExpectedReply result;
 
-    // We try to send packets on alternating buses if possible, so we
-    // can reduce the average latency before the first data goes out
-    // on any bus.  Always send data on the low speed bus out last.
     for (auto& bus_packets : can_packets_) {
       bus_packets.resize(0);
     }
@@ -1085,16 +2525,92 @@ class Pi3Hat::Impl {
       const auto bus = input.tx_can[i].bus;
       can_packets_[bus].push_back(i);
       if (input.tx_can[i].expect_reply) {
-        result.count[bus]++;
+        result.Add(input.tx_can[i]);
+      }
+    }
+
+    if (input.schedule_can || input.auto_timeout) {
+      EstimateCanBusTime(input);
+    }
+
+    return result;
+  }
+
+  /// Fill in can_bus_ns_ with how long each bus is expected to be
+  /// occupied by this cycle's frames and their replies.
+  void EstimateCanBusTime(const Input& input) {
+    auto add = [&](const CanFrame& frame) {
+      if (frame.bus < 1 || frame.bus > 5) { return; }
+      const auto time_ns = EstimateCanFrameTimeNs(
+          config_.can_rate[frame.bus], frame.id, frame.size);
+      can_bus_ns_[frame.bus] += frame.expect_reply ? 2 * time_ns : time_ns;
+    };
+
+    for (auto& value : can_bus_ns_) { value = 0; }
+    for (const auto& frame : input.tx_can) {
+      add(frame);
+    }
+    for (const auto& trigger : input.tx_can_template) {
+      if (trigger.bus < 1 || trigger.bus > 5 ||
+          trigger.slot < 0 || trigger.slot >= kCanTemplatesPerBus) {
+        continue;
       }
+      const auto& can_template = can_templates_[trigger.bus][trigger.slot];
+      if (can_template.valid) { add(can_template.frame); }
+    }
+  }
+
+  /// @return true if the JC5 frames should be sent before any others.
+  bool PrimaryCanFirst(const Input& input) const {
+    if (!input.schedule_can) { return false; }
+    return can_bus_ns_[5] > *std::max_element(&can_bus_ns_[1],
+                                              &can_bus_ns_[5]);
+  }
+
+  /// Send all frames destined for the processors on the auxiliary SPI
+  /// bus, JC1 through JC4.
+  void SendCanAux(const Input& input, ExpectedReply* expected_replies) {
+    // We try to send packets on alternating buses if possible, so we
+    // can reduce the average latency before the first data goes out
+    // on any bus.
+
+    // When a processor has more than one frame to send, they all go
+    // in a single SPI transaction.
+    const bool batch[] = {
+      (can_packets_[1].size() + can_packets_[2].size()) > 1,
+      (can_packets_[3].size() + can_packets_[4].size()) > 1,
+    };
+
+    // When scheduling, the processor whose busiest bus has the most
+    // to do goes first.
+    const bool can2_first =
+        input.schedule_can &&
+        std::max(can_bus_ns_[3], can_bus_ns_[4]) >
+        std::max(can_bus_ns_[1], can_bus_ns_[2]);
+    for (const int cs : { can2_first ? 1 : 0, can2_first ? 0 : 1 }) {
+      const int bus_start = 1 + 2 * cs;
+      if (batch[cs]) { SendCanBatch(aux_spi_, cs, bus_start, input); }
+      SendCanTemplates(aux_spi_, cs, bus_start, input,
+                       can_batch_buf_, expected_replies);
+    }
+
+    // We try to send out packets to buses in this order to minimize
+    // latency.
+    int bus_order[] = { 1, 3, 2, 4 };
+    if (input.schedule_can) {
+      std::stable_sort(
+          std::begin(bus_order), std::end(bus_order),
+          [&](int lhs, int rhs) {
+            return can_bus_ns_[lhs] > can_bus_ns_[rhs];
+          });
     }
 
     int bus_offset[5] = {};
     while (true) {
-      // We try to send out packets to buses in this order to minimize
-      // latency.
       bool any_sent = false;
-      for (const int bus : { 1, 3, 2, 4 }) {
+      for (const int bus : bus_order) {
+        if (batch[(bus - 1) / 2]) { continue; }
+
         auto& offset = bus_offset[bus];
         if (offset >= static_cast<int>(can_packets_[bus].size())) {
           continue;
@@ -1108,13 +2624,275 @@ class Pi3Hat::Impl {
 
       if (!any_sent) { break; }
     }
+  }
 
-    // Now send out all the low speed packets.
+  /// Send all frames destined for the low speed bus, JC5.
+  void SendCanPrimary(const Input& input, ExpectedReply* expected_replies) {
     for (const auto index : can_packets_[5]) {
       SendCanPacket(input.tx_can[index]);
     }
+    SendCanTemplates(primary_spi_, 0, 5, input,
+                     primary_can_batch_buf_, expected_replies);
+  }
 
-    return result;
+  /// Do everything which uses the primary SPI bus, save for receiving
+  /// CAN frames.
+  void PrimaryWork(const Input& input, Output* output,
+                   ExpectedReply* expected_replies, bool send_can = true) {
+    auto& timing = output->timing;
+
+    // Unless scheduled otherwise, data on the low speed bus goes out
+    // last.
+    if (send_can) {
+      SendCanPrimary(input, expected_replies);
+      Stamp(input, &timing.send_can_end_ns);
+    }
+
+    // While those are sending, do our other work.
+    if (input.tx_rf.size()) {
+      Stamp(input, &timing.send_rf_start_ns);
+      SendRf(input.tx_rf);
+      Stamp(input, &timing.send_rf_end_ns);
+    }
+
+    ReadStatusBurst(input);
+
+    if (input.request_rf) {
+      Stamp(input, &timing.read_rf_start_ns);
+      ReadRf(input, output);
+      Stamp(input, &timing.read_rf_end_ns);
+    }
+
+    if (!input.rx_imu_samples.empty()) {
+      ReadImuSamples(input, output);
+    }
+
+    if (!input.rx_microphone.empty()) {
+      ReadMicrophone(input, output);
+    }
+
+    if (input.request_attitude) {
+      Stamp(input, &timing.attitude_start_ns);
+      output->attitude_present =
+          GetAttitude(input.attitude, input.wait_for_attitude,
+                      input.request_attitude_detail,
+                      input.wait_for_attitude_irq);
+      Stamp(input, &timing.attitude_end_ns);
+    }
+  }
+
+  /// Record the time since Submit began, if timing was requested.
+  void Stamp(const Input& input, int64_t* value) {
+    if (!input.request_timing) { return; }
+    *value = GetNow() - submit_start_ns_;
+  }
+
+  struct DeviceMicrophoneStatus {
+    uint16_t available = 0;
+    uint16_t rate_hz = 0;
+    uint16_t overrun_count = 0;
+  } __attribute__((packed));
+
+  /// Status registers which have already been read this cycle.  Each
+  /// is only valid while its flag is set, and the flag is cleared
+  /// once it has been used.
+  struct StatusBurst {
+    bool rf = false;
+    DeviceRfStatus rf_status;
+
+    bool imu = false;
+    DeviceImuFifoStatus imu_status;
+
+    bool microphone = false;
+    DeviceMicrophoneStatus microphone_status;
+
+    // The contents of register 98.
+    bool attitude = false;
+    char attitude_buf[kAuxStatusSize + sizeof(DeviceAttitudeData)] = {};
+
+    // Register 6, which is stored into can_status_buf_.
+    bool can_status = false;
+  };
+
+  /// If more than one status register of the auxiliary processor is
+  /// needed this cycle, read them all in a single burst transfer,
+  /// rather than each with a chip select of its own.
+  void ReadStatusBurst(const Input& input) {
+    auto& burst = status_burst_;
+    burst.rf = input.request_rf;
+    burst.imu = !input.rx_imu_samples.empty();
+    burst.microphone = !input.rx_microphone.empty();
+    // When waiting, attitude may take many attempts, which are best
+    // made on their own.
+    burst.attitude = input.request_attitude && !input.wait_for_attitude;
+    burst.can_status = input.request_can_status;
+
+    const int count = burst.rf + burst.imu + burst.microphone +
+        burst.attitude + burst.can_status;
+    if (count < 2) {
+      burst.rf = burst.imu = burst.microphone = burst.attitude = false;
+      burst.can_status = false;
+      return;
+    }
+
+    uint8_t list[sizeof(burst_list_[2])] = {};
+    size_t list_size = 0;
+    size_t data_size = 0;
+    auto add = [&](bool enabled, int address, size_t size) {
+      if (!enabled) { return; }
+      list[list_size++] = address;
+      list[list_size++] = size;
+      data_size += size;
+    };
+    add(burst.rf, 52, sizeof(DeviceRfStatus));
+    add(burst.imu, 37, sizeof(DeviceImuFifoStatus));
+    add(burst.microphone, 82, sizeof(DeviceMicrophoneStatus));
+    add(burst.attitude, 98,
+        kAuxStatusSize + AttitudeSize(input.request_attitude_detail));
+    add(burst.can_status, 6, sizeof(can_status_buf_[2]));
+
+    SetBurstList(2, list, list_size);
+
+    char buf[sizeof(DeviceRfStatus) +
+             sizeof(DeviceImuFifoStatus) +
+             sizeof(DeviceMicrophoneStatus) +
+             sizeof(burst.attitude_buf) +
+             sizeof(can_status_buf_[2])] = {};
+    primary_spi_.Read(0, kBurstReadAddress, buf, data_size);
+
+    size_t offset = 0;
+    auto take = [&](bool enabled, void* dest, size_t size) {
+      if (!enabled) { return; }
+      ::memcpy(dest, &buf[offset], size);
+      offset += size;
+    };
+    take(burst.rf, &burst.rf_status, sizeof(burst.rf_status));
+    take(burst.imu, &burst.imu_status, sizeof(burst.imu_status));
+    take(burst.microphone, &burst.microphone_status,
+         sizeof(burst.microphone_status));
+    take(burst.attitude, burst.attitude_buf,
+         kAuxStatusSize + AttitudeSize(input.request_attitude_detail));
+    take(burst.can_status, can_status_buf_[2], sizeof(can_status_buf_[2]));
+    can_status_read_[2] = burst.can_status;
+  }
+
+  /// Make @p list the burst list of @p processor.  It is only sent
+  /// when it changes.
+  void SetBurstList(int processor, const uint8_t* list, size_t size) {
+    if (size == burst_list_size_[processor] &&
+        ::memcmp(list, burst_list_[processor], size) == 0) {
+      return;
+    }
+    CountingSpi* spi = nullptr;
+    const int cs = ProcessorSpi(processor, &spi);
+    spi->Write(cs, kBurstListAddress,
+               reinterpret_cast<const char*>(list), size);
+    ::memcpy(burst_list_[processor], list, size);
+    burst_list_size_[processor] = size;
+  }
+
+  void ConfigureMicrophone(int rate_hz) {
+    ThrowIf(
+        rate_hz != 0 && (rate_hz < 200 || rate_hz > 48000),
+        [&]() {
+          return Format("Invalid microphone rate %d", rate_hz);
+        });
+
+    DeviceMicrophoneStatus status;
+    primary_spi_.Read(
+        0, 82, reinterpret_cast<char*>(&status), sizeof(status));
+    if (status.rate_hz == rate_hz) { return; }
+
+    const char buf[2] = {
+      static_cast<char>(rate_hz & 0xff),
+      static_cast<char>((rate_hz >> 8) & 0xff),
+    };
+    primary_spi_.Write(0, 83, buf, sizeof(buf));
+
+    // The new rate is applied within a millisecond.
+    const bool applied = WaitApplied(2000, [&]() {
+        primary_spi_.Read(
+            0, 82, reinterpret_cast<char*>(&status), sizeof(status));
+        return status.rate_hz == rate_hz;
+      });
+    ThrowIf(
+        !applied,
+        [&]() {
+          return Format("Microphone rate not set properly (%d != %d)",
+                        status.rate_hz, rate_hz);
+        });
+  }
+
+  void ReadMicrophone(const Input& input, Output* output) {
+    DeviceMicrophoneStatus status;
+    if (status_burst_.microphone) {
+      status = status_burst_.microphone_status;
+      status_burst_.microphone = false;
+    } else {
+      primary_spi_.Read(
+          0, 82, reinterpret_cast<char*>(&status), sizeof(status));
+    }
+    output->microphone_overrun_count = status.overrun_count;
+
+    // The device stages only as many samples as we ask for, so that
+    // any more are left for the next cycle.
+    const size_t to_read = std::min<size_t>(
+        std::min<size_t>(input.rx_microphone.size(), status.available),
+        std::min<size_t>(sizeof(microphone_buf_),
+                         primary_spi_.max_transfer_size()) - 4);
+    if (to_read == 0) { return; }
+
+    const char request[2] = {
+      static_cast<char>(to_read & 0xff),
+      static_cast<char>((to_read >> 8) & 0xff),
+    };
+    primary_spi_.Write(0, 84, request, sizeof(request));
+    primary_spi_.Read(
+        0, 81, reinterpret_cast<char*>(&microphone_buf_[0]), 4 + to_read);
+    const size_t count = std::min<size_t>(
+        to_read, microphone_buf_[0] | (microphone_buf_[1] << 8));
+    output->microphone_overrun_count =
+        microphone_buf_[2] | (microphone_buf_[3] << 8);
+    ::memcpy(input.rx_microphone.data(), &microphone_buf_[4], count);
+    output->rx_microphone_size = count;
+  }
+
+  void ReadImuSamples(const Input& input, Output* output) {
+    // The FIFO may wrap, in which case it takes two reads to empty.
+    for (int i = 0; i < 2; i++) {
+      DeviceImuFifoStatus status;
+      if (status_burst_.imu) {
+        status = status_burst_.imu_status;
+        status_burst_.imu = false;
+      } else {
+        primary_spi_.Read(
+            0, 37, reinterpret_cast<char*>(&status), sizeof(status));
+      }
+      output->imu_sample_overflow_count = status.overflow_count;
+
+      const size_t room =
+          input.rx_imu_samples.size() - output->rx_imu_sample_size;
+      const size_t to_read = std::min<size_t>(
+          std::min<size_t>(room, status.contiguous),
+          std::min<size_t>(
+              size_t(kMaxImuSamples),
+              primary_spi_.max_transfer_size() / sizeof(DeviceImuSample)));
+      if (to_read == 0) { return; }
+
+      primary_spi_.Read(
+          0, 38, reinterpret_cast<char*>(&imu_sample_buf_[0]),
+          to_read * sizeof(DeviceImuSample));
+
+      for (size_t j = 0; j < to_read; j++) {
+        const auto& ds = imu_sample_buf_[j];
+        auto& sample = input.rx_imu_samples[output->rx_imu_sample_size++];
+        sample.timestamp_us = ds.timestamp_us;
+        sample.rate_dps = { ds.gx_dps, ds.gy_dps, ds.gz_dps };
+        sample.accel_mps2 = { ds.ax_mps2, ds.ay_mps2, ds.az_mps2 };
+      }
+
+      if (status.count <= to_read) { return; }
+    }
   }
 
   void SendRf(const Span<RfSlot>& slots) {
@@ -1122,6 +2900,11 @@ class Pi3Hat::Impl {
     constexpr int kMaxDataSize = 16;
     uint8_t buf[kHeaderSize + kMaxDataSize] = {};
 
+    if (slots.size() > 1) {
+      SendRfBatch(slots);
+      return;
+    }
+
     for (size_t i = 0; i < slots.size(); i++) {
       const auto& slot = slots[i];
       buf[0] = slot.slot;
@@ -1137,88 +2920,243 @@ class Pi3Hat::Impl {
     }
   }
 
+  /// Send several slots in a single transaction to register 54.
+  void SendRfBatch(const Span<RfSlot>& slots) {
+    constexpr int kHeaderSize = 6;
+    constexpr int kMaxDataSize = 16;
+    uint8_t buf[kRfSlots * (kHeaderSize + kMaxDataSize)];
+
+    size_t size = 0;
+    for (size_t i = 0; i < slots.size(); i++) {
+      const auto& slot = slots[i];
+      const size_t data_size = std::min<size_t>(slot.size, kMaxDataSize);
+      if (size + kHeaderSize + data_size > sizeof(buf)) {
+        primary_spi_.Write(0, 54, reinterpret_cast<const char*>(&buf[0]), size);
+        size = 0;
+      }
+
+      uint8_t* const entry = &buf[size];
+      entry[0] = slot.slot;
+      entry[1] = (slot.priority >> 0) & 0xff;
+      entry[2] = (slot.priority >> 8) & 0xff;
+      entry[3] = (slot.priority >> 16) & 0xff;
+      entry[4] = (slot.priority >> 24) & 0xff;
+      entry[5] = data_size;
+      ::memcpy(&entry[kHeaderSize], slot.data, data_size);
+      size += kHeaderSize + data_size;
+    }
+
+    if (size) {
+      primary_spi_.Write(0, 54, reinterpret_cast<const char*>(&buf[0]), size);
+    }
+  }
+
   void ReadRf(const Input& input, Output* output) {
     DeviceRfStatus rf_status;
-    primary_spi_.Read(
-        0, 52, reinterpret_cast<char*>(&rf_status), sizeof(rf_status));
+    if (status_burst_.rf) {
+      rf_status = status_burst_.rf_status;
+      status_burst_.rf = false;
+    } else {
+      primary_spi_.Read(
+          0, 52, reinterpret_cast<char*>(&rf_status), sizeof(rf_status));
+    }
 
     output->rf_lock_age_ms = rf_status.lock_age_ms;
 
-    const auto bitfield_delta = rf_status.bitfield ^ last_bitfield_;
-    if (bitfield_delta == 0) { return; }
+    if (rf_status.pending_mask == 0) { return; }
 
-    DeviceSlotData slot_data;
+    // Every changed slot is read in one transfer.  Any we don't have
+    // room for remain pending on the device for the next cycle.
+    int pending = 0;
+    for (int i = 0; i < kRfSlots; i++) {
+      if (rf_status.pending_mask & (1 << i)) { pending++; }
+    }
+    const int to_read = std::min<int>(
+        pending, input.rx_rf.size() - output->rx_rf_size);
+    if (to_read <= 0) { return; }
 
-    for (int i = 0; i < 15; i++) {
-      if (output->rx_rf_size >= input.rx_rf.size()) {
-        // No more room.
-        return;
-      }
+    primary_spi_.Read(
+        0, 53, reinterpret_cast<char*>(&rf_batch_buf_[0]),
+        2 + to_read * kRfBatchSlotSize);
 
-      if ((bitfield_delta & (3 << (i * 2))) == 0) {
-        continue;
-      }
+    // More slots may have changed since register 52 was read, so we
+    // use the mask reported here.
+    const uint16_t mask = rf_batch_buf_[0] | (rf_batch_buf_[1] << 8);
+    int index = 0;
+    for (int i = 0; i < kRfSlots && index < to_read; i++) {
+      if ((mask & (1 << i)) == 0) { continue; }
 
-      last_bitfield_ ^= (bitfield_delta & (3 << (i * 2)));
+      DeviceSlotData slot_data;
+      ::memcpy(&slot_data, &rf_batch_buf_[2 + index * kRfBatchSlotSize],
+               sizeof(slot_data));
+      index++;
 
-      primary_spi_.Read(
-          0, 64 + i, reinterpret_cast<char*>(&slot_data), sizeof(slot_data));
       auto& output_slot = input.rx_rf[output->rx_rf_size++];
       output_slot.slot = i;
       output_slot.age_ms = slot_data.age_ms;
-      output_slot.size = slot_data.size;
-      ::memcpy(output_slot.data, slot_data.data, slot_data.size);
+      output_slot.size = std::min<uint8_t>(slot_data.size, 16);
+      ::memcpy(output_slot.data, slot_data.data, output_slot.size);
+    }
+  }
+
+  /// Relates a processor's microsecond clock to our own, as of one
+  /// read of register 13.
+  struct DeviceClock {
+    uint32_t device_us = 0;
+    int64_t host_ns = 0;
+  };
+
+  /// Parse as many frames in the register 3 format as are present in
+  /// 'data', storing them into the output.  If 'clock' is non-null,
+  /// then each frame instead has the 4 byte timestamp of register 13
+  /// following its header.
+  ///
+  /// @return the number of frames found
+  int ParseCanFrames(const uint8_t* data, size_t size, int bus_start,
+                     const Span<CanFrame>* rx_can, Output* output,
+                     const DeviceClock* clock = nullptr) {
+    const size_t header_size = clock ? 9 : 5;
+    int count = 0;
+    size_t offset = 0;
+    while (offset + header_size <= size) {
+      const uint8_t* const buf = &data[offset];
+      if (buf[0] == 0) {
+        // Hmmm, this shouldn't happen, but indicates there isn't
+        // really a frame here.
+        break;
+      }
+
+      const size_t payload_size = (buf[0] & 0x7f) - 1;
+      if (payload_size > 64 || offset + header_size + payload_size > size) {
+        // This is malformed or truncated.
+        break;
+      }
+
+      if (output->rx_can_size >= rx_can->size()) { break; }
+
+      auto& output_frame = (*rx_can)[output->rx_can_size++];
+      count++;
+
+      output_frame.bus = bus_start + ((buf[0] & 0x80) ? 1 : 0);
+      output_frame.id = (buf[1] << 24) |
+                        (buf[2] << 16) |
+                        (buf[3] << 8) |
+                        (buf[4] << 0);
+      output_frame.size = payload_size;
+      ::memcpy(output_frame.data, &buf[header_size], payload_size);
+
+      output_frame.timestamp_us = 0;
+      if (clock) {
+        const uint32_t received_us = (buf[5] << 24) |
+                                     (buf[6] << 16) |
+                                     (buf[7] << 8) |
+                                     (buf[8] << 0);
+        // The processor's clock wraps, but no frame stays queued
+        // anywhere near that long.
+        const uint32_t age_us = clock->device_us - received_us;
+        const int64_t received_ns =
+            clock->host_ns - static_cast<int64_t>(age_us) * 1000 -
+            submit_start_ns_;
+        output_frame.timestamp_us =
+            std::max<int64_t>(0, received_ns / 1000);
+      }
+
+      offset += header_size + payload_size;
     }
+
+    return count;
   }
 
+  /// If @p can_status is non-null, then register 6 is read into it
+  /// along with the first read of register 2, using a burst.  The
+  /// processor's burst list must already be kCanStatusBurst.
   template <typename Spi>
   int ReadCanFrames(Spi& spi, int cs, int bus_start,
-                    const Span<CanFrame>* rx_can, Output* output) {
+                    const Span<CanFrame>* rx_can, Output* output,
+                    bool timestamp, uint8_t* can_status = nullptr) {
     // Is there any room?
     if (output->rx_can_size >= rx_can->size()) { return 0; }
 
     int count = 0;
 
     // Purposefully not initialized for speed.
-    uint8_t buf[70];
+    uint8_t buf[5 + 6 * 74];
 
     while (true) {
       // Read until no more frames are available or until the output
       // buffer is full.
       uint8_t queue_sizes[6] = {};
-      spi.Read(cs, 2,
-               reinterpret_cast<char*>(&queue_sizes[0]), sizeof(queue_sizes));
-
-      bool any_read = false;
+      if (can_status) {
+        uint8_t burst[sizeof(queue_sizes) + 16] = {};
+        spi.Read(cs, kBurstReadAddress,
+                 reinterpret_cast<char*>(&burst[0]), sizeof(burst));
+        ::memcpy(queue_sizes, burst, sizeof(queue_sizes));
+        ::memcpy(can_status, &burst[sizeof(queue_sizes)], 16);
+        can_status = nullptr;
+      } else {
+        spi.Read(cs, 2,
+                 reinterpret_cast<char*>(&queue_sizes[0]),
+                 sizeof(queue_sizes));
+      }
 
-      // Read all we can until our buffer is full.
+      int frames = 0;
+      size_t total_size = 0;
+      int last_size = 0;
       for (int size : queue_sizes) {
         if (size == 0) { continue; }
         if (size > (64 + 5)) {
           // This is malformed.  Lets just set it to the maximum size for now.
           size = 64 + 5;
         }
+        frames++;
+        total_size += size;
+        last_size = size;
+      }
 
-        spi.Read(cs, 3, reinterpret_cast<char*>(&buf[0]), size);
-
-        if (buf[0] == 0) {
-          // Hmmm, this shouldn't happen, but indicates there isn't
-          // really a frame here.
-          continue;
+      // Register 2 only reports the first 6 frames of the queue.  If
+      // it was full, there may be more waiting.
+      bool more = (static_cast<size_t>(frames) == sizeof(queue_sizes));
+
+      const size_t room = rx_can->size() - output->rx_can_size;
+      if (frames > 1 && static_cast<size_t>(frames) > room) {
+        // We can't accept all of these, so only read as many as we
+        // have room for one at a time.
+        for (int size : queue_sizes) {
+          if (size == 0) { continue; }
+          if (output->rx_can_size >= rx_can->size()) { break; }
+          size = std::min(size, 64 + 5);
+          spi.Read(cs, 3, reinterpret_cast<char*>(&buf[0]), size);
+          count += ParseCanFrames(buf, size, bus_start, rx_can, output);
         }
-
-        auto& output_frame = (*rx_can)[output->rx_can_size++];
-        count++;
-
-        output_frame.bus = bus_start + ((buf[0] & 0x80) ? 1 : 0);
-        output_frame.id = (buf[1] << 24) |
+      } else if (timestamp && frames > 0) {
+        // Register 13 has the same frames as register 10, with 4
+        // bytes of time prepended to the whole and added to each.
+        // Only the frames we read are consumed, and the leading count
+        // tells us if any remain.
+        DeviceClock clock;
+        clock.host_ns = GetNow();
+        const size_t read_size = 5 + total_size + 4 * frames;
+        spi.Read(cs, 13, reinterpret_cast<char*>(&buf[0]), read_size);
+        clock.device_us = (buf[1] << 24) |
                           (buf[2] << 16) |
                           (buf[3] << 8) |
                           (buf[4] << 0);
-        output_frame.size = size - 5;
-        ::memcpy(output_frame.data, &buf[5], size - 5);
+        count += ParseCanFrames(&buf[5], read_size - 5, bus_start, rx_can,
+                                output, &clock);
+        more = buf[0] > frames;
+      } else if (frames == 1) {
+        spi.Read(cs, 3, reinterpret_cast<char*>(&buf[0]), last_size);
+        count += ParseCanFrames(buf, last_size, bus_start, rx_can, output);
+      } else if (frames > 1) {
+        // Read everything that was reported in one go.
+        spi.Read(cs, 10, reinterpret_cast<char*>(&buf[0]), 1 + total_size);
+        count += ParseCanFrames(&buf[1], total_size, bus_start, rx_can,
+                                output);
+        more = buf[0] > frames;
       }
 
+      const bool any_read = more && output->rx_can_size < rx_can->size();
+
       if (!any_read) {
         break;
       }
@@ -1227,119 +3165,519 @@ class Pi3Hat::Impl {
     return count;
   }
 
-  void ReadCan(const Input& input, const ExpectedReply& expected_replies,
-               Output* output) {
-    int bus_replies[] = {
-      expected_replies.count[1] + expected_replies.count[2],
-      expected_replies.count[3] + expected_replies.count[4],
-      expected_replies.count[5],
-    };
+  /// The state of an in-progress wait for CAN replies.
+  struct ReadState {
+    int bus_replies[3] = {};
+    bool to_check[3] = {};
+
+    // Indexed by processor.  'expected' is set if replies were
+    // expected, and 'ignored' if they are not being waited for
+    // because it is silent.
+    bool expected[3] = {};
+    bool ignored[3] = {};
+    int received[3] = {};
+
+    int64_t start_now = 0;
+
+    // Either Input::timeout_ns, or the automatically derived one.
+    int64_t timeout_ns = 0;
+
+    // The time of the last frame which extends the wait by
+    // rx_extra_wait_ns.
+    int64_t last_reply = 0;
+
+    // When matching reply IDs, these are the sources we have yet to
+    // hear from, indexed by bus.
+    bool match_ids = false;
+    bool any_expected = false;
+    std::bitset<128> pending_ids[6];
+
+    // Only used for Output::timing, these are 0 if not applicable.
+    int64_t first_reply = 0;
+    int64_t last_frame = 0;
+    int64_t timeout = 0;
+  };
 
-    const bool to_check[] = {
-      bus_replies[0] || input.force_can_check & 0x06,
-      bus_replies[1] || input.force_can_check & 0x18,
-      bus_replies[2] || input.force_can_check & 0x20,
-    };
+  void StartReadCan(const Input& input, const ExpectedReply& expected_replies,
+                    ReadState* state) {
+    state->bus_replies[0] =
+        expected_replies.count[1] + expected_replies.count[2];
+    state->bus_replies[1] =
+        expected_replies.count[3] + expected_replies.count[4];
+    state->bus_replies[2] = expected_replies.count[5];
+
+    state->match_ids = input.match_reply_ids;
+    for (int bus = 0; bus < 6; bus++) {
+      state->pending_ids[bus] =
+          state->match_ids ? expected_replies.ids[bus] : std::bitset<128>();
+    }
+    if (state->match_ids) {
+      // Multiple requests to the same ID only result in a single
+      // reply being waited for.
+      const auto& ids = state->pending_ids;
+      state->bus_replies[0] = ids[1].count() + ids[2].count();
+      state->bus_replies[1] = ids[3].count() + ids[4].count();
+      state->bus_replies[2] = ids[5].count();
+    }
+    // A silent processor is still read from, but not waited for,
+    // except when its backoff has expired.
+    for (int i = 0; i < 3; i++) {
+      state->expected[i] = state->bus_replies[i] > 0;
+      state->ignored[i] = false;
+      state->received[i] = 0;
+
+      auto& silent = silent_[i];
+      if (!state->expected[i] || !silent.silent) { continue; }
+      if (silent.remaining == 0) { continue; }
+
+      silent.remaining--;
+      state->ignored[i] = true;
+      state->bus_replies[i] = 0;
+      const int bus_end = (i == 2) ? 5 : (i * 2 + 2);
+      for (int bus = i * 2 + 1; bus <= bus_end; bus++) {
+        state->pending_ids[bus].reset();
+      }
+    }
 
-    const auto start_now = GetNow();
-    int64_t last_reply = start_now;
+    state->any_expected = (state->bus_replies[0] > 0 ||
+                           state->bus_replies[1] > 0 ||
+                           state->bus_replies[2] > 0);
 
-    while (true) {
-      bool any_found = false;
-      // Then check for CAN responses as necessary.
-      if (to_check[0]) {
-        const int count = ReadCanFrames(aux_spi_, 0, 1, &input.rx_can, output);
-        bus_replies[0] -= count;
-        if (count) {
-          last_reply = GetNow();
-          any_found = true;
-        }
-      }
-      if (to_check[1]) {
-        const int count = ReadCanFrames(aux_spi_, 1, 3, &input.rx_can, output);
-        bus_replies[1] -= count;
-        if (count) {
-          last_reply = GetNow();
-          any_found = true;
-        }
+    state->to_check[0] =
+        state->expected[0] || input.force_can_check & 0x06;
+    state->to_check[1] =
+        state->expected[1] || input.force_can_check & 0x18;
+    state->to_check[2] =
+        state->expected[2] || input.force_can_check & 0x20;
+
+    state->timeout_ns = ReadTimeoutNs(input);
+
+    state->start_now = GetNow();
+    state->last_reply = state->start_now;
+    state->first_reply = 0;
+    state->last_frame = 0;
+    state->timeout = 0;
+  }
+
+  /// @return how long to wait for CAN replies once all have been sent
+  int64_t ReadTimeoutNs(const Input& input) const {
+    if (input.auto_timeout) {
+      return
+          *std::max_element(std::begin(can_bus_ns_), std::end(can_bus_ns_)) +
+          input.auto_timeout_margin_ns;
+    }
+    return input.timeout_ns;
+  }
+
+  template <typename Spi>
+  void WriteCanAggregation(Spi& spi, int cs, int count, int timeout_us) {
+    if (count == 0) { return; }
+
+    const char buf[3] = {
+      static_cast<char>(std::min(count, 255)),
+      static_cast<char>(timeout_us & 0xff),
+      static_cast<char>((timeout_us >> 8) & 0xff),
+    };
+    spi.Write(cs, 12, buf, sizeof(buf));
+  }
+
+  /// Tell each processor how many replies to wait for before
+  /// asserting its IRQ line.  This must happen before any frames are
+  /// sent.
+  void StartCanAggregation(const Input& input,
+                           const ExpectedReply& tx_replies) {
+    ExpectedReply expected = tx_replies;
+    for (const auto& trigger : input.tx_can_template) {
+      if (trigger.bus < 1 || trigger.bus > 5 ||
+          trigger.slot < 0 || trigger.slot >= kCanTemplatesPerBus) {
+        continue;
       }
-      if (to_check[2]) {
-        const int count = ReadCanFrames(primary_spi_, 0, 5, &input.rx_can, output);
-        bus_replies[2] -= count;
-        if (count) {
-          last_reply = GetNow();
-          any_found = true;
-        }
+      const auto& can_template = can_templates_[trigger.bus][trigger.slot];
+      if (can_template.valid && can_template.frame.expect_reply) {
+        expected.Add(can_template.frame);
       }
+    }
 
-      if (output->rx_can_size >= input.rx_can.size()) {
-        // Our buffer is full, so no more frames could have been
-        // returned.
-        return;
-      }
+    auto count = [&](int bus) {
+      return input.match_reply_ids ?
+          static_cast<int>(expected.ids[bus].count()) : expected.count[bus];
+    };
 
-      const auto cur_now = GetNow();
-      const auto delta_ns = cur_now - start_now;
-      const auto since_last_ns = cur_now - last_reply;
+    // The processor starts timing now, rather than after all frames
+    // are sent, so it must wait at least as long as we will.
+    const int timeout_us = static_cast<int>(std::min<int64_t>(
+        65535,
+        (ReadTimeoutNs(input) + input.min_tx_wait_ns +
+         input.rx_extra_wait_ns) / 1000 + 1));
 
-      if (bus_replies[0] <= 0 &&
-          bus_replies[1] <= 0 &&
-          bus_replies[2] <= 0 &&
-          delta_ns > input.min_tx_wait_ns &&
-          since_last_ns > input.rx_extra_wait_ns) {
-        // We've read all the replies we are expecting and have polled
-        // everything at least once if requested.
-        return;
-      }
+    WriteCanAggregation(aux_spi_, 0, count(1) + count(2), timeout_us);
+    WriteCanAggregation(aux_spi_, 1, count(3) + count(4), timeout_us);
+    WriteCanAggregation(primary_spi_, 0, count(5), timeout_us);
+  }
 
-      if (delta_ns > input.timeout_ns && !
-          (delta_ns < input.min_tx_wait_ns ||
-           since_last_ns < input.rx_extra_wait_ns)) {
-        // The timeout has expired.
-        return;
-      }
+  /// Read any frames available from one processor, and account for
+  /// them against the replies we are waiting for.
+  template <typename Spi>
+  void ReadCanProcessor(Spi& spi, int cs, int bus_start, int index,
+                        const Input& input, ReadState* state,
+                        Output* output, bool* any_found) {
+    const size_t old_size = output->rx_can_size;
+
+    // The first poll of a processor whose status is wanted reads it
+    // in the same transfer.
+    uint8_t* can_status = nullptr;
+    if (input.request_can_status && !can_status_read_[index] &&
+        old_size < input.rx_can.size()) {
+      SetBurstList(index, kCanStatusBurst, sizeof(kCanStatusBurst));
+      can_status = can_status_buf_[index];
+      can_status_read_[index] = true;
+    }
+
+    const int count = ReadCanFrames(spi, cs, bus_start, &input.rx_can, output,
+                                    input.timestamp_can_rx, can_status);
+    if (count == 0) { return; }
+
+    *any_found = true;
+    state->received[index] += count;
+
+    const auto now = GetNow();
+    state->last_frame = now;
+    if (state->first_reply == 0) {
+      state->first_reply = now;
+    }
+
+    if (!state->match_ids) {
+      state->bus_replies[index] -= count;
+      state->last_reply = now;
+      return;
+    }
 
-      if (!any_found) {
-        // Give the controllers a chance to rest.
-        BusyWaitUs(20);
+    bool unmatched = false;
+    for (size_t i = old_size; i < output->rx_can_size; i++) {
+      const auto& frame = input.rx_can[i];
+      auto& pending = state->pending_ids[frame.bus];
+      const int source = (frame.id >> 8) & 0x7f;
+      if (pending.test(source)) {
+        pending.reset(source);
+        state->bus_replies[index]--;
+      } else {
+        unmatched = true;
       }
     }
+
+    // Only traffic we weren't waiting for suggests that more may be
+    // on the way.
+    if (unmatched) {
+      state->last_reply = now;
+    }
   }
 
-  Output Cycle(const Input& input) {
-    // Send off all our CAN data to all buses.
-    auto expected_replies = SendCan(input);
+  /// Check each processor for CAN replies one time.
+  ///
+  /// @return true if no more waiting is necessary
+  bool ReadCanStep(const Input& input, ReadState* state, Output* output,
+                   bool* any_found) {
+    auto& bus_replies = state->bus_replies;
+    const auto& to_check = state->to_check;
 
-    Output result;
+    auto irq_pending = [&](uint32_t irq_gpio) {
+      return !input.wait_for_can_irq || transport_->GetGpioInput(irq_gpio);
+    };
 
-    // While those are sending, do our other work.
-    if (input.tx_rf.size()) {
-      SendRf(input.tx_rf);
+    *any_found = false;
+    // Then check for CAN responses as necessary.
+    if (to_check[0] && irq_pending(kCan1Irq)) {
+      ReadCanProcessor(aux_spi_, 0, 1, 0, input, state, output, any_found);
+    }
+    if (to_check[1] && irq_pending(kCan2Irq)) {
+      ReadCanProcessor(aux_spi_, 1, 3, 1, input, state, output, any_found);
+    }
+    if (to_check[2] && irq_pending(kAuxCanIrq)) {
+      ReadCanProcessor(primary_spi_, 0, 5, 2, input, state, output, any_found);
     }
 
-    if (input.request_rf) {
-      ReadRf(input, &result);
+    if (output->rx_can_size >= input.rx_can.size()) {
+      // Our buffer is full, so no more frames could have been
+      // returned.
+      return true;
     }
 
-    if (input.request_attitude) {
-      result.attitude_present =
-          GetAttitude(input.attitude, input.wait_for_attitude,
-                      input.request_attitude_detail);
+    const auto cur_now = GetNow();
+    const auto delta_ns = cur_now - state->start_now;
+    const auto since_last_ns = cur_now - state->last_reply;
+
+    const bool all_replied =
+        bus_replies[0] <= 0 && bus_replies[1] <= 0 && bus_replies[2] <= 0;
+    if (state->match_ids && state->any_expected && all_replied) {
+      // Every reply we asked for has arrived, so there is no reason
+      // to wait any longer.
+      return true;
+    }
+
+    if (bus_replies[0] <= 0 &&
+        bus_replies[1] <= 0 &&
+        bus_replies[2] <= 0 &&
+        delta_ns > input.min_tx_wait_ns &&
+        since_last_ns > input.rx_extra_wait_ns) {
+      // We've read all the replies we are expecting and have polled
+      // everything at least once if requested.
+      return true;
+    }
+
+    if (delta_ns > state->timeout_ns && !
+        (delta_ns < input.min_tx_wait_ns ||
+         since_last_ns < input.rx_extra_wait_ns)) {
+      // The timeout has expired.
+      state->timeout = cur_now;
+      return true;
+    }
+
+    return false;
+  }
+
+  void Submit(const Input& input) {
+    ThrowIf(submitted_, []() {
+        return "Submit called with a cycle already outstanding";
+      });
+
+    submitted_ = true;
+    complete_ = false;
+    pending_input_ = input;
+    pending_output_ = {};
+    next_poll_ns_ = 0;
+    for (auto& read : can_status_read_) { read = false; }
+
+    if (input.request_timing || input.timestamp_can_rx) {
+      submit_start_ns_ = GetNow();
+    }
+    if (input.request_timing || config_.spi_crc) {
+      submit_counters_[0] = aux_spi_.counters(0);
+      submit_counters_[1] = aux_spi_.counters(1);
+      submit_counters_[2] = primary_spi_.counters(0);
+    }
+    auto& timing = pending_output_.timing;
+
+    auto expected_replies = PrepareCan(input);
+    if (input.aggregate_can_replies && input.wait_for_can_irq) {
+      StartCanAggregation(input, expected_replies);
+    }
+
+    int64_t aux_can_end_ns = -1;
+    Stamp(input, &timing.send_can_start_ns);
+    if (primary_worker_) {
+      // The primary SPI bus work happens in parallel with sending our
+      // CAN data.
+      primary_expected_replies_ = {};
+      primary_worker_->Start();
+      SendCanAux(input, &expected_replies);
+      Stamp(input, &aux_can_end_ns);
+      primary_worker_->Wait();
+      expected_replies.count[5] += primary_expected_replies_.count[5];
+      expected_replies.ids[5] |= primary_expected_replies_.ids[5];
+    } else if (PrimaryCanFirst(input)) {
+      // The low speed bus will take the longest, so start it first.
+      SendCanPrimary(input, &expected_replies);
+      SendCanAux(input, &expected_replies);
+      Stamp(input, &aux_can_end_ns);
+      PrimaryWork(input, &pending_output_, &expected_replies, false);
+    } else {
+      // Send off all our CAN data to all buses.
+      SendCanAux(input, &expected_replies);
+      Stamp(input, &aux_can_end_ns);
+      PrimaryWork(input, &pending_output_, &expected_replies);
     }
+    timing.send_can_end_ns = std::max(timing.send_can_end_ns, aux_can_end_ns);
 
-    ReadCan(input, expected_replies, &result);
+    StartReadCan(input, expected_replies, &read_state_);
+    Stamp(input, &timing.submit_end_ns);
+  }
+
+  bool Poll() {
+    if (!submitted_ || complete_) { return true; }
+
+    // When we are not using the IRQ lines, give the controllers a
+    // chance to rest between polls that found nothing.
+    if (GetNow() < next_poll_ns_) { return false; }
+
+    bool any_found = false;
+    complete_ = ReadCanStep(
+        pending_input_, &read_state_, &pending_output_, &any_found);
+    if (!complete_ && !any_found && !pending_input_.wait_for_can_irq) {
+      next_poll_ns_ = GetNow() + kCanPollRestNs;
+    }
+    return complete_;
+  }
+
+  Output Complete() {
+    ThrowIf(!submitted_, []() {
+        return "Complete called without a matching Submit";
+      });
+
+    while (!complete_) {
+      bool any_found = false;
+      complete_ = ReadCanStep(
+          pending_input_, &read_state_, &pending_output_, &any_found);
+
+      if (!complete_ && !any_found && !pending_input_.wait_for_can_irq) {
+        // Give the controllers a chance to rest.  When waiting on the
+        // IRQ lines, we only poll our own GPIO registers, so there is
+        // no need.
+        BusyWaitUs(kCanPollRestNs / 1000);
+      }
+    }
+
+    submitted_ = false;
+
+    if (config_.silent_processor_cycles > 0) {
+      UpdateSilent(read_state_, &pending_output_);
+    }
+    if (pending_input_.request_can_status) {
+      ReadCanStatus(pending_input_, read_state_, &pending_output_);
+    }
+    if (pending_input_.request_timing) {
+      FinishTiming(&pending_output_.timing);
+    }
+    if (config_.spi_crc) {
+      FinishCrc(&pending_output_);
+    }
 
-    primary_spi_.gpio()->SetGpioMode(13, Rpi3Gpio::OUTPUT);
     static bool debug_toggle = false;
-    primary_spi_.gpio()->SetGpioOutput(13, debug_toggle);
+    transport_->SetGpioOutput(kDebugGpio, debug_toggle);
     debug_toggle = !debug_toggle;
 
-    return result;
+    return pending_output_;
+  }
+
+  Output Cycle(const Input& input) {
+    Submit(input);
+    return Complete();
+  }
+
+  void FinishTiming(Timing* timing) {
+    auto relative = [&](int64_t value) -> int64_t {
+      return value == 0 ? -1 : (value - submit_start_ns_);
+    };
+    timing->first_can_reply_ns = relative(read_state_.first_reply);
+    timing->last_can_reply_ns =
+        relative(read_state_.last_frame);
+    timing->timeout_ns = relative(read_state_.timeout);
+    timing->complete_ns = GetNow() - submit_start_ns_;
+
+    const SpiCounters* const current[] = {
+      &aux_spi_.counters(0),
+      &aux_spi_.counters(1),
+      &primary_spi_.counters(0),
+    };
+    for (int i = 0; i < 3; i++) {
+      timing->spi[i].transactions =
+          current[i]->transactions - submit_counters_[i].transactions;
+      timing->spi[i].bytes = current[i]->bytes - submit_counters_[i].bytes;
+    }
+  }
+
+  /// Track which processors have stopped replying, from the cycle
+  /// which just completed.
+  void UpdateSilent(const ReadState& state, Output* output) {
+    for (int i = 0; i < 3; i++) {
+      auto& silent = silent_[i];
+      if (state.received[i] > 0) {
+        silent = {};
+      } else if (state.expected[i] && !state.ignored[i]) {
+        silent.missed++;
+        if (silent.silent) {
+          // It was given another chance, and is still silent.
+          silent.backoff = std::min(2 * silent.backoff,
+                                    config_.silent_max_backoff_cycles);
+          silent.remaining = silent.backoff;
+        } else if (silent.missed >= config_.silent_processor_cycles) {
+          silent.silent = true;
+          silent.backoff = config_.silent_backoff_cycles;
+          silent.remaining = silent.backoff;
+        }
+      }
+      output->processor_silent[i] = silent.silent;
+    }
+  }
+
+  /// Decode register 6 from every processor used this cycle into
+  /// Output::can_status.  It is usually read along with some other
+  /// register during the cycle, and otherwise is read now.
+  void ReadCanStatus(const Input& input, const ReadState& state,
+                     Output* output) {
+    bool used[3] = { state.to_check[0], state.to_check[1], state.to_check[2] };
+    auto use_bus = [&](int bus) {
+      if (bus >= 1 && bus <= 5) { used[(bus - 1) / 2] = true; }
+    };
+    for (const auto& frame : input.tx_can) { use_bus(frame.bus); }
+    for (const auto& trigger : input.tx_can_template) { use_bus(trigger.bus); }
+
+    for (int processor = 0; processor < 3; processor++) {
+      if (!used[processor]) { continue; }
+
+      const uint8_t* const buf = can_status_buf_[processor];
+      if (!can_status_read_[processor]) {
+        CountingSpi* spi = nullptr;
+        const int cs = ProcessorSpi(processor, &spi);
+        spi->Read(cs, 6, reinterpret_cast<char*>(can_status_buf_[processor]),
+                  sizeof(can_status_buf_[processor]));
+      }
+
+      const int bus_count = (processor == 2) ? 1 : 2;
+      for (int i = 0; i < bus_count; i++) {
+        const uint8_t* const data = &buf[i * 6];
+        auto& status = output->can_status[processor * 2 + 1 + i];
+        status.valid = true;
+        status.last_error_code = data[0] & 0x07;
+        status.data_last_error_code = (data[0] >> 3) & 0x07;
+        status.activity = (data[0] >> 6) & 0x03;
+        status.error_passive = (data[1] & 0x01) != 0;
+        status.warning = (data[1] & 0x02) != 0;
+        status.bus_off = (data[1] & 0x04) != 0;
+        status.protocol_exception = (data[1] & 0x08) != 0;
+        status.rx_error_count = data[2];
+        status.tx_error_count = data[3];
+        status.bus_off_reset_count = data[4];
+        status.rx_overflow_count = data[5];
+        status.tx_overflow_count = buf[12];
+        status.tx_malformed_count = buf[13];
+      }
+    }
   }
 
+  void FinishCrc(Output* output) {
+    const SpiCounters* const current[] = {
+      &aux_spi_.counters(0),
+      &aux_spi_.counters(1),
+      &primary_spi_.counters(0),
+    };
+    for (int i = 0; i < 3; i++) {
+      output->spi_crc_retries +=
+          current[i]->crc_retries - submit_counters_[i].crc_retries;
+      output->spi_crc_failures +=
+          current[i]->crc_failures - submit_counters_[i].crc_failures;
+    }
+    if (output->spi_crc_failures) {
+      output->error = Output::kErrorSpiCrc;
+    }
+  }
+
+  static constexpr int64_t kCanPollRestNs = 20000;
+
+  // Only maintained when Input::request_timing or Configuration::spi_crc
+  // is set.
+  int64_t submit_start_ns_ = 0;
+  SpiCounters submit_counters_[3];
+
+  // This is initialized first, so that the whole of construction is
+  // included in startup_time_.
+  const int64_t start_ns_ = GetNow();
+  StartupTime startup_time_;
+
   const Configuration config_;
-  PrimarySpi primary_spi_;
-  AuxSpi aux_spi_;
+  std::unique_ptr<RpiTransport> rpi_transport_;
+  Transport* const transport_;
+  CountingSpi primary_spi_;
+  CountingSpi aux_spi_;
 
   DeviceAttitudeData device_attitude_;
 
@@ -1349,8 +3687,67 @@ class Pi3Hat::Impl {
   // It is 1 indexed to match the bus naming.
   std::vector<int> can_packets_[6];
 
+  // The estimated time each bus will be occupied during the current
+  // cycle, 1 indexed by bus.  This is only filled in when scheduling
+  // or an automatic timeout is requested.
+  int64_t can_bus_ns_[6] = {};
+
+  // Staging area for multiple frame transmissions.  This matches the
+  // maximum size accepted by the firmware.
+  char can_batch_buf_[1024] = {};
+  char primary_can_batch_buf_[1024] = {};
+
+  // Our copy of what templates have been stored on the device, 1
+  // indexed by bus.
+  CanTemplate can_templates_[6][kCanTemplatesPerBus];
+
+  // This matches the size of the FIFO on the device.
+  static constexpr size_t kMaxImuSamples = 64;
+  DeviceImuSample imu_sample_buf_[kMaxImuSamples];
+  uint8_t microphone_buf_[4 + 1024];
+
   // To keep track of which RF slots we have processed.
-  uint32_t last_bitfield_ = 0;
+  uint8_t rf_batch_buf_[2 + kRfSlots * kRfBatchSlotSize];
+
+  StatusBurst status_burst_;
+
+  // Copies of Configuration::can_filters, 1 indexed by bus.
+  std::vector<CanFilter> can_filter_storage_[6];
+  CanFilterConfiguration can_filters_[6];
+
+  // Indexed by processor, see Configuration::silent_processor_cycles.
+  struct Silent {
+    bool silent = false;
+    int missed = 0;
+    int backoff = 0;
+    int remaining = 0;
+  };
+  Silent silent_[3];
+
+  // The timing in use for each processor.
+  SpiTiming spi_timing_[3];
+
+  // The burst list most recently written to each processor.
+  uint8_t burst_list_[3][16] = {};
+  size_t burst_list_size_[3] = {};
+
+  // With Input::request_can_status, register 6 of each processor, if
+  // it has already been read this cycle as part of a burst.
+  uint8_t can_status_buf_[3][16] = {};
+  bool can_status_read_[3] = {};
+
+  // The state of a cycle which has been submitted, but not yet
+  // completed.
+  bool submitted_ = false;
+  bool complete_ = false;
+  Input pending_input_;
+  Output pending_output_;
+  ReadState read_state_;
+  int64_t next_poll_ns_ = 0;
+
+  // When enabled, this performs all the primary SPI work in parallel.
+  std::unique_ptr<SpinWorker> primary_worker_;
+  ExpectedReply primary_expected_replies_;
 };
 
 Pi3Hat::Pi3Hat(const Configuration& configuration)
@@ -1364,6 +3761,27 @@ Pi3Hat::Output Pi3Hat::Cycle(const Input& input) {
   return impl_->Cycle(input);
 }
 
+void Pi3Hat::Submit(const Input& input) {
+  impl_->Submit(input);
+}
+
+bool Pi3Hat::Poll() {
+  return impl_->Poll();
+}
+
+Pi3Hat::Output Pi3Hat::Complete() {
+  return impl_->Complete();
+}
+
+void Pi3Hat::SetCanTemplate(int slot, const CanFrame& frame,
+                            int patch_offset, int patch_size) {
+  impl_->SetCanTemplate(slot, frame, patch_offset, patch_size);
+}
+
+void Pi3Hat::ClearCanTemplate(int bus, int slot) {
+  impl_->ClearCanTemplate(bus, slot);
+}
+
 Pi3Hat::DeviceInfo Pi3Hat::device_info() {
   return impl_->device_info();
 }
@@ -1372,9 +3790,25 @@ Pi3Hat::DevicePerformance Pi3Hat::device_performance() {
   return impl_->device_performance();
 }
 
+void Pi3Hat::ResetProcessor(int processor) {
+  impl_->ResetProcessor(processor);
+}
+
 void Pi3Hat::ReadSpi(int spi_bus, int address, char* data, size_t size) {
   impl_->ReadSpi(spi_bus, address, data, size);
 }
 
+SpiTiming Pi3Hat::spi_timing(int processor) {
+  return impl_->spi_timing(processor);
+}
+
+Pi3Hat::SpiCrcStatus Pi3Hat::spi_crc_status() {
+  return impl_->spi_crc_status();
+}
+
+Pi3Hat::StartupTime Pi3Hat::startup_time() {
+  return impl_->startup_time();
+}
+
 }
 }
@@ -64,6 +64,124 @@ struct CanFrame {
   /// If true, then a reply will be expected for this frame on the
   /// same bus.
   bool expect_reply = false;
+
+  /// For received frames, if Input::timestamp_can_rx was set, this is
+  /// when the pi3hat received the frame, in microseconds after the
+  /// start of Submit (or Cycle).  It is 0 if not available.
+  uint32_t timestamp_us = 0;
+};
+
+/// Selects a CAN frame template, previously stored with
+/// Pi3Hat::SetCanTemplate, to be sent.
+struct CanTemplateTrigger {
+  int bus = 0;
+  int slot = 0;
+
+  /// These bytes replace the patch region of the template's payload.
+  /// Only as many bytes as the template's patch size are used.
+  uint8_t patch[32] = {};
+};
+
+/// The health of one CAN bus, as reported by the processor which
+/// drives it.  All counts are 8 bits and wrap around.
+struct CanBusStatus {
+  /// True if this was read in the cycle which returned it.
+  bool valid = false;
+
+  /// The most recent error in the arbitration (nominal) and data
+  /// phases, as defined by the FDCAN PSR register: 0 none, 1 stuff,
+  /// 2 form, 3 ack, 4 bit1, 5 bit0, 6 crc, and 7 unchanged since
+  /// last read.
+  uint8_t last_error_code = 0;
+  uint8_t data_last_error_code = 0;
+
+  /// 0 synchronizing, 1 idle, 2 receiving, 3 transmitting.
+  uint8_t activity = 0;
+
+  bool error_passive = false;
+  bool warning = false;
+  bool bus_off = false;
+  bool protocol_exception = false;
+
+  uint8_t rx_error_count = 0;
+  uint8_t tx_error_count = 0;
+
+  /// The number of times the bus has been recovered from bus off.
+  uint8_t bus_off_reset_count = 0;
+
+  /// Received frames dropped because the processor's queue was full.
+  uint8_t rx_overflow_count = 0;
+
+  /// These are shared by every bus of the same processor.  They
+  /// count transmit requests dropped because all buffers were full,
+  /// or because they were malformed.
+  uint8_t tx_overflow_count = 0;
+  uint8_t tx_malformed_count = 0;
+};
+
+/// How a CAN bus on the pi3hat is configured.  The rates themselves
+/// are fixed by the firmware, so this only describes them, allowing
+/// the time each frame spends on the bus to be estimated.
+struct CanRate {
+  int nominal_bitrate = 1000000;
+  int data_bitrate = 5000000;
+
+  /// If false, classic CAN frames are used, with at most 8 bytes of
+  /// payload.
+  bool fdcan_frame = true;
+
+  /// If true, the data phase of CAN-FD frames uses 'data_bitrate'.
+  bool bitrate_switch = true;
+};
+
+/// @return an estimate of how long a frame with the given ID and
+/// payload size occupies a bus, from its start of frame through the
+/// following interframe space.  Bit stuffing is not included.
+int64_t EstimateCanFrameTimeNs(const CanRate& rate, uint32_t id, size_t size);
+
+/// An acceptance filter for received CAN frames.  These are applied
+/// by the CAN peripheral itself, so rejected frames never use any
+/// pi3hat buffers or SPI bandwidth.
+struct CanFilter {
+  enum class Action {
+    kAccept,
+    kReject,
+  };
+
+  enum class Mode {
+    // Matches id1 <= ID <= id2
+    kRange,
+    // Matches ID == id1 or ID == id2
+    kDual,
+    // Matches (ID & id2) == (id1 & id2)
+    kMask,
+  };
+
+  Action action = Action::kAccept;
+  Mode mode = Mode::kRange;
+
+  // If true, this applies only to frames with extended (29 bit) IDs,
+  // otherwise only to those with standard (11 bit) IDs.
+  bool extended = false;
+
+  uint32_t id1 = 0;
+  uint32_t id2 = 0;
+};
+
+/// The acceptance filters for a single CAN bus.
+struct CanFilterConfiguration {
+  // If false, whatever the pi3hat has configured is left alone.  By
+  // default, it accepts every frame.
+  bool enabled = false;
+
+  // These are evaluated in order, and the first which matches a frame
+  // determines its action.  At most 28 standard and 8 extended
+  // filters may be given.
+  Span<const CanFilter> filters;
+
+  // The action for frames which match no filter.
+  CanFilter::Action standard_default = CanFilter::Action::kAccept;
+  CanFilter::Action extended_default = CanFilter::Action::kAccept;
 };
 
 struct Quaternion {
@@ -105,6 +223,21 @@ struct Attitude {
   Point3D bias_dps;
   Quaternion attitude_uncertainty;
   Point3D bias_uncertainty_dps;
+
+  /// The number of processor cycles taken by the most recent
+  /// attitude filter update.
+  uint32_t update_cycles = 0;
+};
+
+/// A single raw IMU sample, after the mounting rotation has been
+/// applied.
+struct ImuSample {
+  /// The time the sample was taken, as measured by the microsecond
+  /// clock of the pi3hat's auxiliary processor.  It wraps every
+  /// 2^32 microseconds.
+  uint32_t timestamp_us = 0;
+  Point3D rate_dps;
+  Point3D accel_mps2;
 };
 
 struct RfSlot {
@@ -120,6 +253,80 @@ class Error : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
+/// How transactions with one processor are clocked.
+struct SpiTiming {
+  // If 0, Pi3Hat::Configuration::spi_speed_hz is used.
+  int speed_hz = 0;
+
+  // Waited before and after asserting chip select.
+  int cs_hold_us = 3;
+
+  // Waited between the address byte and the data phase.
+  int address_hold_us = 3;
+};
+
+/// A SPI bus with one or more chip selects.  Each transaction
+/// consists of a single register address byte followed by an
+/// optional data phase.
+class SpiTransport {
+ public:
+  virtual ~SpiTransport() {}
+
+  virtual void Write(int cs, int address, const char* data, size_t size) = 0;
+  virtual void Read(int cs, int address, char* data, size_t size) = 0;
+
+  /// Use the given timing for all future transactions with chip
+  /// select @p cs.  'speed_hz' will always be non-zero.
+  /// Implementations which have no notion of timing may ignore this.
+  virtual void SetTiming(int /* cs */, const SpiTiming&) {}
+
+  /// Like Write and Read, except that the address phase consists of
+  /// the @p header_size bytes of @p header, at most 3, and the address
+  /// hold is lengthened by @p hold_us.  This is required for
+  /// Pi3Hat::Configuration::spi_crc.  By default, Error is thrown.
+  virtual void WriteHeader(int /* cs */,
+                           const char* /* header */,
+                           size_t /* header_size */,
+                           int /* hold_us */,
+                           const char* /* data */,
+                           size_t /* size */) {
+    throw Error("SPI transport does not support multi-byte headers");
+  }
+  virtual void ReadHeader(int /* cs */,
+                          const char* /* header */,
+                          size_t /* header_size */,
+                          int /* hold_us */,
+                          char* /* data */,
+                          size_t /* size */) {
+    throw Error("SPI transport does not support multi-byte headers");
+  }
+};
+
+/// Everything that Pi3Hat requires of the hardware.  By default, the
+/// SPI and GPIO peripherals of the Raspberry Pi are used directly,
+/// but an alternate implementation may be provided through
+/// Pi3Hat::Configuration::transport, for instance to simulate the
+/// board.
+class Transport {
+ public:
+  virtual ~Transport() {}
+
+  /// SPI0, where chip select 0 is the auxiliary processor.
+  virtual SpiTransport* primary_spi() = 0;
+
+  /// SPI1, where chip select 0 is the processor for JC1 and JC2, and
+  /// chip select 1 is the processor for JC3 and JC4.
+  virtual SpiTransport* aux_spi() = 0;
+
+  /// Return the level of the given BCM GPIO input.  This is used to
+  /// monitor the IRQ lines of each processor.
+  virtual bool GetGpioInput(int gpio) = 0;
+
+  /// Set the level of the given BCM GPIO output.  This is used only
+  /// for debugging.
+  virtual void SetGpioOutput(int gpio, bool value) = 0;
+};
+
 /// This class provides the top level interface to an application
 /// which wants to use all the features of the mjbots pi3 hat in an
 /// integrated fashion at high rate.
@@ -141,12 +348,125 @@ class Pi3Hat {
     Euler mounting_deg;
 
     // Only a fixed set of rates are achievable.  Valid values are
-    // 100, 200, 400, 1000.  Selecting a higher rate than you need to
-    // sample at will result in more noise.
+    // 100, 200, 400, 1000, 2000.  Selecting a higher rate than you
+    // need to sample at will result in more noise.
     uint32_t attitude_rate_hz = 400;
 
+    // If non-zero, the IMU is sampled at this rate instead, from the
+    // same set of valid values.  Every sample is integrated into the
+    // reported attitude and rates, and placed in the IMU FIFO, while
+    // the attitude filter itself is only updated at approximately
+    // 'attitude_rate_hz'.  This gives low latency rates without the
+    // CPU cost of running the filter at the full sample rate.
+    uint32_t imu_rate_hz = 0;
+
     // RF communication will be with a transmitter having this ID.
     uint32_t rf_id = 5678;
+
+    // If non-negative, the microphone is sampled at this rate, which
+    // must be between 200 and 48000 Hz, or 0 to stop sampling.
+    // Otherwise, the firmware default of 22050 Hz is left in place.
+    int microphone_rate_hz = -1;
+
+    // If true, then work on the primary SPI bus (attitude, RF, and
+    // the JC5 CAN bus) is performed in a second thread, at the same
+    // time as the JC1-JC4 CAN traffic on the auxiliary SPI bus.  That
+    // thread spins while idle, so it should be given its own
+    // isolated CPU.
+    bool primary_spi_thread = false;
+
+    // If non-negative, the primary SPI thread is pinned to this CPU
+    // and run at realtime priority.
+    int primary_spi_thread_cpu = -1;
+
+    // If true, larger transfers on the primary SPI bus are moved by
+    // the DMA controller instead of the CPU.  The two DMA channels
+    // (0-10) must not be in use by the kernel or any other process.
+    // The auxiliary SPI bus has no DMA request lines and is always
+    // driven by the CPU.
+    bool spi_dma = false;
+    int spi_dma_tx_channel = 7;
+    int spi_dma_rx_channel = 8;
+
+    // The timing used for each processor, indexed as in
+    // Output::timing.spi.
+    SpiTiming spi_timing[3];
+
+    // If true, then during construction each processor is read
+    // repeatedly with successively higher speeds and shorter chip
+    // select holds, starting from 'spi_timing', and the fastest which
+    // proves reliable is used instead.  The address hold is never
+    // shortened, as it must cover the slowest register to prepare,
+    // which the calibration reads do not exercise.  Processors which cannot be read
+    // reliably even with 'spi_timing' keep it.  The results are
+    // available from spi_timing(), so that they can be placed in
+    // 'spi_timing' to skip calibration in the future.
+    //
+    // Calibration relies on timings which are too fast being
+    // detected by the version and device information registers,
+    // which may not catch every marginal setting.
+    bool calibrate_spi_timing = false;
+
+    // No speed faster than this is tried during calibration.
+    int calibrate_max_speed_hz = 20000000;
+
+    // If true, every SPI transaction carries a CRC, so that corrupted
+    // transfers are detected rather than silently used.  Reads which
+    // fail their CRC are retried up to 'spi_crc_retries' times, unless
+    // reading consumes data, such as received CAN frames.  Reads
+    // which still fail are returned as all zeros.  Writes which fail
+    // are discarded by the processor, and are counted in
+    // spi_crc_status().  Each transaction becomes 4 bytes longer, and
+    // waits roughly 50ns per byte for the processor to compute its
+    // CRC.
+    bool spi_crc = false;
+    int spi_crc_retries = 2;
+
+    // If non-zero, a processor which returns no CAN frames at all
+    // for this many consecutive cycles in which it was expected to
+    // reply is considered silent, as when it has hung.  Its replies
+    // are then no longer waited for, so that its timeouts do not
+    // delay the other buses, although any which do arrive are still
+    // returned.  Every 'silent_backoff_cycles' cycles it is waited
+    // for once more, with the interval doubling each time it remains
+    // silent, up to 'silent_max_backoff_cycles'.  Any frame from it
+    // ends the silence.  See Output::processor_silent and
+    // Pi3Hat::ResetProcessor.
+    int silent_processor_cycles = 0;
+    int silent_backoff_cycles = 10;
+    int silent_max_backoff_cycles = 1000;
+
+    // If true, construction is made faster, for when the time until
+    // the first Cycle matters.  The auxiliary processor, on the
+    // primary SPI bus, is calibrated, checked, and configured in a
+    // second thread, while the CAN processors on the auxiliary SPI
+    // bus are.  Configuration already present on a processor is
+    // never written again regardless, and with this, changes which
+    // are written are polled for instead of waiting the longest time
+    // they may take.  See startup_time().
+    bool fast_start = false;
+
+    // If non-null, all communication with the board is performed
+    // through this, rather than the Raspberry Pi peripherals, and
+    // the SPI options above are ignored.  It must outlive the Pi3Hat.
+    Transport* transport = nullptr;
+
+    // How each CAN bus is configured, indexed by bus, where 1-4 are
+    // JC1-JC4 and 5 is JC5.  These must match the firmware, and are
+    // only used by Input::schedule_can and Input::auto_timeout.
+    CanRate can_rate[6];
+
+    // Acceptance filters for received CAN frames, indexed by bus as
+    // above.  These are copied during construction, so the filters
+    // they refer to need only remain valid until then.
+    CanFilterConfiguration can_filters[6];
+
+    Configuration() {
+      can_rate[5].nominal_bitrate = 125000;
+      can_rate[5].data_bitrate = 125000;
+      can_rate[5].fdcan_frame = false;
+      can_rate[5].bitrate_switch = false;
+    }
   };
 
   /// This may throw an instance of `Error` if construction fails for
@@ -158,8 +478,29 @@ class Pi3Hat {
   Pi3Hat(const Pi3Hat&) = delete;
   Pi3Hat& operator=(const Pi3Hat&) = delete;
 
+  /// Each bus can store this many CAN frame templates.
+  static constexpr int kCanTemplatesPerBus = 8;
+
+  /// Store a CAN frame on the pi3hat which can later be sent with a
+  /// short command by placing a CanTemplateTrigger in
+  /// Input::tx_can_template.  The 'bus' of the frame selects which
+  /// bus the template is stored for.  Each time it is sent, the
+  /// payload bytes from [patch_offset, patch_offset + patch_size) may
+  /// be replaced.  patch_size may be at most 32.
+  ///
+  /// If 'frame.expect_reply' is set, then a reply is expected each
+  /// time the template is sent.
+  ///
+  /// This may throw an instance of `Error` if the arguments are invalid.
+  void SetCanTemplate(int slot, const CanFrame& frame,
+                      int patch_offset = 0, int patch_size = 0);
+
+  /// Remove a previously stored template.
+  void ClearCanTemplate(int bus, int slot);
+
   struct Input {
     Span<CanFrame> tx_can;
+    Span<CanTemplateTrigger> tx_can_template;
     Span<RfSlot> tx_rf;
 
     /// When waiting for CAN replies, the call will return all data
@@ -181,6 +522,21 @@ class Pi3Hat {
     /// After each succesful receipt, wait this much longer for more.
     uint32_t rx_extra_wait_ns = 40000;
 
+    /// If true, then 'timeout_ns' is ignored, and the timeout is
+    /// instead the estimated time for every frame, and its reply, to
+    /// cross the busiest bus, plus 'auto_timeout_margin_ns'.  Each
+    /// reply is assumed to be the same size as its request.  The
+    /// estimate uses Configuration::can_rate.
+    bool auto_timeout = false;
+    uint32_t auto_timeout_margin_ns = 200000;
+
+    /// If true, then the buses are sent to in order of how long they
+    /// are estimated to be busy, including any replies, so that the
+    /// busiest starts first and all finish as close together as
+    /// possible.  Otherwise, JC1-JC4 are sent to in a fixed order,
+    /// and JC5 always last.
+    bool schedule_can = false;
+
     bool request_attitude = false;
 
     // If true, then the bias and uncertainty information will be
@@ -190,6 +546,13 @@ class Pi3Hat {
     // If no new attitude is available, wait for it.
     bool wait_for_attitude = false;
 
+    // If true, then when waiting for attitude, the IMU's IRQ line is
+    // monitored for a new sample instead of polling over SPI.  If the
+    // line is not raised within a few IMU sample periods, as with
+    // firmware which does not drive it, the wait continues by
+    // polling.
+    bool wait_for_attitude_irq = false;
+
     bool request_rf = false;
 
     // A bitmask indicating CAN buses to check for data even if no
@@ -197,20 +560,140 @@ class Pi3Hat {
     //  * bit 0 is unused, so the used bits start from 1
     uint32_t force_can_check = 0;
 
+    // If true, then while waiting for CAN replies, the IRQ line of
+    // each processor is monitored, and a processor is only queried
+    // over SPI when it reports that frames are available.  This
+    // reduces SPI traffic and the load on the processors.
+    bool wait_for_can_irq = false;
+
+    // If true, then replies are matched to the 'expect_reply' frames
+    // by ID rather than just counted.  This uses the moteus
+    // convention, where a request has the destination ID in its low
+    // 7 bits and a reply has the source ID in bits 8-14.  The wait
+    // ends as soon as every expected ID has replied, and only frames
+    // which do not match an outstanding request extend it by
+    // 'rx_extra_wait_ns'.
+    bool match_reply_ids = false;
+
+    // If true, and 'wait_for_can_irq' is set, then each processor is
+    // told how many replies to expect this cycle.  It holds its IRQ
+    // line low until they have all arrived, or the timeout has
+    // expired, so that the host is woken once and can read every
+    // reply in one transfer.  This costs one short SPI write to each
+    // processor which expects replies.
+    bool aggregate_can_replies = false;
+
+    // If true, then CanFrame::timestamp_us is filled in for each
+    // received frame.  Frames which must be read one at a time,
+    // because 'rx_can' has too little room for all that are queued,
+    // are not timestamped.
+    bool timestamp_can_rx = false;
+
+    // If true, then Output::timing will be filled in.
+    bool request_timing = false;
+
+    // If true, then Output::can_status is filled in for each bus of
+    // every processor which was sent to or read from this cycle.
+    // The status is read in the same transfer as the first poll of
+    // each processor, or its other status registers.  Only a
+    // processor which was never polled costs a separate short read,
+    // at the end of the receive phase.
+    bool request_can_status = false;
+
     // These are data to store results in.
     Span<CanFrame> rx_can;
     Span<RfSlot> rx_rf;
     Attitude* attitude = nullptr;
+
+    // If non-empty, up to this many of the raw IMU samples recorded
+    // since they were last read are returned, oldest first.  The
+    // pi3hat stores a limited number, so they must be read regularly
+    // to avoid any being lost.
+    Span<ImuSample> rx_imu_samples;
+
+    // If non-empty, up to this many 8 bit unsigned microphone samples
+    // recorded since they were last read are returned, oldest first.
+    // The pi3hat stores a little under 4096, so at the default rate
+    // they must be read at least every 180ms to avoid any being lost.
+    Span<uint8_t> rx_microphone;
+  };
+
+  /// Where the time in a single cycle went.  All timestamps are in
+  /// nanoseconds measured from the start of Submit (or Cycle), or -1
+  /// if the given phase did not happen.
+  struct Timing {
+    int64_t send_can_start_ns = -1;
+    int64_t send_can_end_ns = -1;
+    int64_t send_rf_start_ns = -1;
+    int64_t send_rf_end_ns = -1;
+    int64_t read_rf_start_ns = -1;
+    int64_t read_rf_end_ns = -1;
+    int64_t attitude_start_ns = -1;
+    int64_t attitude_end_ns = -1;
+    int64_t submit_end_ns = -1;
+    int64_t first_can_reply_ns = -1;
+    int64_t last_can_reply_ns = -1;
+    int64_t timeout_ns = -1;
+    int64_t complete_ns = -1;
+
+    struct Spi {
+      uint32_t transactions = 0;
+      uint32_t bytes = 0;
+    };
+
+    // The SPI traffic to each processor during this cycle.
+    //  0 - CAN1 (JC1 and JC2)
+    //  1 - CAN2 (JC3 and JC4)
+    //  2 - auxiliary (JC5, IMU, and RF)
+    Spi spi[3];
   };
 
   struct Output {
+    // Set by Pi3HatBroker when its rings were too full to queue every
+    // frame.
+    static constexpr int kErrorBrokerFull = 1;
+    // Set when some reads failed their CRC even after retrying.
+    static constexpr int kErrorSpiCrc = 2;
+
     int error = 0;
     bool attitude_present = false;
     size_t rx_can_size = 0;
     size_t rx_rf_size = 0;
+    size_t rx_imu_sample_size = 0;
+
+    // The total number of IMU samples which have been discarded
+    // because they were not read in time.  This will only be updated
+    // if 'Input::rx_imu_samples' is non-empty.
+    uint32_t imu_sample_overflow_count = 0;
+
+    size_t rx_microphone_size = 0;
+
+    // The number of microphone samples which have been discarded
+    // because they were not read in time.  This wraps around, and is
+    // only updated if 'Input::rx_microphone' is non-empty.
+    uint16_t microphone_overrun_count = 0;
 
     // This will only be updated if 'Input::request_rf' is true
     uint32_t rf_lock_age_ms = 0;
+
+    // This will only be updated if 'Input::request_timing' is true
+    Timing timing;
+
+    // Indexed by bus, so entry 0 is unused.  This will only be
+    // updated if 'Input::request_can_status' is true.
+    CanBusStatus can_status[6];
+
+    // Indexed as in Timing::spi, true for each processor which is
+    // currently considered silent.  See
+    // Configuration::silent_processor_cycles.
+    bool processor_silent[3] = {};
+
+    // With Configuration::spi_crc, the number of reads this cycle
+    // which failed their CRC and were retried, and the number which
+    // failed after every retry or could not be retried.  If the
+    // latter is non-zero, 'error' is set to kErrorSpiCrc.
+    uint32_t spi_crc_retries = 0;
+    uint32_t spi_crc_failures = 0;
   };
 
   /// Do some or all of the following:
@@ -222,6 +705,22 @@ class Pi3Hat {
   ///  * Return any RF slots that may have been received
   Output Cycle(const Input& input);
 
+  /// The same operation as Cycle, split into phases so that the
+  /// caller can do other work while CAN replies are in flight.
+  ///
+  /// Submit sends all CAN and RF data, and reads the attitude and RF
+  /// results.  Poll then checks for CAN replies without blocking, and
+  /// returns true once no more waiting is required.  Complete blocks
+  /// until that is the case (if Poll has not already returned true),
+  /// and returns the results.
+  ///
+  /// The Input, and all the storage it refers to, must remain valid
+  /// until Complete returns.  Only one cycle may be outstanding at a
+  /// time.  Timeouts are measured from the end of Submit.
+  void Submit(const Input& input);
+  bool Poll();
+  Output Complete();
+
   struct ProcessorInfo {
     uint8_t git_hash[20] = {};
     bool dirty = false;
@@ -237,8 +736,31 @@ class Pi3Hat {
   DeviceInfo device_info();
 
   struct PerformanceInfo {
+    // Main loop iterations.
     uint32_t cycles_per_ms = 0;
     uint32_t min_cycles_per_ms = 0;
+
+    // The CPU cycles spent in each part of the main loop, if the
+    // firmware measures them.
+    struct Module {
+      // A short name for the function measured, such as "imu.Poll".
+      const char* name = "";
+
+      // Per call, averaged over the most recent 20ms.
+      uint32_t average_cycles = 0;
+
+      // The longest call since device_performance was last called.
+      uint32_t max_cycles = 0;
+
+      // The total per millisecond, averaged over the most recent
+      // 20ms.  The processors run at 170MHz, so 170000 would mean
+      // this module used all of the CPU.
+      uint32_t cycles_per_ms = 0;
+    };
+
+    static constexpr int kMaxModules = 8;
+    Module modules[kMaxModules];
+    int module_count = 0;
   };
 
   struct DevicePerformance {
@@ -249,9 +771,53 @@ class Pi3Hat {
 
   DevicePerformance device_performance();
 
+  /// Reset one processor, indexed as in Output::timing.spi, as when
+  /// it has stopped responding.  This blocks until it responds again,
+  /// which takes on the order of 100ms, then restores everything this
+  /// object has configured on it: CAN filters and templates, and for
+  /// the auxiliary processor the IMU, RF, and microphone settings.
+  /// Frames queued on it are lost.  An Error is thrown if it does
+  /// not come back.  This may not be called while a cycle is
+  /// outstanding.
+  void ResetProcessor(int processor);
+
   /// Read raw SPI data.
   void ReadSpi(int spi_bus, int address, char* data, size_t size);
 
+  /// @return the timing in use for @p processor, indexed as in
+  /// Output::timing.spi, with 'speed_hz' always filled in.
+  SpiTiming spi_timing(int processor);
+
+  struct SpiCrcStatus {
+    // Indexed as in Output::timing.spi.
+
+    // Reads which failed their CRC, since construction.
+    uint64_t retries[3] = {};
+    uint64_t failures[3] = {};
+
+    // Writes which each processor discarded, since it was reset.
+    // This is only read when Configuration::spi_crc is set.
+    uint32_t rejected_writes[3] = {};
+  };
+
+  SpiCrcStatus spi_crc_status();
+
+  struct StartupTime {
+    // The whole of construction.
+    double total_s = 0.0;
+
+    // Setting up the Raspberry Pi peripherals, or the transport.
+    double transport_s = 0.0;
+
+    // Calibrating, checking, and configuring each processor, indexed
+    // as in Output::timing.spi.  With Configuration::fast_start,
+    // processor 2 is brought up at the same time as the others.
+    double processor_s[3] = {};
+  };
+
+  /// @return how long construction took.
+  StartupTime startup_time();
+
  private:
   class Impl;
   Impl* const impl_;
@@ -0,0 +1,432 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/// @file
+///
+/// Measures the latency of Pi3Hat::Cycle across a sweep of
+/// configurations, and reports the results as JSON on stdout.
+///
+/// NOTE: This file can be compiled manually on a raspberry pi using
+/// the following command line:
+///
+/// g++ -L /opt/vc/lib -I /opt/vc/include -lbcm_host -lpthread -std=c++11 pi3hat_bench.cc pi3hat.cc pi3hat_simulator.cc -o pi3hat_bench
+
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pi3hat.h"
+#include "pi3hat_simulator.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+namespace {
+int64_t GetNow() {
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000ll +
+      static_cast<int64_t>(ts.tv_nsec);
+}
+
+// This mirrors the padding applied by Pi3Hat when frames are sent.
+int RoundUpDlc(int value) {
+  if (value <= 8) { return value; }
+  if (value <= 12) { return 12; }
+  if (value <= 16) { return 16; }
+  if (value <= 20) { return 20; }
+  if (value <= 24) { return 24; }
+  if (value <= 32) { return 32; }
+  if (value <= 48) { return 48; }
+  return 64;
+}
+
+std::vector<int> ParseList(const std::string& value) {
+  std::vector<int> result;
+  std::stringstream stream(value);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (item.empty()) { continue; }
+    result.push_back(std::stoi(item, nullptr, 0));
+  }
+  if (result.empty()) {
+    throw std::runtime_error("Empty list: '" + value + "'");
+  }
+  return result;
+}
+
+struct Arguments {
+  Arguments(const std::vector<std::string>& args) {
+    for (size_t i = 0; i < args.size(); i++) {
+      const auto& arg = args[i];
+      if (arg == "-h" || arg == "--help") {
+        help = true;
+      } else if (arg == "--cycles") {
+        cycles = std::stoi(args.at(++i));
+      } else if (arg == "--warmup") {
+        warmup = std::stoi(args.at(++i));
+      } else if (arg == "--buses") {
+        buses = ParseList(args.at(++i));
+      } else if (arg == "--frames") {
+        frames = ParseList(args.at(++i));
+      } else if (arg == "--sizes") {
+        sizes = ParseList(args.at(++i));
+      } else if (arg == "--spi-speeds") {
+        spi_speeds = ParseList(args.at(++i));
+      } else if (arg == "--attitude") {
+        attitude = ParseList(args.at(++i));
+      } else if (arg == "--rf") {
+        rf = ParseList(args.at(++i));
+      } else if (arg == "--reply") {
+        reply = true;
+      } else if (arg == "--id-base") {
+        id_base = std::stoi(args.at(++i), nullptr, 0);
+      } else if (arg == "--can-timeout-ns") {
+        can_timeout_ns = std::stoull(args.at(++i));
+      } else if (arg == "--schedule-can") {
+        schedule_can = true;
+      } else if (arg == "--auto-timeout") {
+        auto_timeout = true;
+      } else if (arg == "--wait-irq") {
+        wait_irq = true;
+      } else if (arg == "--aggregate") {
+        aggregate = true;
+      } else if (arg == "--timestamp") {
+        timestamp = true;
+      } else if (arg == "--simulate") {
+        simulate = true;
+      } else if (arg == "--realtime") {
+        realtime = std::stoi(args.at(++i));
+      } else {
+        throw std::runtime_error("Unknown argument: " + arg);
+      }
+    }
+  }
+
+  bool help = false;
+  int cycles = 1000;
+  int warmup = 100;
+
+  std::vector<int> buses = {1, 2, 3, 4};
+  std::vector<int> frames = {1};
+  std::vector<int> sizes = {8, 16, 32, 64};
+  std::vector<int> spi_speeds = {10000000};
+  std::vector<int> attitude = {0};
+  std::vector<int> rf = {0};
+
+  bool reply = false;
+  int id_base = 1;
+  int64_t can_timeout_ns = 1000000;
+  bool schedule_can = false;
+  bool auto_timeout = false;
+  bool wait_irq = false;
+  bool aggregate = false;
+  bool timestamp = false;
+  int realtime = -1;
+  bool simulate = false;
+};
+
+void DisplayUsage() {
+  std::cout << "Usage: pi3hat_bench [options]\n";
+  std::cout << "\n";
+  std::cout << "Each list option is comma separated, and every combination\n";
+  std::cout << "of values is measured.\n";
+  std::cout << "\n";
+  std::cout << "  --cycles N          cycles measured per configuration\n";
+  std::cout << "  --warmup N          cycles discarded per configuration\n";
+  std::cout << "  --buses LIST        CAN buses to send on (1-5)\n";
+  std::cout << "  --frames LIST       frames sent to each bus per cycle\n";
+  std::cout << "  --sizes LIST        CAN payload sizes in bytes\n";
+  std::cout << "  --spi-speeds LIST   SPI speeds in Hz\n";
+  std::cout << "  --attitude LIST     0 or 1, whether to read attitude\n";
+  std::cout << "  --rf LIST           0 or 1, whether to read RF\n";
+  std::cout << "  --reply             expect a reply to each frame\n";
+  std::cout << "  --id-base ID        the first destination ID on each bus\n";
+  std::cout << "  --can-timeout-ns T  receive timeout when expecting replies\n";
+  std::cout << "  --schedule-can      order buses by estimated wire time\n";
+  std::cout << "  --auto-timeout      derive the receive timeout from wire time\n";
+  std::cout << "  --wait-irq          wait on the CAN IRQ lines for replies\n";
+  std::cout << "  --aggregate         with --wait-irq, wake once for all replies\n";
+  std::cout << "  --timestamp         report when replies were received\n";
+  std::cout << "  --realtime CPU      run in a realtime configuration on a CPU\n";
+  std::cout << "  --simulate          use a simulated pi3hat instead of hardware\n";
+}
+
+void ConfigureRealtime(int cpu) {
+  {
+    cpu_set_t cpuset = {};
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+
+    const int r = ::sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
+    if (r < 0) {
+      throw std::runtime_error("Error setting CPU affinity");
+    }
+  }
+
+  {
+    struct sched_param params = {};
+    params.sched_priority = 10;
+    const int r = ::sched_setscheduler(0, SCHED_RR, &params);
+    if (r < 0) {
+      throw std::runtime_error("Error setting realtime scheduler");
+    }
+  }
+
+  {
+    const int r = ::mlockall(MCL_CURRENT | MCL_FUTURE);
+    if (r < 0) {
+      throw std::runtime_error("Error locking memory");
+    }
+  }
+}
+
+struct Scenario {
+  int frames = 1;
+  int size = 8;
+  int spi_speed_hz = 10000000;
+  bool attitude = false;
+  bool rf = false;
+};
+
+struct Result {
+  int64_t p50_ns = 0;
+  int64_t p99_ns = 0;
+  int64_t p999_ns = 0;
+  int64_t max_ns = 0;
+
+  // Averages per cycle, indexed as in Pi3Hat::Timing::spi.
+  double spi_bytes[3] = {};
+  double spi_transactions[3] = {};
+
+  double replies = 0.0;
+
+  // The mean time after the start of each cycle at which frames were
+  // received, or -1 if not measured.
+  double rx_time_us = -1.0;
+};
+
+Result RunScenario(Pi3Hat* pi3hat, const Arguments& args,
+                   const Scenario& scenario) {
+  std::vector<CanFrame> tx_can;
+  for (const int bus : args.buses) {
+    for (int i = 0; i < scenario.frames; i++) {
+      CanFrame frame;
+      frame.bus = bus;
+      frame.id = (args.id_base + i) | (args.reply ? 0x8000 : 0x0000);
+      frame.size = scenario.size;
+      for (int j = 0; j < scenario.size; j++) {
+        frame.data[j] = j;
+      }
+      frame.expect_reply = args.reply;
+      tx_can.push_back(frame);
+    }
+  }
+
+  std::vector<CanFrame> rx_can(std::max<size_t>(tx_can.size() * 2, 16));
+  std::vector<RfSlot> rx_rf(16);
+  Attitude attitude;
+
+  Pi3Hat::Input input;
+  input.tx_can = { tx_can.data(), tx_can.size() };
+  input.rx_can = { rx_can.data(), rx_can.size() };
+  input.rx_rf = { rx_rf.data(), rx_rf.size() };
+  input.attitude = &attitude;
+  input.request_attitude = scenario.attitude;
+  input.request_rf = scenario.rf;
+  input.request_timing = true;
+  input.timeout_ns = args.reply ? args.can_timeout_ns : 0;
+  input.schedule_can = args.schedule_can;
+  input.auto_timeout = args.auto_timeout && args.reply;
+  input.wait_for_can_irq = args.wait_irq;
+  input.aggregate_can_replies = args.aggregate;
+  input.timestamp_can_rx = args.timestamp;
+
+  std::vector<int64_t> latencies;
+  latencies.reserve(args.cycles);
+
+  Result result;
+  double rx_time_total_us = 0.0;
+
+  for (int i = 0; i < args.warmup + args.cycles; i++) {
+    const auto start = GetNow();
+    const auto output = pi3hat->Cycle(input);
+    const auto end = GetNow();
+
+    if (i < args.warmup) { continue; }
+
+    latencies.push_back(end - start);
+    for (int j = 0; j < 3; j++) {
+      result.spi_bytes[j] += output.timing.spi[j].bytes;
+      result.spi_transactions[j] += output.timing.spi[j].transactions;
+    }
+    result.replies += output.rx_can_size;
+    for (size_t j = 0; j < output.rx_can_size; j++) {
+      rx_time_total_us += rx_can[j].timestamp_us;
+    }
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[std::min<size_t>(
+        latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+  };
+  result.p50_ns = percentile(0.50);
+  result.p99_ns = percentile(0.99);
+  result.p999_ns = percentile(0.999);
+  result.max_ns = latencies.back();
+
+  for (int j = 0; j < 3; j++) {
+    result.spi_bytes[j] /= args.cycles;
+    result.spi_transactions[j] /= args.cycles;
+  }
+  if (args.timestamp && result.replies > 0) {
+    result.rx_time_us = rx_time_total_us / result.replies;
+  }
+  result.replies /= args.cycles;
+
+  return result;
+}
+
+void EmitResult(const Arguments& args, const Scenario& scenario,
+                const Result& result, bool first) {
+  auto us = [](int64_t value) { return value / 1000.0; };
+
+  char buf[2048] = {};
+  std::string buses;
+  for (size_t i = 0; i < args.buses.size(); i++) {
+    buses += (i ? "," : "") + std::to_string(args.buses[i]);
+  }
+
+  ::snprintf(
+      buf, sizeof(buf) - 1,
+      "%s  {\"buses\": [%s], \"frames_per_bus\": %d, \"frame_size\": %d, "
+      "\"dlc_size\": %d, "
+      "\"spi_speed_hz\": %d, \"attitude\": %s, \"rf\": %s, "
+      "\"reply\": %s, \"schedule_can\": %s, \"auto_timeout\": %s, "
+      "\"wait_irq\": %s, \"aggregate\": %s, "
+      "\"simulated\": %s, \"cycles\": %d,\n"
+      "   \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+      "\"p99.9\": %.1f, \"max\": %.1f},\n"
+      "   \"spi_bytes_per_cycle\": {\"can1\": %.1f, \"can2\": %.1f, "
+      "\"aux\": %.1f},\n"
+      "   \"spi_transactions_per_cycle\": {\"can1\": %.1f, \"can2\": %.1f, "
+      "\"aux\": %.1f},\n"
+      "   \"rx_frames_per_cycle\": %.2f, \"mean_rx_time_us\": %.1f}",
+      first ? "" : ",\n",
+      buses.c_str(), scenario.frames, scenario.size,
+      RoundUpDlc(scenario.size),
+      scenario.spi_speed_hz,
+      scenario.attitude ? "true" : "false",
+      scenario.rf ? "true" : "false",
+      args.reply ? "true" : "false",
+      args.schedule_can ? "true" : "false",
+      args.auto_timeout ? "true" : "false",
+      args.wait_irq ? "true" : "false",
+      args.aggregate ? "true" : "false",
+      args.simulate ? "true" : "false",
+      args.cycles,
+      us(result.p50_ns), us(result.p99_ns),
+      us(result.p999_ns), us(result.max_ns),
+      result.spi_bytes[0], result.spi_bytes[1], result.spi_bytes[2],
+      result.spi_transactions[0], result.spi_transactions[1],
+      result.spi_transactions[2],
+      result.replies, result.rx_time_us);
+  std::cout << buf;
+  std::cout.flush();
+}
+
+int do_main(int argc, char** argv) {
+  Arguments args({argv + 1, argv + argc});
+
+  if (args.help) {
+    DisplayUsage();
+    return 0;
+  }
+
+  if (args.cycles <= 0) {
+    throw std::runtime_error("--cycles must be positive");
+  }
+
+  for (const int size : args.sizes) {
+    if (size < 0 || size > 64) {
+      throw std::runtime_error("Frame sizes must be between 0 and 64");
+    }
+  }
+
+  if (args.realtime >= 0) {
+    ConfigureRealtime(args.realtime);
+  }
+
+  std::cout << "{\"results\": [\n";
+
+  bool first = true;
+  for (const int spi_speed_hz : args.spi_speeds) {
+    // The SPI speed can only be changed at construction time.
+    Pi3Hat::Configuration config;
+    config.spi_speed_hz = spi_speed_hz;
+
+    std::unique_ptr<Pi3HatSimulator> simulator;
+    if (args.simulate) {
+      Pi3HatSimulator::Options options;
+      options.spi_speed_hz = spi_speed_hz;
+      simulator.reset(new Pi3HatSimulator(options));
+      config.transport = simulator.get();
+    }
+
+    Pi3Hat pi3hat{config};
+
+    for (const int frames : args.frames) {
+      for (const int size : args.sizes) {
+        for (const int attitude : args.attitude) {
+          for (const int rf : args.rf) {
+            Scenario scenario;
+            scenario.frames = frames;
+            scenario.size = size;
+            scenario.spi_speed_hz = spi_speed_hz;
+            scenario.attitude = attitude != 0;
+            scenario.rf = rf != 0;
+
+            const auto result = RunScenario(&pi3hat, args, scenario);
+            EmitResult(args, scenario, result, first);
+            first = false;
+          }
+        }
+      }
+    }
+  }
+
+  std::cout << "\n]}\n";
+
+  return 0;
+}
+
+}  // namespace
+}  // namespace pi3hat
+}  // namespace mjbots
+
+int main(int argc, char** argv) {
+  return mjbots::pi3hat::do_main(argc, argv);
+}
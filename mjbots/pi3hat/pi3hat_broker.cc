@@ -0,0 +1,365 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pi3hat_broker.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+#include <vector>
+
+namespace mjbots {
+namespace pi3hat {
+
+namespace {
+constexpr uint32_t kMagic = 0x42483350;  // "P3HB"
+constexpr uint32_t kVersion = 1;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2,
+              "shared memory requires lock free atomics");
+
+int64_t GetNow() {
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000ll +
+      static_cast<int64_t>(ts.tv_nsec);
+}
+
+void ThrowIfErrno(bool value, const std::string& message) {
+  if (!value) { return; }
+  throw Error(message + " : " + ::strerror(errno));
+}
+
+/// A single-producer, single-consumer queue of CAN frames, which
+/// lives in shared memory.
+struct FrameRing {
+  static constexpr uint32_t kSize = 64;
+
+  // Only the producer writes 'head', and only the consumer 'tail'.
+  alignas(64) std::atomic<uint32_t> head;
+  alignas(64) std::atomic<uint32_t> tail;
+  CanFrame frames[kSize];
+
+  bool Push(const CanFrame& frame) {
+    const uint32_t head_value = head.load(std::memory_order_relaxed);
+    if (head_value - tail.load(std::memory_order_acquire) >= kSize) {
+      return false;
+    }
+    frames[head_value % kSize] = frame;
+    head.store(head_value + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool Pop(CanFrame* frame) {
+    const uint32_t tail_value = tail.load(std::memory_order_relaxed);
+    if (tail_value == head.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *frame = frames[tail_value % kSize];
+    tail.store(tail_value + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Discard everything queued.  May only be called by the consumer.
+  void Clear() {
+    tail.store(head.load(std::memory_order_acquire),
+               std::memory_order_release);
+  }
+};
+
+struct ClientSlot {
+  // 0 if this slot is free, otherwise the pid of its client.
+  std::atomic<int32_t> pid;
+
+  FrameRing request;  // client -> owner
+  FrameRing reply;  // owner -> client
+};
+
+struct Region {
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  int32_t owner_pid;
+
+  ClientSlot clients[Pi3HatBroker::kMaxClients];
+};
+
+/// Owns a mapping of the shared memory region.
+class Mapping {
+ public:
+  Mapping(int fd) : fd_(fd) {
+    void* const ptr = ::mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd_, 0);
+    if (ptr == MAP_FAILED) {
+      ::close(fd_);
+      ThrowIfErrno(true, "mapping broker memory");
+    }
+    region_ = static_cast<Region*>(ptr);
+  }
+
+  ~Mapping() {
+    ::munmap(region_, sizeof(Region));
+    ::close(fd_);
+  }
+
+  Mapping(const Mapping&) = delete;
+  Mapping& operator=(const Mapping&) = delete;
+
+  Region* region() { return region_; }
+
+ private:
+  const int fd_;
+  Region* region_ = nullptr;
+};
+
+int CreateShm(const std::string& name) {
+  // Anything left behind by a previous owner is discarded.
+  ::shm_unlink(name.c_str());
+  const int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  ThrowIfErrno(fd < 0, "creating broker memory " + name);
+  if (::ftruncate(fd, sizeof(Region)) < 0) {
+    ::close(fd);
+    ThrowIfErrno(true, "sizing broker memory " + name);
+  }
+  return fd;
+}
+
+int OpenShm(const std::string& name) {
+  const int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+  ThrowIfErrno(fd < 0, "opening broker memory " + name);
+  return fd;
+}
+
+bool ProcessExists(int32_t pid) {
+  return ::kill(pid, 0) == 0 || errno != ESRCH;
+}
+}
+
+class Pi3HatBroker::Impl {
+ public:
+  Impl(const Options& options)
+      : options_(options),
+        mapping_(CreateShm(options.name)) {
+    // Value initialization leaves every ring and slot zeroed.
+    region_ = new (mapping_.region()) Region();
+    region_->version = kVersion;
+    region_->owner_pid = ::getpid();
+    region_->magic.store(kMagic, std::memory_order_release);
+
+    // A client frame with expect_reply may be answered by more than
+    // one reply.
+    tx_can_.resize(options_.max_client_frames);
+    rx_can_.resize(options_.max_client_frames * 2);
+  }
+
+  ~Impl() {
+    region_->magic.store(0);
+    ::shm_unlink(options_.name.c_str());
+  }
+
+  Pi3Hat::Output Cycle(Pi3Hat* pi3hat, const Pi3Hat::Input& input) {
+    bool any_clients = false;
+    for (const auto& client : region_->clients) {
+      if (client.pid.load(std::memory_order_relaxed) != 0) {
+        any_clients = true;
+        break;
+      }
+    }
+    if (!any_clients) {
+      return pi3hat->Cycle(input);
+    }
+
+    // These only ever grow, so in steady state they do not allocate.
+    const size_t tx_capacity =
+        input.tx_can.size() + options_.max_client_frames;
+    const size_t rx_capacity =
+        input.rx_can.size() + options_.max_client_frames * 2;
+    if (tx_can_.size() < tx_capacity) { tx_can_.resize(tx_capacity); }
+    if (rx_can_.size() < rx_capacity) { rx_can_.resize(rx_capacity); }
+
+    size_t tx_size = 0;
+    for (const auto& frame : input.tx_can) {
+      tx_can_[tx_size++] = frame;
+      if (frame.expect_reply) { Route(frame, 0); }
+    }
+
+    // Clients are visited starting from a different one each cycle,
+    // so that no one of them can starve the others.
+    size_t client_frames = 0;
+    for (int i = 0; i < kMaxClients; i++) {
+      const int index = (next_client_ + i) % kMaxClients;
+      auto& client = region_->clients[index];
+      if (client.pid.load(std::memory_order_acquire) == 0) { continue; }
+      while (client_frames < options_.max_client_frames &&
+             client.request.Pop(&tx_can_[tx_size])) {
+        const auto& frame = tx_can_[tx_size];
+        if (frame.expect_reply) { Route(frame, index + 1); }
+        tx_size++;
+        client_frames++;
+      }
+    }
+    next_client_ = (next_client_ + 1) % kMaxClients;
+
+    Pi3Hat::Input merged = input;
+    merged.tx_can = { tx_can_.data(), tx_size };
+    merged.rx_can = { rx_can_.data(), rx_capacity };
+
+    auto output = pi3hat->Cycle(merged);
+
+    size_t own_size = 0;
+    for (size_t i = 0; i < output.rx_can_size; i++) {
+      const auto& frame = rx_can_[i];
+      const int route = Lookup(frame);
+      if (route > 0) {
+        auto& client = region_->clients[route - 1];
+        if (client.pid.load(std::memory_order_acquire) != 0) {
+          // If the client is not keeping up, its reply is lost.
+          client.reply.Push(frame);
+          continue;
+        }
+      }
+      if (own_size < input.rx_can.size()) {
+        input.rx_can[own_size++] = frame;
+      }
+    }
+    output.rx_can_size = own_size;
+
+    return output;
+  }
+
+ private:
+  void Route(const CanFrame& frame, int client) {
+    if (frame.bus < 0 || frame.bus > 5) { return; }
+    routes_[frame.bus][frame.id & 0x7f] = client;
+  }
+
+  int Lookup(const CanFrame& frame) const {
+    if (frame.bus < 0 || frame.bus > 5) { return 0; }
+    return routes_[frame.bus][(frame.id >> 8) & 0x7f];
+  }
+
+  const Options options_;
+  Mapping mapping_;
+  Region* region_ = nullptr;
+
+  // Indexed by bus, then device ID.  0 is the owner, otherwise the
+  // client index plus 1.
+  uint8_t routes_[6][128] = {};
+
+  int next_client_ = 0;
+
+  std::vector<CanFrame> tx_can_;
+  std::vector<CanFrame> rx_can_;
+};
+
+Pi3HatBroker::Pi3HatBroker(const Options& options)
+    : impl_(new Impl(options)) {}
+
+Pi3HatBroker::~Pi3HatBroker() {
+  delete impl_;
+}
+
+Pi3Hat::Output Pi3HatBroker::Cycle(
+    Pi3Hat* pi3hat, const Pi3Hat::Input& input) {
+  return impl_->Cycle(pi3hat, input);
+}
+
+class Pi3HatBrokerClient::Impl {
+ public:
+  Impl(const Options& options)
+      : options_(options),
+        mapping_(OpenShm(options.name)),
+        region_(mapping_.region()) {
+    if (region_->magic.load(std::memory_order_acquire) != kMagic ||
+        region_->version != kVersion) {
+      throw Error("No compatible broker at " + options.name);
+    }
+
+    // Slots left behind by clients which exited without releasing
+    // them are reused.
+    const int32_t pid = ::getpid();
+    for (auto& client : region_->clients) {
+      int32_t current = client.pid.load();
+      if (current != 0 && ProcessExists(current)) { continue; }
+      if (!client.pid.compare_exchange_strong(current, pid)) { continue; }
+      slot_ = &client;
+      break;
+    }
+    if (slot_ == nullptr) {
+      throw Error("No free client slots at " + options.name);
+    }
+
+    // Do not hand over replies meant for a previous client.
+    slot_->reply.Clear();
+  }
+
+  ~Impl() {
+    slot_->pid.store(0);
+  }
+
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input) {
+    Pi3Hat::Output result;
+
+    size_t expected = 0;
+    for (const auto& frame : input.tx_can) {
+      if (!slot_->request.Push(frame)) {
+        result.error = Pi3Hat::Output::kErrorBrokerFull;
+        break;
+      }
+      if (frame.expect_reply) { expected++; }
+    }
+
+    const int64_t deadline = GetNow() + input.timeout_ns;
+    while (true) {
+      while (result.rx_can_size < input.rx_can.size() &&
+             slot_->reply.Pop(&input.rx_can[result.rx_can_size])) {
+        result.rx_can_size++;
+      }
+      if (result.rx_can_size >= expected ||
+          result.rx_can_size >= input.rx_can.size() ||
+          GetNow() >= deadline) {
+        break;
+      }
+      ::usleep(options_.poll_us);
+    }
+
+    return result;
+  }
+
+ private:
+  const Options options_;
+  Mapping mapping_;
+  Region* const region_;
+  ClientSlot* slot_ = nullptr;
+};
+
+Pi3HatBrokerClient::Pi3HatBrokerClient(const Options& options)
+    : impl_(new Impl(options)) {}
+
+Pi3HatBrokerClient::~Pi3HatBrokerClient() {
+  delete impl_;
+}
+
+Pi3Hat::Output Pi3HatBrokerClient::Cycle(const Pi3Hat::Input& input) {
+  return impl_->Cycle(input);
+}
+
+}
+}
@@ -0,0 +1,111 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _MJBOTS_PI3HAT_PI3HAT_BROKER_H_
+#define _MJBOTS_PI3HAT_PI3HAT_BROKER_H_
+
+/// @file
+///
+/// Like pi3hat.h, this relies on nothing but a C++11 compiler and
+/// standard library, along with POSIX shared memory.
+
+#include <string>
+
+#include "pi3hat.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Lets processes other than the one which owns the Pi3Hat send and
+/// receive CAN frames through it.
+///
+/// The owning process creates a Pi3HatBroker, and calls its Cycle in
+/// place of Pi3Hat::Cycle.  That creates a POSIX shared memory region
+/// with a pair of single-producer, single-consumer rings for each of
+/// up to kMaxClients clients.  Any frames queued by clients are
+/// appended to the owner's own frames in the next cycle, and replies
+/// are routed back to whichever process most recently sent a frame
+/// expecting a reply to that bus and device, using the moteus ID
+/// convention.  All other received frames go to the owner.
+///
+/// The owner's side performs no system calls and no memory allocation
+/// in steady state, only atomic operations and copies of the frames
+/// themselves.
+class Pi3HatBroker {
+ public:
+  static constexpr int kMaxClients = 8;
+
+  struct Options {
+    // The name of the POSIX shared memory object.
+    std::string name = "/pi3hat";
+
+    // At most this many client frames are added to each cycle, so as
+    // to bound how much clients can delay the owner.
+    size_t max_client_frames = 16;
+  };
+
+  Pi3HatBroker(const Options& options);
+  ~Pi3HatBroker();
+
+  // This object is non-copyable.
+  Pi3HatBroker(const Pi3HatBroker&) = delete;
+  Pi3HatBroker& operator=(const Pi3HatBroker&) = delete;
+
+  /// Behaves like pi3hat->Cycle(input), but includes any frames from
+  /// clients.  Only the owner's own replies are stored into
+  /// input.rx_can and counted in rx_can_size.
+  Pi3Hat::Output Cycle(Pi3Hat* pi3hat, const Pi3Hat::Input& input);
+
+ private:
+  class Impl;
+  Impl* const impl_;
+};
+
+/// Connects to a Pi3HatBroker in another process.
+class Pi3HatBrokerClient {
+ public:
+  struct Options {
+    std::string name = "/pi3hat";
+
+    // While waiting for replies, the shared memory is checked this
+    // often.
+    int poll_us = 100;
+  };
+
+  Pi3HatBrokerClient(const Options& options);
+  ~Pi3HatBrokerClient();
+
+  // This object is non-copyable.
+  Pi3HatBrokerClient(const Pi3HatBrokerClient&) = delete;
+  Pi3HatBrokerClient& operator=(const Pi3HatBrokerClient&) = delete;
+
+  /// Queue input.tx_can to be sent in the owner's next cycle, then
+  /// wait up to input.timeout_ns for a reply to each frame which
+  /// expects one.  Any replies which were already waiting are
+  /// returned as well.  Only CAN is available through the broker, so
+  /// all other members of input are ignored.
+  ///
+  /// If the rings are full, the remaining frames are dropped and
+  /// Output::error is set to Output::kErrorBrokerFull.
+  Pi3Hat::Output Cycle(const Pi3Hat::Input& input);
+
+ private:
+  class Impl;
+  Impl* const impl_;
+};
+
+}
+}
+
+#endif
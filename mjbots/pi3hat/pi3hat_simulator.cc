@@ -0,0 +1,1153 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pi3hat_simulator.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace mjbots {
+namespace pi3hat {
+
+namespace {
+int64_t GetNow() {
+  struct timespec ts = {};
+  ::clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000ll +
+      static_cast<int64_t>(ts.tv_nsec);
+}
+
+void BusyWaitUntil(int64_t end_ns) {
+  while (GetNow() < end_ns);
+}
+
+uint8_t u8(char value) {
+  return static_cast<uint8_t>(value);
+}
+
+/// CRC-16/CCITT-FALSE, as used by the firmware's CRC framing.
+uint16_t Crc16(uint16_t crc, const char* data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    crc ^= u8(data[i]) << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+int RoundUpDlc(int value) {
+  if (value <= 8) { return value; }
+  if (value <= 12) { return 12; }
+  if (value <= 16) { return 16; }
+  if (value <= 20) { return 20; }
+  if (value <= 24) { return 24; }
+  if (value <= 32) { return 32; }
+  if (value <= 48) { return 48; }
+  return 64;
+}
+
+/// These match the BCM GPIOs used by pi3hat.cc.
+constexpr int kCan1Irq = 26;
+constexpr int kCan2Irq = 5;
+constexpr int kAuxCanIrq = 22;
+constexpr int kImuIrq = 23;
+
+/// These match the register layouts of fw/imu.h and fw/pi3_hat.cc.
+struct AttitudeRegister {
+  uint8_t present = 0;
+  uint8_t update_time_10us = 0;
+  float w = 0;
+  float x = 0;
+  float y = 0;
+  float z = 0;
+  float x_dps = 0;
+  float y_dps = 0;
+  float z_dps = 0;
+  float a_x_mps2 = 0;
+  float a_y_mps2 = 0;
+  float a_z_mps2 = 0;
+  float bias_x_dps = 0;
+  float bias_y_dps = 0;
+  float bias_z_dps = 0;
+  float uncertainty_w = 0;
+  float uncertainty_x = 0;
+  float uncertainty_y = 0;
+  float uncertainty_z = 0;
+  float uncertainty_bias_x_dps = 0;
+  float uncertainty_bias_y_dps = 0;
+  float uncertainty_bias_z_dps = 0;
+  uint32_t error_count = 0;
+  uint32_t last_error = 0;
+  uint32_t update_cycles = 0;
+} __attribute__((packed));
+
+struct SampleRegister {
+  uint32_t timestamp_us = 0;
+  float gx_dps = 0;
+  float gy_dps = 0;
+  float gz_dps = 0;
+  float ax_mps2 = 0;
+  float ay_mps2 = 0;
+  float az_mps2 = 0;
+} __attribute__((packed));
+
+struct FifoStatusRegister {
+  uint16_t count = 0;
+  uint16_t contiguous = 0;
+  uint32_t overflow_count = 0;
+} __attribute__((packed));
+
+constexpr size_t kStatusSize = 6;
+constexpr int kFifoSize = 64;
+constexpr int kRxQueueSize = 32;
+constexpr int kStatusItems = 6;
+constexpr int kMaxTemplates = 16;
+
+/// The time a CAN-FD frame with bit rate switching occupies the bus,
+/// ignoring bit stuffing.
+/// Tracks when a single CAN bus is occupied.
+class CanBusModel {
+ public:
+  /// Reserve the first gap of at least @p duration_ns which starts no
+  /// earlier than @p earliest_ns.
+  ///
+  /// @return the start of the reserved interval
+  int64_t Reserve(int64_t now, int64_t earliest_ns, int64_t duration_ns) {
+    // Forget about anything which is over with.
+    busy_.erase(
+        std::remove_if(busy_.begin(), busy_.end(),
+                       [&](const Interval& i) { return i.end <= now; }),
+        busy_.end());
+
+    int64_t start = earliest_ns;
+    for (const auto& interval : busy_) {
+      if (start + duration_ns <= interval.start) { break; }
+      start = std::max(start, interval.end);
+    }
+
+    Interval result;
+    result.start = start;
+    result.end = start + duration_ns;
+    busy_.insert(
+        std::upper_bound(
+            busy_.begin(), busy_.end(), result,
+            [](const Interval& lhs, const Interval& rhs) {
+              return lhs.start < rhs.start;
+            }),
+        result);
+    return start;
+  }
+
+ private:
+  struct Interval {
+    int64_t start = 0;
+    int64_t end = 0;
+  };
+
+  // Sorted by start time, and non-overlapping.
+  std::vector<Interval> busy_;
+};
+
+/// Models one STM32 processor.  Every processor presents the
+/// CanBridge registers for its two CAN buses, and the auxiliary
+/// processor additionally presents the Imu and RfTransceiver
+/// registers along with the status registers.
+class Processor {
+ public:
+  Processor(const Pi3HatSimulator::Options& options, int bus_start, bool aux)
+      : options_(options),
+        bus_start_(bus_start),
+        aux_(aux),
+        imu_start_ns_(GetNow()) {
+    imu_config_.rate_hz = 400;
+    microphone_.base_ns = imu_start_ns_;
+  }
+
+  void Read(int64_t now, int address, char* data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (now < boot_end_ns_) {
+      // It does not respond at all until it has finished booting.
+      ::memset(data, 0, size);
+      return;
+    }
+
+    if (address != kBurstReadAddress) {
+      ReadRegister(now, address, data, size);
+      return;
+    }
+
+    // Like the firmware, each listed register is zero padded or
+    // truncated to its size, and sees only as many bytes as of its
+    // own section were clocked out.
+    ::memset(data, 0, size);
+    size_t offset = 0;
+    for (const auto& entry : burst_) {
+      if (offset >= size) { break; }
+      char buf[256] = {};
+      ReadRegister(now, entry.address, buf,
+                   std::min<size_t>(entry.size, size - offset));
+      ::memcpy(&data[offset], buf,
+               std::min<size_t>(entry.size, size - offset));
+      offset += entry.size;
+    }
+  }
+
+  void ReadRegister(int64_t now, int address, char* data, size_t size) {
+    ::memset(data, 0, size);
+    auto emit = [&](const void* ptr, size_t ptr_size) {
+      ::memcpy(data, ptr, std::min(size, ptr_size));
+    };
+
+    if (address == 0) {
+      const uint8_t version = 4;
+      emit(&version, 1);
+    } else if (address == 1) {
+      const uint8_t type = 1;
+      emit(&type, 1);
+    } else if (address == 2) {
+      const int ready = std::min(ReadyFrames(now), kStatusItems);
+      uint8_t sizes[kStatusItems] = {};
+      for (int i = 0; i < ready; i++) {
+        sizes[i] = rx_queue_[i].size + 5;
+      }
+      emit(sizes, sizeof(sizes));
+    } else if (address == 3) {
+      if (ReadyFrames(now) == 0) { return; }
+      char buf[5 + 64] = {};
+      const auto frame_size = EncodeFrame(rx_queue_.front(), buf);
+      emit(buf, frame_size);
+      PopFrame();
+    } else if (address == 10 || address == 13) {
+      // Like the firmware, the count of everything ready is given,
+      // but only as many frames as register 2 reports are offered,
+      // and only those which fit completely within the read are
+      // consumed.
+      const bool timestamp = (address == 13);
+      const int ready = ReadyFrames(now);
+      const int offered = std::min(ready, kStatusItems);
+      char buf[5 + kStatusItems * (9 + 64)] = {};
+      buf[0] = static_cast<char>(std::min(ready, 255));
+      size_t total = 1;
+      if (timestamp) {
+        WriteU32(&buf[1], static_cast<uint32_t>(now / 1000));
+        total += 4;
+      }
+      int consumed = 0;
+      for (int i = 0; i < offered; i++) {
+        total += EncodeFrame(rx_queue_[i], &buf[total], timestamp);
+        if (total <= size) { consumed++; }
+      }
+      emit(buf, total);
+      for (int i = 0; i < consumed; i++) { PopFrame(); }
+    } else if (address == 6) {
+      uint8_t status[16] = {};
+      status[5] = static_cast<uint8_t>(rx_overflow_[0]);
+      status[11] = static_cast<uint8_t>(rx_overflow_[1]);
+      status[13] = malformed_count_;
+      emit(status, sizeof(status));
+    } else if (address == 101) {
+      emit(&rejected_count_, sizeof(rejected_count_));
+    } else if (address == 97 || address == 100) {
+      // The device information and performance are all zero.
+    } else if (aux_) {
+      ReadAux(now, address, data, size);
+    }
+  }
+
+  /// True for the registers which the firmware refuses in a burst
+  /// list, because they receive data.
+  bool IsWriteAddress(int address) const {
+    if (address == 4 || address == 5 || (address >= 7 && address <= 9) ||
+        address == 11 || address == 12 || address == 99) {
+      return true;
+    }
+    return aux_ && (address == 36 || address == 50 || address == 51 ||
+                    address == 54 || address == 83 || address == 84);
+  }
+
+  /// Count a CRC framed write which was discarded, as reported by
+  /// register 101.
+  void RejectWrite() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rejected_count_++;
+  }
+
+  void Write(int64_t now, int address, const char* data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (now < boot_end_ns_) { return; }
+
+    if (address == 99) {
+      if (size == 4 && ::memcmp(data, "RSET", 4) == 0) { Reset(now); }
+    } else if (address == kBurstListAddress) {
+      burst_.clear();
+      size_t total = 0;
+      for (size_t i = 0; i + 1 < size && burst_.size() < kMaxBurstEntries;
+           i += 2) {
+        const int entry_address = u8(data[i]);
+        if (entry_address == kBurstListAddress ||
+            entry_address == kBurstReadAddress ||
+            IsWriteAddress(entry_address)) {
+          burst_.clear();
+          return;
+        }
+        burst_.push_back({entry_address, u8(data[i + 1])});
+        total += u8(data[i + 1]);
+      }
+      if (total > kMaxBurstSize) { burst_.clear(); }
+    } else if (address == 4 || address == 5) {
+      const size_t header_size = (address == 4) ? 5 : 3;
+      if (size < header_size) {
+        malformed_count_++;
+        return;
+      }
+      const int can_bus = (u8(data[0]) & 0x80) ? 1 : 0;
+      const size_t payload_size = u8(data[0]) & 0x7f;
+      if (header_size + payload_size > size || payload_size > 64) {
+        malformed_count_++;
+        return;
+      }
+      const uint32_t id = (address == 4) ?
+          ((u8(data[1]) << 24) | (u8(data[2]) << 16) |
+           (u8(data[3]) << 8) | u8(data[4])) :
+          ((u8(data[1]) << 8) | u8(data[2]));
+      Transmit(now, can_bus, id, payload_size);
+    } else if (address == 7) {
+      size_t offset = 0;
+      while (offset < size) {
+        const size_t used = ParseBatchFrame(now, &data[offset], size - offset);
+        if (used == 0) {
+          malformed_count_++;
+          return;
+        }
+        offset += used;
+      }
+    } else if (address == 8) {
+      StoreTemplate(data, size);
+    } else if (address == 9) {
+      SendTemplates(now, data, size);
+    } else if (address == 11) {
+      StoreFilters(data, size);
+    } else if (address == 12) {
+      if (size < 1) { return; }
+      aggregate_.active = true;
+      aggregate_.start_ns = now;
+      aggregate_.count = u8(data[0]);
+      aggregate_.timeout_ns = (size >= 3) ?
+          1000ll * (u8(data[1]) | (u8(data[2]) << 8)) : 0;
+      aggregate_.consumed = 0;
+    } else if (aux_) {
+      WriteAux(now, address, data, size);
+    }
+  }
+
+  void SetHung(bool hung) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    hung_ = hung;
+  }
+
+  bool can_irq(int64_t now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (aggregate_.active) {
+      const bool timed_out = aggregate_.timeout_ns != 0 &&
+          (now - aggregate_.start_ns) >= aggregate_.timeout_ns;
+      if (timed_out ||
+          aggregate_.consumed + ReceivedSince(aggregate_.start_ns, now) >=
+          aggregate_.count) {
+        aggregate_.active = false;
+      }
+    }
+    return !aggregate_.active && ReadyFrames(now) > 0;
+  }
+
+  bool imu_irq(int64_t now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ImuIndex(now) != attitude_read_index_;
+  }
+
+  void AddStats(Pi3HatSimulator::Stats* stats) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The auxiliary processor only has the one bus, JC5.
+    for (int i = 0; i < (aux_ ? 1 : 2); i++) {
+      stats->tx_frames[bus_start_ + i] = tx_frames_[i];
+      stats->rx_frames[bus_start_ + i] = rx_frames_[i];
+      stats->rx_overflow[bus_start_ + i] = rx_overflow_[i];
+    }
+  }
+
+ private:
+  /// Discard everything a reset of the real processor would, and
+  /// stop responding while it boots.
+  void Reset(int64_t now) {
+    boot_end_ns_ = now + kBootNs;
+    hung_ = false;
+
+    burst_.clear();
+    rejected_count_ = 0;
+    rx_queue_.clear();
+    for (auto& this_template : templates_) { this_template = {}; }
+    for (auto& filter_set : filters_) { filter_set = {}; }
+    aggregate_ = {};
+    malformed_count_ = 0;
+
+    imu_config_ = {};
+    imu_config_.rate_hz = 400;
+    rf_id_ = 0;
+    microphone_ = {};
+    microphone_.base_ns = now;
+  }
+
+  struct RxFrame {
+    int64_t ready_ns = 0;
+    int can_bus = 0;
+    uint32_t id = 0;
+    int size = 0;
+  };
+
+  /// The state of a register 12 aggregation.
+  struct Aggregate {
+    bool active = false;
+    int64_t start_ns = 0;
+    int count = 0;
+    int64_t timeout_ns = 0;
+
+    // Frames received after start_ns which have since been read.
+    int consumed = 0;
+  };
+
+  struct Filter {
+    bool accept = true;
+    int mode = 0;
+    bool extended = false;
+    uint32_t id1 = 0;
+    uint32_t id2 = 0;
+  };
+
+  struct FilterSet {
+    std::vector<Filter> filters;
+    bool reject_standard = false;
+    bool reject_extended = false;
+  };
+
+  struct Template {
+    bool valid = false;
+    int can_bus = 0;
+    uint32_t id = 0;
+    int size = 0;
+    int patch_size = 0;
+  };
+
+  /// The number of frames at the head of the queue which have
+  /// finished arriving.
+  int ReadyFrames(int64_t now) const {
+    int result = 0;
+    for (const auto& frame : rx_queue_) {
+      if (frame.ready_ns > now) { break; }
+      result++;
+    }
+    return result;
+  }
+
+  /// The number of queued frames which finished arriving in the
+  /// interval (start, now].
+  int ReceivedSince(int64_t start, int64_t now) const {
+    int result = 0;
+    for (const auto& frame : rx_queue_) {
+      if (frame.ready_ns > now) { break; }
+      if (frame.ready_ns > start) { result++; }
+    }
+    return result;
+  }
+
+  void PopFrame() {
+    if (aggregate_.active && rx_queue_.front().ready_ns > aggregate_.start_ns) {
+      aggregate_.consumed++;
+    }
+    rx_queue_.pop_front();
+  }
+
+  static void WriteU32(char* buf, uint32_t value) {
+    buf[0] = (value >> 24) & 0xff;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = (value >> 0) & 0xff;
+  }
+
+  /// Write a frame in the format of register 3, or if 'timestamp' is
+  /// set, that of register 13.
+  ///
+  /// @return the number of bytes used
+  static size_t EncodeFrame(const RxFrame& frame, char* buf,
+                            bool timestamp = false) {
+    buf[0] = (frame.can_bus ? 0x80 : 0x00) | (frame.size + 1);
+    WriteU32(&buf[1], frame.id);
+    size_t header_size = 5;
+    if (timestamp) {
+      WriteU32(&buf[5], static_cast<uint32_t>(frame.ready_ns / 1000));
+      header_size = 9;
+    }
+    ::memset(&buf[header_size], 0x50, frame.size);
+    return header_size + frame.size;
+  }
+
+  /// Parse the acceptance filters in the format of register 11.
+  void StoreFilters(const char* data, size_t size) {
+    constexpr size_t kFilterSize = 9;
+    if (size < 1 || ((size - 1) % kFilterSize) != 0) {
+      malformed_count_++;
+      return;
+    }
+    auto& set = filters_[(u8(data[0]) & 0x80) ? 1 : 0];
+    set.reject_standard = (u8(data[0]) & 0x02) != 0;
+    set.reject_extended = (u8(data[0]) & 0x01) != 0;
+    set.filters.clear();
+    auto read_u32 = [](const char* ptr) {
+      return static_cast<uint32_t>(
+          (u8(ptr[0]) << 24) | (u8(ptr[1]) << 16) |
+          (u8(ptr[2]) << 8) | u8(ptr[3]));
+    };
+    for (size_t offset = 1; offset < size; offset += kFilterSize) {
+      const char* const item = &data[offset];
+      Filter filter;
+      filter.accept = (u8(item[0]) & 0x03) == 1;
+      filter.mode = (u8(item[0]) >> 2) & 0x03;
+      filter.extended = (u8(item[0]) & 0x10) != 0;
+      filter.id1 = read_u32(&item[1]);
+      filter.id2 = read_u32(&item[5]);
+      set.filters.push_back(filter);
+    }
+  }
+
+  /// @return true if a frame with the given ID would be passed by
+  /// the acceptance filters of the given bus.
+  bool Accepted(int can_bus, uint32_t id) const {
+    const auto& set = filters_[can_bus];
+    const bool extended = id > 0x7ff;
+    for (const auto& filter : set.filters) {
+      if (filter.extended != extended) { continue; }
+      const bool match =
+          (filter.mode == 0) ? (id >= filter.id1 && id <= filter.id2) :
+          (filter.mode == 1) ? (id == filter.id1 || id == filter.id2) :
+          ((id & filter.id2) == (filter.id1 & filter.id2));
+      if (match) { return filter.accept; }
+    }
+    return extended ? !set.reject_extended : !set.reject_standard;
+  }
+
+  /// Parse one frame in the format of register 7 and send it.
+  ///
+  /// @return the number of bytes used, or 0 if malformed
+  size_t ParseBatchFrame(int64_t now, const char* frame, size_t remaining) {
+    if (remaining < 2) { return 0; }
+    const int can_bus = (u8(frame[0]) & 0x80) ? 1 : 0;
+    const size_t id_size = (u8(frame[0]) & 0x40) ? 4 : 2;
+    const size_t payload_size = u8(frame[1]);
+    const size_t header_size = 2 + id_size;
+    if (payload_size > 64 || header_size + payload_size > remaining) {
+      return 0;
+    }
+    const uint32_t id = (id_size == 4) ?
+        ((u8(frame[2]) << 24) | (u8(frame[3]) << 16) |
+         (u8(frame[4]) << 8) | u8(frame[5])) :
+        ((u8(frame[2]) << 8) | u8(frame[3]));
+    Transmit(now, can_bus, id, payload_size);
+    return header_size + payload_size;
+  }
+
+  void StoreTemplate(const char* data, size_t size) {
+    if (size < 1) { return; }
+    const int slot = u8(data[0]);
+    if (slot >= kMaxTemplates) {
+      malformed_count_++;
+      return;
+    }
+    auto& this_template = templates_[slot];
+    this_template.valid = false;
+    if (size == 1) { return; }
+    if (size < 5) {
+      malformed_count_++;
+      return;
+    }
+
+    const char* const frame = &data[3];
+    const size_t id_size = (u8(frame[0]) & 0x40) ? 4 : 2;
+    const int payload_size = u8(frame[1]);
+    const int patch_offset = u8(data[1]);
+    const int patch_size = u8(data[2]);
+    if (payload_size > 64 ||
+        3 + 2 + id_size + payload_size > size ||
+        patch_size > 32 ||
+        patch_offset + patch_size > payload_size) {
+      malformed_count_++;
+      return;
+    }
+
+    this_template.can_bus = (u8(frame[0]) & 0x80) ? 1 : 0;
+    this_template.id = (id_size == 4) ?
+        ((u8(frame[2]) << 24) | (u8(frame[3]) << 16) |
+         (u8(frame[4]) << 8) | u8(frame[5])) :
+        ((u8(frame[2]) << 8) | u8(frame[3]));
+    this_template.size = payload_size;
+    this_template.patch_size = patch_size;
+    this_template.valid = true;
+  }
+
+  void SendTemplates(int64_t now, const char* data, size_t size) {
+    if (size < 2) {
+      malformed_count_++;
+      return;
+    }
+    const uint16_t mask = u8(data[0]) | (u8(data[1]) << 8);
+    size_t patch_start = 2;
+    for (int i = 0; i < kMaxTemplates; i++) {
+      if ((mask & (1 << i)) == 0) { continue; }
+      const auto& this_template = templates_[i];
+      if (patch_start + this_template.patch_size > size) {
+        malformed_count_++;
+        return;
+      }
+      patch_start += this_template.patch_size;
+      if (!this_template.valid) { continue; }
+      Transmit(now, this_template.can_bus, this_template.id,
+               this_template.size);
+    }
+  }
+
+  /// Send a frame on one of our CAN buses, and schedule any reply
+  /// from the addressed device.
+  void Transmit(int64_t now, int can_bus, uint32_t id, int size) {
+    // A hung processor accepts frames over SPI, but never sends them.
+    if (hung_) { return; }
+
+    tx_frames_[can_bus]++;
+
+    auto& bus = buses_[can_bus];
+    // The auxiliary processor has only one bus.
+    const auto& rate = options_.can_rate[std::min(bus_start_ + can_bus, 5)];
+    const auto tx_time = EstimateCanFrameTimeNs(rate, id, size);
+    const auto tx_start = bus.Reserve(
+        now, now + options_.can_tx_latency_ns, tx_time);
+
+    const int dest = id & 0x7f;
+    if ((id & 0x8000) == 0 || !options_.servo_ids.test(dest)) { return; }
+
+    RxFrame reply;
+    reply.can_bus = can_bus;
+    reply.id = (dest << 8) | ((id >> 8) & 0x7f);
+    reply.size = rate.fdcan_frame ?
+        RoundUpDlc(options_.reply_size) : std::min(options_.reply_size, 8);
+
+    const auto reply_time = EstimateCanFrameTimeNs(rate, reply.id, reply.size);
+    const auto reply_start = bus.Reserve(
+        now, tx_start + tx_time + options_.reply_latency_ns, reply_time);
+    reply.ready_ns = reply_start + reply_time;
+
+    // A rejected reply still occupies the bus, but is never queued.
+    if (!Accepted(can_bus, reply.id)) { return; }
+
+    if (rx_queue_.size() >= kRxQueueSize) {
+      rx_overflow_[can_bus]++;
+      return;
+    }
+
+    rx_frames_[can_bus]++;
+    rx_queue_.insert(
+        std::upper_bound(
+            rx_queue_.begin(), rx_queue_.end(), reply,
+            [](const RxFrame& lhs, const RxFrame& rhs) {
+              return lhs.ready_ns < rhs.ready_ns;
+            }),
+        reply);
+  }
+
+  /// The index of the most recent IMU sample at the given time.
+  int64_t ImuIndex(int64_t now) const {
+    return (now - imu_start_ns_) * options_.imu_rate_hz / 1000000000ll;
+  }
+
+  /// @return the attitude register contents, or an empty result if
+  /// no new sample has been produced since the last read.
+  size_t GetAttitude(int64_t now, char* buf) {
+    const auto index = ImuIndex(now);
+    if (index == attitude_read_index_) { return 0; }
+    attitude_read_index_ = index;
+
+    AttitudeRegister attitude;
+    attitude.present = 1;
+    attitude.w = 1.0f;
+    attitude.a_z_mps2 = 9.81f;
+    ::memcpy(buf, &attitude, sizeof(attitude));
+    return sizeof(attitude);
+  }
+
+  void FillStatus(int64_t now, char* buf) {
+    buf[0] = std::min(255, ReadyFrames(now));
+    buf[1] = (ImuIndex(now) != attitude_read_index_) ? 1 : 0;
+    // No RF transmitter is modeled, so the bitfield never changes.
+  }
+
+  /// Bring the sample FIFO up to date, discarding anything which
+  /// would not have fit.
+  void UpdateFifo(int64_t now) {
+    const auto head = ImuIndex(now);
+    if (head - fifo_tail_ > kFifoSize) {
+      fifo_overflow_count_ += head - fifo_tail_ - kFifoSize;
+      fifo_tail_ = head - kFifoSize;
+    }
+    fifo_head_ = head;
+  }
+
+  int FifoContiguous() const {
+    const int count = fifo_head_ - fifo_tail_;
+    return std::min<int>(count, kFifoSize - (fifo_tail_ % kFifoSize));
+  }
+
+  /// Bring the microphone ring up to date, discarding anything which
+  /// would not have fit.
+  void UpdateMicrophone(int64_t now) {
+    auto& mic = microphone_;
+    mic.head = mic.base_count +
+        (now - mic.base_ns) * mic.rate_hz / 1000000000ll;
+    const int64_t limit = kMicrophoneRingSize - kMicrophoneGuardSize;
+    if (mic.head - mic.tail > limit) {
+      mic.overrun_count += mic.head - mic.tail - limit;
+      mic.tail = mic.head - limit;
+    }
+  }
+
+  static void WriteU16(char* buf, uint32_t value) {
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+  }
+
+  void ReadAux(int64_t now, int address, char* data, size_t size) {
+    auto emit = [&](const void* ptr, size_t ptr_size) {
+      ::memcpy(data, ptr, std::min(size, ptr_size));
+    };
+
+    if (address == 32) {
+      const uint8_t version = 0x21;
+      emit(&version, 1);
+    } else if (address == 34) {
+      char buf[sizeof(AttitudeRegister)] = {};
+      emit(buf, GetAttitude(now, buf));
+    } else if (address == 35) {
+      emit(&imu_config_, sizeof(imu_config_));
+    } else if (address == 37) {
+      UpdateFifo(now);
+      FifoStatusRegister status;
+      status.count = fifo_head_ - fifo_tail_;
+      status.contiguous = FifoContiguous();
+      status.overflow_count = fifo_overflow_count_;
+      emit(&status, sizeof(status));
+    } else if (address == 38) {
+      UpdateFifo(now);
+      const int to_read = std::min<int>(
+          FifoContiguous(), size / sizeof(SampleRegister));
+      const int64_t period_ns = 1000000000ll / options_.imu_rate_hz;
+      for (int i = 0; i < to_read; i++) {
+        SampleRegister sample;
+        sample.timestamp_us = static_cast<uint32_t>(
+            (fifo_tail_ + i) * period_ns / 1000);
+        sample.az_mps2 = 9.81f;
+        ::memcpy(&data[i * sizeof(sample)], &sample, sizeof(sample));
+      }
+      fifo_tail_ += to_read;
+    } else if (address == 48) {
+      const uint8_t version = 0x11;
+      emit(&version, 1);
+    } else if (address == 49) {
+      emit(&rf_id_, sizeof(rf_id_));
+    } else if (address == 52) {
+      // byte 0-3 are the bitfield, then the ms since last lock, then
+      // the mask of unread slots.  No data is ever received.
+      char buf[10] = {};
+      ::memset(&buf[4], 0xff, 4);
+      emit(buf, sizeof(buf));
+    } else if (address == 53) {
+      // With no slots pending, the mask reads as zero.
+    } else if (address >= 64 && address <= 79) {
+      // Each slot reads as empty.
+    } else if (address == 80) {
+      const uint8_t version = 0x22;
+      emit(&version, 1);
+    } else if (address == 81) {
+      UpdateMicrophone(now);
+      auto& mic = microphone_;
+      const int64_t count = std::min<int64_t>(
+          mic.head - mic.tail, mic.requested);
+      mic.requested = 0;
+      char buf[4 + kMaxMicrophoneReadSize] = {};
+      WriteU16(&buf[0], count);
+      WriteU16(&buf[2], mic.overrun_count);
+      // The samples are a ramp, which makes any discontinuity obvious.
+      for (int64_t i = 0; i < count; i++) {
+        buf[4 + i] = static_cast<char>((mic.tail + i) & 0xff);
+      }
+      emit(buf, 4 + count);
+      // As with the firmware, a short read consumes nothing.
+      if (static_cast<int64_t>(size) >= 4 + count) { mic.tail += count; }
+    } else if (address == 82) {
+      UpdateMicrophone(now);
+      const auto& mic = microphone_;
+      char buf[6] = {};
+      WriteU16(&buf[0], std::min<int64_t>(65535, mic.head - mic.tail));
+      WriteU16(&buf[2], mic.rate_hz);
+      WriteU16(&buf[4], mic.overrun_count);
+      emit(buf, sizeof(buf));
+    } else if (address == 96) {
+      char buf[kStatusSize] = {};
+      FillStatus(now, buf);
+      emit(buf, sizeof(buf));
+    } else if (address == 98) {
+      char buf[kStatusSize + sizeof(AttitudeRegister)] = {};
+      FillStatus(now, buf);
+      GetAttitude(now, &buf[kStatusSize]);
+      emit(buf, sizeof(buf));
+    }
+  }
+
+  void WriteAux(int64_t now, int address, const char* data, size_t size) {
+    if (address == 36 && (size == sizeof(imu_config_) ||
+                          size == kLegacyImuConfigurationSize)) {
+      imu_config_.filter_rate_hz = 0;
+      ::memcpy(&imu_config_, data, size);
+    } else if (address == 50 && size == sizeof(rf_id_)) {
+      ::memcpy(&rf_id_, data, sizeof(rf_id_));
+    } else if (address == 83 && size >= 2) {
+      const int rate_hz = u8(data[0]) | (u8(data[1]) << 8);
+      UpdateMicrophone(now);
+      microphone_.base_ns = now;
+      microphone_.base_count = microphone_.head;
+      microphone_.rate_hz = (rate_hz == 0) ? 0 :
+          std::max(int(kMinMicrophoneRateHz),
+                        std::min(int(kMaxMicrophoneRateHz), rate_hz));
+    } else if (address == 84 && size >= 2) {
+      microphone_.requested = std::min<int64_t>(
+          kMaxMicrophoneReadSize, u8(data[0]) | (u8(data[1]) << 8));
+    }
+    // Slot writes to registers 51 and 54 are accepted and discarded.
+  }
+
+  const Pi3HatSimulator::Options options_;
+  const int bus_start_;
+  const bool aux_;
+
+  mutable std::mutex mutex_;
+
+  // The most recent burst list, as written to register 126.
+  static constexpr int kBurstListAddress = 126;
+  static constexpr int kBurstReadAddress = 127;
+  static constexpr size_t kMaxBurstEntries = 8;
+  static constexpr size_t kMaxBurstSize = 256;
+  struct BurstEntry {
+    int address;
+    size_t size;
+  };
+  std::vector<BurstEntry> burst_;
+
+  uint32_t rejected_count_ = 0;
+
+  // After a reset through register 99, nothing is responded to until
+  // this time.
+  static constexpr int64_t kBootNs = 50000000;
+  int64_t boot_end_ns_ = 0;
+
+  // See Pi3HatSimulator::SetHung.
+  bool hung_ = false;
+
+  CanBusModel buses_[2];
+  std::deque<RxFrame> rx_queue_;
+  Template templates_[kMaxTemplates];
+  FilterSet filters_[2];
+  Aggregate aggregate_;
+  uint8_t malformed_count_ = 0;
+
+  uint64_t tx_frames_[2] = {};
+  uint64_t rx_frames_[2] = {};
+  uint64_t rx_overflow_[2] = {};
+
+  const int64_t imu_start_ns_;
+  int64_t attitude_read_index_ = 0;
+  int64_t fifo_head_ = 0;
+  int64_t fifo_tail_ = 0;
+  uint32_t fifo_overflow_count_ = 0;
+
+  struct ImuConfiguration {
+    float yaw_deg = 0;
+    float pitch_deg = 0;
+    float roll_deg = 0;
+    uint32_t rate_hz = 0;
+    uint32_t filter_rate_hz = 0;
+  } __attribute__((packed));
+
+  // Older hosts write only the fields before 'filter_rate_hz'.
+  static constexpr size_t kLegacyImuConfigurationSize = 16;
+
+  ImuConfiguration imu_config_;
+  uint32_t rf_id_ = 0;
+
+  // These match the firmware's Microphone.
+  static constexpr int64_t kMicrophoneRingSize = 4096;
+  static constexpr int64_t kMicrophoneGuardSize = 64;
+  static constexpr int kMaxMicrophoneReadSize = 1024;
+  static constexpr int kMinMicrophoneRateHz = 200;
+  static constexpr int kMaxMicrophoneRateHz = 48000;
+
+  struct Microphone {
+    // The rate is taken to have been constant since 'base_ns', when
+    // 'base_count' samples had been produced.
+    int64_t base_ns = 0;
+    int64_t base_count = 0;
+    int rate_hz = 22050;
+
+    int64_t head = 0;
+    int64_t tail = 0;
+    uint16_t overrun_count = 0;
+    // Set by register 84, for the next read of 81 only.
+    int64_t requested = 0;
+  };
+
+  Microphone microphone_;
+};
+
+/// One SPI bus, which dispatches each chip select to a processor.
+class SimulatedSpi : public SpiTransport {
+ public:
+  SimulatedSpi(const Pi3HatSimulator::Options& options,
+               std::vector<Processor*> processors)
+      : options_(options),
+        processors_(processors),
+        timing_(processors.size()) {
+    for (auto& timing : timing_) {
+      timing.speed_hz = options.spi_speed_hz;
+      timing.cs_hold_us = options.cs_hold_us;
+      timing.address_hold_us = options.address_hold_us;
+    }
+  }
+
+  void Write(int cs, int address, const char* data, size_t size) override {
+    if (cs < 0 || cs >= static_cast<int>(processors_.size())) { return; }
+
+    const auto now = GetNow();
+    const auto end = now + TransactionTimeNs(cs, size);
+    if (options_.model_spi_time) { BusyWaitUntil(end); }
+
+    if (!Reliable(cs)) { return; }
+    processors_[cs]->Write(end, address, data, size);
+  }
+
+  void Read(int cs, int address, char* data, size_t size) override {
+    if (cs < 0 || cs >= static_cast<int>(processors_.size())) {
+      ::memset(data, 0, size);
+      return;
+    }
+
+    const auto now = GetNow();
+    const auto end = now + TransactionTimeNs(cs, size);
+
+    if (!Reliable(cs)) {
+      ::memset(data, 0xff, size);
+    } else {
+      // The register contents are latched at the start of the data
+      // phase.
+      processors_[cs]->Read(
+          now + AddressTimeNs(cs), address, data, size);
+    }
+
+    if (options_.model_spi_time) { BusyWaitUntil(end); }
+  }
+
+  void WriteHeader(int cs, const char* header, size_t header_size,
+                   int hold_us, const char* data, size_t size) override {
+    if (header_size == 1) {
+      Write(cs, u8(header[0]), data, size);
+      return;
+    }
+    if (cs < 0 || cs >= static_cast<int>(processors_.size())) { return; }
+
+    size_t length = 0;
+    const int address = ParseCrcHeader(header, header_size, &length);
+
+    const auto now = GetNow();
+    const auto end = now + TransactionTimeNs(cs, header_size - 1 + size) +
+        hold_us * 1000ll;
+    if (options_.model_spi_time) { BusyWaitUntil(end); }
+
+    if (address < 0 || !Reliable(cs) || size != length + 2 ||
+        !CrcMatches(header, header_size, data, length)) {
+      processors_[cs]->RejectWrite();
+      return;
+    }
+    processors_[cs]->Write(end, address, data, length);
+  }
+
+  void ReadHeader(int cs, const char* header, size_t header_size,
+                  int hold_us, char* data, size_t size) override {
+    if (header_size == 1) {
+      Read(cs, u8(header[0]), data, size);
+      return;
+    }
+    ::memset(data, 0, size);
+    if (cs < 0 || cs >= static_cast<int>(processors_.size())) { return; }
+
+    size_t length = 0;
+    const int address = ParseCrcHeader(header, header_size, &length);
+
+    const auto now = GetNow();
+    const auto end = now + TransactionTimeNs(cs, header_size - 1 + size) +
+        hold_us * 1000ll;
+
+    if (!Reliable(cs)) {
+      ::memset(data, 0xff, size);
+    } else if (address >= 0) {
+      // As with the firmware, the register is padded or truncated to
+      // the requested length, then followed by its CRC.
+      std::vector<char> buf(length + 2);
+      processors_[cs]->Read(
+          now + AddressTimeNs(cs), address, buf.data(), length);
+      const uint16_t crc = Crc16(
+          Crc16(0xffff, header, header_size), buf.data(), length);
+      buf[length] = crc >> 8;
+      buf[length + 1] = crc & 0xff;
+      ::memcpy(data, buf.data(), std::min(size, buf.size()));
+    }
+
+    if (options_.model_spi_time) { BusyWaitUntil(end); }
+  }
+
+  void SetTiming(int cs, const SpiTiming& timing) override {
+    if (cs < 0 || cs >= static_cast<int>(timing_.size())) { return; }
+    timing_[cs] = timing;
+  }
+
+ private:
+  static constexpr uint8_t kCrcFlag = 0x80;
+  static constexpr size_t kMaxCrcSize = 1024;
+
+  /// @return the address of a CRC framed header, storing its length
+  /// in @p length, or -1 if it is not valid.
+  static int ParseCrcHeader(const char* header, size_t header_size,
+                            size_t* length) {
+    if (header_size != 3 || !(u8(header[0]) & kCrcFlag)) { return -1; }
+    *length = u8(header[1]) | (u8(header[2]) << 8);
+    if (*length > kMaxCrcSize) { return -1; }
+    return u8(header[0]) & ~kCrcFlag;
+  }
+
+  static bool CrcMatches(const char* header, size_t header_size,
+                         const char* data, size_t length) {
+    const uint16_t crc =
+        Crc16(Crc16(0xffff, header, header_size), data, length);
+    return u8(data[length]) == (crc >> 8) &&
+        u8(data[length + 1]) == (crc & 0xff);
+  }
+
+  bool Reliable(int cs) const {
+    const auto& timing = timing_[cs];
+    return timing.speed_hz <= options_.max_reliable_speed_hz &&
+        timing.cs_hold_us >= options_.min_cs_hold_us &&
+        timing.address_hold_us >= options_.min_address_hold_us;
+  }
+
+  int64_t AddressTimeNs(int cs) const {
+    const auto& timing = timing_[cs];
+    return timing.cs_hold_us * 2000ll +
+        8ll * 1000000000ll / timing.speed_hz;
+  }
+
+  int64_t TransactionTimeNs(int cs, size_t size) const {
+    if (size == 0) { return AddressTimeNs(cs); }
+    const auto& timing = timing_[cs];
+    return AddressTimeNs(cs) + timing.address_hold_us * 1000ll +
+        static_cast<int64_t>(size) * 8ll * 1000000000ll /
+        timing.speed_hz;
+  }
+
+  const Pi3HatSimulator::Options options_;
+  const std::vector<Processor*> processors_;
+  std::vector<SpiTiming> timing_;
+};
+}
+
+class Pi3HatSimulator::Impl {
+ public:
+  Impl(const Options& options)
+      : can1_(options, 1, false),
+        can2_(options, 3, false),
+        aux_(options, 5, true),
+        primary_spi_(options, { &aux_ }),
+        aux_spi_(options, { &can1_, &can2_ }) {}
+
+  Processor can1_;
+  Processor can2_;
+  Processor aux_;
+
+  SimulatedSpi primary_spi_;
+  SimulatedSpi aux_spi_;
+};
+
+Pi3HatSimulator::Pi3HatSimulator(const Options& options)
+    : impl_(new Impl(options)) {}
+
+Pi3HatSimulator::~Pi3HatSimulator() {
+  delete impl_;
+}
+
+SpiTransport* Pi3HatSimulator::primary_spi() {
+  return &impl_->primary_spi_;
+}
+
+SpiTransport* Pi3HatSimulator::aux_spi() {
+  return &impl_->aux_spi_;
+}
+
+bool Pi3HatSimulator::GetGpioInput(int gpio) {
+  const auto now = GetNow();
+  switch (gpio) {
+    case kCan1Irq: { return impl_->can1_.can_irq(now); }
+    case kCan2Irq: { return impl_->can2_.can_irq(now); }
+    case kAuxCanIrq: { return impl_->aux_.can_irq(now); }
+    case kImuIrq: { return impl_->aux_.imu_irq(now); }
+  }
+  return false;
+}
+
+void Pi3HatSimulator::SetGpioOutput(int, bool) {}
+
+void Pi3HatSimulator::SetHung(int processor, bool hung) {
+  Processor* const processors[] = {
+    &impl_->can1_, &impl_->can2_, &impl_->aux_,
+  };
+  if (processor < 0 || processor > 2) { return; }
+  processors[processor]->SetHung(hung);
+}
+
+Pi3HatSimulator::Stats Pi3HatSimulator::stats() const {
+  Stats result;
+  impl_->can1_.AddStats(&result);
+  impl_->can2_.AddStats(&result);
+  impl_->aux_.AddStats(&result);
+  return result;
+}
+
+}
+}
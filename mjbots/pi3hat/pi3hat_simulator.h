@@ -0,0 +1,125 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _MJBOTS_PI3HAT_PI3HAT_SIMULATOR_H_
+#define _MJBOTS_PI3HAT_PI3HAT_SIMULATOR_H_
+
+/// @file
+///
+/// Like pi3hat.h, this relies on nothing but a C++11 compiler and
+/// standard library.
+
+#include <bitset>
+#include <cstdint>
+
+#include "pi3hat.h"
+
+namespace mjbots {
+namespace pi3hat {
+
+/// Models the SPI register interface of the three processors on the
+/// pi3hat, along with the CAN buses and devices attached to them, so
+/// that Pi3Hat can be exercised and profiled without any hardware.
+///
+/// The CanBridge registers are modeled on all three processors, and
+/// the Imu and RfTransceiver registers on the auxiliary processor.
+/// All timing is in terms of CLOCK_MONOTONIC, and by default each SPI
+/// transaction busy-waits for as long as it would take on the real
+/// buses, so that latency measurements are representative.
+///
+/// It is safe to use the primary and auxiliary SPI buses from
+/// different threads at the same time.
+class Pi3HatSimulator : public Transport {
+ public:
+  struct Options {
+    // Both SPI buses are modeled as running at this rate, with the
+    // same hold times as the Raspberry Pi driver.
+    int spi_speed_hz = 10000000;
+    int cs_hold_us = 3;
+    int address_hold_us = 3;
+
+    // If false, every SPI transaction completes immediately.  CAN
+    // traffic is still modeled as taking time.
+    bool model_spi_time = true;
+
+    // Transactions clocked faster than this, or with shorter holds,
+    // as set through SpiTransport::SetTiming, are corrupted: writes
+    // are lost and reads return all ones.
+    int max_reliable_speed_hz = 20000000;
+    int min_cs_hold_us = 1;
+    int min_address_hold_us = 1;
+
+    // How each CAN bus is configured, indexed by bus, where 1-4 are
+    // JC1-JC4 and 5 is JC5.  The defaults match the firmware.
+    CanRate can_rate[6];
+
+    // The time from a frame being received over SPI until it is
+    // ready to be sent on its CAN bus.
+    int64_t can_tx_latency_ns = 10000;
+
+    // A frame with the 0x8000 bit set in its ID is replied to, if
+    // the ID in its low 7 bits is present here.  The reply is sent
+    // this long after the request finishes on the bus, uses the
+    // moteus ID convention, and has this many payload bytes (limited
+    // to 8 on a classic CAN bus).
+    std::bitset<128> servo_ids;
+    int64_t reply_latency_ns = 100000;
+    int reply_size = 24;
+
+    // New attitude and raw IMU samples are produced at this rate.
+    int imu_rate_hz = 1000;
+
+    Options() {
+      servo_ids.set();
+      can_rate[5] = Pi3Hat::Configuration().can_rate[5];
+    }
+  };
+
+  Pi3HatSimulator(const Options& options = Options());
+  ~Pi3HatSimulator() override;
+
+  // This object is non-copyable.
+  Pi3HatSimulator(const Pi3HatSimulator&) = delete;
+  Pi3HatSimulator& operator=(const Pi3HatSimulator&) = delete;
+
+  SpiTransport* primary_spi() override;
+  SpiTransport* aux_spi() override;
+  bool GetGpioInput(int gpio) override;
+  void SetGpioOutput(int gpio, bool value) override;
+
+  /// Counts of CAN traffic, indexed by bus, where 1-5 correspond to
+  /// JC1-JC5.
+  struct Stats {
+    uint64_t tx_frames[6] = {};
+    uint64_t rx_frames[6] = {};
+    uint64_t rx_overflow[6] = {};
+  };
+
+  Stats stats() const;
+
+  /// Make one processor, indexed as in Pi3Hat::Output::timing.spi,
+  /// behave as though it has hung: frames written to it are never
+  /// sent, so nothing is ever received.  It still responds over SPI,
+  /// and resetting it through Pi3Hat::ResetProcessor clears this.
+  void SetHung(int processor, bool hung);
+
+ private:
+  class Impl;
+  Impl* const impl_;
+};
+
+}
+}
+
+#endif
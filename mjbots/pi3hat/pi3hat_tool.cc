@@ -26,6 +26,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iostream>
@@ -34,6 +35,7 @@
 #include <string>
 #include <vector>
 
+#include "cycle_log.h"
 #include "pi3hat.h"
 
 namespace mjbots {
@@ -63,6 +65,20 @@ struct Arguments {
         mounting_deg.roll = std::stod(args.at(++i));
       } else if (arg == "--attitude-rate") {
         attitude_rate_hz = std::stol(args.at(++i));
+      } else if (arg == "--imu-rate") {
+        imu_rate_hz = std::stol(args.at(++i));
+      } else if (arg == "--primary-thread") {
+        primary_spi_thread_cpu = std::stoi(args.at(++i));
+      } else if (arg == "--spi-dma") {
+        spi_dma = true;
+      } else if (arg == "--spi-timing") {
+        spi_timing.push_back(args.at(++i));
+      } else if (arg == "--calibrate-spi") {
+        calibrate_spi = true;
+      } else if (arg == "--spi-crc") {
+        spi_crc = true;
+      } else if (arg == "--fast-start") {
+        fast_start = true;
       } else if (arg == "--rf-id") {
         rf_id = std::stoul(args.at(++i));
       } else if (arg == "-c" || arg == "--write-can") {
@@ -75,8 +91,14 @@ struct Arguments {
         can_min_tx_wait_ns = std::stoull(args.at(++i));
       } else if (arg == "--can-rx-extra-wait-ns") {
         can_rx_extra_wait_ns = std::stoull(args.at(++i));
+      } else if (arg == "--can-irq") {
+        can_irq = true;
       } else if (arg == "--time-log") {
         time_log = args.at(++i);
+      } else if (arg == "--log") {
+        log = args.at(++i);
+      } else if (arg == "--dump-log") {
+        dump_log = args.at(++i);
       } else if (arg == "--realtime") {
         realtime = std::stoull(args.at(++i));
       } else if (arg == "--write-rf") {
@@ -85,12 +107,22 @@ struct Arguments {
         read_rf = true;
       } else if (arg == "--read-att") {
         read_attitude = true;
+      } else if (arg == "--att-irq") {
+        attitude_irq = true;
+      } else if (arg == "--read-imu-samples") {
+        read_imu_samples = true;
+      } else if (arg == "--can-status") {
+        can_status = true;
       } else if (arg == "--read-spi") {
         read_spi = args.at(++i);
       } else if (arg == "--info") {
         info = true;
       } else if (arg == "--performance") {
         performance = true;
+      } else if (arg == "--reset-processor") {
+        reset_processor = std::stoi(args.at(++i));
+      } else if (arg == "--timing") {
+        timing = std::stoi(args.at(++i));
       } else if (arg == "-r" || arg == "--run") {
         run = true;
       } else {
@@ -101,18 +133,32 @@ struct Arguments {
 
   bool help = false;
   bool run = false;
+  int timing = 0;
   std::string time_log;
+  std::string log;
+  std::string dump_log;
 
   int spi_speed_hz = -1;
   Euler mounting_deg;
   uint32_t attitude_rate_hz = 400;
+  uint32_t imu_rate_hz = 0;
   uint32_t rf_id = 5678;
+  int primary_spi_thread_cpu = -2;
+  bool spi_dma = false;
+  std::vector<std::string> spi_timing;
+  bool calibrate_spi = false;
+  bool spi_crc = false;
+  bool fast_start = false;
 
   std::vector<std::string> write_can;
   uint32_t read_can = 0;
   int64_t can_timeout_ns = 0;
   int64_t can_min_tx_wait_ns = 200000;
   int64_t can_rx_extra_wait_ns = 40000;
+  bool can_irq = false;
+  bool attitude_irq = false;
+  bool read_imu_samples = false;
+  bool can_status = false;
   int realtime = -1;
 
   std::vector<std::string> write_rf;
@@ -122,6 +168,7 @@ struct Arguments {
 
   bool info = false;
   bool performance = false;
+  int reset_processor = -1;
 };
 
 void DisplayUsage() {
@@ -135,9 +182,20 @@ void DisplayUsage() {
   std::cout << "  --mount-p DEG       set the mounting pitch angle\n";
   std::cout << "  --mount-r DEG       set the mounting roll angle\n";
   std::cout << "  --attitude-rate HZ  set the attitude rate\n";
+  std::cout << "  --imu-rate HZ       sample the IMU faster than the attitude rate\n";
   std::cout << "  --rf-id ID          set the RF id\n";
+  std::cout << "  --primary-thread CPU  use primary SPI thread on CPU (-1 for any)\n";
+  std::cout << "  --spi-dma           use DMA for the primary SPI bus\n";
+  std::cout << "  --spi-timing T      set the SPI timing of one processor (0+)\n";
+  std::cout << "     PROC,HZ,CS_HOLD_US,ADDRESS_HOLD_US\n";
+  std::cout << "        PROC - 0 (CAN1), 1 (CAN2), 2 (AUX)\n";
+  std::cout << "  --calibrate-spi     find the fastest reliable SPI timing,\n";
+  std::cout << "                      and print it\n";
+  std::cout << "  --spi-crc           protect SPI transactions with a CRC\n";
+  std::cout << "  --fast-start        bring the processors up in parallel\n";
   std::cout << "  --can-timeout-ns T  set the receive timeout\n";
   std::cout << "  --can-min-wait-ns T set the receive timeout\n";
+  std::cout << "  --can-irq           wait for CAN replies using the IRQ lines\n";
   std::cout << "  --realtime CPU      run in a realtime configuration on a CPU\n";
   std::cout << "\n";
   std::cout << "Actions\n";
@@ -149,12 +207,31 @@ void DisplayUsage() {
   std::cout << "     SLOT,PRIORITY,DATA\n";
   std::cout << "  --read-rf       request any RF data\n";
   std::cout << "  --read-att      request attitude data\n";
+  std::cout << "  --att-irq       wait for attitude using the IRQ line\n";
+  std::cout << "  --read-imu-samples  read the raw IMU sample FIFO\n";
+  std::cout << "  --can-status    report the health of each CAN bus used\n";
   std::cout << "  --read-spi      read raw SPI data\n";
   std::cout << "     SPIBUS,ADDRESS,SIZE\n";
   std::cout << "  --info          display device info\n";
   std::cout << "  --performance   print runtime performance\n";
+  std::cout << "  --reset-processor PROC  reset 0 (CAN1), 1 (CAN2), or 2 (AUX)\n";
   std::cout << "  -r,--run        run a sample high rate cycle\n";
+  std::cout << "  --timing COUNT  run COUNT cycles and print timing histograms\n";
   std::cout << "  --time-log F    when running, write a delta-t log\n";
+  std::cout << "  --log F         when running, write a binary cycle log\n";
+  std::cout << "  --dump-log F    print the contents of a binary cycle log\n";
+}
+
+std::vector<std::string> Split(const std::string& input, const char* delim = ",") {
+  std::vector<std::string> result;
+  size_t pos = 0;
+  while(pos < input.size()) {
+    const size_t next = input.find_first_of(delim, pos);
+    result.push_back(input.substr(pos, next - pos));
+    if (next == std::string::npos) { break; }
+    pos = next + 1;
+  }
+  return result;
 }
 
 Pi3Hat::Configuration MakeConfig(const Arguments& args) {
@@ -166,10 +243,33 @@ Pi3Hat::Configuration MakeConfig(const Arguments& args) {
   config.mounting_deg.pitch = args.mounting_deg.pitch;
   config.mounting_deg.roll = args.mounting_deg.roll;
   config.attitude_rate_hz = args.attitude_rate_hz;
+  config.imu_rate_hz = args.imu_rate_hz;
 
   if (args.rf_id != 0) {
     config.rf_id = args.rf_id;
   }
+  if (args.primary_spi_thread_cpu >= -1) {
+    config.primary_spi_thread = true;
+    config.primary_spi_thread_cpu = args.primary_spi_thread_cpu;
+  }
+  config.spi_dma = args.spi_dma;
+  for (const auto& timing : args.spi_timing) {
+    const auto fields = Split(timing);
+    if (fields.size() != 4) {
+      throw std::runtime_error("Invalid SPI timing: " + timing);
+    }
+    const int processor = std::stoi(fields.at(0));
+    if (processor < 0 || processor > 2) {
+      throw std::runtime_error("Invalid SPI timing processor: " + timing);
+    }
+    auto& spi_timing = config.spi_timing[processor];
+    spi_timing.speed_hz = std::stoi(fields.at(1));
+    spi_timing.cs_hold_us = std::stoi(fields.at(2));
+    spi_timing.address_hold_us = std::stoi(fields.at(3));
+  }
+  config.calibrate_spi_timing = args.calibrate_spi;
+  config.spi_crc = args.spi_crc;
+  config.fast_start = args.fast_start;
   return config;
 }
 
@@ -179,18 +279,6 @@ void CheckError(int error) {
       "Unexpected pi3hat error: " + std::to_string(error));
 }
 
-std::vector<std::string> Split(const std::string& input, const char* delim = ",") {
-  std::vector<std::string> result;
-  size_t pos = 0;
-  while(pos < input.size()) {
-    const size_t next = input.find_first_of(delim, pos);
-    result.push_back(input.substr(pos, next - pos));
-    if (next == std::string::npos) { break; }
-    pos = next + 1;
-  }
-  return result;
-}
-
 int ParseHexNybble(char c) {
   if (c >= '0' && c <= '9') { return c - '0'; }
   if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
@@ -333,6 +421,7 @@ struct Input {
     if (args.read_attitude) {
       pi.request_attitude = true;
       pi.wait_for_attitude = true;
+      pi.wait_for_attitude_irq = args.attitude_irq;
     }
     if (args.read_rf) {
       pi.request_rf = true;
@@ -348,6 +437,7 @@ struct Input {
     pi.timeout_ns = args.can_timeout_ns;
     pi.min_tx_wait_ns = args.can_min_tx_wait_ns;
     pi.rx_extra_wait_ns = args.can_rx_extra_wait_ns;
+    pi.wait_for_can_irq = args.can_irq;
 
     // Try to make sure we have plenty of room to receive things.
     rx_frames.resize(std::max<size_t>(can_frames.size() * 2, 20u));
@@ -363,6 +453,12 @@ struct Input {
     rx_rf_data.resize(16);
     pi.rx_rf = { &rx_rf_data[0], rx_rf_data.size() };
 
+    if (args.read_imu_samples) {
+      imu_samples.resize(64);
+      pi.rx_imu_samples = { &imu_samples[0], imu_samples.size() };
+    }
+
+    pi.request_can_status = args.can_status;
   }
 
   // We alias our pointers into the input structure.
@@ -376,9 +472,17 @@ struct Input {
   std::vector<CanFrame> rx_frames;
   std::vector<RfSlot> rf_slots;
   std::vector<RfSlot> rx_rf_data;
+  std::vector<ImuSample> imu_samples;
 };
 
-void Run(Pi3Hat* pi3hat, const Arguments& args) {
+std::unique_ptr<CycleLog> MakeCycleLog(const Arguments& args) {
+  if (args.log.empty()) { return {}; }
+  CycleLog::Options options;
+  options.filename = args.log;
+  return std::unique_ptr<CycleLog>(new CycleLog(options));
+}
+
+void Run(Pi3Hat* pi3hat, const Arguments& args, CycleLog* log) {
   Input input{args};
 
   std::unique_ptr<std::ofstream> time_of;
@@ -393,6 +497,7 @@ void Run(Pi3Hat* pi3hat, const Arguments& args) {
   while (true) {
     const auto result = pi3hat->Cycle(input.pi3hat_input);
     CheckError(result.error);
+    if (log) { log->Record(input.pi3hat_input, result); }
 
     {
       const auto now = GetNow();
@@ -428,6 +533,141 @@ void Run(Pi3Hat* pi3hat, const Arguments& args) {
   }
 }
 
+/// Accumulates a set of samples and reports their distribution.
+class Histogram {
+ public:
+  Histogram(const std::string& name, double scale, const std::string& units)
+      : name_(name), scale_(scale), units_(units) {}
+
+  void Add(int64_t value) {
+    // Negative values indicate that nothing was measured.
+    if (value < 0) { return; }
+    values_.push_back(value);
+  }
+
+  void Print() {
+    std::cout << name_ << ": ";
+    if (values_.empty()) {
+      std::cout << "no samples\n\n";
+      return;
+    }
+    std::sort(values_.begin(), values_.end());
+    auto percentile = [&](double p) {
+      return values_[std::min<size_t>(
+          values_.size() - 1, static_cast<size_t>(p * values_.size()))];
+    };
+    char buf[1024] = {};
+    ::snprintf(buf, sizeof(buf) - 1,
+               "n=%zu min=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f %s\n",
+               values_.size(),
+               values_.front() * scale_,
+               percentile(0.50) * scale_,
+               percentile(0.90) * scale_,
+               percentile(0.99) * scale_,
+               values_.back() * scale_,
+               units_.c_str());
+    std::cout << buf;
+
+    constexpr int kBuckets = 16;
+    constexpr int kWidth = 50;
+    const int64_t min = values_.front();
+    const int64_t range = std::max<int64_t>(1, values_.back() - min + 1);
+    int counts[kBuckets] = {};
+    for (const auto value : values_) {
+      counts[(value - min) * kBuckets / range]++;
+    }
+    const int max_count = *std::max_element(counts, counts + kBuckets);
+    for (int i = 0; i < kBuckets; i++) {
+      ::snprintf(buf, sizeof(buf) - 1, "  %10.1f %7d ",
+                 (min + range * i / kBuckets) * scale_, counts[i]);
+      std::cout << buf
+                << std::string(counts[i] * kWidth / max_count, '#') << "\n";
+    }
+    std::cout << "\n";
+  }
+
+ private:
+  const std::string name_;
+  const double scale_;
+  const std::string units_;
+  std::vector<int64_t> values_;
+};
+
+void DoTiming(Pi3Hat* pi3hat, const Arguments& args, CycleLog* log) {
+  Input input{args};
+  input.pi3hat_input.request_timing = true;
+
+  auto make_us = [](const std::string& name) {
+    return Histogram(name, 1e-3, "us");
+  };
+
+  std::vector<Histogram> histograms = {
+    make_us("send_can_start"),
+    make_us("send_can_end"),
+    make_us("send_rf_start"),
+    make_us("send_rf_end"),
+    make_us("read_rf_start"),
+    make_us("read_rf_end"),
+    make_us("attitude_start"),
+    make_us("attitude_end"),
+    make_us("submit_end"),
+    make_us("first_can_reply"),
+    make_us("last_can_reply"),
+    make_us("timeout"),
+    make_us("complete"),
+  };
+  const char* const kProcessors[] = { "can1", "can2", "aux" };
+  for (const auto* processor : kProcessors) {
+    histograms.emplace_back(
+        std::string("spi_") + processor + "_transactions", 1.0, "");
+    histograms.emplace_back(
+        std::string("spi_") + processor + "_bytes", 1.0, "");
+  }
+
+  for (int i = 0; i < args.timing; i++) {
+    const auto result = pi3hat->Cycle(input.pi3hat_input);
+    CheckError(result.error);
+    if (log) { log->Record(input.pi3hat_input, result); }
+
+    const auto& t = result.timing;
+    const int64_t values[] = {
+      t.send_can_start_ns,
+      t.send_can_end_ns,
+      t.send_rf_start_ns,
+      t.send_rf_end_ns,
+      t.read_rf_start_ns,
+      t.read_rf_end_ns,
+      t.attitude_start_ns,
+      t.attitude_end_ns,
+      t.submit_end_ns,
+      t.first_can_reply_ns,
+      t.last_can_reply_ns,
+      t.timeout_ns,
+      t.complete_ns,
+      t.spi[0].transactions, t.spi[0].bytes,
+      t.spi[1].transactions, t.spi[1].bytes,
+      t.spi[2].transactions, t.spi[2].bytes,
+    };
+    for (size_t j = 0; j < histograms.size(); j++) {
+      histograms[j].Add(values[j]);
+    }
+
+    ::usleep(50);
+  }
+
+  for (auto& histogram : histograms) {
+    histogram.Print();
+  }
+
+  if (log && log->dropped()) {
+    std::cout << "cycle log dropped " << log->dropped() << " records\n";
+  }
+  if (log && log->write_errors()) {
+    std::cout << "cycle log failed to write " << log->write_errors()
+              << " records\n";
+  }
+}
+
 std::string FormatProcessorInfo(const Pi3Hat::ProcessorInfo& pi) {
   std::string result = FormatHexBytes(&pi.git_hash[0], 20) + " ";
   result += (pi.dirty ? "dirty" : "clean");
@@ -456,16 +696,51 @@ void ReadSpi(Pi3Hat* pi3hat, const std::string& command) {
 }
 
 std::string FormatPerformance(const Pi3Hat::PerformanceInfo& p) {
-  return
+  std::string result =
       "average:" + std::to_string(p.cycles_per_ms) + " " +
       "min:" + std::to_string(p.min_cycles_per_ms);
+  for (int i = 0; i < p.module_count; i++) {
+    const auto& m = p.modules[i];
+    char buf[256] = {};
+    ::snprintf(buf, sizeof(buf) - 1,
+               "\n  %-28s avg:%8u max:%8u per_ms:%8u",
+               m.name, m.average_cycles, m.max_cycles, m.cycles_per_ms);
+    result += buf;
+  }
+  return result;
 }
 
-void DoPerformance(Pi3Hat* pi3hat) {
+/// Print the timing of each processor as --spi-timing arguments.
+void DoSpiTiming(Pi3Hat* pi3hat) {
+  for (int i = 0; i < 3; i++) {
+    const auto timing = pi3hat->spi_timing(i);
+    std::cout << "--spi-timing " << i << "," << timing.speed_hz << ","
+              << timing.cs_hold_us << "," << timing.address_hold_us << "\n";
+  }
+}
+
+void DoPerformance(Pi3Hat* pi3hat, const Arguments& args) {
   const auto dp = pi3hat->device_performance();
   std::cout << "CAN1: " << FormatPerformance(dp.can1) << "\n";
   std::cout << "CAN2: " << FormatPerformance(dp.can2) << "\n";
   std::cout << "AUX:  " << FormatPerformance(dp.aux) << "\n";
+
+  if (args.spi_crc) {
+    const auto crc = pi3hat->spi_crc_status();
+    const char* const names[] = { "CAN1", "CAN2", "AUX " };
+    for (int i = 0; i < 3; i++) {
+      std::cout << names[i] << " CRC: retries:" << crc.retries[i]
+                << " failures:" << crc.failures[i]
+                << " rejected_writes:" << crc.rejected_writes[i] << "\n";
+    }
+  }
+
+  const auto startup = pi3hat->startup_time();
+  std::cout << "STARTUP: total:" << startup.total_s * 1e3
+            << "ms transport:" << startup.transport_s * 1e3
+            << "ms CAN1:" << startup.processor_s[0] * 1e3
+            << "ms CAN2:" << startup.processor_s[1] * 1e3
+            << "ms AUX:" << startup.processor_s[2] * 1e3 << "ms\n";
 }
 
 void SingleCycle(Pi3Hat* pi3hat, const Arguments& args) {
@@ -489,6 +764,88 @@ void SingleCycle(Pi3Hat* pi3hat, const Arguments& args) {
   if (result.attitude_present) {
     std::cout << "ATT " << FormatAttitude(input.attitude) << "\n";
   }
+
+  if (args.read_imu_samples) {
+    std::cout << "IMUOVERFLOW: " << result.imu_sample_overflow_count << "\n";
+  }
+
+  for (int bus = 1; bus <= 5; bus++) {
+    const auto& s = result.can_status[bus];
+    if (!s.valid) { continue; }
+    char buf[256] = {};
+    ::snprintf(buf, sizeof(buf) - 1,
+               "CANSTATUS %d lec=%d dlec=%d act=%d ep=%d warn=%d boff=%d "
+               "pex=%d rec=%d tec=%d resets=%d rxovf=%d txovf=%d "
+               "malformed=%d\n",
+               bus, s.last_error_code, s.data_last_error_code, s.activity,
+               s.error_passive, s.warning, s.bus_off, s.protocol_exception,
+               s.rx_error_count, s.tx_error_count, s.bus_off_reset_count,
+               s.rx_overflow_count, s.tx_overflow_count,
+               s.tx_malformed_count);
+    std::cout << buf;
+  }
+
+  for (size_t i = 0; i < result.rx_imu_sample_size; i++) {
+    const auto& s = input.imu_samples.at(i);
+    char buf[256] = {};
+    ::snprintf(buf, sizeof(buf) - 1,
+               "IMU %10u dps=(%6.1f,%6.1f,%6.1f) a=(%5.2f,%5.2f,%5.2f)\n",
+               s.timestamp_us,
+               s.rate_dps.x, s.rate_dps.y, s.rate_dps.z,
+               s.accel_mps2.x, s.accel_mps2.y, s.accel_mps2.z);
+    std::cout << buf;
+  }
+}
+
+void DumpLog(const std::string& filename) {
+  const CycleLogReader reader(filename);
+  char buf[512] = {};
+  for (size_t i = 0; i < reader.size(); i++) {
+    const auto& r = reader[i];
+    ::snprintf(buf, sizeof(buf) - 1, "%8u %lld ",
+               r.cycle, static_cast<long long>(r.timestamp_ns));
+    std::cout << buf;
+    switch (r.type) {
+      case CycleLogRecord::kCycle: {
+        const auto& c = r.cycle_data;
+        std::cout << "CYCLE err=" << c.error << " t=";
+        for (int j = 0; j < 13; j++) {
+          std::cout << (j ? "," : "") << c.timing_ns[j];
+        }
+        for (int j = 0; j < 3; j++) {
+          std::cout << " spi" << j << "=" << c.spi_transactions[j]
+                    << "/" << c.spi_bytes[j];
+        }
+        std::cout << "\n";
+        break;
+      }
+      case CycleLogRecord::kTxCan:
+      case CycleLogRecord::kRxCan: {
+        const auto& c = r.can;
+        ::snprintf(buf, sizeof(buf) - 1, "%s %d %X %s %u\n",
+                   r.type == CycleLogRecord::kTxCan ? "TX" : "RX",
+                   c.bus, c.id, FormatHexBytes(c.data, c.size).c_str(),
+                   c.timestamp_us);
+        std::cout << buf;
+        break;
+      }
+      case CycleLogRecord::kAttitude: {
+        const auto& a = r.attitude;
+        ::snprintf(buf, sizeof(buf) - 1,
+                   "ATT w=%.4f x=%.4f y=%.4f z=%.4f "
+                   "dps=(%.1f,%.1f,%.1f) a=(%.2f,%.2f,%.2f)\n",
+                   a.attitude[0], a.attitude[1], a.attitude[2], a.attitude[3],
+                   a.rate_dps[0], a.rate_dps[1], a.rate_dps[2],
+                   a.accel_mps2[0], a.accel_mps2[1], a.accel_mps2[2]);
+        std::cout << buf;
+        break;
+      }
+      default: {
+        std::cout << "UNKNOWN " << r.type << "\n";
+        break;
+      }
+    }
+  }
 }
 
 void ConfigureRealtime(const Arguments& args) {
@@ -530,20 +887,36 @@ int do_main(int argc, char** argv) {
     return 0;
   }
 
+  if (!args.dump_log.empty()) {
+    DumpLog(args.dump_log);
+    return 0;
+  }
+
   Pi3Hat pi3hat{MakeConfig(args)};
 
+  // The log's writer thread is started before we become realtime,
+  // so that it does not share our CPU.
+  std::unique_ptr<CycleLog> log;
+  if (args.run || args.timing > 0) { log = MakeCycleLog(args); }
+
   if (args.realtime >= 0) {
     ConfigureRealtime(args);
   }
 
   if (args.run) {
-    Run(&pi3hat, args);
+    Run(&pi3hat, args, log.get());
+  } else if (args.timing > 0) {
+    DoTiming(&pi3hat, args, log.get());
   } else if (args.info) {
     DoInfo(&pi3hat);
   } else if (!args.read_spi.empty()) {
     ReadSpi(&pi3hat, args.read_spi);
   } else if (args.performance) {
-    DoPerformance(&pi3hat);
+    DoPerformance(&pi3hat, args);
+  } else if (args.reset_processor >= 0) {
+    pi3hat.ResetProcessor(args.reset_processor);
+  } else if (args.calibrate_spi) {
+    DoSpiTiming(&pi3hat);
   } else {
     SingleCycle(&pi3hat, args);
   }
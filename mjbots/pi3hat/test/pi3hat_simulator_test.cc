@@ -0,0 +1,256 @@
+// Copyright 2020 Josh Pieper, jjp@pobox.com.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mjbots/pi3hat/pi3hat_simulator.h"
+
+#include <unistd.h>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include "mjbots/pi3hat/pi3hat.h"
+#include "mjbots/moteus/pi3hat_moteus_interface.h"
+
+using namespace mjbots;
+using namespace mjbots::pi3hat;
+
+namespace {
+CanFrame MakeQuery(int id, int bus) {
+  CanFrame result;
+  result.id = 0x8000 | id;
+  result.bus = bus;
+  result.size = 3;
+  result.expect_reply = true;
+  return result;
+}
+
+int ReplyId(const CanFrame& frame) {
+  return (frame.id >> 8) & 0x7f;
+}
+}
+
+BOOST_AUTO_TEST_CASE(SimulatorReplyTest) {
+  Pi3HatSimulator simulator;
+  Pi3Hat::Configuration config;
+  config.transport = &simulator;
+  Pi3Hat dut(config);
+
+  CanFrame tx[3] = {
+    MakeQuery(1, 1),
+    MakeQuery(2, 3),
+    MakeQuery(3, 5),
+  };
+  CanFrame rx[8];
+
+  Pi3Hat::Input input;
+  input.tx_can = { tx, 3 };
+  input.rx_can = { rx, 8 };
+  // The simulator runs in real time, so this is generous in case we
+  // are descheduled.  The cycle ends once every servo has replied.
+  input.timeout_ns = 100000000;
+  input.match_reply_ids = true;
+
+  const auto output = dut.Cycle(input);
+  BOOST_TEST(output.error == 0);
+  BOOST_TEST(output.rx_can_size == 3);
+
+  bool seen[4] = {};
+  for (size_t i = 0; i < output.rx_can_size; i++) {
+    const auto& frame = rx[i];
+    const int id = ReplyId(frame);
+    BOOST_REQUIRE(id >= 1);
+    BOOST_REQUIRE(id <= 3);
+    BOOST_TEST(!seen[id]);
+    seen[id] = true;
+    BOOST_TEST(frame.bus == tx[id - 1].bus);
+    BOOST_TEST(frame.size > 0);
+  }
+
+  const auto stats = simulator.stats();
+  BOOST_TEST(stats.tx_frames[1] == 1);
+  BOOST_TEST(stats.tx_frames[3] == 1);
+  BOOST_TEST(stats.tx_frames[5] == 1);
+}
+
+BOOST_AUTO_TEST_CASE(SimulatorDrainTest) {
+  // More replies than register 2 reports at once are left queued on
+  // a single processor, so that they are read through register 10
+  // (or 13).
+  for (const bool timestamp : { false, true }) {
+    Pi3HatSimulator simulator;
+    Pi3Hat::Configuration config;
+    config.transport = &simulator;
+    Pi3Hat dut(config);
+
+    constexpr int kCount = 12;
+    CanFrame tx[kCount];
+    for (int i = 0; i < kCount; i++) { tx[i] = MakeQuery(i + 1, 1); }
+    CanFrame rx[20];
+
+    Pi3Hat::Input send;
+    send.tx_can = { tx, kCount };
+
+    Pi3Hat::Input drain;
+    drain.rx_can = { rx, 20 };
+    drain.force_can_check = 0x02;
+    drain.timestamp_can_rx = timestamp;
+
+    auto send_and_wait = [&]() {
+      dut.Cycle(send);
+      // Long enough for every reply to be queued.
+      ::usleep(20000);
+    };
+
+    send_and_wait();
+    {
+      const auto output = dut.Cycle(drain);
+      BOOST_TEST(output.rx_can_size == kCount);
+
+      bool seen[kCount + 1] = {};
+      for (size_t i = 0; i < output.rx_can_size; i++) {
+        const int id = ReplyId(rx[i]);
+        BOOST_REQUIRE(id >= 1);
+        BOOST_REQUIRE(id <= kCount);
+        BOOST_TEST(!seen[id]);
+        seen[id] = true;
+        BOOST_TEST(rx[i].bus == 1);
+      }
+    }
+
+    // With room for only some of them, the rest stay queued for the
+    // next cycle.
+    send_and_wait();
+    drain.rx_can = { rx, 5 };
+    {
+      const auto output = dut.Cycle(drain);
+      BOOST_TEST(output.rx_can_size == 5);
+    }
+    drain.rx_can = { rx, 20 };
+    {
+      const auto output = dut.Cycle(drain);
+      BOOST_TEST(output.rx_can_size == kCount - 5);
+    }
+    {
+      const auto output = dut.Cycle(drain);
+      BOOST_TEST(output.rx_can_size == 0);
+    }
+
+    BOOST_TEST(simulator.stats().rx_overflow[1] == 0);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(SimulatorSilentProcessorTest) {
+  Pi3HatSimulator simulator;
+  Pi3Hat::Configuration config;
+  config.transport = &simulator;
+  config.silent_processor_cycles = 3;
+  config.silent_backoff_cycles = 2;
+  config.silent_max_backoff_cycles = 8;
+  Pi3Hat dut(config);
+
+  CanFrame tx[2] = {
+    MakeQuery(1, 1),
+    MakeQuery(2, 5),
+  };
+  CanFrame rx[8];
+
+  Pi3Hat::Input input;
+  input.tx_can = { tx, 2 };
+  input.rx_can = { rx, 8 };
+  input.timeout_ns = 2000000;
+
+  simulator.SetHung(0, true);
+
+  bool became_silent = false;
+  for (int i = 0; i < 10; i++) {
+    const auto output = dut.Cycle(input);
+
+    // Nothing is heard from the hung processor, and the others are
+    // unaffected.
+    for (size_t j = 0; j < output.rx_can_size; j++) {
+      BOOST_TEST(rx[j].bus == 5);
+    }
+    BOOST_TEST(!output.processor_silent[1]);
+    BOOST_TEST(!output.processor_silent[2]);
+
+    if (output.processor_silent[0]) {
+      became_silent = true;
+      break;
+    }
+  }
+  BOOST_TEST(became_silent);
+
+  dut.ResetProcessor(0);
+
+  // Once reset, it replies again, and is no longer silent.
+  input.timeout_ns = 100000000;
+  input.match_reply_ids = true;
+  int bus1_replies = 0;
+  for (int i = 0; i < 3 && bus1_replies == 0; i++) {
+    const auto output = dut.Cycle(input);
+    BOOST_TEST(!output.processor_silent[0]);
+    for (size_t j = 0; j < output.rx_can_size; j++) {
+      if (rx[j].bus == 1) { bus1_replies++; }
+    }
+  }
+  BOOST_TEST(bus1_replies == 1);
+}
+
+BOOST_AUTO_TEST_CASE(MoteusInterfaceUpdatedIdsTest) {
+  Pi3HatSimulator::Options simulator_options;
+  simulator_options.servo_ids.reset();
+  simulator_options.servo_ids.set(1);
+  simulator_options.servo_ids.set(7);
+  // The interface does not set a timeout, so replies should arrive
+  // within Input::min_tx_wait_ns.
+  simulator_options.reply_latency_ns = 10000;
+  Pi3HatSimulator simulator(simulator_options);
+
+  using Interface = moteus::Pi3HatMoteusInterface;
+  Interface::Options options;
+  options.pi3hat_configuration.transport = &simulator;
+  options.servo_bus_map = { { 1, 1 }, { 2, 5 }, { 7, 3 } };
+  Interface dut(options);
+
+  Interface::ServoCommand commands[3];
+  commands[0].id = 1;
+  commands[1].id = 2;
+  commands[2].id = 7;
+
+  Interface::ServoReply replies[4];
+  Interface::ServoReply replies_by_id[8];
+
+  Interface::Data data;
+  data.commands = { commands, 3 };
+  data.replies = { replies, 4 };
+  data.replies_by_id = { replies_by_id, 8 };
+
+  // Replies may be late if we are descheduled, so a few cycles are
+  // allowed for both to arrive.
+  std::bitset<128> updated_ids;
+  for (int i = 0; i < 10 && updated_ids.count() < 2; i++) {
+    dut.Cycle(data);
+    const auto output = dut.Wait();
+    BOOST_TEST(output.query_result_size == output.updated_ids.count());
+    updated_ids |= output.updated_ids;
+  }
+
+  BOOST_TEST(updated_ids.count() == 2);
+  BOOST_TEST(updated_ids.test(1));
+  BOOST_TEST(!updated_ids.test(2));
+  BOOST_TEST(updated_ids.test(7));
+
+  BOOST_TEST(replies_by_id[1].id == 1);
+  BOOST_TEST(replies_by_id[2].id == 0);
+  BOOST_TEST(replies_by_id[7].id == 7);
+}